@@ -13,13 +13,13 @@ BINDIR := $(BUILDDIR)
 AR = ar
 ARFLAGS = c
 CC = gcc
-CFLAGS = -O3 -I$(PROJECTDIR) -DSUBDIR=\"$(SUBDIR)\" #-DNO_LOG -DNO_ASSERT -DNO_PRECOND -DNO_ERROR
+CFLAGS = -O3 -I$(PROJECTDIR) -DSUBDIR=\"$(SUBDIR)\" #-DNO_LOG -DNO_ASSERT -DNO_PRECOND -DNO_ERROR -DMIDI_ATOMIC_REFS
 CFLAGS_OBJ_SHARED = $(CFLAGS) -c -fPIC
 CFLAGS_OBJ_STATIC = $(CFLAGS) -c
 CFLAGS_OBJ = $(CFLAGS_OBJ_$(COMPILE_MODE))
 
 LDFLAGS = -L$(LIBDIR)
-LDFLAGS_LIB = $(LDFLAGS) -shared -O4
+LDFLAGS_LIB = $(LDFLAGS) -shared -O4 -lpthread
 LDFLAGS_BIN = $(LDFLAGS)
 
 LIB_SUFFIX_SHARED = .so
@@ -22,7 +22,8 @@
 #define APPLEMIDI_CONTROL_SOCKET 0
 #define APPLEMIDI_RTP_SOCKET     1
 
-#define APPLEMIDI_MAX_MESSAGES_PER_PACKET 16
+/* enough for a command section filled with the shortest commands */
+#define APPLEMIDI_MAX_MESSAGES_PER_PACKET 256
 #define APPLEMIDI_MSG_BUFFER_SIZE 16
 
 struct AppleMIDICommand {
@@ -52,14 +53,31 @@ struct AppleMIDICommand {
   } data;
 };
 
+/* number of synchronization rounds used to fit the drift */
+#define APPLEMIDI_SYNC_WINDOW 16
+/* smallest weight of a new offset or delay, older rounds are averaged */
+#define APPLEMIDI_SYNC_GAIN 8
+/* weight of a new delay deviation in the jitter estimate (RFC 3550) */
+#define APPLEMIDI_JITTER_GAIN 16
+
+/**
+ * @brief Clock model of a peer.
+ * The offset of the peer clock is smoothed exponentially and extrapolated
+ * with the drift, which is a least squares fit of the raw offsets of the
+ * last synchronization rounds. All values are in driver clock ticks.
+ */
 struct AppleMIDIPeer {
-  char * name;
-  unsigned short port;
-  unsigned long token;
-  unsigned long ssrc;
-  unsigned long long timestamp_delay;
-  unsigned long long timestamp_diff;
-  struct RTPMIDIPeer * rtp_peer;
+  unsigned long rounds;  /* number of completed synchronization rounds */
+  MIDITimestamp origin;  /* local time of the first round */
+  MIDITimestamp updated; /* local time of the last round */
+  double offset;         /* smoothed offset of the peer clock at updated */
+  double drift;          /* change of the offset per local tick */
+  double delay;          /* smoothed one-way delay */
+  double jitter;         /* smoothed deviation of the one-way delay */
+  struct {
+    double time;         /* local time relative to origin */
+    double offset;       /* raw offset */
+  } samples[APPLEMIDI_SYNC_WINDOW];
 };
 
 /**
@@ -84,11 +102,22 @@ struct MIDIDriverAppleMIDI {
 
   struct MIDIMessageQueue * in_queue;
   struct MIDIMessageQueue * out_queue;
+
+  struct MIDIClock * send_clock; /* microsecond clock for the latency budget */
+  MIDITimestamp send_latency;  /* the latency budget in microseconds */
+  MIDITimestamp send_oldest;   /* the send clock time of the oldest queued message */
+  size_t        send_bytes;    /* the estimated size of the queued commands */
+  unsigned char send_flush;    /* set if the queue must be sent without delay */
+  struct MIDIRunloopTimer * send_timer; /* fires when the latency budget is used up */
+  struct AppleMIDISendStats send_stats;
 };
 
 static int _applemidi_read_fds( void * drv, int nfds, fd_set * fds );
 static int _applemidi_write_fds( void * drv, int nfsd, fd_set * fds );
 static int _applemidi_idle_timeout( void * drv, struct timespec * ts );
+static int _applemidi_receive( void * drv, int fd, size_t size, void * data, socklen_t namelen, struct sockaddr * name );
+static int _applemidi_send_timer_fire( void * drv, struct MIDIRunloopTimer * timer, struct timespec * now );
+static int _applemidi_send_due( struct MIDIDriverAppleMIDI * driver, MIDITimestamp now );
 
 static int _applemidi_init_runloop_source( struct MIDIDriverAppleMIDI * driver ) {
   struct MIDIRunloopSourceDelegate delegate = {
@@ -97,8 +126,14 @@ static int _applemidi_init_runloop_source( struct MIDIDriverAppleMIDI * driver )
     &_applemidi_write_fds,
     &_applemidi_idle_timeout
   };
+  struct MIDIRunloopTimerDelegate timer_delegate = {
+    driver,
+    &_applemidi_send_timer_fire
+  };
   
-  driver->base.rls = MIDIRunloopSourceCreate( &delegate );
+  driver->base.rls   = MIDIRunloopSourceCreate( &delegate );
+  driver->send_timer = MIDIRunloopTimerCreate( driver->base.rls, &timer_delegate );
+  MIDIRunloopSourceSetReceive( driver->base.rls, &_applemidi_receive );
 
   MIDIRunloopSourceScheduleRead( driver->base.rls, driver->control_socket );
   MIDIRunloopSourceScheduleRead( driver->base.rls, driver->rtp_socket );
@@ -134,6 +169,9 @@ static int _applemidi_init_runloop_source( struct MIDIDriverAppleMIDI * driver )
  * @brief Update the runloop source's handles.
  * - If the driver can accept more data, enable the runloop's @c read callback.
  * - If the driver needs to write data, enable the @c write callback.
+ * - If queued messages wait for their latency budget, arm the send timer.
+ *   The source's own timeout stays the idle interval that drives the
+ *   clock synchronization.
  * @param driver The driver.
  * @retval 0 on success.
  * @retval >0 if something bad happened.
@@ -141,9 +179,17 @@ static int _applemidi_init_runloop_source( struct MIDIDriverAppleMIDI * driver )
 static int _applemidi_update_runloop_source( struct MIDIDriverAppleMIDI * driver ) {
   size_t in = 0, out = 0;
   struct timespec ts = { 1, 500000000 };
+  struct timespec budget;
+  MIDITimestamp now, wait = 0;
 
   MIDIMessageQueueGetLength( driver->in_queue,  &in );
   MIDIMessageQueueGetLength( driver->out_queue, &out );
+  if( out > 0 ) {
+    MIDIClockGetNow( driver->send_clock, &now );
+    if( ! _applemidi_send_due( driver, now ) ) {
+      wait = driver->send_oldest + driver->send_latency - now;
+    }
+  }
   if( in == 0 ) {
     MIDIRunloopSourceScheduleRead( driver->base.rls, driver->rtp_socket );
   } else {
@@ -152,12 +198,20 @@ static int _applemidi_update_runloop_source( struct MIDIDriverAppleMIDI * driver
   if( driver->accept || (driver->sync>0) ) {
     MIDIRunloopSourceScheduleRead( driver->base.rls, driver->control_socket );
   }
-  if( out == 0 ) {
-    MIDIRunloopSourceClearWrite( driver->base.rls, driver->control_socket );
+  if( out == 0 || wait > 0 ) {
+    MIDIRunloopSourceClearWrite( driver->base.rls, driver->rtp_socket );
   } else {
-    MIDIRunloopSourceScheduleWrite( driver->base.rls, driver->control_socket );
+    MIDIRunloopSourceScheduleWrite( driver->base.rls, driver->rtp_socket );
   }
-  if( (in==0) && (out==0) ) {
+  if( wait > 0 ) {
+    /* wake up when the latency budget of the oldest message is used up */
+    budget.tv_sec  = wait / 1000000;
+    budget.tv_nsec = ( wait % 1000000 ) * 1000;
+    MIDIRunloopTimerSchedule( driver->send_timer, &budget );
+  } else {
+    MIDIRunloopTimerCancel( driver->send_timer );
+  }
+  if( (in==0) && (out==0 || wait>0) ) {
     MIDIRunloopSourceScheduleTimeout( driver->base.rls, &ts );
   } else {
     MIDIRunloopSourceClearTimeout( driver->base.rls );
@@ -193,6 +247,10 @@ static int _applemidi_connect( struct MIDIDriverAppleMIDI * driver ) {
 
 static int _applemidi_endsession( struct MIDIDriverAppleMIDI *, int, socklen_t, struct sockaddr * );
 static int _applemidi_control_addr( socklen_t, struct sockaddr *, struct sockaddr * );
+static int _applemidi_remove_peer( struct MIDIDriverAppleMIDI *, struct RTPPeer * );
+static int _applemidi_rtp_addr( socklen_t, struct sockaddr *, struct sockaddr * );
+static struct AppleMIDIPeer * _applemidi_peer_clock( struct RTPPeer *, int );
+static MIDITimestamp _applemidi_peer_to_local( struct AppleMIDIPeer *, MIDITimestamp );
 
 static int _applemidi_disconnect_peer( struct MIDIDriverAppleMIDI * driver, struct RTPPeer * peer ) {
   int result = 0;
@@ -204,7 +262,7 @@ static int _applemidi_disconnect_peer( struct MIDIDriverAppleMIDI * driver, stru
   }
   _applemidi_control_addr( size, rtp_addr, (struct sockaddr *) &addr );
   result = _applemidi_endsession( driver, driver->control_socket, size, (struct sockaddr *) &addr );
-  RTPSessionRemovePeer( driver->rtp_session, peer );
+  _applemidi_remove_peer( driver, peer );
   return result;
 }
 
@@ -246,6 +304,11 @@ static int _driver_send( struct MIDIDriver * driverp, struct MIDIMessage * messa
   return MIDIDriverAppleMIDISendMessage( (struct MIDIDriverAppleMIDI *) driverp, message );
 }
 
+int MIDIDriverAppleMIDISendMessages( struct MIDIDriverAppleMIDI * driver, size_t count, struct MIDIMessage ** messages );
+static int _driver_send_batch( struct MIDIDriver * driverp, size_t count, struct MIDIMessage ** messages ) {
+  return MIDIDriverAppleMIDISendMessages( (struct MIDIDriverAppleMIDI *) driverp, count, messages );
+}
+
 void MIDIDriverAppleMIDIDestroy( struct MIDIDriverAppleMIDI * driver );
 static void _driver_destroy( struct MIDIDriver * driverp ) {
   MIDIDriverAppleMIDIDestroy( (struct MIDIDriverAppleMIDI *) driverp );
@@ -282,9 +345,17 @@ struct MIDIDriverAppleMIDI * MIDIDriverAppleMIDICreate( char * name, unsigned sh
 
   driver->in_queue  = MIDIMessageQueueCreate();
   driver->out_queue = MIDIMessageQueueCreate();
+
+  driver->send_clock   = MIDIClockCreate( 1000000 );
+  driver->send_latency = 0;
+  driver->send_oldest  = 0;
+  driver->send_bytes   = 0;
+  driver->send_flush   = 0;
+  memset( &(driver->send_stats), 0, sizeof(driver->send_stats) );
   
-  driver->base.send    = &_driver_send;
-  driver->base.destroy = &_driver_destroy;
+  driver->base.send       = &_driver_send;
+  driver->base.send_batch = &_driver_send_batch;
+  driver->base.destroy    = &_driver_destroy;
   
   _applemidi_connect( driver );
 
@@ -312,6 +383,8 @@ struct MIDIDriverAppleMIDI * MIDIDriverAppleMIDICreate( char * name, unsigned sh
  */
 void MIDIDriverAppleMIDIDestroy( struct MIDIDriverAppleMIDI * driver ) {
   _applemidi_disconnect( driver, 0 );
+  if( driver->send_timer != NULL ) MIDIRunloopTimerRelease( driver->send_timer );
+  if( driver->send_clock != NULL ) MIDIClockRelease( driver->send_clock );
   RTPMIDISessionRelease( driver->rtpmidi_session );
   RTPSessionRelease( driver->rtp_session );
   MIDIMessageQueueRelease( driver->in_queue );
@@ -371,6 +444,120 @@ int MIDIDriverAppleMIDIAcceptFromPeer( struct MIDIDriverAppleMIDI * driver, char
   return 1;
 }
 
+/**
+ * @brief Set the latency budget of the send scheduler.
+ * Queued messages are held back for at most @c latency microseconds so
+ * that bursts of messages are coalesced into as few packets as possible.
+ * System real-time messages and a full packet are sent immediately.
+ * The default of zero sends every message as soon as it is queued.
+ * @public @memberof MIDIDriverAppleMIDI
+ * @param driver  The driver.
+ * @param latency The latency budget in microseconds.
+ * @retval 0 On success.
+ */
+int MIDIDriverAppleMIDISetSendLatency( struct MIDIDriverAppleMIDI * driver, unsigned long latency ) {
+  driver->send_latency = latency;
+  return 0;
+}
+
+/**
+ * @brief Get the latency budget of the send scheduler.
+ * @public @memberof MIDIDriverAppleMIDI
+ * @param driver  The driver.
+ * @param latency The latency budget in microseconds.
+ * @retval 0 On success.
+ * @retval >0 If the latency could not be stored.
+ */
+int MIDIDriverAppleMIDIGetSendLatency( struct MIDIDriverAppleMIDI * driver, unsigned long * latency ) {
+  if( latency == NULL ) return 1;
+  *latency = driver->send_latency;
+  return 0;
+}
+
+/**
+ * @brief Get the statistics of the send scheduler.
+ * Use them to tune the latency budget: a larger budget lowers the number
+ * of packets per message and raises the added latency.
+ * @public @memberof MIDIDriverAppleMIDI
+ * @param driver The driver.
+ * @param stats  The statistics.
+ * @retval 0 On success.
+ * @retval >0 If the statistics could not be stored.
+ */
+int MIDIDriverAppleMIDIGetSendStats( struct MIDIDriverAppleMIDI * driver, struct AppleMIDISendStats * stats ) {
+  if( stats == NULL ) return 1;
+  *stats = driver->send_stats;
+  return 0;
+}
+
+/**
+ * @brief Reset the statistics of the send scheduler.
+ * @public @memberof MIDIDriverAppleMIDI
+ * @param driver The driver.
+ * @retval 0 On success.
+ */
+int MIDIDriverAppleMIDIResetSendStats( struct MIDIDriverAppleMIDI * driver ) {
+  memset( &(driver->send_stats), 0, sizeof(driver->send_stats) );
+  return 0;
+}
+
+/**
+ * @brief Get the network latency of a peer.
+ * The latency is the smoothed one-way delay measured during clock
+ * synchronization, the jitter is the smoothed deviation of the delay.
+ * @public @memberof MIDIDriverAppleMIDI
+ * @param driver  The driver.
+ * @param size    The size of the address pointed to by @c addr.
+ * @param addr    The control address of the peer.
+ * @param latency The latency in seconds.
+ * @param jitter  The jitter in seconds.
+ * @retval 0 On success.
+ * @retval >0 If the peer is unknown or was not synchronized yet.
+ */
+int MIDIDriverAppleMIDIGetPeerLatency( struct MIDIDriverAppleMIDI * driver, socklen_t size, struct sockaddr * addr,
+                                       double * latency, double * jitter ) {
+  struct RTPPeer * peer = NULL;
+  struct AppleMIDIPeer * model;
+  struct sockaddr_storage rtp_addr;
+
+  if( size > sizeof(rtp_addr) || _applemidi_rtp_addr( size, addr, (struct sockaddr *) &rtp_addr ) ) return 1;
+  if( RTPSessionFindPeerByAddress( driver->rtp_session, &peer, size, (struct sockaddr *) &rtp_addr ) ) return 1;
+  model = _applemidi_peer_clock( peer, 0 );
+  if( model == NULL || model->rounds == 0 ) return 1;
+  if( latency != NULL ) *latency = model->delay / APPLEMIDI_CLOCK_RATE;
+  if( jitter != NULL )  *jitter  = model->jitter / APPLEMIDI_CLOCK_RATE;
+  return 0;
+}
+
+/**
+ * @brief Convert a timestamp of a peer clock to a local clock.
+ * Map the timestamp onto the driver clock using the offset and drift
+ * of the peer clock and convert the result with MIDIClockConvertTimestamp.
+ * Timestamps of received messages are already mapped onto the driver clock.
+ * @public @memberof MIDIDriverAppleMIDI
+ * @param driver    The driver.
+ * @param size      The size of the address pointed to by @c addr.
+ * @param addr      The control address of the peer.
+ * @param clock     The clock to convert to (pass @c NULL for global clock)
+ * @param timestamp The timestamp of the peer clock in synchronization ticks (100 microseconds).
+ * @retval 0 On success.
+ * @retval >0 If the peer is unknown or was not synchronized yet.
+ */
+int MIDIDriverAppleMIDIConvertPeerTimestamp( struct MIDIDriverAppleMIDI * driver, socklen_t size, struct sockaddr * addr,
+                                             struct MIDIClock * clock, MIDITimestamp * timestamp ) {
+  struct RTPPeer * peer = NULL;
+  struct AppleMIDIPeer * model;
+  struct sockaddr_storage rtp_addr;
+
+  if( timestamp == NULL ) return 1;
+  if( size > sizeof(rtp_addr) || _applemidi_rtp_addr( size, addr, (struct sockaddr *) &rtp_addr ) ) return 1;
+  if( RTPSessionFindPeerByAddress( driver->rtp_session, &peer, size, (struct sockaddr *) &rtp_addr ) ) return 1;
+  model = _applemidi_peer_clock( peer, 0 );
+  if( model == NULL || model->rounds == 0 ) return 1;
+  *timestamp = _applemidi_peer_to_local( model, *timestamp );
+  return MIDIClockConvertTimestamp( clock, driver->base.clock, timestamp );
+}
+
 int MIDIDriverAppleMIDISetRTPSocket( struct MIDIDriverAppleMIDI * driver, int socket ) {
   if( socket == driver->rtp_socket ) return 0;
   int result = _applemidi_disconnect( driver, driver->rtp_socket );
@@ -414,6 +601,40 @@ int MIDIDriverAppleMIDIReceiveMessage( struct MIDIDriverAppleMIDI * driver, stru
   return MIDIDriverReceive( &(driver->base), message );
 }
 
+/**
+ * @brief Add a message to the send queue.
+ * @param driver  The driver.
+ * @param message The message.
+ */
+static void _applemidi_queue_message( struct MIDIDriverAppleMIDI * driver, struct MIDIMessage * message ) {
+/**
+ * @todo: when midi messages get timestamped by global clock, do something different:
+ * - if we use the global clock (driver->clock == global_clock) do nothing
+ * - otherwise: convert timestamp between clocks
+ */
+  MIDITimestamp timestamp;
+  MIDIStatus status;
+  size_t size = 0, length = 0;
+
+  MIDIClockGetNow( driver->base.clock, &timestamp );
+  MIDIMessageSetTimestamp( message, timestamp );
+  MIDIMessageGetStatus( message, &status );
+  MIDIMessageGetSize( message, &size );
+  MIDIMessageQueueGetLength( driver->out_queue, &length );
+  if( length == 0 ) {
+    MIDIClockGetNow( driver->send_clock, &(driver->send_oldest) );
+    driver->send_bytes  = 0;
+  }
+  MIDIMessageQueuePush( driver->out_queue, message );
+  MIDIDriverProfileQueue( &(driver->base), length + 1 );
+  /* one more byte for the delta time, larger deltas are rare within the budget */
+  driver->send_bytes += size + 1;
+  if( status >= MIDI_STATUS_TIMING_CLOCK ) {
+    /* system real-time messages must not wait */
+    driver->send_flush = 1;
+  }
+}
+
 /**
  * @brief Process outgoing MIDI messages.
  * This is called by the generic driver interface to pass messages to this driver implementation.
@@ -425,15 +646,27 @@ int MIDIDriverAppleMIDIReceiveMessage( struct MIDIDriverAppleMIDI * driver, stru
  * @retval >0 if the message could not be processed.
  */
 int MIDIDriverAppleMIDISendMessage( struct MIDIDriverAppleMIDI * driver, struct MIDIMessage * message ) {
+  _applemidi_queue_message( driver, message );
+  return MIDIDriverAppleMIDISend( driver );
+}
+
 /**
- * @todo: when midi messages get timestamped by global clock, do something different:
- * - if we use the global clock (driver->clock == global_clock) do nothing
- * - otherwise: convert timestamp between clocks
+ * @brief Process several outgoing MIDI messages at once.
+ * This is called by the generic driver interface to pass a batch of messages to this driver
+ * implementation. All messages are queued first, so that they share as few packets as possible.
+ * Like single messages they are held back until they fill a packet or use up the latency budget.
+ * @public @memberof MIDIDriverAppleMIDI
+ * @param driver   The driver.
+ * @param count    The number of messages.
+ * @param messages The messages that should be sent.
+ * @retval 0 on success.
+ * @retval >0 if the messages could not be processed.
  */
-  MIDITimestamp timestamp;
-  MIDIClockGetNow( driver->base.clock, &timestamp );
-  MIDIMessageSetTimestamp( message, timestamp );
-  MIDIMessageQueuePush( driver->out_queue, message );
+int MIDIDriverAppleMIDISendMessages( struct MIDIDriverAppleMIDI * driver, size_t count, struct MIDIMessage ** messages ) {
+  size_t i;
+  for( i=0; i<count; i++ ) {
+    _applemidi_queue_message( driver, messages[i] );
+  }
   return MIDIDriverAppleMIDISend( driver );
 }
 
@@ -449,19 +682,16 @@ static int _applemidi_init_addr_with_peer( struct AppleMIDICommand * command, st
 }
 
 /**
- * @brief Test incoming packets for the AppleMIDI signature.
- * Check if the data that is waiting on a socket begins with the special AppleMIDI signature (0xffff).
+ * @brief Test a received datagram for the AppleMIDI signature.
  * @private @memberof MIDIDriverAppleMIDI
- * @param fd The file descriptor to use for communication.
+ * @param size The number of bytes in the datagram.
+ * @param data The datagram.
  * @retval 0 if the packet is AppleMIDI
  * @retval 1 if the packet is not AppleMIDI
- * @retval -1 if no signature data could be received
  */
-static int _test_applemidi( int fd ) {
-  ssize_t bytes;
-  unsigned short buf[2];
-  bytes = recv( fd, &buf, 4, MSG_PEEK );
-  if( bytes != 4 ) return -1;
+static int _test_applemidi_data( size_t size, void * data ) {
+  unsigned short * buf = data;
+  if( size < 4 ) return 1;
   if( ntohs(buf[0]) == APPLEMIDI_PROTOCOL_SIGNATURE ) {
     switch( ntohs(buf[1]) ) {
       case APPLEMIDI_COMMAND_INVITATION:
@@ -476,6 +706,23 @@ static int _test_applemidi( int fd ) {
   return 1;
 }
 
+/**
+ * @brief Test incoming packets for the AppleMIDI signature.
+ * Check if the data that is waiting on a socket begins with the special AppleMIDI signature (0xffff).
+ * @private @memberof MIDIDriverAppleMIDI
+ * @param fd The file descriptor to use for communication.
+ * @retval 0 if the packet is AppleMIDI
+ * @retval 1 if the packet is not AppleMIDI
+ * @retval -1 if no signature data could be received
+ */
+static int _test_applemidi( int fd ) {
+  ssize_t bytes;
+  unsigned short buf[2];
+  bytes = recv( fd, &buf, 4, MSG_PEEK );
+  if( bytes != 4 ) return -1;
+  return _test_applemidi_data( bytes, &buf[0] );
+}
+
 /**
  * @brief Send the given AppleMIDI command.
  * Compose a message buffer and send the datagram to the given peer.
@@ -545,6 +792,9 @@ static int _applemidi_send_command( struct MIDIDriverAppleMIDI * driver, int fd,
   }
 }
 
+static int _applemidi_decode_command( struct MIDIDriverAppleMIDI * driver, int fd, int len, unsigned int * msg,
+                                      struct AppleMIDICommand * command );
+
 /**
  * @brief Receive an AppleMIDI command.
  * Receive a datagram and decompose the message into the message structure.
@@ -556,13 +806,32 @@ static int _applemidi_send_command( struct MIDIDriverAppleMIDI * driver, int fd,
  * @retval >0 If the packet could not be sent.
  */
 static int _applemidi_recv_command( struct MIDIDriverAppleMIDI * driver, int fd, struct AppleMIDICommand * command ) {
-  unsigned int ssrc;
   unsigned int msg[16];
   int len;
   
   command->size = sizeof(command->addr);
   len = recvfrom( fd, &msg[0], sizeof(msg), 0,
                   (struct sockaddr *) &(command->addr), &(command->size) );
+  if( len < 0 ) return 1;
+  return _applemidi_decode_command( driver, fd, len, &msg[0], command );
+}
+
+/**
+ * @brief Decode a received AppleMIDI command.
+ * The sender address must already be stored in the command.
+ * @private @memberof MIDIDriverAppleMIDI
+ * @param driver The driver.
+ * @param fd The file descriptor the command was received on.
+ * @param len The number of bytes in the datagram.
+ * @param msg The datagram.
+ * @param command The command.
+ * @retval 0 On success.
+ * @retval >0 If the datagram is not a valid command.
+ */
+static int _applemidi_decode_command( struct MIDIDriverAppleMIDI * driver, int fd, int len, unsigned int * msg,
+                                      struct AppleMIDICommand * command ) {
+  unsigned int ssrc;
+
   if( command->addr.ss_family == AF_INET ) {
     struct sockaddr_in * a = (struct sockaddr_in *) &(command->addr);
     MIDILog( DEBUG, "recv %i bytes from %s:%i on s(%i)\n", len, inet_ntoa( a->sin_addr ), ntohs( a->sin_port ), fd );
@@ -615,6 +884,139 @@ static int _applemidi_recv_command( struct MIDIDriverAppleMIDI * driver, int fd,
   return 0;
 }
 
+/**
+ * @brief Get the clock model of a peer.
+ * @private @memberof MIDIDriverAppleMIDI
+ * @param peer   The peer.
+ * @param create Create the model if the peer has none.
+ * @return a pointer to the clock model or @c NULL if there is none.
+ */
+static struct AppleMIDIPeer * _applemidi_peer_clock( struct RTPPeer * peer, int create ) {
+  struct AppleMIDIPeer * model = NULL;
+  if( peer == NULL ) return NULL;
+  RTPMIDIPeerGetInfo( peer, (void **) &model );
+  if( model == NULL && create ) {
+    model = malloc( sizeof(struct AppleMIDIPeer) );
+    if( model == NULL ) return NULL;
+    memset( model, 0, sizeof(struct AppleMIDIPeer) );
+    RTPMIDIPeerSetInfo( peer, model );
+  }
+  return model;
+}
+
+/**
+ * @brief Remove a peer from the session and free its clock model.
+ * @private @memberof MIDIDriverAppleMIDI
+ * @param driver The driver.
+ * @param peer   The peer.
+ * @retval 0 On success.
+ * @retval >0 If the peer could not be removed.
+ */
+static int _applemidi_remove_peer( struct MIDIDriverAppleMIDI * driver, struct RTPPeer * peer ) {
+  free( _applemidi_peer_clock( peer, 0 ) );
+  RTPMIDIPeerSetInfo( peer, NULL );
+  if( driver->peer == peer ) driver->peer = NULL;
+  return RTPMIDISessionRemovePeer( driver->rtpmidi_session, peer );
+}
+
+/**
+ * @brief Add the result of a synchronization round to a clock model.
+ * The offset is extrapolated from the last round with the drift and
+ * moved towards the measured offset. The first rounds are averaged, later
+ * rounds are smoothed exponentially. The drift is the slope of a least
+ * squares fit of the measured offsets of the last rounds.
+ * Rounds with an implausible delay are ignored, an offset that is off by
+ * more than a second restarts the model because the peer clock was reset.
+ * @private @memberof MIDIDriverAppleMIDI
+ * @param model  The clock model.
+ * @param now    The local time at the end of the round.
+ * @param offset The measured offset of the peer clock.
+ * @param delay  The measured one-way delay.
+ */
+static void _applemidi_peer_sync( struct AppleMIDIPeer * model, MIDITimestamp now,
+                                  MIDITimestamp offset, MIDITimestamp delay ) {
+  double predicted, gain = 1, deviation, time = 0, value = 0, sxx = 0, sxy = 0;
+  unsigned long i, n;
+
+  if( delay < 0 || delay > APPLEMIDI_CLOCK_RATE / 2 ) return;
+  if( model->rounds > 0 ) {
+    predicted = model->offset + model->drift * ( now - model->updated );
+    if( offset - predicted > APPLEMIDI_CLOCK_RATE || predicted - offset > APPLEMIDI_CLOCK_RATE ) {
+      model->rounds = 0;
+    }
+  }
+
+  if( model->rounds == 0 ) {
+    model->origin = now;
+    model->offset = offset;
+    model->drift  = 0;
+    model->delay  = delay;
+    model->jitter = 0;
+  } else {
+    gain = 1.0 / ( ( model->rounds < APPLEMIDI_SYNC_GAIN ) ? model->rounds + 1 : APPLEMIDI_SYNC_GAIN );
+    deviation = ( delay > model->delay ) ? delay - model->delay : model->delay - delay;
+    model->jitter += ( deviation - model->jitter ) / APPLEMIDI_JITTER_GAIN;
+    model->delay  += gain * ( delay - model->delay );
+  }
+
+  i = model->rounds % APPLEMIDI_SYNC_WINDOW;
+  model->samples[i].time   = now - model->origin;
+  model->samples[i].offset = offset;
+  model->rounds++;
+
+  n = ( model->rounds < APPLEMIDI_SYNC_WINDOW ) ? model->rounds : APPLEMIDI_SYNC_WINDOW;
+  for( i=0; i<n; i++ ) {
+    time  += model->samples[i].time;
+    value += model->samples[i].offset;
+  }
+  time  /= n;
+  value /= n;
+  for( i=0; i<n; i++ ) {
+    sxx += ( model->samples[i].time - time ) * ( model->samples[i].time - time );
+    sxy += ( model->samples[i].time - time ) * ( model->samples[i].offset - value );
+  }
+  if( sxx > 0 ) {
+    model->drift = sxy / sxx;
+  }
+
+  if( model->rounds > 1 ) {
+    predicted = model->offset + model->drift * ( now - model->updated );
+    model->offset = predicted + gain * ( offset - predicted );
+  }
+  model->updated = now;
+}
+
+/**
+ * @brief Map a timestamp of the peer clock onto the local clock.
+ * Solve @c peer = @c local + @c offset + @c drift * ( @c local - @c updated ) for @c local.
+ * @private @memberof MIDIDriverAppleMIDI
+ * @param model     The clock model.
+ * @param timestamp The timestamp of the peer clock.
+ * @return the timestamp of the local clock.
+ */
+static MIDITimestamp _applemidi_peer_to_local( struct AppleMIDIPeer * model, MIDITimestamp timestamp ) {
+  double local = ( timestamp - model->updated - model->offset ) / ( 1.0 + model->drift );
+  return model->updated + (MIDITimestamp) ( ( local < 0 ) ? local - 0.5 : local + 0.5 );
+}
+
+/**
+ * @brief Map a 32 bit RTP timestamp of the peer onto the local clock.
+ * The upper bits are taken from the peer time closest to the current time.
+ * @private @memberof MIDIDriverAppleMIDI
+ * @param model     The clock model.
+ * @param now       The current local time.
+ * @param timestamp The RTP timestamp of the peer.
+ * @return the timestamp of the local clock.
+ */
+static MIDITimestamp _applemidi_peer_rtp_to_local( struct AppleMIDIPeer * model, MIDITimestamp now,
+                                                   MIDITimestamp timestamp ) {
+  MIDITimestamp peer, diff;
+  peer = now + (MIDITimestamp) ( model->offset + model->drift * ( now - model->updated ) );
+  diff = ( timestamp - peer ) & 0xffffffffLL;
+  if( diff >= 0x80000000LL ) diff -= 0x100000000LL;
+  return _applemidi_peer_to_local( model, peer + diff );
+}
+
 /**
  * @brief Start or continue a synchronization session.
  * Continue a synchronization session identified by a given command.
@@ -627,7 +1029,8 @@ static int _applemidi_recv_command( struct MIDIDriverAppleMIDI * driver, int fd,
  */
 static int _applemidi_sync( struct MIDIDriverAppleMIDI * driver, int fd, struct AppleMIDICommand * command ) {
   unsigned long ssrc;
-  MIDITimestamp timestamp, diff;
+  MIDITimestamp timestamp, diff, delay;
+  struct AppleMIDIPeer * model;
   RTPSessionGetSSRC( driver->rtp_session, &ssrc );
   MIDIClockGetNow( driver->base.clock, &timestamp );
 
@@ -642,16 +1045,18 @@ static int _applemidi_sync( struct MIDIDriverAppleMIDI * driver, int fd, struct
     driver->sync = 1;
     return _applemidi_send_command( driver, fd, command );
   } else {
+    driver->peer = NULL;
     RTPSessionFindPeerBySSRC( driver->rtp_session, &(driver->peer), command->data.sync.ssrc );
 
     /* received packet from other peer */
     if( command->data.sync.count == 2 ) {
       /* compute media delay */
-      diff = ( command->data.sync.timestamp3 - command->data.sync.timestamp1 ) / 2;
+      delay = ( (MIDITimestamp) command->data.sync.timestamp3 - (MIDITimestamp) command->data.sync.timestamp1 ) / 2;
       /* approximate time difference between peer and self */
-      diff = command->data.sync.timestamp3 + diff - timestamp;
+      diff = command->data.sync.timestamp3 + delay - timestamp;
 
-      /* RTPPeerSetTimestampDiff( command->peer, diff ) */
+      model = _applemidi_peer_clock( driver->peer, 1 );
+      if( model != NULL ) _applemidi_peer_sync( model, timestamp, diff, delay );
       /* finished sync */
       command->data.sync.ssrc  = ssrc;
       command->data.sync.count = 3;
@@ -661,11 +1066,12 @@ static int _applemidi_sync( struct MIDIDriverAppleMIDI * driver, int fd, struct
     }
     if( command->data.sync.count == 1 ) {
       /* compute media delay */
-      diff = ( command->data.sync.timestamp3 - command->data.sync.timestamp1 ) / 2;
+      delay = ( timestamp - (MIDITimestamp) command->data.sync.timestamp1 ) / 2;
       /* approximate time difference between peer and self */
-      diff = command->data.sync.timestamp2 + diff - timestamp;
+      diff = command->data.sync.timestamp2 + delay - timestamp;
 
-      /* RTPPeerSetTimestampDiff( command->peer, diff ) */
+      model = _applemidi_peer_clock( driver->peer, 1 );
+      if( model != NULL ) _applemidi_peer_sync( model, timestamp, diff, delay );
 
       command->data.sync.ssrc       = ssrc;
       command->data.sync.count      = 2;
@@ -826,7 +1232,7 @@ static int _applemidi_respond( struct MIDIDriverAppleMIDI * driver, int fd, stru
       MIDIDriverTriggerEvent( &(driver->base), event );
       MIDIEventRelease( event );
       if( peer != NULL ) {
-        RTPSessionRemovePeer( driver->rtp_session, peer );
+        _applemidi_remove_peer( driver, peer );
       }
       break;
     case APPLEMIDI_COMMAND_SYNCHRONIZATION:
@@ -902,7 +1308,7 @@ int MIDIDriverAppleMIDIRemovePeerWithSockaddr( struct MIDIDriverAppleMIDI * driv
     return result;
   }
 
-  result  = RTPSessionRemovePeer( driver->rtp_session, peer );
+  result  = _applemidi_remove_peer( driver, peer );
   result += _applemidi_endsession( driver, driver->control_socket, size, addr );
   return result;
 }
@@ -934,8 +1340,25 @@ int MIDIDriverAppleMIDIRemovePeer( struct MIDIDriverAppleMIDI * driver, char * a
   return result;
 }
 
-static int _applemidi_receive_rtpmidi( struct MIDIDriverAppleMIDI * driver ) {
+/**
+ * @brief Receive the MIDI messages of one RTP-MIDI packet and relay them.
+ * @private @memberof MIDIDriverAppleMIDI
+ * @param driver  The driver.
+ * @param size    The number of bytes in the datagram.
+ * @param data    The datagram or @c NULL to receive it from the RTP socket.
+ * @param namelen The size of the sender address.
+ * @param name    The sender address.
+ * @retval 0 on success.
+ * @retval >0 if the packet could not be received.
+ */
+static int _applemidi_receive_rtpmidi( struct MIDIDriverAppleMIDI * driver, size_t size, void * data,
+                                       socklen_t namelen, struct sockaddr * name ) {
   struct MIDIMessageList messages[APPLEMIDI_MAX_MESSAGES_PER_PACKET];
+  struct MIDIMessage * received[APPLEMIDI_MAX_MESSAGES_PER_PACKET];
+  struct RTPPeer * peer = NULL;
+  struct AppleMIDIPeer * model;
+  MIDITimestamp now, timestamp;
+  unsigned long long start;
   int i, result;
 
   for( i=0; i<APPLEMIDI_MAX_MESSAGES_PER_PACKET; i++ ) {
@@ -944,40 +1367,122 @@ static int _applemidi_receive_rtpmidi( struct MIDIDriverAppleMIDI * driver ) {
   }
   messages[i-1].next = NULL;
 
-  result = RTPMIDISessionReceive( driver->rtpmidi_session, &(messages[0]) );
+  start  = MIDIDriverProfileTime( &(driver->base) );
+  if( data == NULL ) {
+    result = RTPMIDISessionReceive( driver->rtpmidi_session, &(messages[0]) );
+  } else {
+    result = RTPMIDISessionReceiveDatagram( driver->rtpmidi_session, size, data, namelen, name, &(messages[0]) );
+  }
+  MIDIDriverProfileDecode( &(driver->base), start );
   if( result != 0 ) return result;
 
+  /* move the timestamps from the peer clock onto the driver clock */
+  RTPMIDISessionGetReceivePeer( driver->rtpmidi_session, &peer );
+  model = _applemidi_peer_clock( peer, 0 );
+  if( model != NULL && model->rounds > 0 ) {
+    MIDIClockGetNow( driver->base.clock, &now );
+    for( i=0; i<APPLEMIDI_MAX_MESSAGES_PER_PACKET && messages[i].message != NULL; i++ ) {
+      MIDIMessageGetTimestamp( messages[i].message, &timestamp );
+      MIDIMessageSetTimestamp( messages[i].message, _applemidi_peer_rtp_to_local( model, now, timestamp ) );
+    }
+  }
+
+  /* relay all messages of the packet at once */
   for( i=0; i<APPLEMIDI_MAX_MESSAGES_PER_PACKET && messages[i].message != NULL; i++ ) {
   /*MIDIMessageQueuePush( driver->in_queue, messages[i].message );
     MIDIMessageRelease( messages[i].message );*/
-    MIDIDriverAppleMIDIReceiveMessage( driver, messages[i].message ); /* fixme: add scheduling! */
+    received[i] = messages[i].message;
   }
+  MIDIDriverReceiveBatch( &(driver->base), i, &(received[0]) );
   
   return 0;
 }
 
+/**
+ * @brief Check if the queued messages must be sent now.
+ * @param driver The driver.
+ * @param now    The current time of the send clock.
+ * @retval 1 if the queue holds a real-time message, enough messages to
+ *           fill a packet or a message that used up its latency budget.
+ * @retval 0 otherwise.
+ */
+static int _applemidi_send_due( struct MIDIDriverAppleMIDI * driver, MIDITimestamp now ) {
+  size_t length = 0;
+  MIDIMessageQueueGetLength( driver->out_queue, &length );
+  if( length == 0 ) return 0;
+  return driver->send_flush
+      || driver->send_bytes >= RTPMIDI_COMMAND_SIZE
+      || now - driver->send_oldest >= driver->send_latency;
+}
+
+/**
+ * @brief Send the queued messages in as few packets as possible.
+ * Messages are taken from the queue as long as their commands, including
+ * the delta times, fit into the command section of one packet.
+ * Nothing is sent until the queue is due.
+ * @param driver The driver.
+ * @retval 0 on success.
+ * @retval >0 if a packet could not be sent.
+ */
 static int _applemidi_send_rtpmidi( struct MIDIDriverAppleMIDI * driver ) {
   struct MIDIMessageList messages[APPLEMIDI_MAX_MESSAGES_PER_PACKET];
-  int i, result;
-  size_t length;
-  MIDIMessageQueueGetLength( driver->out_queue, &length );
+  struct MIDIMessage * message;
+  struct AppleMIDISendStats * stats = &(driver->send_stats);
+  MIDITimestamp now, timestamp, first, last = 0, delta, latency, waited;
+  unsigned long long start;
+  size_t i, n, size, bytes;
+  int result = 0;
 
-  if( length > 0 ) {
-    for( i=0; i<length && i<APPLEMIDI_MAX_MESSAGES_PER_PACKET; i++ ) {
-      MIDIMessageQueuePop( driver->out_queue, &(messages[i].message) );
-      messages[i].next = &(messages[i+1]);
+  MIDIClockGetNow( driver->send_clock, &now );
+  if( ! _applemidi_send_due( driver, now ) ) return 0;
+  /* the oldest message waited exactly this long, the others are
+   * younger by the difference of their driver clock timestamps */
+  waited = now - driver->send_oldest;
+  message = NULL;
+  MIDIMessageQueuePeek( driver->out_queue, &message );
+  MIDIMessageGetTimestamp( message, &first );
+
+  do {
+    bytes = 0;
+    for( n=0; n<APPLEMIDI_MAX_MESSAGES_PER_PACKET; n++ ) {
+      message = NULL;
+      MIDIMessageQueuePeek( driver->out_queue, &message );
+      if( message == NULL ) break;
+      size = 0;
+      MIDIMessageGetSize( message, &size );
+      MIDIMessageGetTimestamp( message, &timestamp );
+      if( n > 0 ) {
+        /* length of the delta time as variable length quantity */
+        for( delta = ( timestamp - last ) >> 7, size++; delta > 0; delta >>= 7 ) size++;
+        if( bytes + size > RTPMIDI_COMMAND_SIZE ) break;
+      }
+      last   = timestamp;
+      bytes += size;
+      MIDIMessageQueuePop( driver->out_queue, &(messages[n].message) );
+      messages[n].next = &(messages[n+1]);
     }
-    messages[i-1].next = NULL;
-
-    result = RTPMIDISessionSend( driver->rtpmidi_session, &(messages[0]) );
-
-    for( i=0; i<length && i<APPLEMIDI_MAX_MESSAGES_PER_PACKET; i++ ) {
-      if( messages[i].message != NULL ) MIDIMessageRelease( messages[i].message );
+    if( n == 0 ) break;
+    messages[n-1].next = NULL;
+
+    start   = MIDIDriverProfileTime( &(driver->base) );
+    result += RTPMIDISessionSend( driver->rtpmidi_session, &(messages[0]) );
+    MIDIDriverProfileEncode( &(driver->base), start );
+
+    stats->packets++;
+    for( i=0; i<n; i++ ) {
+      MIDIMessageGetTimestamp( messages[i].message, &timestamp );
+      delta   = ( timestamp - first ) * 1000000 / APPLEMIDI_CLOCK_RATE;
+      latency = ( waited > delta ) ? waited - delta : 0;
+      stats->messages++;
+      stats->latency_total += latency;
+      if( latency > stats->latency_max ) stats->latency_max = latency;
+      MIDIMessageRelease( messages[i].message );
     }
-    return result;
-  } else {
-    return 0;
-  }
+  } while( n == APPLEMIDI_MAX_MESSAGES_PER_PACKET || message != NULL );
+
+  driver->send_flush = 0;
+  driver->send_bytes = 0;
+  return result;
 }
 
 static int _applemidi_read_fds( void * drv, int nfds, fd_set * readfds ) {
@@ -1002,7 +1507,7 @@ static int _applemidi_read_fds( void * drv, int nfds, fd_set * readfds ) {
         result += _applemidi_respond( driver, fd, &(driver->command) );
       }
     } else {
-      result += _applemidi_receive_rtpmidi( driver );
+      result += _applemidi_receive_rtpmidi( driver, 0, NULL, 0, NULL );
     }
   }
   
@@ -1011,6 +1516,41 @@ static int _applemidi_read_fds( void * drv, int nfds, fd_set * readfds ) {
   return result;
 }
 
+/**
+ * @brief Handle a datagram that the runloop received on one of the sockets.
+ * @private @memberof MIDIDriverAppleMIDI
+ * @param drv     The driver.
+ * @param fd      The socket the datagram was received on.
+ * @param size    The number of bytes in the datagram.
+ * @param data    The datagram.
+ * @param namelen The size of the sender address.
+ * @param name    The sender address.
+ * @retval 0 on success.
+ * @retval >0 if the datagram could not be handled.
+ */
+static int _applemidi_receive( void * drv, int fd, size_t size, void * data, socklen_t namelen, struct sockaddr * name ) {
+  struct MIDIDriverAppleMIDI * driver = drv;
+  unsigned int msg[16];
+  int result = 0;
+
+  if( _test_applemidi_data( size, data ) == 0 ) {
+    if( namelen > sizeof(driver->command.addr) ) namelen = sizeof(driver->command.addr);
+    if( size > sizeof(msg) ) size = sizeof(msg);
+    memcpy( &(driver->command.addr), name, namelen );
+    memcpy( &msg[0], data, size );
+    driver->command.size = namelen;
+    if( _applemidi_decode_command( driver, fd, size, &msg[0], &(driver->command) ) == 0 ) {
+      result += _applemidi_respond( driver, fd, &(driver->command) );
+    }
+  } else if( fd == driver->rtp_socket ) {
+    result += _applemidi_receive_rtpmidi( driver, size, data, namelen, name );
+  }
+
+  _applemidi_update_runloop_source( driver );
+
+  return result;
+}
+
 static int _applemidi_write_fds( void * drv, int nfds, fd_set * writefds ) {
   struct MIDIDriverAppleMIDI * driver = drv;
   int fd, result = 0;
@@ -1031,13 +1571,21 @@ static int _applemidi_write_fds( void * drv, int nfds, fd_set * writefds ) {
   return result;
 }
 
+static int _applemidi_send_timer_fire( void * drv, struct MIDIRunloopTimer * timer, struct timespec * now ) {
+  struct MIDIDriverAppleMIDI * driver = drv;
+  int result;
+
+  /* the latency budget of the oldest queued message ran out */
+  result = _applemidi_send_rtpmidi( driver );
+  _applemidi_update_runloop_source( driver );
+  return result;
+}
+
 static int _applemidi_idle_timeout( void * drv, struct timespec * ts ) {
   struct MIDIDriverAppleMIDI * driver = drv;
   struct sockaddr * addr;
   socklen_t size;
 
-  _applemidi_update_runloop_source( driver );
-
   RTPSessionNextPeer( driver->rtp_session, &(driver->peer) );
   if( driver->peer != NULL ) {
     /* check if receiver feedback needs to be sent */
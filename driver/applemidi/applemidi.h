@@ -1,6 +1,7 @@
 #ifndef MIDIKIT_DRIVER_APPLEMIDI_H
 #define MIDIKIT_DRIVER_APPLEMIDI_H
 #include <sys/socket.h>
+#include "midi/midi.h"
 
 #ifndef MIDI_DRIVER_INTERNALS
 /**
@@ -10,6 +11,7 @@
 #define MIDIDriverAppleMIDI MIDIDriver
 #endif
 
+struct MIDIClock;
 struct MIDIMessage;
 struct MIDIDriverAppleMIDI;
 
@@ -27,6 +29,19 @@ struct MIDIDriverAppleMIDI;
 #define MIDI_APPLEMIDI_PEER_DID_REJECT_INVITATION (0x4b710000 + APPLEMIDI_COMMAND_INVITATION_REJECTED)
 #define MIDI_APPLEMIDI_PEER_DID_END_SESSION       (0x4b710000 + APPLEMIDI_COMMAND_ENDSESSION)
 
+/**
+ * @brief Statistics of the AppleMIDI send scheduler.
+ * The number of packets counts every RTP-MIDI packet sent to each of the
+ * peers once, so @c packets / @c messages is the number of packets per message.
+ * The latency is the time messages waited in the send queue.
+ */
+struct AppleMIDISendStats {
+  unsigned long messages;       /**< The number of messages sent */
+  unsigned long packets;        /**< The number of packets the messages were sent in */
+  unsigned long latency_total;  /**< The sum of the added latency of all messages in microseconds */
+  unsigned long latency_max;    /**< The largest added latency of a message in microseconds */
+};
+
 struct MIDIDriverAppleMIDI * MIDIDriverAppleMIDICreate( char * name, unsigned short port );
 
 int MIDIDriverAppleMIDISetPort( struct MIDIDriverAppleMIDI * driver, unsigned short port ); 
@@ -41,6 +56,16 @@ int MIDIDriverAppleMIDIRemovePeerWithSockaddr( struct MIDIDriverAppleMIDI * driv
 int MIDIDriverAppleMIDIAddPeer( struct MIDIDriverAppleMIDI * driver, char * address, unsigned short port );
 int MIDIDriverAppleMIDIRemovePeer( struct MIDIDriverAppleMIDI * driver, char * address, unsigned short port );
 
+int MIDIDriverAppleMIDISetSendLatency( struct MIDIDriverAppleMIDI * driver, unsigned long latency );
+int MIDIDriverAppleMIDIGetSendLatency( struct MIDIDriverAppleMIDI * driver, unsigned long * latency );
+int MIDIDriverAppleMIDIGetSendStats( struct MIDIDriverAppleMIDI * driver, struct AppleMIDISendStats * stats );
+int MIDIDriverAppleMIDIResetSendStats( struct MIDIDriverAppleMIDI * driver );
+
+int MIDIDriverAppleMIDIGetPeerLatency( struct MIDIDriverAppleMIDI * driver, socklen_t size, struct sockaddr * addr,
+                                       double * latency, double * jitter );
+int MIDIDriverAppleMIDIConvertPeerTimestamp( struct MIDIDriverAppleMIDI * driver, socklen_t size, struct sockaddr * addr,
+                                             struct MIDIClock * clock, MIDITimestamp * timestamp );
+
 int MIDIDriverAppleMIDISetRTPSocket( struct MIDIDriverAppleMIDI * driver, int socket );
 int MIDIDriverAppleMIDIGetRTPSocket( struct MIDIDriverAppleMIDI * driver, int * socket );
 int MIDIDriverAppleMIDISetControlSocket( struct MIDIDriverAppleMIDI * driver, int socket );
@@ -49,6 +74,7 @@ int MIDIDriverAppleMIDIGetControlSocket( struct MIDIDriverAppleMIDI * driver, in
 /*
 int MIDIDriverAppleMIDIReceiveMessage( struct MIDIDriverAppleMIDI * driver, struct MIDIMessage * message );
 int MIDIDriverAppleMIDISendMessage( struct MIDIDriverAppleMIDI * driver, struct MIDIMessage * message );
+int MIDIDriverAppleMIDISendMessages( struct MIDIDriverAppleMIDI * driver, size_t count, struct MIDIMessage ** messages );
 
 int MIDIDriverAppleMIDIReceive( struct MIDIDriverAppleMIDI * driver );
 int MIDIDriverAppleMIDISend( struct MIDIDriverAppleMIDI * driver );
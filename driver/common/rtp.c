@@ -1,14 +1,20 @@
+#if defined( __linux__ ) && ! defined( _GNU_SOURCE )
+#define _GNU_SOURCE
+#endif
 #include "rtp.h"
 #include <string.h>
 #include <unistd.h>
 #include <sys/time.h>
 #include <arpa/inet.h>
+#if defined( __linux__ ) && defined( MSG_WAITFORONE )
+#define HAVE_MMSG 1
+#endif
 
 #ifndef NO_LOG
 #include "midi/midi.h"
 #endif
 
-#define RTP_MAX_PEERS 16
+#define RTP_PEER_CAPACITY 16
 #define RTP_BUF_LEN   512
 #define RTP_IOV_LEN   16
 
@@ -30,18 +36,37 @@ struct RTPPeer {
   void * info;
 };
 
+#ifndef HAVE_MMSG
+struct mmsghdr {
+  struct msghdr msg_hdr;
+  unsigned int  msg_len;
+};
+#endif
+
 struct RTPSession {
   size_t refs;
   
   int socket;
   
   struct RTPAddress self;
-  struct RTPPeer *  peers[RTP_MAX_PEERS];
+  struct RTPPeer ** peers;
+  size_t peers_length;
+  size_t peers_count;
+  size_t peers_capacity;
+  size_t index_mask;
+  int  * index[2];
+  int    cursor;
+  struct RTPPeer * cursor_peer;
   struct RTPPacketInfo info;
   
   struct iovec iov[RTP_IOV_LEN];
   size_t buflen;
   void * buffer;
+
+  struct mmsghdr          batch_msg[RTP_MAX_BATCH];
+  struct iovec            batch_iov[RTP_MAX_BATCH][RTP_IOV_LEN+3];
+  struct sockaddr_storage batch_name[RTP_MAX_BATCH];
+  void * batch_buffer;
 };
 
 /**
@@ -386,6 +411,148 @@ int RTPPeerGetInfo( struct RTPPeer * peer, void ** info ) {
   return 0;
 }
 
+/* MARK: Peer table *//**
+ * @name Peer table
+ * The peers of a session are stored in a growable array of slots in the
+ * order they were added. Removing a peer leaves an empty slot behind that
+ * is dropped when the table is compacted, which keeps the order of the
+ * remaining peers. Two open addressing hash indexes with linear probing
+ * map SSRC identifiers and addresses to slots.
+ * @cond INTERNALS
+ * @{
+ */
+
+#define RTP_INDEX_SSRC 0
+#define RTP_INDEX_ADDR 1
+
+static size_t _peer_hash_ssrc( unsigned long ssrc ) {
+  return (size_t) ( ( ssrc & 0xffffffff ) * 2654435761UL );
+}
+
+static size_t _peer_hash_addr( socklen_t size, struct sockaddr * addr ) {
+  unsigned char * bytes = (unsigned char *) addr;
+  size_t i, hash = 2166136261UL;
+  for( i=0; i<size; i++ ) {
+    hash = ( hash ^ bytes[i] ) * 16777619UL;
+  }
+  return hash;
+}
+
+static size_t _peer_hash( struct RTPPeer * peer, int which ) {
+  if( which == RTP_INDEX_SSRC ) {
+    return _peer_hash_ssrc( peer->address.ssrc );
+  } else {
+    return _peer_hash_addr( peer->address.size, (struct sockaddr *) &(peer->address.addr) );
+  }
+}
+
+static void _peer_index_insert( struct RTPSession * session, int which, size_t slot ) {
+  int * index = session->index[which];
+  size_t i = _peer_hash( session->peers[slot], which ) & session->index_mask;
+  while( index[i] >= 0 ) {
+    i = ( i + 1 ) & session->index_mask;
+  }
+  index[i] = slot;
+}
+
+static void _peer_index_remove( struct RTPSession * session, int which, size_t slot ) {
+  int * index = session->index[which];
+  size_t i, j, home;
+  i = _peer_hash( session->peers[slot], which ) & session->index_mask;
+  while( index[i] != (int) slot ) {
+    if( index[i] < 0 ) return;
+    i = ( i + 1 ) & session->index_mask;
+  }
+  /* shift following entries of the probe sequence back into the gap */
+  j = i;
+  for(;;) {
+    index[i] = -1;
+    do {
+      j = ( j + 1 ) & session->index_mask;
+      if( index[j] < 0 ) return;
+      home = _peer_hash( session->peers[index[j]], which ) & session->index_mask;
+    } while( ( i <= j ) ? ( i < home && home <= j ) : ( i < home || home <= j ) );
+    index[i] = index[j];
+    i = j;
+  }
+}
+
+static void _peer_index_rebuild( struct RTPSession * session ) {
+  size_t i;
+  for( i=0; i<=session->index_mask; i++ ) {
+    session->index[RTP_INDEX_SSRC][i] = -1;
+    session->index[RTP_INDEX_ADDR][i] = -1;
+  }
+  for( i=0; i<session->peers_length; i++ ) {
+    if( session->peers[i] != NULL ) {
+      _peer_index_insert( session, RTP_INDEX_SSRC, i );
+      _peer_index_insert( session, RTP_INDEX_ADDR, i );
+    }
+  }
+}
+
+/**
+ * @brief Drop empty slots and make room for at least one more peer.
+ * @private @memberof RTPSession
+ * @param session The session.
+ * @retval 0 on success.
+ * @retval >0 if the table could not be grown.
+ */
+static int _peer_table_reserve( struct RTPSession * session ) {
+  struct RTPPeer ** peers;
+  int * index[2];
+  size_t i, j, capacity = session->peers_capacity;
+  int cursor = -1;
+
+  if( session->peers_length < capacity ) return 0;
+  if( session->peers_count * 2 > capacity ) {
+    capacity *= 2;
+    peers    = realloc( session->peers, sizeof(struct RTPPeer *) * capacity );
+    if( peers == NULL ) return 1;
+    session->peers = peers;
+    index[0] = malloc( sizeof(int) * capacity * 2 );
+    index[1] = malloc( sizeof(int) * capacity * 2 );
+    if( index[0] == NULL || index[1] == NULL ) {
+      free( index[0] );
+      free( index[1] );
+      return 1;
+    }
+    free( session->index[0] );
+    free( session->index[1] );
+    session->index[0]       = index[0];
+    session->index[1]       = index[1];
+    session->index_mask     = capacity * 2 - 1;
+    session->peers_capacity = capacity;
+  }
+  for( i=0, j=0; i<session->peers_length; i++ ) {
+    if( (int) i == session->cursor ) {
+      cursor = ( session->peers[i] != NULL ) ? (int) j : (int) j - 1;
+    }
+    if( session->peers[i] != NULL ) {
+      session->peers[j++] = session->peers[i];
+    }
+  }
+  if( session->cursor >= (int) session->peers_length ) {
+    cursor = (int) j - 1;
+  }
+  session->cursor       = cursor;
+  session->peers_length = j;
+  _peer_index_rebuild( session );
+  return 0;
+}
+
+static int _peer_find( struct RTPSession * session, struct RTPPeer * peer ) {
+  int * index = session->index[RTP_INDEX_SSRC];
+  size_t i = _peer_hash( peer, RTP_INDEX_SSRC ) & session->index_mask;
+  while( index[i] >= 0 ) {
+    if( session->peers[index[i]] == peer ) return index[i];
+    i = ( i + 1 ) & session->index_mask;
+  }
+  return -1;
+}
+
+/** @} @endcond */
+
 /* MARK: Creation and destruction *//**
  * @name Creation and destruction
  * Creating, destroying and reference counting of RTPSession objects.
@@ -436,16 +603,30 @@ struct RTPSession * RTPSessionCreate( int socket ) {
   session->socket = socket;
 
   _init_addr_with_socket( &(session->self), socket );
-  for( i=0; i<RTP_MAX_PEERS; i++ ) {
-    session->peers[i] = NULL;
+  session->peers_length   = 0;
+  session->peers_count    = 0;
+  session->peers_capacity = RTP_PEER_CAPACITY;
+  session->cursor         = -1;
+  session->cursor_peer    = NULL;
+  session->index_mask     = RTP_PEER_CAPACITY * 2 - 1;
+  session->peers    = malloc( sizeof(struct RTPPeer *) * RTP_PEER_CAPACITY );
+  session->index[0] = malloc( sizeof(int) * RTP_PEER_CAPACITY * 2 );
+  session->index[1] = malloc( sizeof(int) * RTP_PEER_CAPACITY * 2 );
+  if( session->peers == NULL || session->index[0] == NULL || session->index[1] == NULL ) {
+    free( session->peers );
+    free( session->index[0] );
+    free( session->index[1] );
+    free( session );
+    return NULL;
   }
-  
-  
+  _peer_index_rebuild( session );
+
   session->buflen = RTP_BUF_LEN;
   session->buffer = malloc( session->buflen );
   if( session->buffer == NULL ) {
     session->buflen = 0;
   }
+  session->batch_buffer = malloc( RTP_MAX_BATCH * RTP_BUF_LEN );
   session->iov[0].iov_base = session->buffer;
   session->iov[9].iov_len  = session->buflen;
   for( i=1; i<RTP_IOV_LEN; i++ ) {
@@ -476,12 +657,16 @@ struct RTPSession * RTPSessionCreate( int socket ) {
  */
 void RTPSessionDestroy( struct RTPSession * session ) {
   int i;
-  for( i=0; i<RTP_MAX_PEERS; i++ ) {
+  for( i=0; i<session->peers_length; i++ ) {
     if( session->peers[i] != NULL ) {
       RTPPeerRelease( session->peers[i] );
     }
   }
+  free( session->peers );
+  free( session->index[0] );
+  free( session->index[1] );
   free( session->buffer );
+  free( session->batch_buffer );
   free( session );
 }
 
@@ -563,7 +748,7 @@ int RTPSessionGetSocket( struct RTPSession * session, int * socket ) {
 
 /**
  * @brief Add an RTPPeer to the session.
- * Lookup the peer using the (pseudo) hash-table, add it to the list and retain it.
+ * Append the peer to the peer table, index it and retain it.
  * The peer will be included when data is sent via RTPSessionSendPayload.
  * @public @memberof RTPSession
  * @param session The session.
@@ -572,22 +757,29 @@ int RTPSessionGetSocket( struct RTPSession * session, int * socket ) {
  * @retval >0 if the peer could not be added.
  */
 int RTPSessionAddPeer( struct RTPSession * session, struct RTPPeer * peer ) {
-  int i, off, p;
-  off = peer->address.ssrc % RTP_MAX_PEERS;
-  for( i=0; i < RTP_MAX_PEERS; i++ ) {
-    p = (i+off)%RTP_MAX_PEERS;
-    if( session->peers[p] == NULL ) {
-      session->peers[p] = peer;
-      RTPPeerRetain( peer );
-      return 0;
-    }
+  size_t slot;
+  if( peer == NULL || _peer_find( session, peer ) >= 0 ) return 1;
+  if( _peer_table_reserve( session ) ) return 1;
+  if( peer == session->cursor_peer ) {
+    /* a removed cursor peer was freed and its address reused */
+    session->cursor_peer = NULL;
   }
-  return 1;
+  slot = session->peers_length++;
+  session->peers[slot] = peer;
+  session->peers_count++;
+  _peer_index_insert( session, RTP_INDEX_SSRC, slot );
+  _peer_index_insert( session, RTP_INDEX_ADDR, slot );
+  RTPPeerRetain( peer );
+  return 0;
 }
 
 /**
  * @brief Remove an RTPPeer from the session.
- * Lookup the peer using the (pseudo) hash-table, remove it from the list and release it.
+ * Lookup the peer using the hash index, remove it from the table and release it.
+ * The slot of the peer stays empty until the table is compacted. If the
+ * peer is the one RTPSessionNextPeer returned last, the iteration
+ * cursor keeps its slot, so passing the removed peer to
+ * RTPSessionNextPeer continues with the following peer.
  * @public @memberof RTPSession
  * @param session The session.
  * @param peer The peer to remove.
@@ -595,23 +787,30 @@ int RTPSessionAddPeer( struct RTPSession * session, struct RTPPeer * peer ) {
  * @retval >0 if the peer could not be removed.
  */
 int RTPSessionRemovePeer( struct RTPSession * session, struct RTPPeer * peer ) {
-  int i, off, p;
-  off = peer->address.ssrc % RTP_MAX_PEERS;
-  for( i=0; i < RTP_MAX_PEERS; i++ ) {
-    p = (i+off)%RTP_MAX_PEERS;
-    if( session->peers[p] == peer ) {
-      session->peers[p] = NULL;
-      RTPPeerRelease( peer );
-      return 0;
-    }
+  int slot;
+  if( peer == NULL ) return 1;
+  slot = _peer_find( session, peer );
+  if( slot < 0 ) return 1;
+  _peer_index_remove( session, RTP_INDEX_SSRC, slot );
+  _peer_index_remove( session, RTP_INDEX_ADDR, slot );
+  session->peers[slot] = NULL;
+  session->peers_count--;
+  while( session->peers_length > 0 && session->peers[session->peers_length-1] == NULL ) {
+    session->peers_length--;
   }
-  return 1;
+  RTPPeerRelease( peer );
+  return 0;
 }
 
 /**
  * @brief Advance the pointer to the next peer.
  * Given a @c NULL pointer the first peer will be returned. When the
  * last peer was reached a @c NULL pointer will be returned.
+ * Peers are returned in the order they were added. Peers may be added or
+ * removed during the iteration, including the peer that was returned
+ * last. Every peer that stays in the session is returned exactly once.
+ * The session remembers the slot of the peer that was returned last, so
+ * one iteration at a time resolves in constant time.
  * @public @memberof RTPSession
  * @param session The session.
  * @param peer The peer.
@@ -623,23 +822,24 @@ int RTPSessionNextPeer( struct RTPSession * session, struct RTPPeer ** peer ) {
   if( peer == NULL ) return 1;
   if( *peer == NULL ) {
     i=-1;
+  } else if( *peer == session->cursor_peer ) {
+    i = session->cursor;
   } else {
-    for( i=0; i < RTP_MAX_PEERS; i++ ) {
-      if( session->peers[i] == *peer ) {
-        break;
-      }
-    }
-    if( i == RTP_MAX_PEERS ) return 1;
+    i = _peer_find( session, *peer );
+    if( i < 0 ) return 1;
   }
 
   do {
      i++;
-  } while( i < RTP_MAX_PEERS && session->peers[i] == NULL );
-  if( i == RTP_MAX_PEERS ) {
+  } while( i < (int) session->peers_length && session->peers[i] == NULL );
+  if( i >= (int) session->peers_length ) {
     *peer = NULL;
+    session->cursor = (int) session->peers_length;
   } else {
     *peer = session->peers[i];
+    session->cursor = i;
   }
+  session->cursor_peer = *peer;
   return 0;
 }
 
@@ -654,16 +854,14 @@ int RTPSessionNextPeer( struct RTPSession * session, struct RTPPeer ** peer ) {
  */
 int RTPSessionFindPeerBySSRC( struct RTPSession * session, struct RTPPeer ** peer,
                               unsigned long ssrc ) {
-  int i, off, p;
-  off = ssrc % RTP_MAX_PEERS;
-  for( i=0; i < RTP_MAX_PEERS; i++ ) {
-    p = (i+off)%RTP_MAX_PEERS;
-    if( session->peers[p] != NULL ) {
-      if( session->peers[p]->address.ssrc == ssrc ) {
-        *peer = session->peers[p];
-        return 0;
-      }
+  int * index = session->index[RTP_INDEX_SSRC];
+  size_t i = _peer_hash_ssrc( ssrc ) & session->index_mask;
+  while( index[i] >= 0 ) {
+    if( session->peers[index[i]]->address.ssrc == ssrc ) {
+      *peer = session->peers[index[i]];
+      return 0;
     }
+    i = ( i + 1 ) & session->index_mask;
   }
   return 1;
 }
@@ -680,17 +878,16 @@ int RTPSessionFindPeerBySSRC( struct RTPSession * session, struct RTPPeer ** pee
  */
 int RTPSessionFindPeerByAddress( struct RTPSession * session, struct RTPPeer ** peer,
                                  socklen_t size, struct sockaddr * addr ) {
-  int i;
-  socklen_t s;
-  struct sockaddr * a;
-  for( i=0; i < RTP_MAX_PEERS; i++ ) {
-    if( session->peers[i] != NULL ) {
-      RTPPeerGetAddress( session->peers[i], &s, &a );
-      if( s == size && memcmp( a, addr, s ) == 0 ) {
-        *peer = session->peers[i];
-        return 0;
-      }
+  int * index = session->index[RTP_INDEX_ADDR];
+  size_t i = _peer_hash_addr( size, addr ) & session->index_mask;
+  struct RTPAddress * a;
+  while( index[i] >= 0 ) {
+    a = &(session->peers[index[i]]->address);
+    if( a->size == size && memcmp( &(a->addr), addr, size ) == 0 ) {
+      *peer = session->peers[index[i]];
+      return 0;
     }
+    i = ( i + 1 ) & session->index_mask;
   }
   return 1;
 }
@@ -843,77 +1040,185 @@ static void _append_iov( size_t * iovlen, struct iovec * iov, size_t size, void
   *iovlen += 1;
 }
 
+static void _rtp_log_iov( size_t iovlen, struct iovec * iov ) {
+#ifndef NO_LOG
+  int i, j;
+  for( i=0; i<iovlen; i++ ) {
+    MIDILog( DEBUG, "[%i] iov_len: %i, iov_base: %p\n", i, (int) iov[i].iov_len, iov[i].iov_base );
+    for( j=0; j<iov[i].iov_len; j++ ) {
+      unsigned char c = *((unsigned char*)iov[i].iov_base+j);
+      if( (j+1) % 8 == 0 || j+1 == iov[i].iov_len ) {
+        MIDILog( DEBUG, "0x%02x\n", c );
+      } else {
+        MIDILog( DEBUG, "0x%02x ", c );
+      }
+    }
+  }
+#endif
+}
+
 /**
- * @brief Send an RTP packet.
- * @public @memberof RTPSession
+ * @brief Encode the header of a packet and collect the iovecs to send.
+ * The header, extension and padding are written to @c buffer, the
+ * payload iovecs are referenced.
+ * @private @memberof RTPSession
  * @param session The session.
- * @param info The packet info.
- * @retval 0 On success.
- * @retval >0 If the message could not be sent.
+ * @param info    The packet info.
+ * @param size    The size of the header buffer.
+ * @param buffer  The header buffer.
+ * @param iovlen  The number of iovecs used.
+ * @param iov     An array of at least @c RTP_IOV_LEN+3 iovecs.
  */
-int RTPSessionSendPacket( struct RTPSession * session, struct RTPPacketInfo * info ) {
-  size_t size, written = 0, iovlen = 0;
-  void * buffer;
-  struct msghdr msg;
-  struct iovec  iov[RTP_IOV_LEN+3];
-  ssize_t bytes_sent;
-  
-  if( info == NULL || info->peer == NULL ) return 1;
-  if( info->iovlen > RTP_IOV_LEN ) return 1;
-  
-  size   = session->buflen;
-  buffer = session->buffer;
+static void _rtp_encode_packet( struct RTPSession * session, struct RTPPacketInfo * info,
+                                size_t size, void * buffer, size_t * iovlen, struct iovec * iov ) {
+  size_t written = 0;
 
+  *iovlen = 0;
   info->ssrc            = session->self.ssrc;
   info->sequence_number = info->peer->out_seqnum + 1;
 
   info->total_size = 0;
   _rtp_encode_header( info, size, buffer, &written );
-  _append_iov( &iovlen, &(iov[0]), written, buffer );
+  _append_iov( iovlen, iov, written, buffer );
   _advance_buffer( &size, &buffer, written );
   info->total_size += written;
   if( info->extension ) {
-    _rtp_encode_extension( info, size, &buffer, &written );
-    _append_iov( &iovlen, &(iov[0]), written, buffer );
+    _rtp_encode_extension( info, size, buffer, &written );
+    _append_iov( iovlen, iov, written, buffer );
     _advance_buffer( &size, &buffer, written );
     info->total_size += written;
   }
   info->payload_size = 0;
-  while( (iovlen-1)<info->iovlen ) {
-    info->payload_size += info->iov[iovlen-1].iov_len;
-    _append_iov( &iovlen, &(iov[0]), info->iov[iovlen-1].iov_len, info->iov[iovlen-1].iov_base );
+  while( (*iovlen-1)<info->iovlen ) {
+    info->payload_size += info->iov[*iovlen-1].iov_len;
+    _append_iov( iovlen, iov, info->iov[*iovlen-1].iov_len, info->iov[*iovlen-1].iov_base );
   }
   info->total_size += info->payload_size;
   if( info->padding ) {
-    _rtp_encode_padding( info, size, &buffer, &written );
-    _append_iov( &iovlen, &(iov[0]), written, buffer );
+    _rtp_encode_padding( info, size, buffer, &written );
+    _append_iov( iovlen, iov, written, buffer );
     _advance_buffer( &size, &buffer, written );
     info->total_size += written;
   }
 
 #ifndef NO_LOG
-  MIDILogLocation( DEBUG, "Sending RTP message consisting of %i iovecs.\n", (int) iovlen );
-  int i, j;
-  for( i=0; i<iovlen; i++ ) {
-    MIDILog( DEBUG, "[%i] iov_len: %i, iov_base: %p\n", i, (int) iov[i].iov_len, iov[i].iov_base );
-    for( j=0; j<iov[i].iov_len; j++ ) {
-      unsigned char c = *((unsigned char*)iov[i].iov_base+j);
-      if( (j+1) % 8 == 0 || j+1 == iov[i].iov_len ) {
-        MIDILog( DEBUG, "0x%02x\n", c );
-      } else {
-        MIDILog( DEBUG, "0x%02x ", c );
-      }
-    }
+  MIDILogLocation( DEBUG, "Sending RTP message consisting of %i iovecs.\n", (int) *iovlen );
+#endif
+  _rtp_log_iov( *iovlen, iov );
+}
+
+/**
+ * @brief Interpret a received packet and look up or create its peer.
+ * @private @memberof RTPSession
+ * @param session The session.
+ * @param info    The packet info. Must provide at least two iovecs.
+ * @param size    The number of received bytes.
+ * @param buffer  The received bytes.
+ * @param namelen The size of the sender address.
+ * @param name    The sender address.
+ * @retval 0 on success.
+ * @retval 1 if the packet is malformed.
+ */
+static int _rtp_decode_packet( struct RTPSession * session, struct RTPPacketInfo * info,
+                               size_t size, void * buffer, socklen_t namelen, struct sockaddr * name ) {
+  size_t read = 0;
+
+  if( size < 12 ) return 1;
+  info->total_size = size;
+  if( _rtp_decode_header( info, size, buffer, &read ) ) return 1;
+  _advance_buffer( &size, &buffer, read );
+  if( info->extension ) {
+    _rtp_decode_extension( info, size, buffer, &read );
+    if( read > size ) return 1;
+    _advance_buffer( &size, &buffer, read );
+  }
+  if( info->padding > size ) return 1;
+  info->payload_size = size - info->padding;
+  if( info->extension ) {
+    info->iovlen = 2;
+    info->iov[1].iov_base = buffer;
+    info->iov[1].iov_len  = info->payload_size;
+  } else {
+    info->iovlen = 1;
+    info->iov[0].iov_base = buffer;
+    info->iov[0].iov_len  = info->payload_size;
+  }
+
+#ifndef NO_LOG
+  MIDILogLocation( DEBUG, "Received RTP message consisting of %i iovecs.\n", (int) info->iovlen );
+#endif
+  _rtp_log_iov( info->iovlen, info->iov );
+
+  info->peer = NULL;
+  RTPSessionFindPeerBySSRC( session, &(info->peer), info->ssrc );
+  if( info->peer == NULL ) {
+    info->peer = RTPPeerCreate( info->ssrc, namelen, name );
+    RTPSessionAddPeer( session, info->peer );
+    RTPPeerRelease( info->peer );
+  }
+  if( info->sequence_number == info->peer->in_seqnum + 1 ) {
+    info->peer->in_seqnum    = info->sequence_number;
+    info->peer->in_timestamp = info->timestamp;
+  }
+  return 0;
+}
+
+static void _rtp_init_msg( struct msghdr * msg, void * name, socklen_t namelen, size_t iovlen, struct iovec * iov ) {
+  msg->msg_name       = name;
+  msg->msg_namelen    = namelen;
+  msg->msg_iov        = iov;
+  msg->msg_iovlen     = iovlen;
+  msg->msg_control    = NULL;
+  msg->msg_controllen = 0;
+  msg->msg_flags      = 0;
+}
+
+#ifndef HAVE_MMSG
+static int sendmmsg( int socket, struct mmsghdr * msgvec, unsigned int vlen, int flags ) {
+  unsigned int i;
+  ssize_t bytes;
+  for( i=0; i<vlen; i++ ) {
+    bytes = sendmsg( socket, &(msgvec[i].msg_hdr), flags );
+    if( bytes < 0 ) return ( i > 0 ) ? i : -1;
+    msgvec[i].msg_len = bytes;
+  }
+  return vlen;
+}
+
+static int recvmmsg( int socket, struct mmsghdr * msgvec, unsigned int vlen, int flags, struct timespec * timeout ) {
+  unsigned int i;
+  ssize_t bytes;
+  for( i=0; i<vlen; i++ ) {
+    /* block for the first packet only */
+    bytes = recvmsg( socket, &(msgvec[i].msg_hdr), ( i > 0 ) ? MSG_DONTWAIT : 0 );
+    if( bytes < 0 ) return ( i > 0 ) ? i : -1;
+    msgvec[i].msg_len = bytes;
   }
+  return vlen;
+}
+
+#define MSG_WAITFORONE 0
 #endif
 
-  msg.msg_name       = &(info->peer->address.addr);
-  msg.msg_namelen    = info->peer->address.size;
-  msg.msg_iov        = &(iov[0]);
-  msg.msg_iovlen     = iovlen;
-  msg.msg_control    = NULL;
-  msg.msg_controllen = 0;
-  msg.msg_flags      = 0;
+/**
+ * @brief Send an RTP packet.
+ * @public @memberof RTPSession
+ * @param session The session.
+ * @param info The packet info.
+ * @retval 0 On success.
+ * @retval >0 If the message could not be sent.
+ */
+int RTPSessionSendPacket( struct RTPSession * session, struct RTPPacketInfo * info ) {
+  size_t iovlen = 0;
+  struct msghdr msg;
+  struct iovec  iov[RTP_IOV_LEN+3];
+  ssize_t bytes_sent;
+
+  if( info == NULL || info->peer == NULL ) return 1;
+  if( info->iovlen > RTP_IOV_LEN ) return 1;
+
+  _rtp_encode_packet( session, info, session->buflen, session->buffer, &iovlen, &(iov[0]) );
+  _rtp_init_msg( &msg, &(info->peer->address.addr), info->peer->address.size, iovlen, &(iov[0]) );
 
   bytes_sent = sendmsg( session->socket, &msg, 0 );
 
@@ -937,78 +1242,159 @@ int RTPSessionSendPacket( struct RTPSession * session, struct RTPPacketInfo * in
  * @retval >0 If the message could not be received.
  */
 int RTPSessionReceivePacket( struct RTPSession * session, struct RTPPacketInfo * info ) {
-  size_t size, read = 0;
-  void * buffer;
+  return RTPSessionReceivePacketBuffer( session, session->buflen, session->buffer, info );
+}
+
+/**
+ * @brief Receive an RTP packet into a caller supplied buffer.
+ * The datagram is received directly into @c buffer and the payload iovecs
+ * of the packet info point into it, so no bytes are copied.
+ * @public @memberof RTPSession
+ * @param session The session.
+ * @param size    The size of the buffer.
+ * @param buffer  The buffer to receive the datagram into.
+ * @param info    The packet info. Must provide at least two iovecs.
+ * @retval 0 On success.
+ * @retval >0 If the message could not be received.
+ */
+int RTPSessionReceivePacketBuffer( struct RTPSession * session, size_t size, void * buffer,
+                                   struct RTPPacketInfo * info ) {
   struct sockaddr_storage name;
   struct msghdr msg;
   struct iovec  iov;
   ssize_t bytes_received;
 
-  iov.iov_base = session->buffer;
-  iov.iov_len  = session->buflen;
-
-  msg.msg_name       = &name;
-  msg.msg_namelen    = sizeof(name);
-  msg.msg_iov        = &iov;
-  msg.msg_iovlen     = 1;
-  msg.msg_control    = NULL;
-  msg.msg_controllen = 0;
-  msg.msg_flags      = 0;
+  iov.iov_base = buffer;
+  iov.iov_len  = size;
+  _rtp_init_msg( &msg, &name, sizeof(name), 1, &iov );
 
   bytes_received = recvmsg( session->socket, &msg, 0 );
 
-  if( bytes_received == -1 ) return -1;
+  if( bytes_received == -1 ) return 1;
   if( msg.msg_flags != 0  )  return 1;
-  if( bytes_received < 12 )  return 1;
 
-  size   = bytes_received;
-  buffer = session->buffer;
-  info->total_size = bytes_received;
-  _rtp_decode_header( info, size, buffer, &read );
-  _advance_buffer( &size, &buffer, read );
-  if( info->extension ) {
-    _rtp_decode_extension( info, size, buffer, &read );
-    _advance_buffer( &size, &buffer, read );
-  }
-  info->payload_size = size - info->padding;
-  if( info->extension ) {
-    info->iovlen = 2;
-    info->iov[1].iov_base = buffer;
-    info->iov[1].iov_len  = info->payload_size;
-  } else {
-    info->iovlen = 1;
-    info->iov[0].iov_base = buffer;
-    info->iov[0].iov_len  = info->payload_size;
-  }
-  
-#ifndef NO_LOG
-  int i, j;
-  MIDILogLocation( DEBUG, "Received RTP message consisting of %i iovecs.\n", (int) info->iovlen );
-  for( i=0; i<info->iovlen; i++ ) {
-    MIDILog( DEBUG, "[%i] iov_len: %i, iov_base: %p\n", i, (int) info->iov[i].iov_len, info->iov[i].iov_base );
-    for( j=0; j<info->iov[i].iov_len; j++ ) {
-      unsigned char c = *((unsigned char*)info->iov[i].iov_base+j);
-      if( (j+1) % 8 == 0 || j+1 == info->iov[i].iov_len ) {
-        MIDILog( DEBUG, "0x%02x\n", c );
-      } else {
-        MIDILog( DEBUG, "0x%02x ", c );
+  return _rtp_decode_packet( session, info, bytes_received, buffer,
+                             msg.msg_namelen, msg.msg_name );
+}
+
+/**
+ * @brief Interpret a packet that was received by someone else.
+ * Used when the runloop receives the datagrams of the session's socket.
+ * The payload iovecs of the packet info point into @c buffer.
+ * @public @memberof RTPSession
+ * @param session The session.
+ * @param size    The number of received bytes.
+ * @param buffer  The received bytes.
+ * @param namelen The size of the sender address.
+ * @param name    The sender address.
+ * @param info    The packet info. Must provide at least two iovecs.
+ * @retval 0 On success.
+ * @retval >0 If the packet is malformed.
+ */
+int RTPSessionDecodePacket( struct RTPSession * session, size_t size, void * buffer,
+                            socklen_t namelen, struct sockaddr * name, struct RTPPacketInfo * info ) {
+  return _rtp_decode_packet( session, info, size, buffer, namelen, name );
+}
+
+/**
+ * @brief Send several RTP packets with as few system calls as possible.
+ * Every packet info must have a peer, the peers may differ. The packets
+ * are handed to the kernel in chunks of up to @c RTP_MAX_BATCH packets
+ * with a single @c sendmmsg call per chunk. Sending stops at the first
+ * packet that could not be sent.
+ * @public @memberof RTPSession
+ * @param session The session.
+ * @param count   The number of packets.
+ * @param infos   An array of @c count packet infos.
+ * @param sent    The number of packets that were sent. May be @c NULL.
+ * @retval 0 On success.
+ * @retval >0 If not all packets could be sent.
+ */
+int RTPSessionSendBatch( struct RTPSession * session, size_t count, struct RTPPacketInfo * infos, size_t * sent ) {
+  struct RTPPacketInfo * info;
+  size_t i, n, iovlen, done = 0;
+  int result;
+
+  if( session->batch_buffer == NULL ) return 1;
+  while( done < count ) {
+    n = count - done;
+    if( n > RTP_MAX_BATCH ) n = RTP_MAX_BATCH;
+    for( i=0; i<n; i++ ) {
+      info = &(infos[done+i]);
+      if( info->peer == NULL || info->iovlen > RTP_IOV_LEN ) {
+        n = i;
+        break;
       }
+      _rtp_encode_packet( session, info, RTP_BUF_LEN, (char *) session->batch_buffer + i * RTP_BUF_LEN,
+                          &iovlen, &(session->batch_iov[i][0]) );
+      _rtp_init_msg( &(session->batch_msg[i].msg_hdr), &(info->peer->address.addr), info->peer->address.size,
+                     iovlen, &(session->batch_iov[i][0]) );
+      /* several packets in one batch may go to the same peer */
+      info->peer->out_seqnum    = info->sequence_number;
+      info->peer->out_timestamp = info->timestamp;
+    }
+    result = ( n > 0 ) ? sendmmsg( session->socket, &(session->batch_msg[0]), n, 0 ) : 0;
+    if( result < 0 ) result = 0;
+    for( i=result; i>0; i-- ) {
+      if( session->batch_msg[i-1].msg_len != infos[done+i-1].total_size ) result = i-1;
     }
+    /* unsent packets did not use up their sequence numbers */
+    for( i=n; i>result; i-- ) {
+      info = &(infos[done+i-1]);
+      info->peer->out_seqnum = info->sequence_number - 1;
+    }
+    done += result;
+    if( result < n || n < RTP_MAX_BATCH ) break;
   }
-#endif
+  if( sent != NULL ) *sent = done;
+  return ( done == count ) ? 0 : 1;
+}
 
-  info->peer = NULL;
-  RTPSessionFindPeerBySSRC( session, &(info->peer), info->ssrc );
-  if( info->peer == NULL ) {
-    info->peer = RTPPeerCreate( info->ssrc, msg.msg_namelen, msg.msg_name );
-    RTPSessionAddPeer( session, info->peer );
-    RTPPeerRelease( info->peer );
+/**
+ * @brief Receive several RTP packets with as few system calls as possible.
+ * Block until at least one packet is available, then receive up to @c count
+ * packets that are already queued with a single @c recvmmsg call.
+ * Every packet is received into its own buffer owned by the session, the
+ * payload iovecs of the packet infos point into these buffers and stay
+ * valid until the next call to RTPSessionReceiveBatch. Malformed packets
+ * are dropped.
+ * @public @memberof RTPSession
+ * @param session  The session.
+ * @param count    The number of packet infos. Each info must provide at
+ *                 least two iovecs.
+ * @param infos    An array of @c count packet infos.
+ * @param received The number of packet infos that were filled.
+ * @retval 0 On success.
+ * @retval >0 If no packets could be received.
+ */
+int RTPSessionReceiveBatch( struct RTPSession * session, size_t count, struct RTPPacketInfo * infos, size_t * received ) {
+  size_t i, n = 0;
+  int result;
+  struct msghdr * msg;
+
+  if( received != NULL ) *received = 0;
+  if( session->batch_buffer == NULL ) return 1;
+  if( count > RTP_MAX_BATCH ) count = RTP_MAX_BATCH;
+  for( i=0; i<count; i++ ) {
+    session->batch_iov[i][0].iov_base = (char *) session->batch_buffer + i * RTP_BUF_LEN;
+    session->batch_iov[i][0].iov_len  = RTP_BUF_LEN;
+    _rtp_init_msg( &(session->batch_msg[i].msg_hdr), &(session->batch_name[i]), sizeof(struct sockaddr_storage),
+                   1, &(session->batch_iov[i][0]) );
   }
-  if( info->sequence_number == info->peer->in_seqnum + 1 ) {
-    info->peer->in_seqnum    = info->sequence_number;
-    info->peer->in_timestamp = info->timestamp;
+
+  result = recvmmsg( session->socket, &(session->batch_msg[0]), count, MSG_WAITFORONE, NULL );
+  if( result <= 0 ) return 1;
+
+  for( i=0; i<result; i++ ) {
+    msg = &(session->batch_msg[i].msg_hdr);
+    if( msg->msg_flags != 0 ) continue;
+    if( _rtp_decode_packet( session, &(infos[n]), session->batch_msg[i].msg_len, session->batch_iov[i][0].iov_base,
+                            msg->msg_namelen, msg->msg_name ) == 0 ) {
+      n++;
+    }
   }
-  return 0;
+  if( received != NULL ) *received = n;
+  return ( n > 0 ) ? 0 : 1;
 }
 
 /**
@@ -1037,7 +1423,7 @@ int RTPSessionSend( struct RTPSession * session, size_t size, void * payload,
   info->iov       = &iov;
   
   if( info->peer == NULL ) {
-    for( i=0; i<RTP_MAX_PEERS; i++ ) {
+    for( i=0; i<session->peers_length; i++ ) {
       if( session->peers[i] != NULL ) {
         info->peer = session->peers[i];
         result += RTPSessionSendPacket( session, info );
@@ -4,6 +4,8 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 
+#define RTP_MAX_BATCH 16
+
 struct RTPPeer;
 struct RTPSession;
 
@@ -54,7 +56,13 @@ int RTPSessionFindPeerByAddress( struct RTPSession * session, struct RTPPeer **
 
 int RTPSessionSendPacket( struct RTPSession * session, struct RTPPacketInfo * info );
 int RTPSessionReceivePacket( struct RTPSession * session, struct RTPPacketInfo * info );
+int RTPSessionReceivePacketBuffer( struct RTPSession * session, size_t size, void * buffer,
+                                   struct RTPPacketInfo * info );
+int RTPSessionDecodePacket( struct RTPSession * session, size_t size, void * buffer,
+                            socklen_t namelen, struct sockaddr * name, struct RTPPacketInfo * info );
 int RTPSessionSend( struct RTPSession * session, size_t size, void * payload, struct RTPPacketInfo * info );
 int RTPSessionReceive( struct RTPSession * session, size_t size, void * payload, struct RTPPacketInfo * info );
+int RTPSessionSendBatch( struct RTPSession * session, size_t count, struct RTPPacketInfo * infos, size_t * sent );
+int RTPSessionReceiveBatch( struct RTPSession * session, size_t count, struct RTPPacketInfo * infos, size_t * received );
 
 #endif
@@ -1,6 +1,10 @@
+#include <string.h>
 #include "rtpmidi.h"
 #include "rtp.h"
 #include "midi/util.h"
+#include "midi/scan.h"
+
+#define RTPMIDI_VIEW_POOL 32
 
 /**
  * @defgroup RTP-MIDI RTP-MIDI
@@ -19,63 +23,107 @@ struct RTPMIDIInfo {
 };
 
 /**
- * Structure for easily removing journal parts by sequence number.
- */
-struct RTPMIDIJournalChapterPart {
-  unsigned short checkpoint_pkt_seqnum; /**< The RTP sequence number encoded in this journal part */
-  unsigned short length;                /**< Number of bytes[] allocated */
-  unsigned char  bytes[1];              /**< Variable length array of chapter bytes */
-};
-
-/**
- * Hold information for the system history.
+ * Hold the recovery state of the system commands.
+ * Every field remembers the sequence number of the packet that last
+ * changed it, the journal only encodes fields that changed since its
+ * checkpoint.
  */
 struct RTPMIDISystemJournal {
-  unsigned short checkpoint_pkt_seqnum;         /**< The latest RTP sequence number encoded in the journal */
-  struct RTPMIDIJournalChapterPart * chapter_d; /**< Chapter D: Song Select (0xf3), Tune Request (0xf6), Reset (0xff),
-                                                                undefined System commands (0xf4, 0xf5, 0xf9, 0xfd) */
-  struct RTPMIDIJournalChapterPart * chapter_v; /**< Chapter V: Active Sense (0xfe) */
-  struct RTPMIDIJournalChapterPart * chapter_q; /**< Chapter Q: Sequencer State (0xf2, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc) */
-  struct RTPMIDIJournalChapterPart * chapter_f; /**< Chapter F: MTC Tape Position (0xf1, 0xf0, 0x7f, 0xcc 0x01 0x01) */
-  struct RTPMIDIJournalChapterPart * chapter_x; /**< Chapter X: System Exclusive (all other 0xf0) */
+  unsigned char  reset_count;      /**< Chapter D: Number of Resets (0xff), modulo 128 */
+  unsigned short reset_seqnum;
+  unsigned char  tune_count;       /**< Chapter D: Number of Tune Requests (0xf6), modulo 128 */
+  unsigned short tune_seqnum;
+  unsigned char  song;             /**< Chapter D: The last Song Select (0xf3) */
+  unsigned short song_seqnum;
+  unsigned char  sense_count;      /**< Chapter V: Number of Active Sense (0xfe) commands, modulo 128 */
+  unsigned short sense_seqnum;
+  unsigned char  running;          /**< Chapter Q: Set if the last of Start, Stop and Continue was not Stop */
+  unsigned long  clock;            /**< Chapter Q: Song position in MIDI clocks (0xf2, 0xf8, 0xfa) */
+  unsigned short sequencer_seqnum;
+  unsigned char  changed;          /**< Bits for the fields above that were ever set */
 };
 
 /**
- * Hold information for the channel history.
+ * Hold the recovery state of one MIDI channel.
+ * Notes and controllers that changed are also kept in a list, so that
+ * encoding the journal visits only the state that changed since the
+ * checkpoint instead of all 128 entries.
  */
 struct RTPMIDIChannelJournal {
-  unsigned short checkpoint_pkt_seqnum;         /**< The latest RTP sequence number encoded in the journal */
-  unsigned char  enhanced_chapter_c;            /**< Use enhanced chapter C coding */
-  unsigned char  channel;                       /**< The channel number */
-  struct RTPMIDIJournalChapterPart * chapter_p; /**< Chapter P: MIDI Program Change (0xc) */
-  struct RTPMIDIJournalChapterPart * chapter_c; /**< Chapter C: MIDI Control Change (0xb) */
-  struct RTPMIDIJournalChapterPart * chapter_m; /**< Chapter M: MIDI Parameter System (part of 0xb) */
-  struct RTPMIDIJournalChapterPart * chapter_w; /**< Chapter W: MIDI Pitch Wheel (0xe) */
-  struct RTPMIDIJournalChapterPart * chapter_n; /**< Chapter N: MIDI NoteOff (0x8), NoteOn (0x9) */
-  struct RTPMIDIJournalChapterPart * chapter_e; /**< Chapter E: MIDI Note Command Extras (0x8, 0x9) */
+  unsigned char  channel;             /**< The channel number */
+  unsigned char  program;             /**< Chapter P: MIDI Program Change (0xc) */
+  unsigned char  program_bank[2];     /**< Chapter P: Bank select MSB and LSB at the time of the program change */
+  unsigned char  program_has_bank;
+  unsigned char  has_program;
+  unsigned short program_seqnum;
+  unsigned char  wheel[2];            /**< Chapter W: MIDI Pitch Wheel (0xe) */
+  unsigned char  has_wheel;
+  unsigned short wheel_seqnum;
+  unsigned char  control_value[128];  /**< Chapter C: MIDI Control Change (0xb) */
+  unsigned char  control_seen[128];
+  unsigned short control_seqnum[128];
+  unsigned char  control_listed[128];
+  unsigned char  control_list[128];
+  unsigned char  control_count;
+  unsigned char  note_velocity[128];  /**< Chapter N: MIDI NoteOff (0x8), NoteOn (0x9) */
+  unsigned short note_seqnum[128];
+  unsigned char  note_off[128];       /**< Chapter N: Set if the note was ever released */
+  unsigned short note_off_seqnum[128];
+  unsigned char  note_listed[128];
+  unsigned char  note_list[128];
+  unsigned char  note_count;
 };
 
 /**
  * Hold information for the RTP-MIDI session history.
  */
 struct RTPMIDIJournal {
-/*unsigned char  single_pkt_loss;*/
-  unsigned char  enhanced_chapter_c;    /**< Use enhanced chapter C coding in at least one channel journal */
-  unsigned char  total_channels;        /**< The number of valid entries in the channel journals list */
-  unsigned short checkpoint_pkt_seqnum; /**< The latest RTP sequence number encoded in the journal */
+  unsigned char  active;                /**< Set if any state was stored in the journal */
+  unsigned short checkpoint_pkt_seqnum; /**< The first RTP sequence number covered by the journal */
   struct RTPMIDISystemJournal  * system_journal;
   struct RTPMIDIChannelJournal * channel_journals[16];
-
-  size_t size;
-  void * buffer;
 };
 
+/**
+ * Hold the per-peer journals.
+ * The receive journal holds the last journal that was decoded from a
+ * packet of the peer, the receive state is the stream state as it was
+ * seen by the receiver. Comparing both after a packet loss tells which
+ * commands must be synthesised to repair the stream.
+ */
 struct RTPMIDIPeerInfo {
   struct RTPMIDIJournal * receive_journal;
+  struct RTPMIDIJournal * receive_state;
   struct RTPMIDIJournal * send_journal;
+  unsigned short receive_seqnum;   /**< The sequence number of the last packet received */
+  unsigned char  receive_started;  /**< Set if any packet was received from the peer */
+  MIDITimestamp  receive_timestamp;
   void * info;
 };
 
+/**
+ * @brief Read-only view of a received RTP-MIDI packet.
+ * The datagram is received directly into the view. Views are reference
+ * counted and go back to the free list of their session when the last
+ * reference is released.
+ */
+struct RTPMIDIPacketView {
+/**
+ * @privatesection
+ * @cond INTERNALS
+ */
+  size_t refs;
+  struct RTPMIDISession    * session;
+  struct RTPMIDIPacketView * next;
+  struct RTPPacketInfo info;
+  struct iovec         iov[2];
+  struct RTPMIDIInfo   midi_info;
+  size_t commands;
+  size_t end;
+  unsigned char data[RTPMIDI_VIEW_SIZE];
+/** @endcond */
+};
+
 /**
  * @brief Send and receive MIDIMessage objects via an @c RTPSession.
  * This class describes a payload format to code MIDI messages as
@@ -95,9 +143,17 @@ struct RTPMIDISession {
 
   size_t size;
   void * buffer;
+
+  size_t free_count;
+  struct RTPMIDIPacketView * free_views;
+
+  unsigned char header_buffer[RTP_MAX_BATCH][2];
+  unsigned char journal_buffer[RTP_MAX_BATCH][RTPMIDI_JOURNAL_SIZE];
 /** @endcond */
 };
 
+static void _rtpmidi_peer_info_destroy( struct RTPPeer * peer );
+
 /** @} */
 
 /* MARK: Creation and destruction *//**
@@ -126,23 +182,38 @@ struct RTPMIDISession * RTPMIDISessionCreate( struct RTPSession * rtp_session )
   session->midi_info.zero    = 0;
   session->midi_info.phantom = 0;
   session->midi_info.len     = 0;
+  session->rtp_info.peer     = NULL;
 
-  session->size   = 512;
+  session->size   = RTPMIDI_COMMAND_SIZE;
   session->buffer = malloc( session->size );
   if( session->buffer == NULL ) {
     session->size = 0;
   }
+  session->free_count = 0;
+  session->free_views = NULL;
   return session;
 }
 
 /**
  * @brief Destroy an RTPMIDISession instance.
- * Free all resources occupied by the session and release the
- * RTP session.
+ * Free all resources occupied by the session, including the journals of
+ * the peers, and release the RTP session.
  * @public @memberof RTPMIDISession
  * @param session The session.
  */
 void RTPMIDISessionDestroy( struct RTPMIDISession * session ) {
+  struct RTPMIDIPacketView * view;
+  struct RTPPeer * peer = NULL;
+  /* the rtp session may outlive this session, drop the journals now */
+  RTPSessionNextPeer( session->rtp_session, &peer );
+  while( peer != NULL ) {
+    _rtpmidi_peer_info_destroy( peer );
+    RTPSessionNextPeer( session->rtp_session, &peer );
+  }
+  while( ( view = session->free_views ) != NULL ) {
+    session->free_views = view->next;
+    free( view );
+  }
   RTPSessionRelease( session->rtp_session );
   if( session->size > 0 && session->buffer != NULL ) {
     free( session->buffer );
@@ -179,9 +250,356 @@ void RTPMIDISessionRelease( struct RTPMIDISession * session ) {
  * @name RTP-MIDI journal coding
  * Functions for encoding the various journals and their chapters to a
  * continuous stream of bytes.
+ * The sender keeps the current state of every channel and of the system
+ * commands together with the sequence number of the packet that changed
+ * it last. The recovery journal of a packet (RFC 6295) codes all state
+ * that changed since the checkpoint packet. Storing the messages of a
+ * packet only updates the touched entries and encoding only visits the
+ * entries that changed since the checkpoint, so neither depends on the
+ * length of the history.
+ * All S-bits are sent as zero, which is always valid and makes receivers
+ * examine the whole journal.
  * @{
  */
 
+#define RTPMIDI_SYSTEM_RESET     0x01
+#define RTPMIDI_SYSTEM_TUNE      0x02
+#define RTPMIDI_SYSTEM_SONG      0x04
+#define RTPMIDI_SYSTEM_SENSE     0x08
+#define RTPMIDI_SYSTEM_SEQUENCER 0x10
+
+/**
+ * @brief Check if a sequence number is not older than the checkpoint.
+ * Compare using serial number arithmetic so that wrap arounds of the
+ * 16 bit sequence numbers are handled.
+ */
+static int _rtpmidi_seqnum_since( unsigned short seqnum, unsigned short checkpoint ) {
+  return (short) ( seqnum - checkpoint ) >= 0;
+}
+
+static struct RTPMIDIJournal * _rtpmidi_journal_create( void ) {
+  struct RTPMIDIJournal * journal = malloc( sizeof( struct RTPMIDIJournal ) );
+  int i;
+  if( journal == NULL ) return NULL;
+  journal->active = 0;
+  journal->checkpoint_pkt_seqnum = 0;
+  journal->system_journal = NULL;
+  for( i=0; i<16; i++ ) {
+    journal->channel_journals[i] = NULL;
+  }
+  return journal;
+}
+
+static void _rtpmidi_journal_destroy( struct RTPMIDIJournal * journal ) {
+  int i;
+  if( journal == NULL ) return;
+  for( i=0; i<16; i++ ) {
+    free( journal->channel_journals[i] );
+  }
+  free( journal->system_journal );
+  free( journal );
+}
+
+static struct RTPMIDIChannelJournal * _rtpmidi_journal_channel( struct RTPMIDIJournal * journal, int channel ) {
+  struct RTPMIDIChannelJournal * cj = journal->channel_journals[channel];
+  if( cj == NULL ) {
+    cj = calloc( 1, sizeof( struct RTPMIDIChannelJournal ) );
+    if( cj == NULL ) return NULL;
+    cj->channel = channel;
+    journal->channel_journals[channel] = cj;
+  }
+  return cj;
+}
+
+static struct RTPMIDISystemJournal * _rtpmidi_journal_system( struct RTPMIDIJournal * journal ) {
+  if( journal->system_journal == NULL ) {
+    journal->system_journal = calloc( 1, sizeof( struct RTPMIDISystemJournal ) );
+  }
+  return journal->system_journal;
+}
+
+static void _rtpmidi_list_touch( unsigned char * list, unsigned char * count, unsigned char * listed, int number ) {
+  if( ! listed[number] ) {
+    listed[number] = 1;
+    list[(*count)++] = number;
+  }
+}
+
+/**
+ * @brief Update the journal state with a single MIDI command.
+ * @memberof RTPMIDIJournal
+ * @param journal The journal.
+ * @param seqnum  The sequence number of the packet that contains the command.
+ * @param size    The number of bytes of the command.
+ * @param bytes   The command, starting with a status byte.
+ */
+static void _rtpmidi_journal_store( struct RTPMIDIJournal * journal, unsigned short seqnum,
+                                    size_t size, unsigned char * bytes ) {
+  struct RTPMIDIChannelJournal * cj;
+  struct RTPMIDISystemJournal  * sj;
+  unsigned char status = bytes[0];
+  unsigned char data1  = ( size > 1 ) ? bytes[1] & 0x7f : 0;
+  unsigned char data2  = ( size > 2 ) ? bytes[2] & 0x7f : 0;
+
+  if( status < 0xf0 ) {
+    cj = _rtpmidi_journal_channel( journal, status & 0x0f );
+    if( cj == NULL ) return;
+    switch( status & 0xf0 ) {
+      case 0x90:
+        if( data2 > 0 ) {
+          cj->note_velocity[data1] = data2;
+          cj->note_seqnum[data1]   = seqnum;
+          _rtpmidi_list_touch( cj->note_list, &(cj->note_count), cj->note_listed, data1 );
+          break;
+        }
+        /* fall through - note on with zero velocity is a note off */
+      case 0x80:
+        cj->note_velocity[data1]   = 0;
+        cj->note_seqnum[data1]     = seqnum;
+        cj->note_off[data1]        = 1;
+        cj->note_off_seqnum[data1] = seqnum;
+        _rtpmidi_list_touch( cj->note_list, &(cj->note_count), cj->note_listed, data1 );
+        break;
+      case 0xb0:
+        cj->control_value[data1]  = data2;
+        cj->control_seen[data1]   = 1;
+        cj->control_seqnum[data1] = seqnum;
+        _rtpmidi_list_touch( cj->control_list, &(cj->control_count), cj->control_listed, data1 );
+        break;
+      case 0xc0:
+        cj->program          = data1;
+        cj->program_bank[0]  = cj->control_value[0];
+        cj->program_bank[1]  = cj->control_value[32];
+        cj->program_has_bank = cj->control_seen[0] && cj->control_seen[32];
+        cj->has_program      = 1;
+        cj->program_seqnum   = seqnum;
+        break;
+      case 0xe0:
+        cj->wheel[0]     = data1;
+        cj->wheel[1]     = data2;
+        cj->has_wheel    = 1;
+        cj->wheel_seqnum = seqnum;
+        break;
+      default:
+        /* poly and channel aftertouch (chapters A and T) are not journalled */
+        return;
+    }
+  } else {
+    sj = _rtpmidi_journal_system( journal );
+    if( sj == NULL ) return;
+    switch( status ) {
+      case MIDI_STATUS_RESET:
+        sj->reset_count   = ( sj->reset_count + 1 ) & 0x7f;
+        sj->reset_seqnum  = seqnum;
+        sj->changed      |= RTPMIDI_SYSTEM_RESET;
+        break;
+      case MIDI_STATUS_TUNE_REQUEST:
+        sj->tune_count    = ( sj->tune_count + 1 ) & 0x7f;
+        sj->tune_seqnum   = seqnum;
+        sj->changed      |= RTPMIDI_SYSTEM_TUNE;
+        break;
+      case MIDI_STATUS_SONG_SELECT:
+        sj->song          = data1;
+        sj->song_seqnum   = seqnum;
+        sj->changed      |= RTPMIDI_SYSTEM_SONG;
+        break;
+      case MIDI_STATUS_ACTIVE_SENSING:
+        sj->sense_count   = ( sj->sense_count + 1 ) & 0x7f;
+        sj->sense_seqnum  = seqnum;
+        sj->changed      |= RTPMIDI_SYSTEM_SENSE;
+        break;
+      case MIDI_STATUS_START:
+        sj->clock   = 0;
+        sj->running = 1;
+        break;
+      case MIDI_STATUS_CONTINUE:
+        sj->running = 1;
+        break;
+      case MIDI_STATUS_STOP:
+        sj->running = 0;
+        break;
+      case MIDI_STATUS_TIMING_CLOCK:
+        if( ! sj->running ) return;
+        sj->clock = ( sj->clock + 1 ) & 0x7ffff;
+        break;
+      case MIDI_STATUS_SONG_POSITION_POINTER:
+        sj->clock = ( ( ( data2 << 7 ) | data1 ) * 6 ) & 0x7ffff;
+        break;
+      default:
+        /* sysex and time code (chapters X and F) are not journalled */
+        return;
+    }
+    if( ( status >= MIDI_STATUS_TIMING_CLOCK && status <= MIDI_STATUS_STOP ) ||
+        status == MIDI_STATUS_SONG_POSITION_POINTER ) {
+      sj->sequencer_seqnum = seqnum;
+      sj->changed         |= RTPMIDI_SYSTEM_SEQUENCER;
+    }
+  }
+  if( ! journal->active ) {
+    journal->active = 1;
+    journal->checkpoint_pkt_seqnum = seqnum;
+  }
+}
+
+/**
+ * @brief Remove list entries that are older than the checkpoint.
+ * @return the number of entries left.
+ */
+static int _rtpmidi_list_prune( unsigned char * list, unsigned char * count, unsigned char * listed,
+                                unsigned short * seqnums, unsigned short checkpoint ) {
+  int i, j;
+  for( i=0, j=0; i<*count; i++ ) {
+    if( _rtpmidi_seqnum_since( seqnums[list[i]], checkpoint ) ) {
+      list[j++] = list[i];
+    } else {
+      listed[list[i]] = 0;
+    }
+  }
+  *count = j;
+  return j;
+}
+
+/**
+ * @brief Encode the journal of one channel.
+ * @memberof RTPMIDIJournal
+ * @param cj         The channel journal.
+ * @param checkpoint The checkpoint sequence number.
+ * @param size       The number of available bytes in the buffer.
+ * @param buffer     The buffer to write the channel journal to.
+ * @param written    The number of bytes written, zero if nothing changed.
+ * @retval 0 on success.
+ * @retval 1 if the buffer is too small.
+ */
+static int _rtpmidi_journal_encode_channel( struct RTPMIDIChannelJournal * cj, unsigned short checkpoint,
+                                            size_t size, unsigned char * buffer, size_t * written ) {
+  unsigned char toc = 0, offbits[16];
+  size_t p = 3;
+  int i, n, note, logs, low = 16, high = -1;
+
+  *written = 0;
+  /* chapter P */
+  if( cj->has_program && _rtpmidi_seqnum_since( cj->program_seqnum, checkpoint ) ) {
+    if( p + 3 > size ) return 1;
+    buffer[p++] = cj->program;
+    buffer[p++] = ( cj->program_has_bank ? 0x80 : 0 ) | cj->program_bank[0];
+    buffer[p++] = cj->program_bank[1];
+    toc |= 0x80;
+  }
+  /* chapter C */
+  n = _rtpmidi_list_prune( cj->control_list, &(cj->control_count), cj->control_listed,
+                           cj->control_seqnum, checkpoint );
+  if( n > 0 ) {
+    if( p + 1 + n * 2 > size ) return 1;
+    buffer[p++] = n - 1;
+    for( i=0; i<n; i++ ) {
+      buffer[p++] = cj->control_list[i];
+      buffer[p++] = cj->control_value[cj->control_list[i]];
+    }
+    toc |= 0x40;
+  }
+  /* chapter W */
+  if( cj->has_wheel && _rtpmidi_seqnum_since( cj->wheel_seqnum, checkpoint ) ) {
+    if( p + 2 > size ) return 1;
+    buffer[p++] = cj->wheel[0];
+    buffer[p++] = cj->wheel[1];
+    toc |= 0x10;
+  }
+  /* chapter N, note logs for sounding notes and offbits for released notes */
+  n = _rtpmidi_list_prune( cj->note_list, &(cj->note_count), cj->note_listed,
+                           cj->note_seqnum, checkpoint );
+  if( n > 0 ) {
+    memset( offbits, 0, sizeof(offbits) );
+    if( p + 2 + n * 2 + 16 > size ) return 1;
+    logs = 0;
+    for( i=0; i<n; i++ ) {
+      note = cj->note_list[i];
+      if( cj->note_velocity[note] ) {
+        /* LEN=127 has a special meaning, so at most 127 note logs fit */
+        if( logs == 127 ) continue;
+        buffer[p + 2 + logs * 2]     = note;
+        buffer[p + 2 + logs * 2 + 1] = 0x80 | cj->note_velocity[note];
+        logs++;
+        /* a note log with the offbit set means the note was released and struck again */
+        if( ! cj->note_off[note] || ! _rtpmidi_seqnum_since( cj->note_off_seqnum[note], checkpoint ) ) continue;
+      }
+      offbits[note >> 3] |= 0x80 >> ( note & 7 );
+      if( ( note >> 3 ) < low )  low  = note >> 3;
+      if( ( note >> 3 ) > high ) high = note >> 3;
+    }
+    if( high < 0 ) {
+      /* no offbits, LOW > HIGH */
+      low  = 1;
+      high = 0;
+    }
+    buffer[p]   = logs;
+    buffer[p+1] = ( low << 4 ) | high;
+    p += 2 + logs * 2;
+    for( i=low; i<=high; i++ ) {
+      buffer[p++] = offbits[i];
+    }
+    toc |= 0x08;
+  }
+  if( toc == 0 ) return 0;
+
+  buffer[0] = ( cj->channel << 3 ) | ( ( p >> 8 ) & 0x03 );
+  buffer[1] = p & 0xff;
+  buffer[2] = toc;
+  *written = p;
+  return 0;
+}
+
+/**
+ * @brief Encode the system journal.
+ * @memberof RTPMIDIJournal
+ * @param sj         The system journal.
+ * @param checkpoint The checkpoint sequence number.
+ * @param size       The number of available bytes in the buffer.
+ * @param buffer     The buffer to write the system journal to.
+ * @param written    The number of bytes written, zero if nothing changed.
+ * @retval 0 on success.
+ * @retval 1 if the buffer is too small.
+ */
+static int _rtpmidi_journal_encode_system( struct RTPMIDISystemJournal * sj, unsigned short checkpoint,
+                                           size_t size, unsigned char * buffer, size_t * written ) {
+  unsigned char toc = 0, d = 0;
+  size_t p = 2;
+
+  *written = 0;
+  if( size < 10 ) return 1;
+#define SYSTEM_CHANGED( bit, seqnum ) \
+  ( ( sj->changed & (bit) ) && _rtpmidi_seqnum_since( sj->seqnum, checkpoint ) )
+  /* chapter D */
+  if( SYSTEM_CHANGED( RTPMIDI_SYSTEM_RESET, reset_seqnum ) ) d |= 0x40;
+  if( SYSTEM_CHANGED( RTPMIDI_SYSTEM_TUNE, tune_seqnum ) )   d |= 0x20;
+  if( SYSTEM_CHANGED( RTPMIDI_SYSTEM_SONG, song_seqnum ) )   d |= 0x10;
+  if( d ) {
+    buffer[p++] = d;
+    if( d & 0x40 ) buffer[p++] = sj->reset_count;
+    if( d & 0x20 ) buffer[p++] = sj->tune_count;
+    if( d & 0x10 ) buffer[p++] = sj->song;
+    toc |= 0x40;
+  }
+  /* chapter V */
+  if( SYSTEM_CHANGED( RTPMIDI_SYSTEM_SENSE, sense_seqnum ) ) {
+    buffer[p++] = sj->sense_count;
+    toc |= 0x20;
+  }
+  /* chapter Q with the clock field */
+  if( SYSTEM_CHANGED( RTPMIDI_SYSTEM_SEQUENCER, sequencer_seqnum ) ) {
+    buffer[p++] = ( sj->running ? 0x40 : 0 ) | 0x10 | ( ( sj->clock >> 16 ) & 0x07 );
+    buffer[p++] = ( sj->clock >> 8 ) & 0xff;
+    buffer[p++] =   sj->clock        & 0xff;
+    toc |= 0x10;
+  }
+#undef SYSTEM_CHANGED
+  if( toc == 0 ) return 0;
+
+  buffer[0] = toc | ( ( p >> 8 ) & 0x03 );
+  buffer[1] = p & 0xff;
+  *written = p;
+  return 0;
+}
+
 /**
  * @brief Encode the RTP-MIDI history to a stream.
  * @memberof RTPMIDIJournal
@@ -189,29 +607,233 @@ void RTPMIDISessionRelease( struct RTPMIDISession * session ) {
  * @param journal The journal.
  * @param size    The number of available bytes in the buffer.
  * @param buffer  The buffer to write the journal to.
- * @param written The number of bytes written to the stream.
+ * @param written The number of bytes written to the stream, zero if
+ *                the journal is empty and should be left out.
+ * @retval 0 on success.
+ * @retval 1 if the journal did not fit into the buffer.
  */
 static int _rtpmidi_journal_encode( struct RTPMIDISession * session, struct RTPMIDIJournal * journal,
                                     size_t size, void * buffer, size_t * written ) {
+  unsigned char * bytes = buffer;
+  unsigned short checkpoint;
+  size_t p = 3, w;
+  int i, channels = 0;
+
   *written = 0;
+  if( journal == NULL || ! journal->active ) return 0;
+  if( size < 3 ) return 1;
+  checkpoint = journal->checkpoint_pkt_seqnum;
+
+  bytes[0] = 0;
+  if( journal->system_journal != NULL ) {
+    if( _rtpmidi_journal_encode_system( journal->system_journal, checkpoint, size - p, bytes + p, &w ) ) return 1;
+    if( w > 0 ) bytes[0] |= 0x40;
+    p += w;
+  }
+  for( i=0; i<16; i++ ) {
+    if( journal->channel_journals[i] == NULL ) continue;
+    if( _rtpmidi_journal_encode_channel( journal->channel_journals[i], checkpoint, size - p, bytes + p, &w ) ) return 1;
+    if( w > 0 ) channels++;
+    p += w;
+  }
+  if( channels > 0 ) {
+    bytes[0] |= 0x20 | ( channels - 1 );
+  }
+  if( bytes[0] == 0 ) return 0;
+
+  bytes[1] = ( checkpoint >> 8 ) & 0xff;
+  bytes[2] =   checkpoint        & 0xff;
+  *written = p;
+  return 0;
+}
+
+/**
+ * @brief Forget the contents of a decoded journal.
+ * Only the list entries are visited, so this does not depend on the
+ * number of notes and controllers the journal can hold.
+ * @memberof RTPMIDIJournal
+ * @param journal The journal.
+ */
+static void _rtpmidi_journal_clear( struct RTPMIDIJournal * journal ) {
+  struct RTPMIDIChannelJournal * cj;
+  int i, j;
+  journal->active = 0;
+  if( journal->system_journal != NULL ) {
+    journal->system_journal->changed = 0;
+  }
+  for( i=0; i<16; i++ ) {
+    cj = journal->channel_journals[i];
+    if( cj == NULL ) continue;
+    for( j=0; j<cj->control_count; j++ ) {
+      cj->control_listed[cj->control_list[j]] = 0;
+      cj->control_seen[cj->control_list[j]]   = 0;
+    }
+    for( j=0; j<cj->note_count; j++ ) {
+      cj->note_listed[cj->note_list[j]] = 0;
+      cj->note_off[cj->note_list[j]]    = 0;
+    }
+    cj->control_count = 0;
+    cj->note_count    = 0;
+    cj->has_program   = 0;
+    cj->has_wheel     = 0;
+  }
+}
+
+/**
+ * @brief Decode the journal of one channel.
+ * Chapters P, C, W and N are decoded, chapter M is skipped and the
+ * chapters E, T and A that follow chapter N are ignored.
+ * @memberof RTPMIDIJournal
+ * @param journal The journal to decode the channel journal into.
+ * @param size    The number of available bytes in the buffer.
+ * @param buffer  The buffer to read the channel journal from.
+ * @param read    The length of the channel journal.
+ * @retval 0 on success.
+ * @retval 1 if the channel journal is malformed.
+ */
+static int _rtpmidi_journal_decode_channel( struct RTPMIDIJournal * journal, size_t size,
+                                            unsigned char * buffer, size_t * read ) {
+  struct RTPMIDIChannelJournal * cj;
+  unsigned char toc;
+  size_t p = 3, len;
+  int i, n, low, high, note;
+
+  if( size < 3 ) return 1;
+  len = ( ( buffer[0] & 0x03 ) << 8 ) | buffer[1];
+  if( len < 3 || len > size ) return 1;
+  toc = buffer[2];
+  cj  = _rtpmidi_journal_channel( journal, ( buffer[0] >> 3 ) & 0x0f );
+  if( cj == NULL ) return 1;
+  *read = len;
+
+  /* chapter P */
+  if( toc & 0x80 ) {
+    if( p + 3 > len ) return 1;
+    cj->program          = buffer[p] & 0x7f;
+    cj->program_has_bank = ( buffer[p+1] & 0x80 ) ? 1 : 0;
+    cj->program_bank[0]  = buffer[p+1] & 0x7f;
+    cj->program_bank[1]  = buffer[p+2] & 0x7f;
+    cj->has_program      = 1;
+    p += 3;
+  }
+  /* chapter C, controllers logged with the alternative format are skipped */
+  if( toc & 0x40 ) {
+    if( p + 1 > len ) return 1;
+    n = ( buffer[p++] & 0x7f ) + 1;
+    if( p + n * 2 > len ) return 1;
+    for( i=0; i<n; i++, p+=2 ) {
+      if( buffer[p+1] & 0x80 ) continue;
+      cj->control_value[buffer[p] & 0x7f] = buffer[p+1];
+      cj->control_seen[buffer[p] & 0x7f]  = 1;
+      _rtpmidi_list_touch( cj->control_list, &(cj->control_count), cj->control_listed, buffer[p] & 0x7f );
+    }
+  }
+  /* chapter M */
+  if( toc & 0x20 ) {
+    if( p + 2 > len ) return 1;
+    n = ( ( buffer[p] & 0x03 ) << 8 ) | buffer[p+1];
+    if( n < 2 ) return 1;
+    p += n;
+  }
+  /* chapter W */
+  if( toc & 0x10 ) {
+    if( p + 2 > len ) return 1;
+    cj->wheel[0]  = buffer[p]   & 0x7f;
+    cj->wheel[1]  = buffer[p+1] & 0x7f;
+    cj->has_wheel = 1;
+    p += 2;
+  }
+  /* chapter N */
+  if( toc & 0x08 ) {
+    if( p + 2 > len ) return 1;
+    n    = buffer[p] & 0x7f;
+    low  = buffer[p+1] >> 4;
+    high = buffer[p+1] & 0x0f;
+    /* LEN=127 with LOW=15 and HIGH=0 codes 128 note logs */
+    if( n == 127 && low == 15 && high == 0 ) n = 128;
+    p += 2;
+    if( p + n * 2 > len ) return 1;
+    for( i=0; i<n; i++, p+=2 ) {
+      note = buffer[p] & 0x7f;
+      cj->note_velocity[note] = buffer[p+1] & 0x7f;
+      _rtpmidi_list_touch( cj->note_list, &(cj->note_count), cj->note_listed, note );
+    }
+    for( i=low; i<=high; i++, p++ ) {
+      if( p >= len ) return 1;
+      for( n=0; n<8; n++ ) {
+        if( ( buffer[p] & ( 0x80 >> n ) ) == 0 ) continue;
+        note = i * 8 + n;
+        cj->note_off[note] = 1;
+        if( cj->note_listed[note] ) continue;
+        cj->note_velocity[note] = 0;
+        _rtpmidi_list_touch( cj->note_list, &(cj->note_count), cj->note_listed, note );
+      }
+    }
+  }
   return 0;
 }
 
 /**
  * @brief Decode the RTP-MIDI history from a stream.
+ * The previous contents of the journal are replaced. The system journal
+ * is skipped, only the channel journals are decoded.
  * @memberof RTPMIDIJournal
  * @param session The session.
  * @param journal The journal.
  * @param size    The number of available bytes in the buffer.
  * @param buffer  The buffer to read the journal from.
  * @param read    The number of bytes read from the stream.
+ * @retval 0 on success.
+ * @retval 1 if the journal is malformed.
  */
 static int _rtpmidi_journal_decode( struct RTPMIDISession * session, struct RTPMIDIJournal * journal,
                                     size_t size, void * buffer, size_t * read ) {
+  unsigned char * bytes = buffer;
+  size_t p = 3, len;
+  int i, channels;
+
   *read = 0;
+  _rtpmidi_journal_clear( journal );
+  if( size < 3 ) return 1;
+  journal->checkpoint_pkt_seqnum = ( bytes[1] << 8 ) | bytes[2];
+
+  if( bytes[0] & 0x40 ) {
+    if( p + 2 > size ) return 1;
+    len = ( ( bytes[p] & 0x03 ) << 8 ) | bytes[p+1];
+    if( len < 2 || p + len > size ) return 1;
+    p += len;
+  }
+  if( bytes[0] & 0x20 ) {
+    channels = ( bytes[0] & 0x0f ) + 1;
+    for( i=0; i<channels; i++ ) {
+      if( _rtpmidi_journal_decode_channel( journal, size - p, bytes + p, &len ) ) return 1;
+      p += len;
+    }
+  }
+  journal->active = 1;
+  *read = p;
   return 0;
 }
 
+/**
+ * @brief Store a single message in the journal.
+ * @memberof RTPMIDIJournal
+ * @param journal The journal.
+ * @param seqnum  The sequence number of the packet that contains the message.
+ * @param message The message to store.
+ */
+static void _rtpmidi_journal_store_message( struct RTPMIDIJournal * journal, unsigned short seqnum,
+                                            struct MIDIMessage * message ) {
+  unsigned char bytes[4];
+  size_t size;
+  MIDIStatus status;
+
+  MIDIMessageGetStatus( message, &status );
+  if( status == MIDI_STATUS_SYSTEM_EXCLUSIVE ) return;
+  if( MIDIMessageEncode( message, sizeof(bytes), &bytes[0], &size ) ) return;
+  _rtpmidi_journal_store( journal, seqnum, size, &bytes[0] );
+}
+
 /**
  * @brief Store a list of messages in the journal.
  * @memberof RTPMIDIJournal
@@ -221,20 +843,104 @@ static int _rtpmidi_journal_decode( struct RTPMIDISession * session, struct RTPM
  */
 static int _rtpmidi_journal_encode_messages( struct RTPMIDIJournal * journal, unsigned short checkpoint,
                                              struct MIDIMessageList * messages ) {
-  struct MIDIMessage * message;
+  if( journal == NULL ) return 1;
+  for( ; messages != NULL && messages->message != NULL; messages = messages->next ) {
+    _rtpmidi_journal_store_message( journal, checkpoint, messages->message );
+  }
+  return 0;
+}
+
+/**
+ * @brief Append a recovered command to a message list.
+ * The command is also stored in the receive state.
+ * @retval 0 on success.
+ * @retval 1 if the list is full or the message could not be created.
+ */
+static int _rtpmidi_recover_command( struct RTPMIDIJournal * state, unsigned short seqnum, MIDITimestamp timestamp,
+                                     struct MIDIMessageList ** messages, size_t size, unsigned char * bytes ) {
+  struct MIDIMessageList * list = *messages;
+  size_t read;
+
+  if( list == NULL ) return 1;
+  if( list->message == NULL ) {
+    list->message = MIDIMessageCreate( 0 );
+    if( list->message == NULL ) return 1;
+  }
+  if( MIDIMessageDecode( list->message, size, bytes, &read ) ) return 1;
+  MIDIMessageSetTimestamp( list->message, timestamp );
+  _rtpmidi_journal_store( state, seqnum, size, bytes );
+  *messages = list->next;
   return 0;
 }
 
 /**
  * @brief Restore a list of messages from the journal.
+ * Compare a journal that was received from the sender with the state of
+ * the receiver and synthesise the commands that bring the receiver back
+ * in line: lost program changes, controller changes and pitch wheel
+ * changes are repeated, sounding notes that were missed are started and
+ * notes that were released while packets were lost are stopped.
+ * Every synthesised command is stored in the receive state.
  * @memberof RTPMIDIJournal
- * @param journal    The journal.
- * @param checkpoint The sequence number of the packet that contains the messages.
- * @param messages   The list to store the recovered messages in.
+ * @param journal   The journal received from the sender.
+ * @param state     The receive state.
+ * @param seqnum    The sequence number of the packet that contained the journal.
+ * @param timestamp The timestamp for the recovered messages.
+ * @param messages  The list to store the recovered messages in. Advanced
+ *                  to the first list entry after the recovered messages.
+ * @retval 0 on success.
+ * @retval 1 if the list was too short to hold all recovered messages.
  */
-static int _rtpmidi_journal_decode_messages( struct RTPMIDIJournal * journal, unsigned short checkpoint,
-                                             struct MIDIMessageList * messages ) {
-  struct MIDIMessage * message;
+static int _rtpmidi_journal_decode_messages( struct RTPMIDIJournal * journal, struct RTPMIDIJournal * state,
+                                             unsigned short seqnum, MIDITimestamp timestamp,
+                                             struct MIDIMessageList ** messages ) {
+  struct RTPMIDIChannelJournal * cj, * sc;
+  unsigned char bytes[3];
+  int c, i, number;
+
+#define RECOVER( n ) \
+  if( _rtpmidi_recover_command( state, seqnum, timestamp, messages, n, &bytes[0] ) ) return 1
+  if( journal == NULL || ! journal->active ) return 0;
+  for( c=0; c<16; c++ ) {
+    cj = journal->channel_journals[c];
+    if( cj == NULL ) continue;
+    sc = _rtpmidi_journal_channel( state, c );
+    if( sc == NULL ) return 1;
+    if( cj->has_program &&
+        ( ! sc->has_program || sc->program != cj->program ||
+          ( cj->program_has_bank && ( sc->control_value[0]  != cj->program_bank[0] ||
+                                      sc->control_value[32] != cj->program_bank[1] ) ) ) ) {
+      if( cj->program_has_bank ) {
+        bytes[0] = 0xb0 | c; bytes[1] = 0;  bytes[2] = cj->program_bank[0]; RECOVER( 3 );
+        bytes[0] = 0xb0 | c; bytes[1] = 32; bytes[2] = cj->program_bank[1]; RECOVER( 3 );
+      }
+      bytes[0] = 0xc0 | c; bytes[1] = cj->program; RECOVER( 2 );
+    }
+    for( i=0; i<cj->control_count; i++ ) {
+      number = cj->control_list[i];
+      if( sc->control_seen[number] && sc->control_value[number] == cj->control_value[number] ) continue;
+      bytes[0] = 0xb0 | c; bytes[1] = number; bytes[2] = cj->control_value[number]; RECOVER( 3 );
+    }
+    if( cj->has_wheel &&
+        ( ! sc->has_wheel || sc->wheel[0] != cj->wheel[0] || sc->wheel[1] != cj->wheel[1] ) ) {
+      bytes[0] = 0xe0 | c; bytes[1] = cj->wheel[0]; bytes[2] = cj->wheel[1]; RECOVER( 3 );
+    }
+    for( i=0; i<cj->note_count; i++ ) {
+      number = cj->note_list[i];
+      if( cj->note_velocity[number] ) {
+        /* the note was struck again, unless the receiver has already seen it */
+        if( sc->note_velocity[number] && cj->note_off[number] &&
+            sc->note_velocity[number] != cj->note_velocity[number] ) {
+          bytes[0] = 0x80 | c; bytes[1] = number; bytes[2] = 0x40; RECOVER( 3 );
+        }
+        if( sc->note_velocity[number] ) continue;
+        bytes[0] = 0x90 | c; bytes[1] = number; bytes[2] = cj->note_velocity[number]; RECOVER( 3 );
+      } else if( ! cj->note_velocity[number] && sc->note_velocity[number] ) {
+        bytes[0] = 0x80 | c; bytes[1] = number; bytes[2] = 0x40; RECOVER( 3 );
+      }
+    }
+  }
+#undef RECOVER
   return 0;
 }
 
@@ -248,12 +954,54 @@ static int _rtpmidi_journal_decode_messages( struct RTPMIDIJournal * journal, un
 
 static void * _rtpmidi_peer_info_create() {
   struct RTPMIDIPeerInfo * info = malloc( sizeof( struct RTPMIDIPeerInfo ) );
-  info->send_journal = NULL;
-  info->receive_journal = NULL;
+  if( info == NULL ) return NULL;
+  info->send_journal      = NULL;
+  info->receive_journal   = NULL;
+  info->receive_state     = NULL;
+  info->receive_seqnum    = 0;
+  info->receive_started   = 0;
+  info->receive_timestamp = 0;
   info->info = NULL;
   return info;
 }
 
+static struct RTPMIDIPeerInfo * _rtpmidi_peer_info( struct RTPPeer * peer ) {
+  struct RTPMIDIPeerInfo * info = NULL;
+  RTPPeerGetInfo( peer, (void**) &info );
+  if( info == NULL ) {
+    info = _rtpmidi_peer_info_create();
+    if( info == NULL ) return NULL;
+    RTPPeerSetInfo( peer, info );
+  }
+  return info;
+}
+
+/**
+ * @brief Free the journals and the info-structure of a peer.
+ * The pointer that was set with RTPMIDIPeerSetInfo is not freed.
+ * @private @memberof RTPMIDISession
+ * @param peer The peer.
+ */
+static void _rtpmidi_peer_info_destroy( struct RTPPeer * peer ) {
+  struct RTPMIDIPeerInfo * info = NULL;
+  RTPPeerGetInfo( peer, (void **) &info );
+  if( info == NULL ) return;
+  _rtpmidi_journal_destroy( info->send_journal );
+  _rtpmidi_journal_destroy( info->receive_journal );
+  _rtpmidi_journal_destroy( info->receive_state );
+  free( info );
+  RTPPeerSetInfo( peer, NULL );
+}
+
+static struct RTPMIDIJournal * _rtpmidi_peer_send_journal( struct RTPPeer * peer ) {
+  struct RTPMIDIPeerInfo * info = _rtpmidi_peer_info( peer );
+  if( info == NULL ) return NULL;
+  if( info->send_journal == NULL ) {
+    info->send_journal = _rtpmidi_journal_create();
+  }
+  return info->send_journal;
+}
+
 /**
  * @brief Set the pointer of the internal info-structure.
  * @relates RTPMIDISession
@@ -294,9 +1042,28 @@ int RTPMIDIPeerGetInfo( struct RTPPeer * peer, void ** info ) {
   return 0;
 }
 
+/**
+ * @brief Remove a peer from the RTP session.
+ * Free the journals of the peer and remove it from the underlying
+ * RTPSession. The pointer that was set with RTPMIDIPeerSetInfo is not
+ * freed, the caller has to do that first.
+ * @public @memberof RTPMIDISession
+ * @param session The session.
+ * @param peer    The peer.
+ * @retval 0 on success.
+ * @retval >0 if the peer could not be removed.
+ */
+int RTPMIDISessionRemovePeer( struct RTPMIDISession * session, struct RTPPeer * peer ) {
+  if( peer == NULL ) return 1;
+  _rtpmidi_peer_info_destroy( peer );
+  return RTPSessionRemovePeer( session->rtp_session, peer );
+}
+
 /**
  * @brief Trunkate a peers send journal.
  * Remove all message entries that have a sequence number less or equal to @c seqnum.
+ * This is called when the peer reports that it received all packets up to
+ * @c seqnum, the next packet after it becomes the new checkpoint.
  * @public @memberof RTPMIDISession
  * @param session The session.
  * @param peer    The peer.
@@ -304,6 +1071,15 @@ int RTPMIDIPeerGetInfo( struct RTPPeer * peer, void ** info ) {
  * @retval 0 on success.
  */
 int RTPMIDISessionJournalTrunkate( struct RTPMIDISession * session, struct RTPPeer * peer, unsigned long seqnum ) {
+  struct RTPMIDIPeerInfo * info = NULL;
+  unsigned short checkpoint = ( seqnum + 1 ) & 0xffff;
+
+  RTPPeerGetInfo( peer, (void**) &info );
+  if( info == NULL || info->send_journal == NULL ) return 0;
+  /* never move the checkpoint backwards on late feedback */
+  if( _rtpmidi_seqnum_since( checkpoint, info->send_journal->checkpoint_pkt_seqnum ) ) {
+    info->send_journal->checkpoint_pkt_seqnum = checkpoint;
+  }
   return 0;
 }
 
@@ -319,30 +1095,23 @@ int RTPMIDISessionJournalTrunkate( struct RTPMIDISession * session, struct RTPPe
  */
 int RTPMIDISessionJournalStoreMessages( struct RTPMIDISession * session, struct RTPPeer * peer,
                                         unsigned long seqnum, struct MIDIMessageList * messages ) {
-  struct RTPMIDIPeerInfo * info = NULL;
-
-  RTPPeerGetInfo( peer, (void**) &info );
-  if( info == NULL ) {
-    info = _rtpmidi_peer_info_create();
-    RTPPeerSetInfo( peer, info );
-  }
-
-  if( info->send_journal == NULL ) {
-    /* create journal */
-  }
-
-  return _rtpmidi_journal_encode_messages( info->send_journal, seqnum, messages );
+  return _rtpmidi_journal_encode_messages( _rtpmidi_peer_send_journal( peer ), seqnum, messages );
 }
 
 /**
  * @brief Restore a list of messages from a peer's receive
  * journal associated with the given sequence number.
+ * Compare the last journal that was received from the peer with the
+ * state the receiver has seen and write the messages that are needed
+ * to repair the stream to the list. The receive state is updated as if
+ * the messages had been received.
  * @public @memberof RTPMIDISession
  * @param session  The session.
  * @param peer     The peer.
  * @param seqnum   The sequence number.
  * @param messages The messages list to decode messages to.
  * @retval 0 on success.
+ * @retval 1 if the list was too short to hold all recovered messages.
  */
 int RTPMIDISessionJournalRecoverMessages( struct RTPMIDISession * session, struct RTPPeer * peer,
                                           unsigned long seqnum, struct MIDIMessageList * messages ) {
@@ -350,9 +1119,10 @@ int RTPMIDISessionJournalRecoverMessages( struct RTPMIDISession * session, struc
 
   RTPPeerGetInfo( peer, (void**) &info );
   if( info == NULL ) return 0;
-  if( info->receive_journal == NULL ) return 0;
+  if( info->receive_journal == NULL || info->receive_state == NULL ) return 0;
 
-  return _rtpmidi_journal_decode_messages( info->receive_journal, seqnum, messages );
+  return _rtpmidi_journal_decode_messages( info->receive_journal, info->receive_state,
+                                           seqnum, info->receive_timestamp, &messages );
 }
 
 static void _advance_buffer( size_t * size, void ** buffer, size_t bytes ) {
@@ -433,7 +1203,8 @@ static int _rtpmidi_encode_messages( struct RTPMIDIInfo * info, MIDITimestamp ti
   return result;
 }
 
-static int _rtpmidi_decode_messages( struct RTPMIDIInfo * info, MIDITimestamp timestamp, struct MIDIMessageList * messages, size_t size, void * data, size_t * read ) {
+static int _rtpmidi_decode_messages( struct RTPMIDIInfo * info, MIDITimestamp timestamp, struct MIDIMessageList ** list, size_t size, void * data, size_t * read ) {
+  struct MIDIMessageList * messages = *list;
   int m, result = 0;
   void * buffer = data;
   size_t r;
@@ -462,6 +1233,7 @@ static int _rtpmidi_decode_messages( struct RTPMIDIInfo * info, MIDITimestamp ti
     messages = messages->next;
   }
 
+  *list = messages;
   *read = buffer - data;
   return result;
 }
@@ -481,13 +1253,15 @@ static int _rtpmidi_decode_messages( struct RTPMIDIInfo * info, MIDITimestamp ti
  */
 int RTPMIDISessionSend( struct RTPMIDISession * session, struct MIDIMessageList * messages ) {
   int result = 0;
-  struct iovec iov[3];
+  struct iovec iov[RTP_MAX_BATCH][3];
+  struct RTPPacketInfo  infos[RTP_MAX_BATCH], last;
+  struct RTPMIDIJournal * journals[RTP_MAX_BATCH];
+  size_t i, count = 0, sent = 0, total = 0;
   size_t written = 0;
   size_t size    = session->size;
   void * buffer  = session->buffer;
 
   struct RTPPeer        * peer    = NULL;
-  struct RTPMIDIJournal * journal = NULL;
   struct RTPMIDIInfo    * minfo   = &(session->midi_info);
   struct RTPPacketInfo  * info    = &(session->rtp_info);
 
@@ -508,56 +1282,132 @@ int RTPMIDISessionSend( struct RTPMIDISession * session, struct MIDIMessageList
   minfo->phantom = 0;
   minfo->zero    = 0;
 
-  _rtpmidi_encode_messages( minfo, timestamp, messages, size, buffer, &written );
-  iov[1].iov_base = buffer;
-  iov[1].iov_len  = written;
-  _advance_buffer( &size, &buffer, written );
-
-  _rtpmidi_encode_header( minfo, size, buffer, &written );
-  iov[0].iov_base = buffer;
-  iov[0].iov_len  = written;
-  _advance_buffer( &size, &buffer, written );
+  /* the command section is shared by all peers */
+  if( _rtpmidi_encode_messages( minfo, timestamp, messages, size, buffer, &written ) ) return 1;
 
-  /* send encoded messages to each peer
-   * each peer has its own journal */
-  result = RTPSessionNextPeer( session->rtp_session, &peer );
+  /* send encoded messages to each peer, each peer has its own journal
+   * so every peer gets its own packet but they are all handed to the
+   * kernel with a single system call */
+  RTPSessionNextPeer( session->rtp_session, &peer );
   while( peer != NULL ) {
-    if( minfo->journal ) {
-      journal = NULL; /* peer out journal */
-      _rtpmidi_journal_encode( session, journal, size, buffer, &written );
-      iov[2].iov_base = buffer;
-      iov[2].iov_len  = written;
-      _advance_buffer( &size, &buffer, written );
-    } else {
-      iov[2].iov_base = NULL;
-      iov[2].iov_len  = 0;
+    infos[count] = *info;
+    infos[count].iov  = &(iov[count][0]);
+    infos[count].peer = peer;
+    iov[count][1].iov_base = buffer;
+    iov[count][1].iov_len  = written;
+
+    journals[count] = _rtpmidi_peer_send_journal( peer );
+    if( _rtpmidi_journal_encode( session, journals[count], RTPMIDI_JOURNAL_SIZE,
+                                 session->journal_buffer[count], &(iov[count][2].iov_len) ) ) {
+      /* send without journal, the receiver will notice the loss */
+      iov[count][2].iov_len = 0;
     }
+    iov[count][2].iov_base = session->journal_buffer[count];
+    minfo->journal = ( iov[count][2].iov_len > 0 ) ? 1 : 0;
 
-    info->peer   = peer;
-    info->iovlen = ( minfo->journal ) ? 3 : 2;
-    info->iov    = &(iov[0]);
-    info->payload_size = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
-
-    result = RTPSessionSendPacket( session->rtp_session, info );
-
-    if( result == 0 && minfo->journal ) {
-      _rtpmidi_journal_encode_messages( journal, info->sequence_number, messages );
-    }
+    _rtpmidi_encode_header( minfo, 2, session->header_buffer[count], &(iov[count][0].iov_len) );
+    iov[count][0].iov_base = session->header_buffer[count];
+    infos[count].iovlen    = ( minfo->journal ) ? 3 : 2;
+    count++;
 
     RTPSessionNextPeer( session->rtp_session, &peer );
+    if( count == RTP_MAX_BATCH || ( peer == NULL && count > 0 ) ) {
+      /* keep going after a failed batch, the other peers may still be reachable */
+      if( RTPSessionSendBatch( session->rtp_session, count, &(infos[0]), &sent ) ) result = 1;
+      for( i=0; i<sent; i++ ) {
+        _rtpmidi_journal_encode_messages( journals[i], infos[i].sequence_number, messages );
+      }
+      if( sent > 0 ) last = infos[sent-1];
+      total += sent;
+      count  = 0;
+    }
   }
 
+  if( total > 0 ) {
+    *info = last;
+    info->iov = NULL;
+  }
   return result;
 }
 
 
+/**
+ * @brief Turn the received packet in the session's packet info into messages.
+ * @private @memberof RTPMIDISession
+ * @param session  The session.
+ * @param messages A pointer to a list of midi messages.
+ * @retval 0 on success.
+ * @retval >0 If the message was corrupted.
+ */
+static int _rtpmidi_receive_messages( struct RTPMIDISession * session, struct MIDIMessageList * messages ) {
+  int result = 0;
+  size_t read = 0;
+  size_t size;
+  void * buffer;
+  short gap = 0;
+  MIDITimestamp timestamp;
+  unsigned short seqnum;
+
+  struct RTPMIDIPeerInfo * pinfo;
+  struct MIDIMessageList * list;
+  struct RTPMIDIInfo     * minfo   = &(session->midi_info);
+  struct RTPPacketInfo   * info    = &(session->rtp_info);
+
+  timestamp = info->timestamp;
+  seqnum    = info->sequence_number;
+  size      = info->iov[0].iov_len;
+  buffer    = info->iov[0].iov_base;
+
+  if( size == 0 || _rtpmidi_decode_header( minfo, size, buffer, &read ) ) return 1;
+  _advance_buffer( &size, &buffer, read );
+  if( minfo->len > size ) return 1;
+
+  pinfo = _rtpmidi_peer_info( info->peer );
+  if( pinfo == NULL ) return 1;
+  if( pinfo->receive_state == NULL ) {
+    pinfo->receive_state = _rtpmidi_journal_create();
+    if( pinfo->receive_state == NULL ) return 1;
+  }
+  if( pinfo->receive_started ) {
+    gap = (short) ( seqnum - pinfo->receive_seqnum - 1 );
+    /* late or duplicate packet, its contents were already recovered */
+    if( gap < 0 ) return 0;
+  }
+  pinfo->receive_started   = 1;
+  pinfo->receive_seqnum    = seqnum;
+  pinfo->receive_timestamp = timestamp;
+
+  /* packets were lost, repair the stream before the new commands */
+  list = messages;
+  if( gap > 0 && minfo->journal ) {
+    if( pinfo->receive_journal == NULL ) {
+      pinfo->receive_journal = _rtpmidi_journal_create();
+    }
+    if( pinfo->receive_journal != NULL &&
+        _rtpmidi_journal_decode( session, pinfo->receive_journal, size - minfo->len,
+                                 (unsigned char *) buffer + minfo->len, &read ) == 0 ) {
+      _rtpmidi_journal_decode_messages( pinfo->receive_journal, pinfo->receive_state,
+                                        seqnum, timestamp, &list );
+    }
+  }
+
+  messages = list;
+  _rtpmidi_decode_messages( minfo, timestamp, &list, size, buffer, &read );
+  for( ; messages != list; messages = messages->next ) {
+    _rtpmidi_journal_store_message( pinfo->receive_state, seqnum, messages->message );
+  }
+  return result;
+}
+
 /**
  * @brief Receive MIDI messages over an RTPSession.
  * Receive messages from any connected peer. Store the number of received messages
  * in @c count, if the @c info argument was specified it will be populated with the
  * packet info of the last received packet.
  * If lost packets are detected the required information is recovered from the
- * journal.
+ * journal. The recovered messages are written to the list in front of the
+ * messages of the packet. Packets that arrive late are dropped because their
+ * contents were already recovered.
  * @public @memberof RTPMIDISession
  * @param session  The session.
  * @param messages A pointer to a list of midi messages.
@@ -565,59 +1415,311 @@ int RTPMIDISessionSend( struct RTPMIDISession * session, struct MIDIMessageList
  * @retval >0 If the message was corrupted or could not be received.
  */
 int RTPMIDISessionReceive( struct RTPMIDISession * session, struct MIDIMessageList * messages ) {
-  int result = 0;
   struct iovec iov[3];
-  size_t read = 0;
-  size_t size;
-  void * buffer;
-  MIDITimestamp timestamp;
-
-  struct RTPPeer        * peer    = NULL;
-  struct RTPMIDIJournal * journal = NULL;
-  struct RTPMIDIInfo    * minfo   = &(session->midi_info);
-  struct RTPPacketInfo  * info    = &(session->rtp_info);
+  struct RTPPacketInfo * info = &(session->rtp_info);
+  int result;
 
   info->iovlen = 3;
   info->iov    = &(iov[0]);
-  
+
   if( messages == NULL ) return 1;
   result = RTPSessionReceivePacket( session->rtp_session, info );
   if( result != 0 ) return result;
-  
-  timestamp = info->timestamp;
-  size      = info->iov[0].iov_len;
-  buffer    = info->iov[0].iov_base;
+  return _rtpmidi_receive_messages( session, messages );
+}
 
-  _rtpmidi_decode_header( minfo, size, buffer, &read );
-  _advance_buffer( &size, &buffer, read );
+/**
+ * @brief Receive MIDI messages from a datagram that was already received.
+ * Behaves like RTPMIDISessionReceive for a datagram that the runloop
+ * received from the session's socket.
+ * @public @memberof RTPMIDISession
+ * @param session  The session.
+ * @param size     The number of bytes in the datagram.
+ * @param buffer   The datagram.
+ * @param namelen  The size of the sender address.
+ * @param name     The sender address.
+ * @param messages A pointer to a list of midi messages.
+ * @retval 0 on success.
+ * @retval >0 If the message was corrupted.
+ */
+int RTPMIDISessionReceiveDatagram( struct RTPMIDISession * session, size_t size, void * buffer,
+                                   socklen_t namelen, struct sockaddr * name, struct MIDIMessageList * messages ) {
+  struct iovec iov[3];
+  struct RTPPacketInfo * info = &(session->rtp_info);
+  int result;
 
-  _rtpmidi_decode_messages( minfo, timestamp, messages, size, buffer, &read );
-  _advance_buffer( &size, &buffer, read );
-  
-  if( minfo->journal ) {
-    if( 0 /* check for out of order package */ ) {
-      if( 0 /* any more packets pending? */ ) {
-        /* move messages to buffer */
-        /* receive pending packets, try again */
-      } else {
-        journal = NULL; /* peer in journal */
-        _rtpmidi_journal_decode( session, journal, size, buffer, &read );
-        _advance_buffer( &size, &buffer, read );
-        /* recover from journal */
+  info->iovlen = 3;
+  info->iov    = &(iov[0]);
+
+  if( messages == NULL ) return 1;
+  result = RTPSessionDecodePacket( session->rtp_session, size, buffer, namelen, name, info );
+  if( result != 0 ) return result;
+  return _rtpmidi_receive_messages( session, messages );
+}
+
+/**
+ * @brief Get the peer that sent the last received packet.
+ * Use it right after RTPMIDISessionReceive to tell which peer the
+ * messages came from, sending overwrites the packet info.
+ * @public @memberof RTPMIDISession
+ * @param session The session.
+ * @param peer    The peer, @c NULL if no packet was received yet.
+ * @retval 0 on success.
+ * @retval >0 if the peer could not be stored.
+ */
+int RTPMIDISessionGetReceivePeer( struct RTPMIDISession * session, struct RTPPeer ** peer ) {
+  if( peer == NULL ) return 1;
+  *peer = session->rtp_info.peer;
+  return 0;
+}
+
+/** @} */
+
+/* MARK: Zero-copy reception *//**
+ * @name Zero-copy reception
+ * Receiving packets into pooled buffers and walking their command lists
+ * without creating MIDIMessage objects.
+ * @{
+ */
+
+/**
+ * @brief Get the number of data bytes following a status byte.
+ * System exclusive data ends with the first status byte, which is
+ * included in the size if it is an end (0xf7), segment (0xf0) or
+ * cancel (0xf4) marker as described in RFC 6295.
+ */
+static int _rtpmidi_command_size( MIDIStatus status, size_t size, unsigned char * data, size_t * command_size ) {
+  size_t n;
+  switch( status & 0xf0 ) {
+    case 0x80: case 0x90: case 0xa0: case 0xb0: case 0xe0:
+      n = 2;
+      break;
+    case 0xc0: case 0xd0:
+      n = 1;
+      break;
+    default:
+      switch( status ) {
+        case 0xf0:
+          n = MIDIScanStatus( size, data );
+          if( n == size ) return 1;
+          if( data[n] == 0xf7 || data[n] == 0xf0 || data[n] == 0xf4 ) n++;
+          break;
+        case 0xf1: case 0xf3:
+          n = 1;
+          break;
+        case 0xf2:
+          n = 2;
+          break;
+        default:
+          n = 0;
+          break;
       }
+  }
+  if( n > size ) return 1;
+  *command_size = n;
+  return 0;
+}
+
+static void _rtpmidi_view_free( struct RTPMIDIPacketView * view ) {
+  struct RTPMIDISession * session = view->session;
+  if( session->free_count < RTPMIDI_VIEW_POOL ) {
+    view->next = session->free_views;
+    session->free_views = view;
+    session->free_count++;
+  } else {
+    free( view );
+  }
+  RTPMIDISessionRelease( session );
+}
+
+/**
+ * @brief Receive a packet without copying or decoding it.
+ * Take a buffer from the session's pool, receive the next datagram
+ * directly into it and parse only the RTP and RTP-MIDI headers. The
+ * commands are decoded on demand with RTPMIDIPacketViewFirstCommand and
+ * RTPMIDIPacketViewNextCommand. The view must be released with
+ * RTPMIDIPacketViewRelease which returns the buffer to the pool.
+ * @public @memberof RTPMIDISession
+ * @param session The session.
+ * @param view    The location to store the retained view in.
+ * @retval 0 on success.
+ * @retval >0 If the packet was corrupted or could not be received.
+ */
+int RTPMIDISessionReceiveView( struct RTPMIDISession * session, struct RTPMIDIPacketView ** view ) {
+  struct RTPMIDIPacketView * v;
+  size_t size, read = 0;
+  int result;
+
+  if( view == NULL ) return 1;
+  *view = NULL;
+  v = session->free_views;
+  if( v != NULL ) {
+    session->free_views = v->next;
+    session->free_count--;
+  } else {
+    v = malloc( sizeof( struct RTPMIDIPacketView ) );
+    if( v == NULL ) return 1;
+  }
+  v->refs     = 1;
+  v->session  = session;
+  v->next     = NULL;
+  v->info.iov    = &(v->iov[0]);
+  v->info.iovlen = 2;
+  RTPMIDISessionRetain( session );
+
+  result = RTPSessionReceivePacketBuffer( session->rtp_session, sizeof(v->data), &(v->data[0]), &(v->info) );
+  if( result == 0 ) {
+    /* the payload starts after the rtp header and optional extension */
+    v->commands = (unsigned char *) v->info.iov[v->info.iovlen-1].iov_base - &(v->data[0]);
+    size        = v->info.payload_size;
+    if( size == 0 || _rtpmidi_decode_header( &(v->midi_info), size, &(v->data[v->commands]), &read ) ) {
+      result = 1;
+    } else if( read + v->midi_info.len > size ) {
+      result = 1;
+    } else {
+      v->commands += read;
+      v->end       = v->commands + v->midi_info.len;
     }
   }
-  /* - clear the internal packet buffer
-   * - repeat as long as the socket holds packets:
-   *   - if the packet is not currupted sort it into the internal packet buffer
-   *     using it's sequence number (first sent, first dispatched)
-   *   - if the packet is corrupted, omit it
-   * - write messages from the internal packet buffer to the message
-   *   list and recover lost packets on the way
-   * - store messages that don't fit into the supplied buffer in the
-   *   internal message buffer
-   */
-  return result;
+  if( result != 0 ) {
+    _rtpmidi_view_free( v );
+    return result;
+  }
+  *view = v;
+  return 0;
+}
+
+/**
+ * @brief Retain an RTPMIDIPacketView instance.
+ * @public @memberof RTPMIDIPacketView
+ * @param view The view.
+ */
+void RTPMIDIPacketViewRetain( struct RTPMIDIPacketView * view ) {
+  view->refs++;
+}
+
+/**
+ * @brief Release an RTPMIDIPacketView instance.
+ * Decrement the reference counter of a view. If the reference count
+ * reached zero, return the view to the pool of its session.
+ * @public @memberof RTPMIDIPacketView
+ * @param view The view.
+ */
+void RTPMIDIPacketViewRelease( struct RTPMIDIPacketView * view ) {
+  if( ! --view->refs ) {
+    _rtpmidi_view_free( view );
+  }
+}
+
+/**
+ * @brief Get the peer that sent the packet.
+ * @public @memberof RTPMIDIPacketView
+ * @param view The view.
+ * @param peer The peer.
+ * @retval 0 on success.
+ */
+int RTPMIDIPacketViewGetPeer( struct RTPMIDIPacketView * view, struct RTPPeer ** peer ) {
+  if( peer == NULL ) return 1;
+  *peer = view->info.peer;
+  return 0;
+}
+
+/**
+ * @brief Get the RTP sequence number and timestamp of the packet.
+ * @public @memberof RTPMIDIPacketView
+ * @param view      The view.
+ * @param seqnum    The sequence number. (may be @c NULL)
+ * @param timestamp The timestamp. (may be @c NULL)
+ * @retval 0 on success.
+ */
+int RTPMIDIPacketViewGetHeader( struct RTPMIDIPacketView * view, unsigned short * seqnum, MIDITimestamp * timestamp ) {
+  if( seqnum != NULL )    *seqnum    = view->info.sequence_number;
+  if( timestamp != NULL ) *timestamp = view->info.timestamp;
+  return 0;
+}
+
+/**
+ * @brief Get the raw bytes of the datagram.
+ * Command offsets are relative to the returned buffer. The buffer must
+ * not be modified and is valid until the view is released.
+ * @public @memberof RTPMIDIPacketView
+ * @param view The view.
+ * @param size The size of the datagram.
+ * @param data The datagram.
+ * @retval 0 on success.
+ */
+int RTPMIDIPacketViewGetData( struct RTPMIDIPacketView * view, size_t * size, const unsigned char ** data ) {
+  if( size == NULL || data == NULL ) return 1;
+  *size = view->info.total_size;
+  *data = &(view->data[0]);
+  return 0;
+}
+
+/**
+ * @brief Decode the command descriptor at the cursor of @c command.
+ * @private @memberof RTPMIDIPacketView
+ */
+static int _rtpmidi_view_command( struct RTPMIDIPacketView * view, struct RTPMIDICommand * command ) {
+  unsigned char * data = &(view->data[0]);
+  size_t p = command->next, r;
+  MIDIVarLen delta = 0;
+
+  if( p >= view->end ) return 1;
+  if( p > view->commands || view->midi_info.zero ) {
+    if( MIDIUtilReadVarLen( &delta, view->end - p, data + p, &r ) ) return 1;
+    p += r;
+    if( p >= view->end ) return 1;
+  }
+  if( data[p] & 0x80 ) {
+    command->status = data[p++];
+    /* only channel messages set the running status, system common
+     * messages cancel it and real-time messages leave it alone */
+    if( command->status < 0xf0 ) {
+      command->running = command->status;
+    } else if( command->status < 0xf8 ) {
+      command->running = 0;
+    }
+  } else if( command->running ) {
+    command->status = command->running;
+  } else {
+    return 1;
+  }
+  if( _rtpmidi_command_size( command->status, view->end - p, data + p, &r ) ) return 1;
+  command->delta      = delta;
+  command->timestamp += delta;
+  command->offset     = p;
+  command->size       = r;
+  command->next       = p + r;
+  return 0;
+}
+
+/**
+ * @brief Get the first command of the packet.
+ * @public @memberof RTPMIDIPacketView
+ * @param view    The view.
+ * @param command The command descriptor to fill.
+ * @retval 0 on success.
+ * @retval 1 if the packet contains no (more) valid commands.
+ */
+int RTPMIDIPacketViewFirstCommand( struct RTPMIDIPacketView * view, struct RTPMIDICommand * command ) {
+  if( command == NULL ) return 1;
+  command->next      = view->commands;
+  command->running   = 0;
+  command->timestamp = view->info.timestamp;
+  return _rtpmidi_view_command( view, command );
+}
+
+/**
+ * @brief Advance a command descriptor to the next command of the packet.
+ * @public @memberof RTPMIDIPacketView
+ * @param view    The view.
+ * @param command A command descriptor filled by RTPMIDIPacketViewFirstCommand.
+ * @retval 0 on success.
+ * @retval 1 if the packet contains no (more) valid commands.
+ */
+int RTPMIDIPacketViewNextCommand( struct RTPMIDIPacketView * view, struct RTPMIDICommand * command ) {
+  if( command == NULL ) return 1;
+  return _rtpmidi_view_command( view, command );
 }
 
 /** @} */
@@ -1,18 +1,53 @@
 #ifndef MIDIKIT_DRIVER_RTPMIDI_H
 #define MIDIKIT_DRIVER_RTPMIDI_H
 #include <stdlib.h>
+#include <sys/socket.h>
 #include "midi/message.h"
+#include "midi/util.h"
 
 struct RTPPeer;
 struct RTPSession;
 
 struct RTPMIDISession;
+struct RTPMIDIPacketView;
+
+#define RTPMIDI_VIEW_SIZE 1500
+
+/**
+ * The space reserved for the recovery journal and the resulting maximum
+ * size of the command section, so that a packet with both fits into an
+ * ethernet frame (1500 bytes minus IP, UDP, RTP and RTP-MIDI headers).
+ */
+#define RTPMIDI_JOURNAL_SIZE 960
+#define RTPMIDI_COMMAND_SIZE ( 1500 - 20 - 8 - 12 - 2 - RTPMIDI_JOURNAL_SIZE )
+
+/**
+ * @brief Descriptor of one command in a received RTP-MIDI packet.
+ * The data bytes of the command start at @c offset in the buffer
+ * returned by RTPMIDIPacketViewGetData.
+ */
+struct RTPMIDICommand {
+  MIDIStatus    status;    /**< The status byte, resolved from the running status */
+  MIDIVarLen    delta;     /**< The delta time to the previous command */
+  MIDITimestamp timestamp; /**< The RTP timestamp of the packet plus all delta times */
+  size_t        offset;    /**< The offset of the first data byte */
+  size_t        size;      /**< The number of data bytes */
+/**
+ * @privatesection
+ * @cond INTERNALS
+ */
+  size_t next;
+  MIDIRunningStatus running;
+/** @endcond */
+};
 
 struct RTPMIDISession * RTPMIDISessionCreate( struct RTPSession * session );
 void RTPMIDISessionDestroy( struct RTPMIDISession * session );
 void RTPMIDISessionRetain( struct RTPMIDISession * session );
 void RTPMIDISessionRelease( struct RTPMIDISession * session );
 
+int RTPMIDISessionRemovePeer( struct RTPMIDISession * session, struct RTPPeer * peer );
+
 int RTPMIDISessionJournalTrunkate( struct RTPMIDISession * session, struct RTPPeer * peer, unsigned long seqnum );
 int RTPMIDISessionJournalStoreMessages( struct RTPMIDISession * session, struct RTPPeer * peer,
                                         unsigned long seqnum, struct MIDIMessageList * messages );
@@ -24,5 +59,18 @@ int RTPMIDIPeerGetInfo( struct RTPPeer * peer, void ** info );
 
 int RTPMIDISessionSend( struct RTPMIDISession * session, struct MIDIMessageList * messages );
 int RTPMIDISessionReceive( struct RTPMIDISession * session, struct MIDIMessageList * messages );
+int RTPMIDISessionReceiveDatagram( struct RTPMIDISession * session, size_t size, void * buffer,
+                                   socklen_t namelen, struct sockaddr * name, struct MIDIMessageList * messages );
+int RTPMIDISessionGetReceivePeer( struct RTPMIDISession * session, struct RTPPeer ** peer );
+int RTPMIDISessionReceiveView( struct RTPMIDISession * session, struct RTPMIDIPacketView ** view );
+
+void RTPMIDIPacketViewRetain( struct RTPMIDIPacketView * view );
+void RTPMIDIPacketViewRelease( struct RTPMIDIPacketView * view );
+
+int RTPMIDIPacketViewGetPeer( struct RTPMIDIPacketView * view, struct RTPPeer ** peer );
+int RTPMIDIPacketViewGetHeader( struct RTPMIDIPacketView * view, unsigned short * seqnum, MIDITimestamp * timestamp );
+int RTPMIDIPacketViewGetData( struct RTPMIDIPacketView * view, size_t * size, const unsigned char ** data );
+int RTPMIDIPacketViewFirstCommand( struct RTPMIDIPacketView * view, struct RTPMIDICommand * command );
+int RTPMIDIPacketViewNextCommand( struct RTPMIDIPacketView * view, struct RTPMIDICommand * command );
 
 #endif
@@ -352,7 +352,7 @@ void MIDIClockDestroy( struct MIDIClock * clock ) {
  */
 void MIDIClockRetain( struct MIDIClock * clock ) {
   MIDIPrecondReturn( clock != NULL, EFAULT, (void)0 );
-  clock->refs++;
+  MIDI_REFS_RETAIN( clock->refs );
 }
 
 /**
@@ -364,7 +364,7 @@ void MIDIClockRetain( struct MIDIClock * clock ) {
  */
 void MIDIClockRelease( struct MIDIClock * clock ) {
   MIDIPrecondReturn( clock != NULL, EFAULT, (void)0 );
-  if( ! --clock->refs ) {
+  if( MIDI_REFS_RELEASE( clock->refs ) == 0 ) {
     MIDIClockDestroy( clock );
   }
 }
@@ -388,7 +388,7 @@ void MIDIClockRelease( struct MIDIClock * clock ) {
  */
 int MIDIClockSetNow( struct MIDIClock * clock, MIDITimestamp now ) {
   if( clock == NULL ) clock = _get_global_clock();
-  MIDIPrecond( clock->refs == 1, EFAULT );
+  MIDIPrecond( MIDI_REFS_GET( clock->refs ) == 1, EFAULT );
   clock->offset = now - _get_real_time( clock );
   return 0;
 }
@@ -419,7 +419,7 @@ int MIDIClockGetNow( struct MIDIClock * clock, MIDITimestamp * now ) {
  */
 int MIDIClockSetSamplingRate( struct MIDIClock * clock, MIDISamplingRate rate ) {
   if( clock == NULL ) clock = _get_global_clock();
-  MIDIPrecond( clock->refs == 1, EFAULT );
+  MIDIPrecond( MIDI_REFS_GET( clock->refs ) == 1, EFAULT );
   clock->numer = ( clock->numer / clock->rate ) * rate;
   clock->rate  = rate;
   return 0;
@@ -311,6 +311,116 @@ static int _recv_msg( struct MIDIDevice * device, struct MIDIMessage * message )
   return 0;
 }
 
+/**
+ * @brief Receive an array of packed MIDI messages.
+ * Dispatch every message straight from its status and data bytes,
+ * without creating MIDIMessage objects or reading properties.
+ * System exclusive messages are passed to the generic routing function.
+ * @private @memberof MIDIDevice
+ * @param device The midi device.
+ * @param array  The received messages.
+ * @retval 0 on success.
+ * @retval >0 if any message could not be processed.
+ */
+static int _recv_packed( struct MIDIDevice * device, struct MIDIPackedMessageArray * array ) {
+  struct MIDIPackedMessage * m;
+  struct MIDIMessage * message;
+  MIDIChannel channel;
+  size_t i;
+  int result = 0;
+  MIDIPrecond( device != NULL, EFAULT );
+  MIDIPrecond( array != NULL, EINVAL );
+
+  for( i=0; i<array->count; i++ ) {
+    m = &(array->messages[i]);
+    channel = MIDI_LOW_NIBBLE( m->status );
+    switch( ( m->status < 0xf0 ) ? MIDI_HIGH_NIBBLE( m->status ) : m->status ) {
+      case MIDI_STATUS_NOTE_OFF:
+        result += MIDIDeviceReceiveNoteOff( device, channel, m->data[0], m->data[1] );
+        break;
+      case MIDI_STATUS_NOTE_ON:
+        result += MIDIDeviceReceiveNoteOn( device, channel, m->data[0], m->data[1] );
+        break;
+      case MIDI_STATUS_POLYPHONIC_KEY_PRESSURE:
+        result += MIDIDeviceReceivePolyphonicKeyPressure( device, channel, m->data[0], m->data[1] );
+        break;
+      case MIDI_STATUS_CONTROL_CHANGE:
+        result += MIDIDeviceReceiveControlChange( device, channel, m->data[0], m->data[1] );
+        break;
+      case MIDI_STATUS_PROGRAM_CHANGE:
+        result += MIDIDeviceReceiveProgramChange( device, channel, m->data[0] );
+        break;
+      case MIDI_STATUS_CHANNEL_PRESSURE:
+        result += MIDIDeviceReceiveChannelPressure( device, channel, m->data[0] );
+        break;
+      case MIDI_STATUS_PITCH_WHEEL_CHANGE:
+        result += MIDIDeviceReceivePitchWheelChange( device, channel, MIDI_LONG_VALUE( m->data[1], m->data[0] ) );
+        break;
+      case MIDI_STATUS_SYSTEM_EXCLUSIVE:
+        if( MIDIPackedMessageGetSysex( m, &message ) == 0 ) {
+          result += _recv_msg( device, message );
+        } else {
+          result++;
+        }
+        break;
+      case MIDI_STATUS_TIME_CODE_QUARTER_FRAME:
+        result += MIDIDeviceReceiveTimeCodeQuarterFrame( device, MIDI_HIGH_NIBBLE( m->data[0] ),
+                                                         MIDI_LOW_NIBBLE( m->data[0] ) );
+        break;
+      case MIDI_STATUS_SONG_POSITION_POINTER:
+        result += MIDIDeviceReceiveSongPositionPointer( device, MIDI_LONG_VALUE( m->data[1], m->data[0] ) );
+        break;
+      case MIDI_STATUS_SONG_SELECT:
+        result += MIDIDeviceReceiveSongSelect( device, m->data[0] );
+        break;
+      case MIDI_STATUS_TUNE_REQUEST:
+        result += MIDIDeviceReceiveTuneRequest( device );
+        break;
+      case MIDI_STATUS_END_OF_EXCLUSIVE:
+        result += MIDIDeviceReceiveEndOfExclusive( device );
+        break;
+      case MIDI_STATUS_TIMING_CLOCK:
+      case MIDI_STATUS_START:
+      case MIDI_STATUS_CONTINUE:
+      case MIDI_STATUS_STOP:
+      case MIDI_STATUS_ACTIVE_SENSING:
+      case MIDI_STATUS_RESET:
+        result += MIDIDeviceReceiveRealTime( device, m->status, m->timestamp );
+        break;
+      default:
+        break;
+    }
+  }
+  return result;
+}
+
+static int _recv( void * dev, void * source, struct MIDITypeSpec * type, void * data );
+
+/**
+ * @brief Receive a batch of objects.
+ * Route every object of the batch as if it was received on its own.
+ * @private @memberof MIDIDevice
+ * @param device The device.
+ * @param source The source that sent the batch.
+ * @param batch  The batch.
+ * @retval 0 on success.
+ * @retval >0 if any object could not be processed.
+ */
+static int _recv_batch( struct MIDIDevice * device, void * source, struct MIDIPortBatch * batch ) {
+  size_t i;
+  int result = 0;
+  if( batch->type == MIDIMessageType ) {
+    for( i=0; i<batch->count; i++ ) {
+      result += _recv_msg( device, batch->objects[i] );
+    }
+  } else {
+    for( i=0; i<batch->count; i++ ) {
+      result += _recv( device, source, batch->type, batch->objects[i] );
+    }
+  }
+  return result;
+}
+
 /**
  * @brief Receive anything that can be sent through a port.
  * This is used as the callback of the device's @c IN port.
@@ -328,6 +438,12 @@ static int _recv( void * dev, void * source, struct MIDITypeSpec * type, void *
   if( type == MIDIMessageType ) {
     MIDIPrecond( data != NULL, EINVAL );
     return _recv_msg( dev, data );
+  } else if( type == MIDIPackedMessageArrayType ) {
+    MIDIPrecond( data != NULL, EINVAL );
+    return _recv_packed( dev, data );
+  } else if( type == MIDIPortBatchType ) {
+    MIDIPrecond( data != NULL, EINVAL );
+    return _recv_batch( dev, source, data );
   } else {
     return 0;
   }
@@ -358,7 +474,7 @@ struct MIDIDevice * MIDIDeviceCreate( struct MIDIDeviceDelegate * delegate ) {
   MIDIChannel channel;
 
   device->refs = 1;
-  device->in   = MIDIPortCreate( "Device IN",  MIDI_PORT_IN | MIDI_PORT_THRU, device, &_recv );
+  device->in   = MIDIPortCreate( "Device IN",  MIDI_PORT_IN | MIDI_PORT_THRU | MIDI_PORT_BATCH, device, &_recv );
   device->out  = MIDIPortCreate( "Device OUT", MIDI_PORT_OUT, device, NULL );
 /*device->in   = NULL;
   device->out  = NULL;
@@ -408,7 +524,7 @@ void MIDIDeviceDestroy( struct MIDIDevice * device ) {
  * @param device The device.
  */
 void MIDIDeviceRetain( struct MIDIDevice * device ) {
-  device->refs++;
+  MIDI_REFS_RETAIN( device->refs );
 }
 
 /**
@@ -419,7 +535,7 @@ void MIDIDeviceRetain( struct MIDIDevice * device ) {
  * @param device The device.
  */
 void MIDIDeviceRelease( struct MIDIDevice * device ) {
-  if( ! --device->refs ) {
+  if( MIDI_REFS_RELEASE( device->refs ) == 0 ) {
     MIDIDeviceDestroy( device );
   }
 }
@@ -769,6 +885,64 @@ int MIDIDeviceSend( struct MIDIDevice * device, struct MIDIMessage * message ) {
   return MIDIPortSend( device->out, MIDIMessageType, message );
 }
 
+/**
+ * @brief Send several MIDI messages at once.
+ * Pass the messages as one batch through the @c OUT port.
+ * @public @memberof MIDIDevice
+ * @param device   The device.
+ * @param count    The number of messages.
+ * @param messages The messages.
+ * @retval 0 on success.
+ * @retval >0 if any message could not be sent.
+ */
+int MIDIDeviceSendBatch( struct MIDIDevice * device, size_t count, struct MIDIMessage ** messages ) {
+  MIDIPrecond( device != NULL, EFAULT );
+  MIDIPrecond( messages != NULL || count == 0, EINVAL );
+  return MIDIPortSendBatch( device->out, MIDIMessageType, count, (void **) messages );
+}
+
+/**
+ * @brief Receive an array of packed MIDI messages.
+ * This simulates a batch of messages received on the device's @c IN
+ * port. The whole array is relayed through the @c THRU port at once and
+ * every message is dispatched without creating a MIDIMessage.
+ * @public @memberof MIDIDevice
+ * @param device   The midi device.
+ * @param count    The number of messages.
+ * @param messages The received messages.
+ * @retval 0 on success.
+ * @retval >0 if any message could not be processed.
+ */
+int MIDIDeviceReceivePacked( struct MIDIDevice * device, size_t count, struct MIDIPackedMessage * messages ) {
+  struct MIDIPackedMessageArray array;
+  MIDIPrecond( device != NULL, EFAULT );
+  MIDIPrecond( messages != NULL || count == 0, EINVAL );
+  array.count    = count;
+  array.messages = messages;
+  return MIDIPortReceive( device->in, MIDIPackedMessageArrayType, &array );
+}
+
+/**
+ * @brief Send an array of packed MIDI messages.
+ * Pass the whole array through the @c OUT port at once. Connected ports
+ * that do not handle batches receive the messages one at a time as
+ * MIDIMessage objects.
+ * @public @memberof MIDIDevice
+ * @param device   The device.
+ * @param count    The number of messages.
+ * @param messages The messages.
+ * @retval 0 on success.
+ * @retval >0 if the messages could not be sent.
+ */
+int MIDIDeviceSendPacked( struct MIDIDevice * device, size_t count, struct MIDIPackedMessage * messages ) {
+  struct MIDIPackedMessageArray array;
+  MIDIPrecond( device != NULL, EFAULT );
+  MIDIPrecond( messages != NULL || count == 0, EINVAL );
+  array.count    = count;
+  array.messages = messages;
+  return MIDIPortSend( device->out, MIDIPackedMessageArrayType, &array );
+}
+
 /**
  * @brief Receive a "Note Off" message.
  * This is called whenever the device receives a "Note Off" message.
@@ -4,6 +4,7 @@
 #include "midi.h"
 
 struct MIDIMessage;
+struct MIDIPackedMessage;
 struct MIDIPort;
 struct MIDIController;
 struct MIDITimer;
@@ -59,6 +60,10 @@ int MIDIDeviceGetChannelController( struct MIDIDevice * device, MIDIChannel chan
 
 int MIDIDeviceReceive( struct MIDIDevice * device, struct MIDIMessage * message );
 int MIDIDeviceSend( struct MIDIDevice * device, struct MIDIMessage * message );
+int MIDIDeviceSendBatch( struct MIDIDevice * device, size_t count, struct MIDIMessage ** messages );
+
+int MIDIDeviceReceivePacked( struct MIDIDevice * device, size_t count, struct MIDIPackedMessage * messages );
+int MIDIDeviceSendPacked( struct MIDIDevice * device, size_t count, struct MIDIPackedMessage * messages );
 
 int MIDIDeviceReceiveNoteOff( struct MIDIDevice * device, MIDIChannel channel, MIDIKey key, MIDIVelocity velocity );
 int MIDIDeviceSendNoteOff( struct MIDIDevice * device, MIDIChannel channel, MIDIKey key, MIDIVelocity velocity );
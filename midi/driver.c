@@ -1,4 +1,6 @@
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #define MIDI_DRIVER_INTERNALS
 #include "driver.h"
 
@@ -6,9 +8,23 @@
 #include "port.h"
 #include "event.h"
 #include "message.h"
+#include "message_format.h"
+#include "realtime.h"
 
 #include "runloop.h"
 #include "clock.h"
+#include "scheduler.h"
+
+#define ATOMIC_LOAD_RELAXED( p )     __atomic_load_n( p, __ATOMIC_RELAXED )
+#define ATOMIC_LOAD_ACQUIRE( p )     __atomic_load_n( p, __ATOMIC_ACQUIRE )
+#define ATOMIC_STORE_RELAXED( p, v ) __atomic_store_n( p, v, __ATOMIC_RELAXED )
+#define ATOMIC_CAS_WEAK( p, e, v )   __atomic_compare_exchange_n( p, e, v, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED )
+#define ATOMIC_ADD_FETCH( p, v )     __atomic_add_fetch( p, v, __ATOMIC_RELAXED )
+
+/* Counters of a profile are only written by the owning thread. */
+#define PROFILE_ADD( p, v ) ATOMIC_STORE_RELAXED( p, *(p) + (v) )
+
+#define MIDI_DRIVER_PROFILE_CACHE 4
 
 /**
  * @defgroup MIDI-driver MIDI driver implementations
@@ -54,6 +70,267 @@
  * @{
  */
 
+/**
+ * @brief Profiling counters of one thread.
+ * Every thread that passes messages through a profiled driver gets its
+ * own set of counters, so that recording needs no locks. The profiles
+ * are kept in a list that is only ever prepended to until the driver
+ * is destroyed.
+ */
+struct MIDIDriverProfile {
+  struct MIDIDriverProfile * next;
+  void * thread;
+  int sending;
+  struct MIDIDriverProfilingStats stats;
+};
+
+static unsigned long _profile_ids = 0;
+
+/* The address of this variable identifies the thread. */
+static __thread char _profile_thread;
+
+/* Recently used profiles of this thread, indexed by driver profile id. */
+static __thread struct {
+  unsigned long id;
+  struct MIDIDriverProfile * profile;
+} _profile_cache[MIDI_DRIVER_PROFILE_CACHE];
+
+/**
+ * @brief Get a monotonic time in nanoseconds.
+ * @private @memberof MIDIDriver
+ * @return the current time.
+ */
+static unsigned long long _profile_now( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Get the profile of the calling thread.
+ * Look up the profile in the thread-local cache first, then in the
+ * driver's list. Create and prepend a new profile if the thread has
+ * none yet.
+ * @private @memberof MIDIDriver
+ * @param driver The driver.
+ * @return the profile or @c NULL if profiling is off or memory is short.
+ */
+static struct MIDIDriverProfile * _profile_get( struct MIDIDriver * driver ) {
+  unsigned long id = driver->profile_id;
+  size_t slot = id % MIDI_DRIVER_PROFILE_CACHE;
+  struct MIDIDriverProfile * profile;
+
+  if( ! ATOMIC_LOAD_RELAXED( &(driver->profiling) ) ) return NULL;
+  if( _profile_cache[slot].id == id ) return _profile_cache[slot].profile;
+
+  for( profile = ATOMIC_LOAD_ACQUIRE( &(driver->profiles) ); profile != NULL; profile = profile->next ) {
+    if( profile->thread == &_profile_thread ) break;
+  }
+  if( profile == NULL ) {
+    MIDIRealTimeCheck( MIDI_REALTIME_ALLOCATION );
+    profile = calloc( 1, sizeof( struct MIDIDriverProfile ) );
+    if( profile == NULL ) return NULL;
+    profile->thread = &_profile_thread;
+    profile->next   = ATOMIC_LOAD_RELAXED( &(driver->profiles) );
+    while( ! ATOMIC_CAS_WEAK( &(driver->profiles), &(profile->next), profile ) );
+  }
+  _profile_cache[slot].id      = id;
+  _profile_cache[slot].profile = profile;
+  return profile;
+}
+
+/**
+ * @brief Get the histogram bucket of a value.
+ * @private @memberof MIDIDriver
+ * @param value The value.
+ * @return the bucket index.
+ */
+static size_t _histogram_bucket( unsigned long long value ) {
+  size_t e, bucket;
+  if( value < 8 ) return value;
+  e = 63 - __builtin_clzll( value );
+  bucket = ( e - 2 ) * 8 + ( ( value >> ( e - 3 ) ) & 7 );
+  return ( bucket < MIDI_DRIVER_HISTOGRAM_BUCKETS ) ? bucket : MIDI_DRIVER_HISTOGRAM_BUCKETS - 1;
+}
+
+/**
+ * @brief Get the smallest value that falls into a histogram bucket.
+ * @private @memberof MIDIDriver
+ * @param bucket The bucket index.
+ * @return the lower bound of the bucket.
+ */
+static unsigned long long _histogram_value( size_t bucket ) {
+  if( bucket < 8 ) return bucket;
+  return (unsigned long long) ( 8 + bucket % 8 ) << ( bucket / 8 - 1 );
+}
+
+static void _histogram_record( struct MIDIDriverHistogram * histogram, unsigned long long value ) {
+  size_t bucket = _histogram_bucket( value );
+  PROFILE_ADD( &(histogram->count), 1 );
+  PROFILE_ADD( &(histogram->total), value );
+  PROFILE_ADD( &(histogram->buckets[bucket]), 1 );
+  if( value > histogram->max ) {
+    ATOMIC_STORE_RELAXED( &(histogram->max), value );
+  }
+}
+
+static void _histogram_merge( struct MIDIDriverHistogram * histogram, struct MIDIDriverHistogram * other ) {
+  unsigned long long max = ATOMIC_LOAD_RELAXED( &(other->max) );
+  size_t i;
+  histogram->count += ATOMIC_LOAD_RELAXED( &(other->count) );
+  histogram->total += ATOMIC_LOAD_RELAXED( &(other->total) );
+  if( max > histogram->max ) histogram->max = max;
+  for( i=0; i<MIDI_DRIVER_HISTOGRAM_BUCKETS; i++ ) {
+    histogram->buckets[i] += ATOMIC_LOAD_RELAXED( &(other->buckets[i]) );
+  }
+}
+
+/**
+ * @brief Record the delay between the timestamp of a message and now.
+ * Messages without a timestamp are not recorded, messages that are
+ * early count as zero delay.
+ * @private @memberof MIDIDriver
+ * @param driver    The driver.
+ * @param histogram The histogram to record the delay in microseconds.
+ * @param timestamp The timestamp of the message.
+ */
+static void _profile_latency( struct MIDIDriver * driver, struct MIDIDriverHistogram * histogram,
+                              MIDITimestamp timestamp ) {
+  MIDITimestamp now = 0;
+  MIDISamplingRate rate = 0;
+
+  if( timestamp == 0 || driver->clock == NULL ) return;
+  MIDIClockGetNow( driver->clock, &now );
+  MIDIClockGetSamplingRate( driver->clock, &rate );
+  if( rate == 0 ) return;
+  _histogram_record( histogram, ( now > timestamp ) ? (double) ( now - timestamp ) * 1000000 / rate : 0 );
+}
+
+/**
+ * @brief Pass a message to the implementation.
+ * @private @memberof MIDIDriver
+ * @param driver  The driver.
+ * @param message The message.
+ * @retval 0 on success.
+ */
+static int _driver_send( struct MIDIDriver * driver, struct MIDIMessage * message ) {
+  struct MIDIDriverProfile * profile;
+  unsigned long long start;
+  MIDITimestamp timestamp = 0;
+  size_t size = 0;
+  int result;
+
+  if( driver->send == NULL ) return 0;
+  if( ( profile = _profile_get( driver ) ) == NULL ) {
+    return (*driver->send)( driver, message );
+  }
+
+  MIDIMessageGetTimestamp( message, &timestamp );
+  _profile_latency( driver, &(profile->stats.latency_out), timestamp );
+  profile->sending++;
+  start  = _profile_now();
+  result = (*driver->send)( driver, message );
+  PROFILE_ADD( &(profile->stats.encode_time), _profile_now() - start );
+  profile->sending--;
+  MIDIMessageGetSize( message, &size );
+  PROFILE_ADD( &(profile->stats.messages_out), 1 );
+  PROFILE_ADD( &(profile->stats.bytes_out), size );
+  return result;
+}
+
+static int _port_receive( void * target, void * source, struct MIDITypeSpec * type, void * object );
+static int _port_receive_batch( struct MIDIDriver * driver, void * source, struct MIDIPortBatch * batch );
+
+/**
+ * @brief Get the size of a packed message on the wire.
+ * @private @memberof MIDIDriver
+ * @param packed The packed message.
+ * @return the size in bytes.
+ */
+static size_t _packed_size( struct MIDIPackedMessage * packed ) {
+  struct MIDIMessage * message;
+  size_t size = 0;
+  if( packed->status == MIDI_STATUS_SYSTEM_EXCLUSIVE ) {
+    if( MIDIPackedMessageGetSysex( packed, &message ) == 0 ) MIDIMessageGetSize( message, &size );
+  } else if( MIDIMessageFormatGetDataLength( packed->status, &size ) == 0 ) {
+    size++;
+  }
+  return size;
+}
+
+/**
+ * @brief Receive packed messages on the port.
+ * Driver implementations send MIDIMessage objects, so every packed
+ * message is unpacked and passed on like a message received on the port.
+ * @private @memberof MIDIDriver
+ * @param driver The driver.
+ * @param source The source that sent the messages.
+ * @param array  The packed messages.
+ * @retval 0 on success.
+ * @retval >0 if any message could not be sent.
+ */
+static int _port_receive_packed( struct MIDIDriver * driver, void * source, struct MIDIPackedMessageArray * array ) {
+  struct MIDIMessage * message;
+  size_t i;
+  int result = 0;
+
+  for( i=0; i<array->count; i++ ) {
+    if( MIDIPackedMessageToMessage( &(array->messages[i]), &message ) ) {
+      result++;
+      continue;
+    }
+    result += _port_receive( driver, source, MIDIMessageType, message );
+    MIDIMessageRelease( message );
+  }
+  return result;
+}
+
+/**
+ * @brief Pass several messages to the implementation.
+ * Use the implementation's @c send_batch callback if there is one so
+ * that it can encode all messages at once, fall back to sending the
+ * messages one by one otherwise.
+ * @private @memberof MIDIDriver
+ * @param driver   The driver.
+ * @param count    The number of messages.
+ * @param messages The messages.
+ * @retval 0 on success.
+ */
+static int _driver_send_batch( struct MIDIDriver * driver, size_t count, struct MIDIMessage ** messages ) {
+  struct MIDIDriverProfile * profile;
+  unsigned long long start, bytes = 0;
+  MIDITimestamp timestamp;
+  size_t i, size;
+  int result = 0;
+
+  if( driver->send_batch == NULL ) {
+    for( i=0; i<count; i++ ) {
+      result += _driver_send( driver, messages[i] );
+    }
+    return result;
+  }
+  if( ( profile = _profile_get( driver ) ) == NULL ) {
+    return (*driver->send_batch)( driver, count, messages );
+  }
+
+  for( i=0; i<count; i++ ) {
+    timestamp = 0;
+    size      = 0;
+    MIDIMessageGetTimestamp( messages[i], &timestamp );
+    _profile_latency( driver, &(profile->stats.latency_out), timestamp );
+    MIDIMessageGetSize( messages[i], &size );
+    bytes += size;
+  }
+  profile->sending++;
+  start  = _profile_now();
+  result = (*driver->send_batch)( driver, count, messages );
+  PROFILE_ADD( &(profile->stats.encode_time), _profile_now() - start );
+  profile->sending--;
+  PROFILE_ADD( &(profile->stats.messages_out), count );
+  PROFILE_ADD( &(profile->stats.bytes_out), bytes );
+  return result;
+}
+
 /**
  * @brief Port callback.
  * This may be confusing at first but when the driver <b>receives</b>
@@ -71,14 +348,63 @@
  */
 static int _port_receive( void * target, void * source, struct MIDITypeSpec * type, void * object ) {
   struct MIDIDriver * driver = target;
+  struct MIDIDriverProfile * profile;
+  size_t length = 0;
+  int result;
 
-  if( type == MIDIMessageType && driver->send != NULL ) {
-    return (*driver->send)( driver, object );
+  if( type == MIDIMessageType && driver->scheduler != NULL ) {
+    result = MIDISchedulerSchedule( driver->scheduler, object );
+    if( ( profile = _profile_get( driver ) ) != NULL ) {
+      MIDISchedulerGetLength( driver->scheduler, &length );
+      _histogram_record( &(profile->stats.queue_depth), length );
+    }
+    return result;
+  } else if( type == MIDIMessageType ) {
+    return _driver_send( driver, object );
+  } else if( type == MIDIPackedMessageArrayType ) {
+    return _port_receive_packed( driver, source, object );
+  } else if( type == MIDIPortBatchType ) {
+    return _port_receive_batch( driver, source, object );
   } else {
     return 0;
   }
 }
 
+/**
+ * @brief Receive a batch of objects on the port.
+ * Batches of messages go to the implementation at once unless they
+ * have to be scheduled, other batches are split into their objects.
+ * @private @memberof MIDIDriver
+ * @param driver The driver.
+ * @param source The source that sent the batch.
+ * @param batch  The batch.
+ * @retval 0 on success.
+ */
+static int _port_receive_batch( struct MIDIDriver * driver, void * source, struct MIDIPortBatch * batch ) {
+  size_t i;
+  int result = 0;
+
+  if( batch->type == MIDIMessageType && driver->scheduler == NULL ) {
+    return _driver_send_batch( driver, batch->count, (struct MIDIMessage **) batch->objects );
+  }
+  for( i=0; i<batch->count; i++ ) {
+    result += _port_receive( driver, source, batch->type, batch->objects[i] );
+  }
+  return result;
+}
+
+/**
+ * @brief Scheduler callback.
+ * Pass a message that became due to the implementation.
+ * @private @memberof MIDIDriver
+ * @param info    The driver.
+ * @param message The message.
+ * @retval 0 on success.
+ */
+static int _scheduler_deliver( void * info, struct MIDIMessage * message ) {
+  return _driver_send( info, message );
+}
+
 /** 
  * @}
  * @endcond
@@ -118,21 +444,35 @@ void MIDIDriverInit( struct MIDIDriver * driver, char * name, MIDISamplingRate r
 
   driver->refs  = 1;
   driver->rls   = NULL;
-  driver->port  = MIDIPortCreate( name, MIDI_PORT_IN | MIDI_PORT_OUT, driver, &_port_receive );
+  driver->port  = MIDIPortCreate( name, MIDI_PORT_IN | MIDI_PORT_OUT | MIDI_PORT_BATCH, driver, &_port_receive );
   driver->clock = MIDIClockProvide( rate );
+  driver->scheduler = NULL;
+  driver->profiling  = 0;
+  driver->profile_id = ATOMIC_ADD_FETCH( &_profile_ids, 1 );
+  driver->profiles   = NULL;
 
-  driver->send    = NULL;
-  driver->destroy = NULL;
+  driver->send       = NULL;
+  driver->send_batch = NULL;
+  driver->destroy    = NULL;
 }
 
 /**
  * @brief Destroy a MIDIDriver instance.
  * Free all resources occupied by the driver and release all referenced objects.
+ * Messages that are still held back by the scheduler are sent first.
  * @public @memberof MIDIDriver
  * @param driver The driver.
  */
 void MIDIDriverDestroy( struct MIDIDriver * driver ) {
+  struct MIDIDriverProfile * profile;
   MIDIPrecondReturn( driver != NULL, EFAULT, (void)0 );
+  /* send pending note offs while the implementation is still alive */
+  MIDIDriverStopScheduling( driver );
+  while( driver->profiles != NULL ) {
+    profile = driver->profiles;
+    driver->profiles = profile->next;
+    free( profile );
+  }
   if( driver->destroy != NULL ) {
     (*driver->destroy)( driver );
   }
@@ -156,7 +496,7 @@ void MIDIDriverDestroy( struct MIDIDriver * driver ) {
  */
 void MIDIDriverRetain( struct MIDIDriver * driver ) {
   MIDIPrecondReturn( driver != NULL, EFAULT, (void)0 );
-  driver->refs++;
+  MIDI_REFS_RETAIN( driver->refs );
 }
 
 /**
@@ -168,7 +508,7 @@ void MIDIDriverRetain( struct MIDIDriver * driver ) {
  */
 void MIDIDriverRelease( struct MIDIDriver * driver ) {
   MIDIPrecondReturn( driver != NULL, EFAULT, (void)0 );
-  if( ! --driver->refs ) {
+  if( MIDI_REFS_RELEASE( driver->refs ) == 0 ) {
     MIDIDriverDestroy( driver );
   }
 }
@@ -234,9 +574,27 @@ int MIDIDriverMakeLoopback( struct MIDIDriver * driver ) {
  * @retval >0 if the message could not be relayed.
  */
 int MIDIDriverReceive( struct MIDIDriver * driver, struct MIDIMessage * message ) {
+  struct MIDIDriverProfile * profile;
+  unsigned long long start;
+  MIDITimestamp timestamp = 0;
+  size_t size = 0;
+  int result;
   MIDIPrecond( driver != NULL, EFAULT );
   MIDIPrecond( message != NULL, EINVAL );
-  return MIDIPortSend( driver->port, MIDIMessageType, message );
+
+  if( ( profile = _profile_get( driver ) ) == NULL ) {
+    return MIDIPortSend( driver->port, MIDIMessageType, message );
+  }
+
+  MIDIMessageGetTimestamp( message, &timestamp );
+  _profile_latency( driver, &(profile->stats.latency_in), timestamp );
+  start  = _profile_now();
+  result = MIDIPortSend( driver->port, MIDIMessageType, message );
+  PROFILE_ADD( &(profile->stats.fanout_time), _profile_now() - start );
+  MIDIMessageGetSize( message, &size );
+  PROFILE_ADD( &(profile->stats.messages_in), 1 );
+  PROFILE_ADD( &(profile->stats.bytes_in), size );
+  return result;
 }
 
 /**
@@ -256,6 +614,129 @@ int MIDIDriverSend( struct MIDIDriver * driver, struct MIDIMessage * message ) {
   return MIDIPortReceive( driver->port, MIDIMessageType, message );
 }
 
+/**
+ * @brief Receive several MIDIMessages at once.
+ * Relay the messages as one MIDIPortBatch via all attached receiving
+ * ports. This should be called by driver implementations that decode
+ * several messages from one packet.
+ * @public @memberof MIDIDriver
+ * @param driver   The driver.
+ * @param count    The number of messages.
+ * @param messages The messages.
+ * @retval 0  on success.
+ * @retval >0 if the messages could not be relayed.
+ */
+int MIDIDriverReceiveBatch( struct MIDIDriver * driver, size_t count, struct MIDIMessage ** messages ) {
+  struct MIDIDriverProfile * profile;
+  unsigned long long start, bytes = 0;
+  MIDITimestamp timestamp;
+  size_t i, size;
+  int result;
+  MIDIPrecond( driver != NULL, EFAULT );
+  MIDIPrecond( messages != NULL || count == 0, EINVAL );
+
+  if( ( profile = _profile_get( driver ) ) == NULL ) {
+    return MIDIPortSendBatch( driver->port, MIDIMessageType, count, (void **) messages );
+  }
+
+  for( i=0; i<count; i++ ) {
+    timestamp = 0;
+    size      = 0;
+    MIDIMessageGetTimestamp( messages[i], &timestamp );
+    _profile_latency( driver, &(profile->stats.latency_in), timestamp );
+    MIDIMessageGetSize( messages[i], &size );
+    bytes += size;
+  }
+  start  = _profile_now();
+  result = MIDIPortSendBatch( driver->port, MIDIMessageType, count, (void **) messages );
+  PROFILE_ADD( &(profile->stats.fanout_time), _profile_now() - start );
+  PROFILE_ADD( &(profile->stats.messages_in), count );
+  PROFILE_ADD( &(profile->stats.bytes_in), bytes );
+  return result;
+}
+
+/**
+ * @brief Send several MIDIMessages at once.
+ * Pass the messages as one MIDIPortBatch through the port to the
+ * implementation. Implementations with a @c send_batch callback get
+ * all messages in one call, e.g. to encode them into one packet.
+ * @public @memberof MIDIDriver
+ * @param driver   The driver.
+ * @param count    The number of messages.
+ * @param messages The messages.
+ * @retval 0  on success.
+ * @retval >0 if any message could not be sent.
+ */
+int MIDIDriverSendBatch( struct MIDIDriver * driver, size_t count, struct MIDIMessage ** messages ) {
+  struct MIDIPortBatch batch;
+  MIDIPrecond( driver != NULL, EFAULT );
+  MIDIPrecond( messages != NULL || count == 0, EINVAL );
+  batch.type    = MIDIMessageType;
+  batch.count   = count;
+  batch.objects = (void **) messages;
+  return MIDIPortReceive( driver->port, MIDIPortBatchType, &batch );
+}
+
+/**
+ * @brief Receive an array of packed messages.
+ * Relay the whole array via all attached receiving ports at once.
+ * Driver implementations can call this instead of MIDIDriverReceive
+ * when they decode several messages from one packet.
+ * @public @memberof MIDIDriver
+ * @param driver   The driver.
+ * @param count    The number of messages.
+ * @param messages The messages.
+ * @retval 0  on success.
+ * @retval >0 if the messages could not be relayed.
+ */
+int MIDIDriverReceivePacked( struct MIDIDriver * driver, size_t count, struct MIDIPackedMessage * messages ) {
+  struct MIDIPackedMessageArray array;
+  struct MIDIDriverProfile * profile;
+  unsigned long long start, size = 0;
+  size_t i;
+  int result;
+  MIDIPrecond( driver != NULL, EFAULT );
+  MIDIPrecond( messages != NULL || count == 0, EINVAL );
+
+  array.count    = count;
+  array.messages = messages;
+  if( ( profile = _profile_get( driver ) ) == NULL ) {
+    return MIDIPortSend( driver->port, MIDIPackedMessageArrayType, &array );
+  }
+
+  for( i=0; i<count; i++ ) {
+    _profile_latency( driver, &(profile->stats.latency_in), messages[i].timestamp );
+    size += _packed_size( &(messages[i]) );
+  }
+  start  = _profile_now();
+  result = MIDIPortSend( driver->port, MIDIPackedMessageArrayType, &array );
+  PROFILE_ADD( &(profile->stats.fanout_time), _profile_now() - start );
+  PROFILE_ADD( &(profile->stats.messages_in), count );
+  PROFILE_ADD( &(profile->stats.bytes_in), size );
+  return result;
+}
+
+/**
+ * @brief Send an array of packed messages.
+ * Pass the messages through the port to the implementation. Every
+ * message is handed to the implementation's @c send callback as a
+ * MIDIMessage.
+ * @public @memberof MIDIDriver
+ * @param driver   The driver.
+ * @param count    The number of messages.
+ * @param messages The messages.
+ * @retval 0  on success.
+ * @retval >0 if any message could not be sent.
+ */
+int MIDIDriverSendPacked( struct MIDIDriver * driver, size_t count, struct MIDIPackedMessage * messages ) {
+  struct MIDIPackedMessageArray array;
+  MIDIPrecond( driver != NULL, EFAULT );
+  MIDIPrecond( messages != NULL || count == 0, EINVAL );
+  array.count    = count;
+  array.messages = messages;
+  return MIDIPortReceive( driver->port, MIDIPackedMessageArrayType, &array );
+}
+
 /**
  * @brief Trigger an event that occured in the driver implementation.
  * @public @memberof MIDIDriver
@@ -270,3 +751,233 @@ int MIDIDriverTriggerEvent( struct MIDIDriver * driver, struct MIDIEvent * event
 }
 
 /** @} */
+
+/* MARK: Scheduling *//**
+ * @name Scheduling
+ * Holding back messages until their timestamp is due.
+ * @{
+ */
+
+/**
+ * @brief Start holding back messages with future timestamps.
+ * Messages that the driver port receives are passed to a MIDIScheduler
+ * that delivers them to the implementation when their timestamp is due
+ * on the driver clock. The scheduler uses the runloop source of the
+ * driver, drivers without one have to add the source returned by
+ * MIDISchedulerGetRunloopSource to a runloop.
+ * @public @memberof MIDIDriver
+ * @param driver The driver.
+ * @retval 0  on success.
+ * @retval >0 if the scheduler could not be created.
+ */
+int MIDIDriverStartScheduling( struct MIDIDriver * driver ) {
+  struct MIDISchedulerDelegate delegate = { driver, &_scheduler_deliver };
+  MIDIPrecond( driver != NULL, EFAULT );
+  if( driver->scheduler != NULL ) return 0;
+  driver->scheduler = MIDISchedulerCreate( driver->clock, driver->rls, &delegate );
+  return ( driver->scheduler == NULL ) ? 1 : 0;
+}
+
+/**
+ * @brief Get the scheduler of the driver.
+ * @public @memberof MIDIDriver
+ * @param driver    The driver.
+ * @param scheduler The scheduler or @c NULL if scheduling was not started.
+ * @retval 0  on success.
+ */
+int MIDIDriverGetScheduler( struct MIDIDriver * driver, struct MIDIScheduler ** scheduler ) {
+  MIDIPrecond( driver != NULL, EFAULT );
+  MIDIPrecond( scheduler != NULL, EINVAL );
+  *scheduler = driver->scheduler;
+  return 0;
+}
+
+/**
+ * @brief Stop holding back messages.
+ * Messages that are still waiting are sent immediately, so that no
+ * note off messages get lost.
+ * @public @memberof MIDIDriver
+ * @param driver The driver.
+ * @retval 0  on success.
+ * @retval >0 if the waiting messages could not be sent.
+ */
+int MIDIDriverStopScheduling( struct MIDIDriver * driver ) {
+  struct MIDIScheduler * scheduler;
+  int result;
+  MIDIPrecond( driver != NULL, EFAULT );
+  if( driver->scheduler == NULL ) return 0;
+  scheduler = driver->scheduler;
+  driver->scheduler = NULL;
+  result = MIDISchedulerFlush( scheduler );
+  MIDISchedulerRelease( scheduler );
+  return result;
+}
+
+/** @} */
+
+/* MARK: Profiling *//**
+ * @name Profiling
+ * Measuring throughput, processing time and latency of a driver.
+ * Recording is cheap enough to stay enabled in production: every thread
+ * counts into its own profile without taking locks and the statistics
+ * are only summed up when they are requested.
+ * @{
+ */
+
+/**
+ * @brief Start recording profiling statistics.
+ * If profiling was not running, all statistics are reset first.
+ * Statistics that are recorded by other threads while profiling is
+ * started may be lost.
+ * @public @memberof MIDIDriver
+ * @param driver The driver.
+ * @retval 0 on success.
+ */
+int MIDIDriverStartProfiling( struct MIDIDriver * driver ) {
+  struct MIDIDriverProfile * profile;
+  MIDIPrecond( driver != NULL, EFAULT );
+  if( ATOMIC_LOAD_RELAXED( &(driver->profiling) ) ) return 0;
+  for( profile = ATOMIC_LOAD_ACQUIRE( &(driver->profiles) ); profile != NULL; profile = profile->next ) {
+    memset( &(profile->stats), 0, sizeof( struct MIDIDriverProfilingStats ) );
+  }
+  ATOMIC_STORE_RELAXED( &(driver->profiling), 1 );
+  return 0;
+}
+
+/**
+ * @brief Get the profiling statistics.
+ * Sum up the statistics of all threads that used the driver since
+ * profiling was started. The statistics stay available after profiling
+ * was stopped.
+ * @public @memberof MIDIDriver
+ * @param driver The driver.
+ * @param stats  The statistics.
+ * @retval 0 on success.
+ */
+int MIDIDriverGetProfilingStats( struct MIDIDriver * driver, struct MIDIDriverProfilingStats * stats ) {
+  struct MIDIDriverProfile * profile;
+  struct MIDIDriverProfilingStats * other;
+  MIDIPrecond( driver != NULL, EFAULT );
+  MIDIPrecond( stats != NULL, EINVAL );
+
+  memset( stats, 0, sizeof( struct MIDIDriverProfilingStats ) );
+  for( profile = ATOMIC_LOAD_ACQUIRE( &(driver->profiles) ); profile != NULL; profile = profile->next ) {
+    other = &(profile->stats);
+    stats->messages_in  += ATOMIC_LOAD_RELAXED( &(other->messages_in) );
+    stats->messages_out += ATOMIC_LOAD_RELAXED( &(other->messages_out) );
+    stats->bytes_in     += ATOMIC_LOAD_RELAXED( &(other->bytes_in) );
+    stats->bytes_out    += ATOMIC_LOAD_RELAXED( &(other->bytes_out) );
+    stats->encode_time  += ATOMIC_LOAD_RELAXED( &(other->encode_time) );
+    stats->decode_time  += ATOMIC_LOAD_RELAXED( &(other->decode_time) );
+    stats->fanout_time  += ATOMIC_LOAD_RELAXED( &(other->fanout_time) );
+    _histogram_merge( &(stats->queue_depth), &(other->queue_depth) );
+    _histogram_merge( &(stats->latency_in), &(other->latency_in) );
+    _histogram_merge( &(stats->latency_out), &(other->latency_out) );
+  }
+  return 0;
+}
+
+/**
+ * @brief Stop recording profiling statistics.
+ * @public @memberof MIDIDriver
+ * @param driver The driver.
+ * @retval 0 on success.
+ */
+int MIDIDriverStopProfiling( struct MIDIDriver * driver ) {
+  MIDIPrecond( driver != NULL, EFAULT );
+  ATOMIC_STORE_RELAXED( &(driver->profiling), 0 );
+  return 0;
+}
+
+/**
+ * @brief Get a percentile of the values recorded in a histogram.
+ * The result is the upper bound of the bucket that holds the percentile,
+ * so it overestimates the exact value by less than 1/8.
+ * @public @memberof MIDIDriver
+ * @param histogram  The histogram.
+ * @param percentile The percentile between 0 and 100.
+ * @param value      The value below which @c percentile percent of the
+ *                   recorded values are.
+ * @retval 0 on success.
+ */
+int MIDIDriverHistogramGetPercentile( struct MIDIDriverHistogram * histogram, double percentile,
+                                      unsigned long long * value ) {
+  unsigned long count = 0, rank;
+  size_t i;
+  MIDIPrecond( histogram != NULL, EFAULT );
+  MIDIPrecond( percentile >= 0 && percentile <= 100, EINVAL );
+  MIDIPrecond( value != NULL, EINVAL );
+
+  *value = 0;
+  if( histogram->count == 0 ) return 0;
+  rank = percentile * histogram->count / 100;
+  if( rank < 1 ) rank = 1;
+  for( i=0; i<MIDI_DRIVER_HISTOGRAM_BUCKETS-1; i++ ) {
+    count += histogram->buckets[i];
+    if( count >= rank ) break;
+  }
+  *value = ( i < MIDI_DRIVER_HISTOGRAM_BUCKETS-1 ) ? _histogram_value( i+1 ) - 1 : histogram->max;
+  if( *value > histogram->max ) *value = histogram->max;
+  return 0;
+}
+
+/**
+ * @brief Get a start time for the time profiling of an implementation.
+ * @private @memberof MIDIDriver
+ * @param driver The driver.
+ * @return the current time in nanoseconds or 0 if profiling is off.
+ */
+unsigned long long MIDIDriverProfileTime( struct MIDIDriver * driver ) {
+  MIDIPrecondReturn( driver != NULL, EFAULT, 0 );
+  return ATOMIC_LOAD_RELAXED( &(driver->profiling) ) ? _profile_now() : 0;
+}
+
+/**
+ * @brief Record the time the implementation spent encoding messages.
+ * Time spent inside the @c send callback is already recorded by the
+ * driver interface and is not counted twice.
+ * @private @memberof MIDIDriver
+ * @param driver The driver.
+ * @param start  The time returned by MIDIDriverProfileTime before encoding.
+ * @retval 0 on success.
+ */
+int MIDIDriverProfileEncode( struct MIDIDriver * driver, unsigned long long start ) {
+  struct MIDIDriverProfile * profile;
+  MIDIPrecond( driver != NULL, EFAULT );
+  if( start == 0 || ( profile = _profile_get( driver ) ) == NULL || profile->sending ) return 0;
+  PROFILE_ADD( &(profile->stats.encode_time), _profile_now() - start );
+  return 0;
+}
+
+/**
+ * @brief Record the time the implementation spent decoding messages.
+ * @private @memberof MIDIDriver
+ * @param driver The driver.
+ * @param start  The time returned by MIDIDriverProfileTime before decoding.
+ * @retval 0 on success.
+ */
+int MIDIDriverProfileDecode( struct MIDIDriver * driver, unsigned long long start ) {
+  struct MIDIDriverProfile * profile;
+  MIDIPrecond( driver != NULL, EFAULT );
+  if( start == 0 || ( profile = _profile_get( driver ) ) == NULL ) return 0;
+  PROFILE_ADD( &(profile->stats.decode_time), _profile_now() - start );
+  return 0;
+}
+
+/**
+ * @brief Record the length of a queue of the implementation.
+ * Call this whenever a message was queued for sending.
+ * @private @memberof MIDIDriver
+ * @param driver The driver.
+ * @param length The number of messages waiting in the queue.
+ * @retval 0 on success.
+ */
+int MIDIDriverProfileQueue( struct MIDIDriver * driver, size_t length ) {
+  struct MIDIDriverProfile * profile;
+  MIDIPrecond( driver != NULL, EFAULT );
+  if( ( profile = _profile_get( driver ) ) == NULL ) return 0;
+  _histogram_record( &(profile->stats.queue_depth), length );
+  return 0;
+}
+
+/** @} */
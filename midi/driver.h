@@ -5,6 +5,8 @@
 struct MIDIPort;
 struct MIDIEvent;
 struct MIDIMessage;
+struct MIDIPackedMessage;
+struct MIDIScheduler;
 
 struct MIDIDriver;
 
@@ -12,16 +14,48 @@ struct MIDIDriver;
 #define MIDI_DRIVER_WILL_RECEIVE_MESSAGE 1
 #define MIDI_DRIVER_NUM_EVENT_TYPES 2
 
+/**
+ * The number of buckets of a MIDIDriverHistogram. Values below 8 get a
+ * bucket each, every following power of two is split into 8 buckets.
+ */
+#define MIDI_DRIVER_HISTOGRAM_BUCKETS 256
+
+struct MIDIDriverHistogram {
+  unsigned long count;       /**< The number of recorded values */
+  unsigned long long total;  /**< The sum of the recorded values */
+  unsigned long long max;    /**< The largest recorded value */
+  unsigned long buckets[MIDI_DRIVER_HISTOGRAM_BUCKETS];
+};
+
+struct MIDIDriverProfilingStats {
+  unsigned long messages_in;        /**< The number of messages passed to the port */
+  unsigned long messages_out;       /**< The number of messages passed to the implementation */
+  unsigned long long bytes_in;      /**< The size of the received messages in bytes */
+  unsigned long long bytes_out;     /**< The size of the sent messages in bytes */
+  unsigned long long encode_time;   /**< The time spent sending in the implementation in nanoseconds */
+  unsigned long long decode_time;   /**< The time spent decoding in the implementation in nanoseconds */
+  unsigned long long fanout_time;   /**< The time spent passing received messages to the port in nanoseconds */
+  struct MIDIDriverHistogram queue_depth; /**< The number of waiting messages, sampled per queued message */
+  struct MIDIDriverHistogram latency_in;  /**< The delay from timestamp to port in microseconds */
+  struct MIDIDriverHistogram latency_out; /**< The delay from timestamp to implementation in microseconds */
+};
+
 #ifdef MIDI_DRIVER_INTERNALS
 struct MIDIRunloopSource;
 struct MIDIClock;
+struct MIDIDriverProfile;
 
 struct MIDIDriver {
   size_t refs;
   struct MIDIRunloopSource * rls;
   struct MIDIPort * port;
   struct MIDIClock * clock;
+  struct MIDIScheduler * scheduler;
+  int profiling;
+  unsigned long profile_id;
+  struct MIDIDriverProfile * profiles;
   int (*send)( struct MIDIDriver * driver, struct MIDIMessage * message );
+  int (*send_batch)( struct MIDIDriver * driver, size_t count, struct MIDIMessage ** messages );
   void (*destroy)( struct MIDIDriver * driver );
 };
 #endif
@@ -38,10 +72,28 @@ int MIDIDriverGetPort( struct MIDIDriver * driver, struct MIDIPort ** port );
 
 int MIDIDriverSend( struct MIDIDriver * driver, struct MIDIMessage * message );
 int MIDIDriverReceive( struct MIDIDriver * driver, struct MIDIMessage * message );
+int MIDIDriverSendBatch( struct MIDIDriver * driver, size_t count, struct MIDIMessage ** messages );
+int MIDIDriverReceiveBatch( struct MIDIDriver * driver, size_t count, struct MIDIMessage ** messages );
+int MIDIDriverSendPacked( struct MIDIDriver * driver, size_t count, struct MIDIPackedMessage * messages );
+int MIDIDriverReceivePacked( struct MIDIDriver * driver, size_t count, struct MIDIPackedMessage * messages );
 int MIDIDriverTriggerEvent( struct MIDIDriver * driver, struct MIDIEvent * event );
 
+int MIDIDriverStartScheduling( struct MIDIDriver * driver );
+int MIDIDriverGetScheduler( struct MIDIDriver * driver, struct MIDIScheduler ** scheduler );
+int MIDIDriverStopScheduling( struct MIDIDriver * driver );
+
 int MIDIDriverStartProfiling( struct MIDIDriver * driver );
-int MIDIDriverGetProfilingStats( struct MIDIDriver * driver, void * stats );
+int MIDIDriverGetProfilingStats( struct MIDIDriver * driver, struct MIDIDriverProfilingStats * stats );
 int MIDIDriverStopProfiling( struct MIDIDriver * driver );
 
+int MIDIDriverHistogramGetPercentile( struct MIDIDriverHistogram * histogram, double percentile,
+                                      unsigned long long * value );
+
+#ifdef MIDI_DRIVER_INTERNALS
+unsigned long long MIDIDriverProfileTime( struct MIDIDriver * driver );
+int MIDIDriverProfileEncode( struct MIDIDriver * driver, unsigned long long start );
+int MIDIDriverProfileDecode( struct MIDIDriver * driver, unsigned long long start );
+int MIDIDriverProfileQueue( struct MIDIDriver * driver, size_t length );
+#endif
+
 #endif
@@ -4,6 +4,7 @@
 #include "event.h"
 #include "type.h"
 #include "midi.h"
+#include "realtime.h"
 
 /**
  * @ingroup MIDI
@@ -51,7 +52,10 @@ struct MIDIEvent * MIDIEventCreate( size_t id, void * info, char * message, ...
   void * buffer;
   size_t length, required;
   va_list vargs;
-  struct MIDIEvent * event = malloc( sizeof( struct MIDIEvent ) );
+  struct MIDIEvent * event;
+
+  MIDIRealTimeCheck( MIDI_REALTIME_ALLOCATION );
+  event = malloc( sizeof( struct MIDIEvent ) );
   MIDIPrecondReturn( event != NULL, ENOMEM, NULL );
 
   event->refs = 1;
@@ -1,15 +1,28 @@
 #include <stdlib.h>
 #include "midi.h"
 #include "list.h"
+#include "realtime.h"
 
-struct MIDIIterator;
+#define MIDI_LIST_INITIAL_CAPACITY 4
 
 /**
  * @ingroup MIDI
  * @brief A list of MIDI objects of a common type.
- * I realize that this a general purpose linked list and should not be
+ * I realize that this a general purpose list and should not be
  * restricted to MIDIKit use as the MIDI-prefix might indicate.
  * I will evaluate and extract general purpose code at a later point.
+ *
+ * The items are stored in a contiguous array. New items are appended, so
+ * MIDIListApply visits them in insertion order (the former linked list
+ * visited the most recently added item first). Removing an item moves the
+ * last item into the free slot, so the order of items is not preserved
+ * across removals.
+ * While the list is being applied, removed items leave an empty slot that
+ * is skipped and compacted when the outermost MIDIListApply returns.
+ *
+ * MIDIListRemove has to search for the item and is O(n). An applier that
+ * removes the item it was called with should use MIDIListRemoveCurrent,
+ * which uses the index of the current item and is O(1).
  * @todo allow iteration, assure ordering (insert before, insert after, etc.)
  */
 struct MIDIList {
@@ -19,8 +32,12 @@ struct MIDIList {
  */
   int    refs;
   struct MIDITypeSpec * type;
-  struct MIDIIterator * first;
-  struct MIDIIterator * last;
+  size_t length;
+  size_t capacity;
+  void ** items;
+  int    applying;
+  size_t holes;
+  size_t current;
 /** @endcond */
 };
 
@@ -30,11 +47,6 @@ struct MIDIList {
  * @{
  */
 
-struct MIDIIterator {
-  void * object;
-  struct MIDIIterator * next;
-};
-
 /**
  * @brief Use the callback to retain a list item.
  * @private @memberof MIDIList
@@ -61,6 +73,34 @@ static void _list_item_release( struct MIDIList * list, void * item ) {
   }
 }
 
+/**
+ * @brief Remove the item at the given index by moving the last item into its slot.
+ * @private @memberof MIDIList
+ * @param list  The list.
+ * @param index The index of the item to remove.
+ */
+static void _list_swap_remove( struct MIDIList * list, size_t index ) {
+  list->items[index] = list->items[--list->length];
+}
+
+/**
+ * @brief Remove the empty slots that were left by removals during apply.
+ * @private @memberof MIDIList
+ * @param list The list.
+ */
+static void _list_compact( struct MIDIList * list ) {
+  size_t i = 0;
+  while( list->holes > 0 && i < list->length ) {
+    if( list->items[i] == NULL ) {
+      _list_swap_remove( list, i );
+      list->holes--;
+    } else {
+      i++;
+    }
+  }
+  list->holes = 0;
+}
+
 /**
  * @}
  * @endcond
@@ -85,10 +125,14 @@ struct MIDIList * MIDIListCreate( struct MIDITypeSpec * type ) {
   struct MIDIList * list = malloc( sizeof( struct MIDIList ) );
   MIDIPrecondReturn( list != NULL, ENOMEM, NULL );
 
-  list->refs  = 1;
-  list->type  = type;
-  list->first = NULL;
-  list->last  = NULL;
+  list->refs     = 1;
+  list->type     = type;
+  list->length   = 0;
+  list->capacity = 0;
+  list->items    = NULL;
+  list->applying = 0;
+  list->holes    = 0;
+  list->current  = 0;
 
   return list;
 }
@@ -101,18 +145,12 @@ struct MIDIList * MIDIListCreate( struct MIDITypeSpec * type ) {
  * @param list The list.
  */
 void MIDIListDestroy( struct MIDIList * list ) {
-  struct MIDIIterator * entry;
-  struct MIDIIterator * next;
+  size_t i;
   MIDIPrecondReturn( list != NULL, EFAULT, (void)0 );
-  entry = list->first;
-  list->first = NULL;
-  list->last  = NULL;
-  while( entry != NULL ) {
-    next = entry->next;
-    _list_item_release( list, entry->object );
-    free( entry );
-    entry = next;
+  for( i=0; i<list->length; i++ ) {
+    _list_item_release( list, list->items[i] );
   }
+  free( list->items );
   free( list );
 }
 
@@ -124,7 +162,7 @@ void MIDIListDestroy( struct MIDIList * list ) {
  */
 void MIDIListRetain( struct MIDIList * list ) {
   MIDIPrecondReturn( list != NULL, EFAULT, (void)0 );
-  list->refs++;
+  MIDI_REFS_RETAIN( list->refs );
 }
 
 /**
@@ -136,7 +174,7 @@ void MIDIListRetain( struct MIDIList * list ) {
  */
 void MIDIListRelease( struct MIDIList * list ) {
   MIDIPrecondReturn( list != NULL, EFAULT, (void)0 );
-  if( ! --list->refs ) {
+  if( MIDI_REFS_RELEASE( list->refs ) == 0 ) {
     MIDIListDestroy( list );
   }
 }
@@ -159,22 +197,25 @@ void MIDIListRelease( struct MIDIList * list ) {
  * @retval >0 otherwise.
  */
 int MIDIListAdd( struct MIDIList * list, void * item ) {
-  struct MIDIIterator * entry;
+  void ** items;
+  size_t capacity;
   MIDIPrecond( list != NULL, EFAULT );
   MIDIPrecond( item != NULL, EINVAL );
 
-  entry = malloc( sizeof( struct MIDIIterator ) );
-  if( entry == NULL ) {
-    MIDIError( ENOMEM, "Failed to allocate space for iterator." );
+  if( list->length == list->capacity ) {
+    capacity = ( list->capacity > 0 ) ? list->capacity * 2 : MIDI_LIST_INITIAL_CAPACITY;
+    MIDIRealTimeCheck( MIDI_REALTIME_ALLOCATION );
+    items    = realloc( list->items, capacity * sizeof( void * ) );
+    if( items == NULL ) {
+      MIDIError( ENOMEM, "Failed to allocate space for list items." );
+      return ENOMEM;
+    }
+    list->items    = items;
+    list->capacity = capacity;
   }
 
-  entry->object = item;
-  entry->next   = list->first;
-  _list_item_retain( list, entry->object );
-  list->first   = entry;
-  if( list->last == NULL ) {
-    list->last = entry;
-  }
+  _list_item_retain( list, item );
+  list->items[list->length++] = item;
   return 0;
 }
 
@@ -188,30 +229,51 @@ int MIDIListAdd( struct MIDIList * list, void * item ) {
  * @retval >0 otherwise.
  */
 int MIDIListRemove( struct MIDIList * list, void * item ) {
-  struct MIDIIterator * entry;
-  struct MIDIIterator ** eptr;
+  size_t i = 0;
   MIDIPrecond( list != NULL, EFAULT );
   MIDIPrecond( item != NULL, EINVAL );
 
-  eptr  = &(list->first);
-  entry = list->first;
-  while( entry != NULL ) {
-    if( entry->object == item ) {
-      if( entry == list->last ) {
-        list->last = *eptr;
+  while( i < list->length ) {
+    if( list->items[i] == item ) {
+      if( list->applying ) {
+        list->items[i] = NULL;
+        list->holes++;
+        i++;
+      } else {
+        _list_swap_remove( list, i );
       }
-      _list_item_release( list, entry->object );
-      *eptr = entry->next;
-      free( entry );
-      entry = *eptr;
+      _list_item_release( list, item );
     } else {
-      eptr  = &(entry->next);
-      entry = entry->next;
+      i++;
     }
   }
   return 0;
 }
 
+/**
+ * @brief Remove the item that is currently applied from the list.
+ * Remove the item that was passed to the function given to MIDIListApply
+ * and release it. In contrast to MIDIListRemove the item is not searched,
+ * so this is O(1). Only call this from inside the applied function.
+ * @public @memberof MIDIList
+ * @param list The list.
+ * @retval 0 on success.
+ * @retval >0 otherwise.
+ */
+int MIDIListRemoveCurrent( struct MIDIList * list ) {
+  void * item;
+  MIDIPrecond( list != NULL, EFAULT );
+  MIDIPrecond( list->applying > 0, EINVAL );
+
+  item = list->items[list->current];
+  if( item != NULL ) {
+    list->items[list->current] = NULL;
+    list->holes++;
+    _list_item_release( list, item );
+  }
+  return 0;
+}
+
 /**
  * @brief Check if an item is contained inside the list.
  * Step through all items and check if any item has the given address.
@@ -223,13 +285,12 @@ int MIDIListRemove( struct MIDIList * list, void * item ) {
  * @retval >0 if an error occurred.
  */
 int MIDIListContains( struct MIDIList * list, void * item ) {
-  struct MIDIIterator * entry;
+  size_t i;
   MIDIPrecond( list != NULL, EFAULT );
   MIDIPrecond( item != NULL, EINVAL );
   
-  entry = list->first;
-  while( entry != NULL ) {
-    if( entry->object == item ) {
+  for( i=0; i<list->length; i++ ) {
+    if( list->items[i] == item ) {
       return 0;
     }
   }
@@ -249,14 +310,13 @@ int MIDIListContains( struct MIDIList * list, void * item ) {
  * @retval >0 if an error occurred.
  */
 int MIDIListFind( struct MIDIList * list, void ** item, void * info, int (*func)( void *, void *) ) {
-  struct MIDIIterator * entry;
+  size_t i;
   MIDIPrecond( list != NULL, EFAULT );
   MIDIPrecond( item != NULL, EINVAL );
   
-  entry = list->first;
-  while( entry != NULL ) {
-    if( (*func)( entry->object, info ) == 0 ) {
-      *item = entry->object;
+  for( i=0; i<list->length; i++ ) {
+    if( list->items[i] != NULL && (*func)( list->items[i], info ) == 0 ) {
+      *item = list->items[i];
       return 0;
     }
   }
@@ -276,20 +336,26 @@ int MIDIListFind( struct MIDIList * list, void ** item, void * info, int (*func)
  * @retval >0 otherwise.
  */
 int MIDIListApply( struct MIDIList * list, void * info, int (*func)( void *, void * ) ) {
-  struct MIDIIterator * entry;
+  size_t i, length, current;
   void * item;
   int result = 0;
   MIDIPrecond( list != NULL, EFAULT );
   MIDIPrecond( func != NULL, EINVAL );
 
-  entry = list->first;
-  while( entry != NULL ) {
-    item  = entry->object;
-    entry = entry->next;
+  list->applying++;
+  current = list->current;
+  length  = list->length;
+  for( i=0; i<length; i++ ) {
+    item = list->items[i];
     if( item != NULL ) {
+      list->current = i;
       result += (*func)( item, info );
     }
   }
+  list->current = current;
+  if( --list->applying == 0 && list->holes > 0 ) {
+    _list_compact( list );
+  }
   return result;
 }
 
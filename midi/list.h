@@ -11,6 +11,7 @@ void MIDIListRelease( struct MIDIList * list );
 
 int MIDIListAdd( struct MIDIList * list, void * item );
 int MIDIListRemove( struct MIDIList * list, void * item );
+int MIDIListRemoveCurrent( struct MIDIList * list );
 
 int MIDIListContains( struct MIDIList * list, void * item );
 int MIDIListFind( struct MIDIList * list, void ** item, void * info, int (*func)( void *, void *) );
@@ -1,6 +1,9 @@
 #include <stdlib.h>
+#include <pthread.h>
 #include "message.h"
 #include "message_format.h"
+#include "message_pool.h"
+#include "realtime.h"
 
 /**
  * @ingroup MIDI
@@ -13,6 +16,7 @@ struct MIDIMessage {
  * @cond INTERNALS
  */
   int    refs;
+  struct MIDIMessagePool * pool;
   struct MIDIMessageFormat * format;
   struct MIDIMessageData data;
   MIDITimestamp timestamp;
@@ -24,6 +28,13 @@ struct MIDIMessage {
  */
 MIDI_TYPE_SPEC_CODING( MIDIMessage, 0x4010 );
 
+/**
+ * @brief Declare the MIDIPackedMessageArray type specification.
+ * Arrays are only borrowed while they are passed through a port and
+ * are not reference counted.
+ */
+MIDI_TYPE_SPEC( MIDIPackedMessageArray, 0x4011, NULL, NULL, NULL, NULL );
+
 /* MARK: Internals *//**
  * @name Internals
  * @cond INTERNALS
@@ -39,11 +50,136 @@ MIDI_TYPE_SPEC_CODING( MIDIMessage, 0x4010 );
  */
 static void _check_release_data( struct MIDIMessage * message ) {
   if( message->data.data != NULL && ( message->data.bytes[3] & 1 ) ) {
-    free( message->data.data );
+    MIDIMessagePoolFreeData( message->data.data );
     message->data.data = NULL;
   }
 }
 
+/*
+ * System exclusive messages do not fit into a MIDIPackedMessage. They
+ * are kept in a table of retained messages instead and the packed
+ * message stores the index plus one in the low bits of the handle and
+ * the generation of the entry in the high bits. The generation changes
+ * whenever an entry is freed, so a stale handle does not resolve to a
+ * message that reused the entry. Free entries are chained through the
+ * refs field.
+ */
+struct MIDISysexHandle {
+  struct MIDIMessage * message;
+  unsigned int refs;
+  unsigned int generation;
+};
+
+#define SYSEX_INDEX_BITS 20
+#define SYSEX_INDEX_MASK ( ( 1u << SYSEX_INDEX_BITS ) - 1 )
+#define SYSEX_GENERATION_MASK ( ~0u >> SYSEX_INDEX_BITS )
+
+static pthread_mutex_t _sysex_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct MIDISysexHandle * _sysex_handles = NULL;
+static unsigned int _sysex_capacity = 0;
+static unsigned int _sysex_free = 0;
+
+/**
+ * @brief Find the table entry of a handle.
+ * Must be called with the lock held.
+ * @param handle The handle.
+ * @return the entry or @c NULL if the handle is not in use.
+ */
+static struct MIDISysexHandle * _sysex_entry( unsigned int handle ) {
+  unsigned int index = handle & SYSEX_INDEX_MASK;
+  struct MIDISysexHandle * entry;
+  if( index == 0 || index > _sysex_capacity ) return NULL;
+  entry = &(_sysex_handles[index-1]);
+  if( entry->message == NULL || entry->generation != ( handle >> SYSEX_INDEX_BITS ) ) return NULL;
+  return entry;
+}
+
+/**
+ * @brief Store a system exclusive message in the handle table.
+ * @param message The message. It is retained until the handle is released.
+ * @return the handle or zero if the table could not grow.
+ */
+static unsigned int _sysex_acquire( struct MIDIMessage * message ) {
+  struct MIDISysexHandle * handles;
+  unsigned int handle, capacity, i;
+
+  MIDIRealTimeCheck( MIDI_REALTIME_LOCK );
+  pthread_mutex_lock( &_sysex_lock );
+  if( _sysex_free == 0 ) {
+    capacity = ( _sysex_capacity == 0 ) ? 16 : _sysex_capacity * 2;
+    if( capacity > SYSEX_INDEX_MASK ) capacity = SYSEX_INDEX_MASK;
+    MIDIRealTimeCheck( MIDI_REALTIME_ALLOCATION );
+    handles  = ( capacity > _sysex_capacity )
+             ? realloc( _sysex_handles, capacity * sizeof( struct MIDISysexHandle ) ) : NULL;
+    if( handles == NULL ) {
+      pthread_mutex_unlock( &_sysex_lock );
+      return 0;
+    }
+    for( i=_sysex_capacity; i<capacity; i++ ) {
+      handles[i].message    = NULL;
+      handles[i].refs       = ( i+1 < capacity ) ? i+2 : 0;
+      handles[i].generation = 0;
+    }
+    _sysex_handles  = handles;
+    _sysex_free     = _sysex_capacity + 1;
+    _sysex_capacity = capacity;
+  }
+  i           = _sysex_free;
+  _sysex_free = _sysex_handles[i-1].refs;
+  _sysex_handles[i-1].message = message;
+  _sysex_handles[i-1].refs    = 1;
+  handle = ( _sysex_handles[i-1].generation << SYSEX_INDEX_BITS ) | i;
+  pthread_mutex_unlock( &_sysex_lock );
+  MIDIMessageRetain( message );
+  return handle;
+}
+
+/**
+ * @brief Look up a system exclusive message.
+ * @param handle The handle.
+ * @param retain Retain the message before the lock is dropped, so that
+ *               a concurrent release of the handle can not destroy it.
+ * @return the message or @c NULL if the handle is not in use.
+ */
+static struct MIDIMessage * _sysex_lookup( unsigned int handle, int retain ) {
+  struct MIDISysexHandle * entry;
+  struct MIDIMessage * message = NULL;
+  MIDIRealTimeCheck( MIDI_REALTIME_LOCK );
+  pthread_mutex_lock( &_sysex_lock );
+  if( ( entry = _sysex_entry( handle ) ) != NULL ) {
+    message = entry->message;
+    if( retain ) MIDIMessageRetain( message );
+  }
+  pthread_mutex_unlock( &_sysex_lock );
+  return message;
+}
+
+/**
+ * @brief Add or remove a reference to a handle.
+ * Release the message and put the entry on the free list when the
+ * last reference is removed.
+ * @param handle The handle.
+ * @param delta  +1 to add a reference, -1 to remove one.
+ */
+static void _sysex_update( unsigned int handle, int delta ) {
+  struct MIDISysexHandle * entry;
+  struct MIDIMessage * message = NULL;
+  MIDIRealTimeCheck( MIDI_REALTIME_LOCK );
+  pthread_mutex_lock( &_sysex_lock );
+  if( ( entry = _sysex_entry( handle ) ) != NULL ) {
+    entry->refs += delta;
+    if( entry->refs == 0 ) {
+      message = entry->message;
+      entry->message    = NULL;
+      entry->refs       = _sysex_free;
+      entry->generation = ( entry->generation + 1 ) & SYSEX_GENERATION_MASK;
+      _sysex_free = handle & SYSEX_INDEX_MASK;
+    }
+  }
+  pthread_mutex_unlock( &_sysex_lock );
+  if( message != NULL ) MIDIMessageRelease( message );
+}
+
 /**
  * @}
  * @endcond
@@ -59,6 +195,7 @@ static void _check_release_data( struct MIDIMessage * message ) {
 /**
  * @brief Create a MIDIMessage instance.
  * Allocate space and initialize a MIDIMessage instance.
+ * If a default message pool is set, the message is taken from the pool.
  * @public @memberof MIDIMessage
  * @param status The message status to be used for initialization.
  * @return a pointer to the created message structure on success.
@@ -66,6 +203,7 @@ static void _check_release_data( struct MIDIMessage * message ) {
  */
 struct MIDIMessage * MIDIMessageCreate( MIDIStatus status ) {
   struct MIDIMessage * message;
+  struct MIDIMessagePool * pool;
   struct MIDIMessageFormat * format = NULL;
   MIDITimestamp timestamp = 0;
   int i;
@@ -76,10 +214,18 @@ struct MIDIMessage * MIDIMessageCreate( MIDIStatus status ) {
       return NULL;
     }
   }
-  message = malloc( sizeof( struct MIDIMessage ) );
+  pool = MIDIMessagePoolGetDefault();
+  if( pool != NULL ) {
+    message = MIDIMessagePoolAllocMessage( pool );
+  } else {
+    MIDIRealTimeCheck( MIDI_REALTIME_ALLOCATION );
+    message = malloc( sizeof( struct MIDIMessage ) );
+  }
   MIDIPrecondReturn( message != NULL, ENOMEM, NULL );
+  if( pool != NULL ) MIDIMessagePoolRetain( pool );
 
   message->refs   = 1;
+  message->pool   = pool;
   message->format = format;
   for( i=1; i<MIDI_MESSAGE_DATA_BYTES; i++ ) {
     message->data.bytes[i] = 0;
@@ -100,9 +246,16 @@ struct MIDIMessage * MIDIMessageCreate( MIDIStatus status ) {
  * @param message The message.
  */
 void MIDIMessageDestroy( struct MIDIMessage * message ) {
+  struct MIDIMessagePool * pool;
   MIDIPrecondReturn( message != NULL, EFAULT, (void)0 );
-  if( message->data.data != NULL && ( message->data.bytes[3] & 1 ) ) free( message->data.data );
-  free( message );
+  _check_release_data( message );
+  if( message->pool != NULL ) {
+    pool = message->pool;
+    MIDIMessagePoolFreeMessage( pool, message );
+    MIDIMessagePoolRelease( pool );
+  } else {
+    free( message );
+  }
 }
 
 /**
@@ -113,7 +266,7 @@ void MIDIMessageDestroy( struct MIDIMessage * message ) {
  */
 void MIDIMessageRetain( struct MIDIMessage * message ) {
   MIDIPrecondReturn( message != NULL, EFAULT, (void)0 );
-  message->refs++;
+  MIDI_REFS_RETAIN( message->refs );
 }
 
 /**
@@ -125,11 +278,27 @@ void MIDIMessageRetain( struct MIDIMessage * message ) {
  */
 void MIDIMessageRelease( struct MIDIMessage * message ) {
   MIDIPrecondReturn( message != NULL, EFAULT, (void)0 );
-  if( ! --message->refs ) {
+  if( MIDI_REFS_RELEASE( message->refs ) == 0 ) {
     MIDIMessageDestroy( message );
   }
 }
 
+/**
+ * @brief Get the number of references to a MIDIMessage instance.
+ * Without -DMIDI_ATOMIC_REFS the count is only meaningful on the thread
+ * that owns all references.
+ * @public @memberof MIDIMessage
+ * @param message The message.
+ * @param refs    The number of references.
+ * @retval 0 on success.
+ */
+int MIDIMessageGetRefs( struct MIDIMessage * message, int * refs ) {
+  MIDIPrecond( message != NULL, EFAULT );
+  MIDIPrecond( refs != NULL, EINVAL );
+  *refs = MIDI_REFS_GET( message->refs );
+  return 0;
+}
+
 /** @} */
 
 /* MARK: Property access *//**
@@ -390,3 +559,143 @@ int MIDIMessageListDecode( struct MIDIMessageList * messages, size_t size, unsig
 }
 
 /** @} */
+
+/* MARK: Packed messages *//**
+ * @name Packed messages
+ * Convert between MIDIMessage objects and MIDIPackedMessage records.
+ * @{
+ */
+
+/**
+ * @ingroup MIDI
+ * @struct MIDIPackedMessage message.h
+ * @brief Fixed-size plain record of a MIDI message.
+ * A packed message is 16 bytes and holds the timestamp and the message
+ * bytes as they appear on the wire, so that arrays of messages can be
+ * passed around without reference counting and read without property
+ * access. System exclusive messages are kept as a retained MIDIMessage
+ * and referenced by the @c sysex handle. Copies of a packed system
+ * exclusive message have to be retained and released with
+ * MIDIPackedMessageRetain and MIDIPackedMessageRelease, for all other
+ * messages these functions do nothing.
+ */
+
+/**
+ * @ingroup MIDI
+ * @struct MIDIPackedMessageArray message.h
+ * @brief A borrowed array of packed messages.
+ * This is the object that is passed through ports by the packed batch
+ * functions of MIDIDevice and MIDIDriver. Receivers must not keep a
+ * pointer to the array or the messages after the callback returned.
+ * Ports that were not created with @c MIDI_PORT_BATCH receive every
+ * packed message as a MIDIMessage instead.
+ */
+
+/**
+ * @brief Pack a message.
+ * Store the timestamp and bytes of a message in a packed message.
+ * System exclusive messages are retained and stored as a handle that
+ * must be released with MIDIPackedMessageRelease.
+ * @public @memberof MIDIPackedMessage
+ * @param packed  The packed message.
+ * @param message The message.
+ * @retval 0 on success.
+ * @retval 1 if the message has no status or could not be stored.
+ */
+int MIDIPackedMessageFromMessage( struct MIDIPackedMessage * packed, struct MIDIMessage * message ) {
+  size_t length;
+  MIDIPrecond( packed != NULL, EFAULT );
+  MIDIPrecond( message != NULL, EINVAL );
+
+  packed->timestamp = message->timestamp;
+  packed->status    = message->data.bytes[0];
+  packed->data[0]   = 0;
+  packed->data[1]   = 0;
+  packed->reserved  = 0;
+  packed->sysex     = 0;
+  if( packed->status == MIDI_STATUS_SYSTEM_EXCLUSIVE ) {
+    packed->sysex = _sysex_acquire( message );
+    return ( packed->sysex == 0 ) ? 1 : 0;
+  }
+  if( MIDIMessageFormatGetDataLength( packed->status, &length ) ) return 1;
+  if( length > 0 ) packed->data[0] = message->data.bytes[1];
+  if( length > 1 ) packed->data[1] = message->data.bytes[2];
+  return 0;
+}
+
+/**
+ * @brief Unpack a message.
+ * Create a MIDIMessage from a packed message. For system exclusive
+ * messages the stored message is returned instead, it is shared by all
+ * copies of the packed message and must not be modified.
+ * @public @memberof MIDIPackedMessage
+ * @param packed  The packed message.
+ * @param message The message. The caller has to release it.
+ * @retval 0 on success.
+ * @retval 1 if the packed message is invalid or the message could not be created.
+ */
+int MIDIPackedMessageToMessage( struct MIDIPackedMessage * packed, struct MIDIMessage ** message ) {
+  struct MIDIMessage * m;
+  struct MIDIMessageFormat * format;
+  MIDIPrecond( packed != NULL, EFAULT );
+  MIDIPrecond( message != NULL, EINVAL );
+
+  if( packed->status == MIDI_STATUS_SYSTEM_EXCLUSIVE ) {
+    if( ( m = _sysex_lookup( packed->sysex, 1 ) ) == NULL ) return 1;
+    *message = m;
+    return 0;
+  }
+  format = MIDIMessageFormatDetect( &(packed->status) );
+  if( format == NULL ) return 1;
+  if( ( m = MIDIMessageCreate( 0 ) ) == NULL ) return 1;
+  m->format = format;
+  m->data.bytes[0] = packed->status;
+  m->data.bytes[1] = packed->data[0];
+  m->data.bytes[2] = packed->data[1];
+  m->timestamp = packed->timestamp;
+  *message = m;
+  return 0;
+}
+
+/**
+ * @brief Get the system exclusive message of a packed message.
+ * The message is not retained, it is valid as long as the packed
+ * message is.
+ * @public @memberof MIDIPackedMessage
+ * @param packed  The packed message.
+ * @param message The system exclusive message.
+ * @retval 0 on success.
+ * @retval 1 if the packed message has no system exclusive message.
+ */
+int MIDIPackedMessageGetSysex( struct MIDIPackedMessage * packed, struct MIDIMessage ** message ) {
+  MIDIPrecond( packed != NULL, EFAULT );
+  MIDIPrecond( message != NULL, EINVAL );
+  if( packed->sysex == 0 ) return 1;
+  *message = _sysex_lookup( packed->sysex, 0 );
+  return ( *message == NULL ) ? 1 : 0;
+}
+
+/**
+ * @brief Retain a packed message.
+ * Add a reference to the system exclusive message of a packed message.
+ * @public @memberof MIDIPackedMessage
+ * @param packed The packed message.
+ */
+void MIDIPackedMessageRetain( struct MIDIPackedMessage * packed ) {
+  MIDIPrecondReturn( packed != NULL, EFAULT, (void)0 );
+  if( packed->sysex != 0 ) _sysex_update( packed->sysex, 1 );
+}
+
+/**
+ * @brief Release a packed message.
+ * Remove a reference to the system exclusive message of a packed
+ * message and release the message when the last reference is gone.
+ * @public @memberof MIDIPackedMessage
+ * @param packed The packed message.
+ */
+void MIDIPackedMessageRelease( struct MIDIPackedMessage * packed ) {
+  MIDIPrecondReturn( packed != NULL, EFAULT, (void)0 );
+  if( packed->sysex != 0 ) _sysex_update( packed->sysex, -1 );
+}
+
+/** @} */
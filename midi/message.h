@@ -8,6 +8,20 @@
 struct MIDIMessage;
 extern struct MIDITypeSpec * MIDIMessageType;
 
+struct MIDIPackedMessage {
+  MIDITimestamp timestamp; /**< The timestamp */
+  unsigned char status;    /**< The complete status byte, including the channel */
+  unsigned char data[2];   /**< The data bytes, unused bytes are zero */
+  unsigned char reserved;  /**< Reserved, must be zero */
+  unsigned int  sysex;     /**< The handle of a system exclusive message or zero */
+};
+
+struct MIDIPackedMessageArray {
+  size_t count;
+  struct MIDIPackedMessage * messages;
+};
+extern struct MIDITypeSpec * MIDIPackedMessageArrayType;
+
 struct MIDIMessageList {
 /*size_t refs;
   size_t length;*/
@@ -19,6 +33,7 @@ struct MIDIMessage * MIDIMessageCreate( MIDIStatus status );
 void MIDIMessageDestroy( struct MIDIMessage * message );
 void MIDIMessageRetain( struct MIDIMessage * message );
 void MIDIMessageRelease( struct MIDIMessage * message );
+int MIDIMessageGetRefs( struct MIDIMessage * message, int * refs );
 
 int MIDIMessageSetStatus( struct MIDIMessage * message, MIDIStatus status );
 int MIDIMessageGetStatus( struct MIDIMessage * message, MIDIStatus * status );
@@ -36,6 +51,12 @@ int MIDIMessageEncodeRunningStatus( struct MIDIMessage * message, MIDIRunningSta
 int MIDIMessageDecodeRunningStatus( struct MIDIMessage * message, MIDIRunningStatus * status,
                                     size_t size, unsigned char * buffer, size_t * read );
 
+int MIDIPackedMessageFromMessage( struct MIDIPackedMessage * packed, struct MIDIMessage * message );
+int MIDIPackedMessageToMessage( struct MIDIPackedMessage * packed, struct MIDIMessage ** message );
+int MIDIPackedMessageGetSysex( struct MIDIPackedMessage * packed, struct MIDIMessage ** message );
+void MIDIPackedMessageRetain( struct MIDIPackedMessage * packed );
+void MIDIPackedMessageRelease( struct MIDIPackedMessage * packed );
+
 /*
 struct MIDIMessageList * MIDIMessageListCreate( size_t length );
 void MIDIMessageListDestroy( struct MIDIMessageList * messages );
@@ -1,6 +1,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include "message_format.h"
+#include "message_pool.h"
+#include "scan.h"
 
 /**
  * @ingroup MIDI
@@ -10,6 +12,8 @@
  * However, there is one important thing to remember. You may only free the data
  * field if bytes[3] has the least significant bit set! (And you need to set it
  * o one if you allocate some buffer for it.
+ * Owned buffers must be allocated with MIDIMessagePoolAllocData and released
+ * with MIDIMessagePoolFreeData.)
  *
  * The size and data fields are only used for system exclusive messages. Those
  * messages store the system exclusive data inside the data field. Status,
@@ -193,29 +197,29 @@ static int _encode_system_exclusive( struct MIDIMessageData * data, MIDIRunningS
 }
 
 static int _decode_system_exclusive( struct MIDIMessageData * data, MIDIRunningStatus * status, size_t size, void * buffer, size_t * read ) {
+  size_t header, end;
   MIDIAssert( data != NULL && buffer != NULL );
   if( size < 2 ) return 1;
-  if( VOID_BYTE(buffer,1) == 0 ) {
+  header = ( VOID_BYTE(buffer,1) == 0 ) ? 4 : 2;
+  if( size < header ) return 1;
+  /* the payload ends with the next status byte, keep the end of exclusive byte */
+  end = header + MIDIScanSysexEnd( size-header, buffer+header );
+  if( end < size && VOID_BYTE(buffer,end) == MIDI_STATUS_END_OF_EXCLUSIVE ) end++;
+  if( header == 4 ) {
     /* extended manufacturer id */
-    if( size < 4 ) return 1;
     data->bytes[0] = VOID_BYTE(buffer,0);
     data->bytes[1] = VOID_BYTE(buffer,2);
     data->bytes[2] = VOID_BYTE(buffer,3) | 0x80;
-    data->bytes[3] = 1;
-    data->data = malloc( size-4 );
-    memcpy( data->data, (buffer+4), size-4 );
-    data->size = size-4;
-    if( read != NULL ) *read = size;
   } else {
     data->bytes[0] = VOID_BYTE(buffer,0);
     data->bytes[1] = 0;
     data->bytes[2] = VOID_BYTE(buffer,1);
-    data->bytes[3] = 1;
-    data->data = malloc( size-2 );
-    memcpy( data->data, (buffer+2), size-2 );
-    data->size = size-2;
-    if( read != NULL ) *read = size;
   }
+  data->bytes[3] = 1;
+  data->data = MIDIMessagePoolAllocData( MIDIMessagePoolGetDefault(), end-header );
+  memcpy( data->data, (buffer+header), end-header );
+  data->size = end-header;
+  if( read != NULL ) *read = end;
   return _update_running_status( data, status );
 }
 
@@ -678,7 +682,7 @@ static int _set_system_exclusive( struct MIDIMessageData * data, MIDIProperty pr
       data->bytes[3] = ( data->bytes[3] & 1 ) | (*((char*)value) << 1);
       return 0;
     PROPERTY_CASE_BASE(MIDI_SYSEX_DATA,void**);
-      if( data->data != NULL && ( data->bytes[3] & 1 ) ) free( data->data );
+      if( data->data != NULL && ( data->bytes[3] & 1 ) ) MIDIMessagePoolFreeData( data->data );
       data->data = *((void**)value);
       return 0;
   /*case MIDI_SYSEX_DATA:
@@ -1050,6 +1054,65 @@ static struct MIDIMessageFormat _real_time = {
   &_decode_one_byte
 };
 
+/**
+ * @}
+ * @endcond
+ */
+
+/* MARK: Status byte table *//**
+ * @name Status byte table
+ * @cond INTERNALS
+ * Map every possible first byte directly to its message format and the
+ * number of data bytes that follow it. Data bytes and undefined status
+ * bytes map to @c NULL.
+ * @{
+ */
+
+struct MIDIMessageFormatEntry {
+  struct MIDIMessageFormat * format;
+  signed char length; /* -1 for variable length */
+};
+
+#define ENTRY( format, length ) { format, length }
+#define ENTRY_2( f, l )  ENTRY( f, l ), ENTRY( f, l )
+#define ENTRY_4( f, l )  ENTRY_2( f, l ), ENTRY_2( f, l )
+#define ENTRY_8( f, l )  ENTRY_4( f, l ), ENTRY_4( f, l )
+#define ENTRY_16( f, l ) ENTRY_8( f, l ), ENTRY_8( f, l )
+#define ENTRY_64( f, l ) ENTRY_16( f, l ), ENTRY_16( f, l ), ENTRY_16( f, l ), ENTRY_16( f, l )
+
+static const struct MIDIMessageFormatEntry _formats[256] = {
+  ENTRY_64( NULL, 0 ), ENTRY_64( NULL, 0 ),    /* 0x00 - 0x7f data bytes */
+  ENTRY_16( &_note_off_on, 2 ),                /* 0x80 */
+  ENTRY_16( &_note_off_on, 2 ),                /* 0x90 */
+  ENTRY_16( &_polyphonic_key_pressure, 2 ),    /* 0xa0 */
+  ENTRY_16( &_control_change, 2 ),             /* 0xb0 */
+  ENTRY_16( &_program_change, 1 ),             /* 0xc0 */
+  ENTRY_16( &_channel_pressure, 1 ),           /* 0xd0 */
+  ENTRY_16( &_pitch_wheel_change, 2 ),         /* 0xe0 */
+  ENTRY( &_system_exclusive, -1 ),             /* 0xf0 */
+  ENTRY( &_time_code_quarter_frame, 1 ),       /* 0xf1 */
+  ENTRY( &_song_position_pointer, 2 ),         /* 0xf2 */
+  ENTRY( &_song_select, 1 ),                   /* 0xf3 */
+  ENTRY_2( NULL, 0 ),                          /* 0xf4, 0xf5 undefined */
+  ENTRY( &_tune_request, 0 ),                  /* 0xf6 */
+  ENTRY( NULL, 0 ),                            /* 0xf7 end of exclusive */
+  ENTRY( &_real_time, 0 ),                     /* 0xf8 timing clock */
+  ENTRY( NULL, 0 ),                            /* 0xf9 undefined */
+  ENTRY( &_real_time, 0 ),                     /* 0xfa start */
+  ENTRY( &_real_time, 0 ),                     /* 0xfb continue */
+  ENTRY( &_real_time, 0 ),                     /* 0xfc stop */
+  ENTRY( NULL, 0 ),                            /* 0xfd undefined */
+  ENTRY( &_real_time, 0 ),                     /* 0xfe active sensing */
+  ENTRY( &_real_time, 0 )                      /* 0xff reset */
+};
+
+#undef ENTRY_64
+#undef ENTRY_16
+#undef ENTRY_8
+#undef ENTRY_4
+#undef ENTRY_2
+#undef ENTRY
+
 /**
  * @}
  * @endcond
@@ -1058,8 +1121,6 @@ static struct MIDIMessageFormat _real_time = {
 /* MARK: -
  * MARK: Public functions */
 
-#define N_ELEM(a) (sizeof(a) / sizeof(a[0]))
-
 /**
  * @brief Detect the format of message stored in a buffer.
  * Determine the message format used in a stream of bytes.
@@ -1069,29 +1130,8 @@ static struct MIDIMessageFormat _real_time = {
  * @return a NULL pointer if the format could not be detected.
  */
 struct MIDIMessageFormat * MIDIMessageFormatDetect( void * buffer ) {
-  static struct MIDIMessageFormat * formats[] = {
-    &_note_off_on,
-    &_polyphonic_key_pressure,
-    &_control_change,
-    &_program_change,
-    &_channel_pressure,
-    &_pitch_wheel_change,
-    &_system_exclusive,
-    &_time_code_quarter_frame,
-    &_song_position_pointer,
-    &_song_select,
-    &_tune_request,
-    &_real_time
-  };
-  int i;
   MIDIPrecondReturn( buffer != NULL, EFAULT, NULL );
-  for( i=0; i<N_ELEM(formats); i++ ) {
-    MIDIAssert( formats[i] != NULL && formats[i]->test != NULL );
-    if( (formats[i]->test)( buffer ) ) {
-      return formats[i];
-    }
-  }
-  return NULL;
+  return _formats[VOID_BYTE(buffer, 0)].format;
 }
 
 /**
@@ -1104,10 +1144,14 @@ struct MIDIMessageFormat * MIDIMessageFormatDetect( void * buffer ) {
  * @return a NULL pointer if the format could not be detected.
  */
 struct MIDIMessageFormat * MIDIMessageFormatDetectRunningStatus( void * buffer, MIDIRunningStatus * status ) {
-  if( VOID_BYTE(buffer, 0) & 0x80 ) {
-    return MIDIMessageFormatDetect( buffer );
-  } else if( status != NULL && *status != 0 ) {
-    return MIDIMessageFormatDetect( status );
+  unsigned char byte;
+  MIDIPrecondReturn( buffer != NULL, EFAULT, NULL );
+  byte = VOID_BYTE(buffer, 0);
+  if( byte & 0x80 ) {
+    return _formats[byte].format;
+  } else if( status != NULL ) {
+    /* the table maps a running status of zero to NULL as well */
+    return _formats[*status].format;
   } else {
     return NULL;
   }
@@ -1135,7 +1179,23 @@ struct MIDIMessageFormat * MIDIMessageFormatForStatus( MIDIStatus status ) {
     byte = status << 4;
     if( byte < 0x80 ) return NULL; /* no status bit? */
   }
-  return MIDIMessageFormatDetect( &byte );
+  return _formats[byte].format;
+}
+
+/**
+ * @brief Get the number of data bytes that follow a status byte.
+ * @public @memberof MIDIMessageFormat
+ * @param byte   The status byte as it would appear on a MIDI cable.
+ * @param length The number of data bytes.
+ * @retval 0  on success.
+ * @retval >0 if the byte is no status byte or starts a message of
+ *            variable length (system exclusive).
+ */
+int MIDIMessageFormatGetDataLength( unsigned char byte, size_t * length ) {
+  MIDIPrecond( length != NULL, EINVAL );
+  if( _formats[byte].format == NULL || _formats[byte].length < 0 ) return 1;
+  *length = _formats[byte].length;
+  return 0;
 }
 
 /**
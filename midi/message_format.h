@@ -13,6 +13,7 @@ struct MIDIMessageData {
 struct MIDIMessageFormat * MIDIMessageFormatDetect( void * buffer );
 struct MIDIMessageFormat * MIDIMessageFormatDetectRunningStatus( void * buffer, MIDIRunningStatus * status );
 struct MIDIMessageFormat * MIDIMessageFormatForStatus( MIDIStatus status );
+int MIDIMessageFormatGetDataLength( unsigned char byte, size_t * length );
 int MIDIMessageFormatTest( struct MIDIMessageFormat * format, void * buffer );
 int MIDIMessageFormatGetSize( struct MIDIMessageFormat * format, struct MIDIMessageData * data,
                               size_t * size );
@@ -0,0 +1,534 @@
+#include <stdlib.h>
+#include "message_pool.h"
+#include "message.h"
+#include "type.h"
+#include "realtime.h"
+
+/**
+ * @ingroup MIDI
+ * @struct MIDIMessagePoolChunk
+ * @brief A contiguous block of equally sized pool entries.
+ * The entries are stored directly behind the chunk header.
+ */
+struct MIDIMessagePoolChunk {
+/**
+ * @privatesection
+ * @cond INTERNALS
+ */
+  struct MIDIMessagePoolChunk * next;
+  char * begin;
+  char * end;
+/** @endcond */
+};
+
+/**
+ * @ingroup MIDI
+ * @struct MIDIMessagePoolSlab
+ * @brief Free list of pool entries of a single size.
+ */
+struct MIDIMessagePoolSlab {
+/**
+ * @privatesection
+ * @cond INTERNALS
+ */
+  size_t size;
+  size_t count;
+  void * free;
+  void * remote;
+  struct MIDIMessagePoolChunk * chunks;
+/** @endcond */
+};
+
+/**
+ * @ingroup MIDI
+ * @struct MIDIMessagePoolData
+ * @brief Header in front of every system exclusive buffer.
+ * The header remembers where the buffer came from, so that it can be put
+ * back without searching for the owning pool.
+ */
+struct MIDIMessagePoolData {
+/**
+ * @privatesection
+ * @cond INTERNALS
+ */
+  struct MIDIMessagePool * pool;
+  size_t size_class;
+/** @endcond */
+};
+
+/**
+ * @ingroup MIDI
+ * @struct MIDIMessagePool message_pool.h
+ * @brief Allocator for MIDIMessage objects and their system exclusive data.
+ * A message pool keeps free lists of message structures and of a few size
+ * classes for system exclusive buffers. Entries are never returned to the
+ * system before the pool is destroyed, so a warmed-up pool serves messages
+ * without calling @c malloc.
+ * A pool belongs to the thread that made it its default pool, only that
+ * thread takes entries from it. Entries may be put back on any thread:
+ * the owner pushes them onto its free list, every other thread pushes them
+ * onto a lock-free return list that the owner takes over when its free
+ * list runs dry. The statistics are updated atomically.
+ */
+struct MIDIMessagePool {
+/**
+ * @privatesection
+ * @cond INTERNALS
+ */
+  int    refs;
+  const void * owner;
+  struct MIDIMessagePoolSlab message;
+  struct MIDIMessagePoolSlab data[MIDI_MESSAGE_POOL_DATA_CLASSES];
+  struct MIDIMessagePoolStats stats;
+/** @endcond */
+};
+
+/* MARK: Internals *//**
+ * @name Internals
+ * @cond INTERNALS
+ * @{
+ */
+
+#define CHUNK_HEADER_SIZE ( ( sizeof( struct MIDIMessagePoolChunk ) + 15 ) & ~(size_t)15 )
+#define CHUNK_MIN_ENTRIES 32
+#define DATA_HEADER_SIZE  ( ( sizeof( struct MIDIMessagePoolData ) + 15 ) & ~(size_t)15 )
+
+#define ATOMIC_EXCHANGE_ACQUIRE( p, v ) __atomic_exchange_n( p, v, __ATOMIC_ACQUIRE )
+#define ATOMIC_CAS_WEAK( p, e, v )      __atomic_compare_exchange_n( p, e, v, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED )
+
+#define POOL_ADD( p, v ) __atomic_add_fetch( p, v, __ATOMIC_RELAXED )
+#define POOL_SUB( p, v ) __atomic_sub_fetch( p, v, __ATOMIC_RELAXED )
+#define POOL_LOAD( p )   __atomic_load_n( p, __ATOMIC_RELAXED )
+#define POOL_STORE( p, v ) __atomic_store_n( p, v, __ATOMIC_RELAXED )
+
+static const size_t _data_class_size[MIDI_MESSAGE_POOL_DATA_CLASSES] = { 16, 64, 256, 1024 };
+
+static __thread struct MIDIMessagePool * _default_pool = NULL;
+static __thread char _thread_token;
+
+/**
+ * @brief Check if the calling thread owns a pool.
+ * @private @memberof MIDIMessagePool
+ * @param pool The message pool.
+ */
+static int _pool_is_owner( struct MIDIMessagePool * pool ) {
+  return __atomic_load_n( &(pool->owner), __ATOMIC_ACQUIRE ) == &_thread_token;
+}
+
+/**
+ * @brief Check if the calling thread may take entries from a pool.
+ * Pools that are not the default pool of any thread may be used by a
+ * single thread of the caller's choice.
+ * @private @memberof MIDIMessagePool
+ * @param pool The message pool.
+ */
+static int _pool_may_alloc( struct MIDIMessagePool * pool ) {
+  const void * owner = __atomic_load_n( &(pool->owner), __ATOMIC_ACQUIRE );
+  return owner == NULL || owner == &_thread_token;
+}
+
+static void _slab_init( struct MIDIMessagePoolSlab * slab, size_t size, size_t count ) {
+  slab->size   = ( size + sizeof(void*) - 1 ) & ~( sizeof(void*) - 1 );
+  slab->count  = ( count < CHUNK_MIN_ENTRIES ) ? CHUNK_MIN_ENTRIES : count;
+  slab->free   = NULL;
+  slab->remote = NULL;
+  slab->chunks = NULL;
+}
+
+/**
+ * @brief Add a chunk of @c count entries to the slab's free list.
+ * @private @memberof MIDIMessagePool
+ * @param slab  The slab.
+ * @param count The number of entries to add.
+ * @retval 0 on success.
+ * @retval >0 if the memory could not be allocated.
+ */
+static int _slab_grow( struct MIDIMessagePoolSlab * slab, size_t count ) {
+  struct MIDIMessagePoolChunk * chunk;
+  char * entry;
+  size_t i;
+
+  MIDIRealTimeCheck( MIDI_REALTIME_ALLOCATION );
+  chunk = malloc( CHUNK_HEADER_SIZE + count * slab->size );
+  if( chunk == NULL ) return 1;
+  chunk->begin = ((char *) chunk) + CHUNK_HEADER_SIZE;
+  chunk->end   = chunk->begin + count * slab->size;
+  chunk->next  = slab->chunks;
+  slab->chunks = chunk;
+
+  for( i=count; i>0; i-- ) {
+    entry = chunk->begin + (i-1) * slab->size;
+    *((void **) entry) = slab->free;
+    slab->free = entry;
+  }
+  return 0;
+}
+
+static void _slab_destroy( struct MIDIMessagePoolSlab * slab ) {
+  struct MIDIMessagePoolChunk * chunk;
+  while( slab->chunks != NULL ) {
+    chunk = slab->chunks;
+    slab->chunks = chunk->next;
+    free( chunk );
+  }
+  slab->free   = NULL;
+  slab->remote = NULL;
+}
+
+/**
+ * @brief Take an entry from the slab.
+ * If the free list is empty, take over the entries that were returned by
+ * other threads and grow the slab if there are none.
+ * @private @memberof MIDIMessagePool
+ * @param slab The slab.
+ * @param hit  Set to one if the entry came from the free list, zero otherwise.
+ * @return a pointer to the entry on success.
+ * @return a @c NULL pointer if the slab could not grow.
+ */
+static void * _slab_alloc( struct MIDIMessagePoolSlab * slab, int * hit ) {
+  void * entry;
+  if( slab->free == NULL ) {
+    slab->free = ATOMIC_EXCHANGE_ACQUIRE( &(slab->remote), NULL );
+  }
+  *hit = ( slab->free != NULL );
+  if( slab->free == NULL && _slab_grow( slab, slab->count ) ) {
+    return NULL;
+  }
+  entry = slab->free;
+  slab->free = *((void **) entry);
+  return entry;
+}
+
+/**
+ * @brief Put an entry back into the slab.
+ * The owner of the pool pushes the entry onto the free list, other threads
+ * push it onto the return list. The owner only ever takes the whole return
+ * list, which keeps the push free of ABA problems.
+ * @private @memberof MIDIMessagePool
+ * @param slab  The slab.
+ * @param entry The entry.
+ * @param local Non-zero if the calling thread owns the pool.
+ */
+static void _slab_free( struct MIDIMessagePoolSlab * slab, void * entry, int local ) {
+  void * head;
+  if( local ) {
+    *((void **) entry) = slab->free;
+    slab->free = entry;
+    return;
+  }
+  head = __atomic_load_n( &(slab->remote), __ATOMIC_RELAXED );
+  do {
+    *((void **) entry) = head;
+  } while( ! ATOMIC_CAS_WEAK( &(slab->remote), &head, entry ) );
+}
+
+static void _update_high_water( size_t used, size_t * high_water ) {
+  size_t current = POOL_LOAD( high_water );
+  while( used > current &&
+         ! __atomic_compare_exchange_n( high_water, &current, used, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) ) {}
+}
+
+/**
+ * @}
+ * @endcond
+ */
+
+/* MARK: -
+ * MARK: Creation and destruction *//**
+ * @name Creation and destruction
+ * Creating, destroying and reference counting of MIDIMessagePool objects.
+ * @{
+ */
+
+/**
+ * @brief Create a MIDIMessagePool instance.
+ * Allocate space and initialize a MIDIMessagePool instance. The pool is
+ * filled with the given number of entries up front and grows on demand.
+ * @public @memberof MIDIMessagePool
+ * @param messages The number of message structures to preallocate.
+ * @param buffers  The number of system exclusive buffers to preallocate
+ *                 in each size class.
+ * @return a pointer to the created pool on success.
+ * @return a @c NULL pointer if the pool could not created.
+ */
+struct MIDIMessagePool * MIDIMessagePoolCreate( size_t messages, size_t buffers ) {
+  struct MIDIMessagePool * pool = malloc( sizeof( struct MIDIMessagePool ) );
+  int i, result = 0;
+  MIDIPrecondReturn( pool != NULL, ENOMEM, NULL );
+
+  pool->refs  = 1;
+  pool->owner = NULL;
+  _slab_init( &(pool->message), MIDIMessageType->size, messages );
+  if( messages > 0 ) result += _slab_grow( &(pool->message), messages );
+  for( i=0; i<MIDI_MESSAGE_POOL_DATA_CLASSES; i++ ) {
+    _slab_init( &(pool->data[i]), DATA_HEADER_SIZE + _data_class_size[i], buffers );
+    if( buffers > 0 ) result += _slab_grow( &(pool->data[i]), buffers );
+  }
+  pool->stats.message_used = 0;
+  pool->stats.data_used    = 0;
+  MIDIMessagePoolResetStats( pool );
+
+  if( result ) {
+    MIDIMessagePoolDestroy( pool );
+    MIDIError( ENOMEM, "Could not preallocate message pool entries." );
+    return NULL;
+  }
+  return pool;
+}
+
+/**
+ * @brief Destroy a MIDIMessagePool instance.
+ * Free all resources occupied by the pool.
+ * All messages and system exclusive buffers that were taken from the pool must
+ * be released before. (Messages and buffers hold a reference to their pool.)
+ * @public @memberof MIDIMessagePool
+ * @param pool The message pool.
+ */
+void MIDIMessagePoolDestroy( struct MIDIMessagePool * pool ) {
+  int i;
+  MIDIPrecondReturn( pool != NULL, EFAULT, (void)0 );
+
+  _slab_destroy( &(pool->message) );
+  for( i=0; i<MIDI_MESSAGE_POOL_DATA_CLASSES; i++ ) {
+    _slab_destroy( &(pool->data[i]) );
+  }
+  free( pool );
+}
+
+/**
+ * @brief Retain a MIDIMessagePool instance.
+ * Increment the reference counter of a pool so that it won't be destroyed.
+ * Pool references are always atomic, because messages that are released
+ * on other threads release their pool as well.
+ * @public @memberof MIDIMessagePool
+ * @param pool The message pool.
+ */
+void MIDIMessagePoolRetain( struct MIDIMessagePool * pool ) {
+  MIDIPrecondReturn( pool != NULL, EFAULT, (void)0 );
+  MIDI_REFS_RETAIN_ATOMIC( pool->refs );
+}
+
+/**
+ * @brief Release a MIDIMessagePool instance.
+ * Decrement the reference counter of a pool. If the reference count
+ * reached zero, destroy the pool.
+ * @public @memberof MIDIMessagePool
+ * @param pool The message pool.
+ */
+void MIDIMessagePoolRelease( struct MIDIMessagePool * pool ) {
+  MIDIPrecondReturn( pool != NULL, EFAULT, (void)0 );
+  if( ! MIDI_REFS_RELEASE_ATOMIC( pool->refs ) ) {
+    MIDIMessagePoolDestroy( pool );
+  }
+}
+
+/** @} */
+
+/* MARK: Default pool *//**
+ * @name Default pool
+ * Opt in to pooled message allocation.
+ * @{
+ */
+
+/**
+ * @brief Set the default message pool of the calling thread.
+ * MIDIMessageCreate takes new messages from the default pool and the message
+ * decoders take system exclusive buffers from it. Without a default pool
+ * (the initial state) messages are allocated with @c malloc.
+ * Every thread has its own default pool. The calling thread becomes the
+ * owner of the pool and the only thread that takes entries from it, so a
+ * pool cannot be the default pool of two threads at the same time. Messages
+ * and buffers from the pool may be released on any thread, they are handed
+ * back to the owner through a lock-free return list. A thread should reset
+ * its default pool to @c NULL before it exits, which gives up the ownership.
+ * @public @memberof MIDIMessagePool
+ * @param pool The new default pool or @c NULL to disable pooling.
+ * @retval 0 on success.
+ * @retval EBUSY if the pool is the default pool of another thread.
+ */
+int MIDIMessagePoolSetDefault( struct MIDIMessagePool * pool ) {
+  const void * owner = NULL;
+  if( pool == _default_pool ) return 0;
+  if( pool != NULL ) {
+    if( ! __atomic_compare_exchange_n( &(pool->owner), &owner, &_thread_token, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ) ) {
+      MIDIError( EBUSY, "Message pool is the default pool of another thread." );
+      return EBUSY;
+    }
+    MIDIMessagePoolRetain( pool );
+  }
+  if( _default_pool != NULL ) {
+    __atomic_store_n( &(_default_pool->owner), NULL, __ATOMIC_RELEASE );
+    MIDIMessagePoolRelease( _default_pool );
+  }
+  _default_pool = pool;
+  return 0;
+}
+
+/**
+ * @brief Get the default message pool of the calling thread.
+ * @public @memberof MIDIMessagePool
+ * @return the default pool or @c NULL if pooling is disabled.
+ */
+struct MIDIMessagePool * MIDIMessagePoolGetDefault( void ) {
+  return _default_pool;
+}
+
+/** @} */
+
+/* MARK: Statistics *//**
+ * @name Statistics
+ * Monitor the pool usage.
+ * @{
+ */
+
+/**
+ * @brief Get the pool statistics.
+ * Hits count allocations that were served from a free list, misses count
+ * allocations that had to ask the system for memory.
+ * @public @memberof MIDIMessagePool
+ * @param pool  The message pool.
+ * @param stats The statistics structure to fill.
+ * @retval 0 on success.
+ */
+int MIDIMessagePoolGetStats( struct MIDIMessagePool * pool, struct MIDIMessagePoolStats * stats ) {
+  MIDIPrecond( pool != NULL, EFAULT );
+  MIDIPrecond( stats != NULL, EINVAL );
+  stats->message_hits       = POOL_LOAD( &(pool->stats.message_hits) );
+  stats->message_misses     = POOL_LOAD( &(pool->stats.message_misses) );
+  stats->message_used       = POOL_LOAD( &(pool->stats.message_used) );
+  stats->message_high_water = POOL_LOAD( &(pool->stats.message_high_water) );
+  stats->data_hits          = POOL_LOAD( &(pool->stats.data_hits) );
+  stats->data_misses        = POOL_LOAD( &(pool->stats.data_misses) );
+  stats->data_used          = POOL_LOAD( &(pool->stats.data_used) );
+  stats->data_high_water    = POOL_LOAD( &(pool->stats.data_high_water) );
+  return 0;
+}
+
+/**
+ * @brief Reset the pool statistics.
+ * Clear the hit and miss counters and set the high-water marks to the
+ * current usage.
+ * @public @memberof MIDIMessagePool
+ * @param pool The message pool.
+ * @retval 0 on success.
+ */
+int MIDIMessagePoolResetStats( struct MIDIMessagePool * pool ) {
+  MIDIPrecond( pool != NULL, EFAULT );
+  POOL_STORE( &(pool->stats.message_hits), 0 );
+  POOL_STORE( &(pool->stats.message_misses), 0 );
+  POOL_STORE( &(pool->stats.message_high_water), POOL_LOAD( &(pool->stats.message_used) ) );
+  POOL_STORE( &(pool->stats.data_hits), 0 );
+  POOL_STORE( &(pool->stats.data_misses), 0 );
+  POOL_STORE( &(pool->stats.data_high_water), POOL_LOAD( &(pool->stats.data_used) ) );
+  return 0;
+}
+
+/** @} */
+
+/* MARK: Allocation *//**
+ * @name Allocation
+ * Take entries from the pool and put them back.
+ * @{
+ */
+
+/**
+ * @brief Take a message structure from the pool.
+ * Must be called on the thread that owns the pool, or on a single thread
+ * if the pool is not the default pool of any thread.
+ * @public @memberof MIDIMessagePool
+ * @param pool The message pool.
+ * @return a pointer to uninitialized memory for one MIDIMessage on success.
+ * @return a @c NULL pointer if the pool could not grow.
+ */
+void * MIDIMessagePoolAllocMessage( struct MIDIMessagePool * pool ) {
+  void * message;
+  int hit;
+  MIDIPrecondReturn( pool != NULL, EFAULT, NULL );
+  MIDIPrecondReturn( _pool_may_alloc( pool ), EPERM, NULL );
+  message = _slab_alloc( &(pool->message), &hit );
+  MIDIPrecondReturn( message != NULL, ENOMEM, NULL );
+  POOL_ADD( hit ? &(pool->stats.message_hits) : &(pool->stats.message_misses), 1 );
+  _update_high_water( POOL_ADD( &(pool->stats.message_used), 1 ), &(pool->stats.message_high_water) );
+  return message;
+}
+
+/**
+ * @brief Put a message structure back into the pool.
+ * May be called on any thread.
+ * @public @memberof MIDIMessagePool
+ * @param pool    The message pool the structure was taken from.
+ * @param message The message structure.
+ */
+void MIDIMessagePoolFreeMessage( struct MIDIMessagePool * pool, void * message ) {
+  MIDIPrecondReturn( pool != NULL, EFAULT, (void)0 );
+  MIDIPrecondReturn( message != NULL, EINVAL, (void)0 );
+  _slab_free( &(pool->message), message, _pool_is_owner( pool ) );
+  POOL_SUB( &(pool->stats.message_used), 1 );
+}
+
+/**
+ * @brief Allocate a system exclusive buffer.
+ * Take the buffer from the smallest size class that fits. Buffers that are
+ * larger than the biggest size class (or requested without a pool) are
+ * allocated with @c malloc. A pooled buffer retains its pool until it is
+ * freed, so the pool may be released or replaced as the default pool while
+ * the buffer is still in use.
+ * @public @memberof MIDIMessagePool
+ * @param pool The message pool or @c NULL.
+ * @param size The number of bytes needed.
+ * @return a pointer to the buffer on success.
+ * @return a @c NULL pointer if the buffer could not be allocated.
+ */
+void * MIDIMessagePoolAllocData( struct MIDIMessagePool * pool, size_t size ) {
+  struct MIDIMessagePoolData * header;
+  int i = MIDI_MESSAGE_POOL_DATA_CLASSES, hit;
+  if( pool != NULL ) {
+    for( i=0; i<MIDI_MESSAGE_POOL_DATA_CLASSES; i++ ) {
+      if( size <= _data_class_size[i] ) break;
+    }
+  }
+  if( i == MIDI_MESSAGE_POOL_DATA_CLASSES ) {
+    if( pool != NULL ) POOL_ADD( &(pool->stats.data_misses), 1 );
+    MIDIRealTimeCheck( MIDI_REALTIME_ALLOCATION );
+    header = malloc( DATA_HEADER_SIZE + size );
+    MIDIPrecondReturn( header != NULL, ENOMEM, NULL );
+    header->pool = NULL;
+    header->size_class = MIDI_MESSAGE_POOL_DATA_CLASSES;
+    return ((char *) header) + DATA_HEADER_SIZE;
+  }
+  MIDIPrecondReturn( _pool_may_alloc( pool ), EPERM, NULL );
+  header = _slab_alloc( &(pool->data[i]), &hit );
+  MIDIPrecondReturn( header != NULL, ENOMEM, NULL );
+  POOL_ADD( hit ? &(pool->stats.data_hits) : &(pool->stats.data_misses), 1 );
+  _update_high_water( POOL_ADD( &(pool->stats.data_used), 1 ), &(pool->stats.data_high_water) );
+  MIDIMessagePoolRetain( pool );
+  header->pool = pool;
+  header->size_class = i;
+  return ((char *) header) + DATA_HEADER_SIZE;
+}
+
+/**
+ * @brief Free a system exclusive buffer.
+ * Put the buffer back into the pool it was taken from, or pass it to
+ * @c free if it was allocated with @c malloc. The buffer must have been
+ * allocated with MIDIMessagePoolAllocData.
+ * @public @memberof MIDIMessagePool
+ * @param data The buffer.
+ */
+void MIDIMessagePoolFreeData( void * data ) {
+  struct MIDIMessagePoolData * header;
+  struct MIDIMessagePool * pool;
+  if( data == NULL ) return;
+  header = (struct MIDIMessagePoolData *) ( ((char *) data) - DATA_HEADER_SIZE );
+  pool   = header->pool;
+  if( pool == NULL ) {
+    free( header );
+    return;
+  }
+  _slab_free( &(pool->data[header->size_class]), header, _pool_is_owner( pool ) );
+  POOL_SUB( &(pool->stats.data_used), 1 );
+  MIDIMessagePoolRelease( pool );
+}
+
+/** @} */
@@ -0,0 +1,38 @@
+#ifndef MIDIKIT_MIDI_MESSAGE_POOL_H
+#define MIDIKIT_MIDI_MESSAGE_POOL_H
+#include <stdlib.h>
+#include "midi.h"
+
+#define MIDI_MESSAGE_POOL_DATA_CLASSES 4
+
+struct MIDIMessagePool;
+
+struct MIDIMessagePoolStats {
+  size_t message_hits;
+  size_t message_misses;
+  size_t message_used;
+  size_t message_high_water;
+  size_t data_hits;
+  size_t data_misses;
+  size_t data_used;
+  size_t data_high_water;
+};
+
+struct MIDIMessagePool * MIDIMessagePoolCreate( size_t messages, size_t buffers );
+void MIDIMessagePoolDestroy( struct MIDIMessagePool * pool );
+void MIDIMessagePoolRetain( struct MIDIMessagePool * pool );
+void MIDIMessagePoolRelease( struct MIDIMessagePool * pool );
+
+int MIDIMessagePoolSetDefault( struct MIDIMessagePool * pool );
+struct MIDIMessagePool * MIDIMessagePoolGetDefault( void );
+
+int MIDIMessagePoolGetStats( struct MIDIMessagePool * pool, struct MIDIMessagePoolStats * stats );
+int MIDIMessagePoolResetStats( struct MIDIMessagePool * pool );
+
+void * MIDIMessagePoolAllocMessage( struct MIDIMessagePool * pool );
+void MIDIMessagePoolFreeMessage( struct MIDIMessagePool * pool, void * message );
+
+void * MIDIMessagePoolAllocData( struct MIDIMessagePool * pool, size_t size );
+void MIDIMessagePoolFreeData( void * data );
+
+#endif
@@ -1,9 +1,108 @@
 #include <stdlib.h>
 #include "message_queue.h"
+#include "realtime.h"
+
+#define MIDI_CACHE_LINE_SIZE 64
+
+#define ATOMIC_LOAD_RELAXED( p )     __atomic_load_n( p, __ATOMIC_RELAXED )
+#define ATOMIC_LOAD_ACQUIRE( p )     __atomic_load_n( p, __ATOMIC_ACQUIRE )
+#define ATOMIC_STORE_RELEASE( p, v ) __atomic_store_n( p, v, __ATOMIC_RELEASE )
+#define ATOMIC_CAS_WEAK( p, e, v )   __atomic_compare_exchange_n( p, e, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED )
+
+/**
+ * @ingroup MIDI
+ * @struct MIDIMessageRing
+ * @brief Single-producer single-consumer ring buffer.
+ * The consumer owns @c head, the producer owns @c tail. Each index lives on
+ * its own cache line together with a cached copy of the other side's index,
+ * so that the sides only touch each other's line when the cached value says
+ * the ring is full (or empty).
+ */
+struct MIDIMessageRing {
+/**
+ * @privatesection
+ * @cond INTERNALS
+ */
+  size_t mask;
+  struct MIDIMessage ** slots;
+  char   pad0[MIDI_CACHE_LINE_SIZE - sizeof(size_t) - sizeof(void*)];
+  size_t head;
+  size_t cached_tail;
+  char   pad1[MIDI_CACHE_LINE_SIZE - 2*sizeof(size_t)];
+  size_t tail;
+  size_t cached_head;
+  char   pad2[MIDI_CACHE_LINE_SIZE - 2*sizeof(size_t)];
+/** @endcond */
+};
+
+/**
+ * @ingroup MIDI
+ * @struct MIDIMessageSlot
+ * @brief Slot of a multi-producer ring.
+ * The sequence number tells producers and the consumer whether the slot
+ * is free for the lap they are working on.
+ */
+struct MIDIMessageSlot {
+/**
+ * @privatesection
+ * @cond INTERNALS
+ */
+  size_t seq;
+  struct MIDIMessage * message;
+/** @endcond */
+};
+
+/**
+ * @ingroup MIDI
+ * @struct MIDIMessageHeapEntry
+ * @brief Entry of the consumer side reorder heap.
+ */
+struct MIDIMessageHeapEntry {
+/**
+ * @privatesection
+ * @cond INTERNALS
+ */
+  MIDITimestamp timestamp;
+  size_t order;
+  struct MIDIMessage * message;
+/** @endcond */
+};
+
+/**
+ * @ingroup MIDI
+ * @struct MIDIMessageFanIn
+ * @brief Multi-producer single-consumer ring buffer with timestamp ordering.
+ * Producers claim slots by advancing @c tail with a compare-and-swap and
+ * publish them by bumping the slot sequence number. The consumer moves
+ * published messages into a private min-heap keyed by timestamp, so
+ * messages that were pushed by different threads are drained in timestamp
+ * order (as far as they are already visible to the consumer).
+ */
+struct MIDIMessageFanIn {
+/**
+ * @privatesection
+ * @cond INTERNALS
+ */
+  size_t mask;
+  struct MIDIMessageSlot * slots;
+  char   pad0[MIDI_CACHE_LINE_SIZE - sizeof(size_t) - sizeof(void*)];
+  size_t tail;
+  char   pad1[MIDI_CACHE_LINE_SIZE - sizeof(size_t)];
+  size_t head;
+  size_t length;
+  struct MIDIMessageHeapEntry * heap;
+  char   pad2[MIDI_CACHE_LINE_SIZE - 2*sizeof(size_t) - sizeof(void*)];
+/** @endcond */
+};
 
 /**
  * @ingroup MIDI
  * @brief Queue for MIDI message objects.
+ * The queue either stores messages in an unbounded linked list or, if it was
+ * created with MIDIMessageQueueCreateRing, in a bounded lock-free ring that
+ * may be shared by exactly one producer thread and one consumer thread.
+ * Queues created with MIDIMessageQueueCreateFanIn accept messages from any
+ * number of producer threads and hand them to one consumer in timestamp order.
  * @todo  Implement this using a MIDIList
  */
 struct MIDIMessageQueue {
@@ -15,9 +114,224 @@ struct MIDIMessageQueue {
   size_t length;
   struct MIDIMessageList * first;
   struct MIDIMessageList * last;
+  struct MIDIMessageRing * ring;
+  struct MIDIMessageFanIn * fanin;
 /** @endcond */
 };
 
+/* MARK: Internals *//**
+ * @name Internals
+ * @cond INTERNALS
+ * @{
+ */
+
+static struct MIDIMessageRing * _ring_create( size_t capacity ) {
+  struct MIDIMessageRing * ring;
+  size_t size = 1;
+  while( size < capacity ) size <<= 1;
+
+  if( posix_memalign( (void **) &ring, MIDI_CACHE_LINE_SIZE, sizeof( struct MIDIMessageRing ) ) ) {
+    return NULL;
+  }
+  ring->slots = malloc( size * sizeof( struct MIDIMessage * ) );
+  if( ring->slots == NULL ) {
+    free( ring );
+    return NULL;
+  }
+  ring->mask        = size - 1;
+  ring->head        = 0;
+  ring->cached_tail = 0;
+  ring->tail        = 0;
+  ring->cached_head = 0;
+  return ring;
+}
+
+static void _ring_destroy( struct MIDIMessageRing * ring ) {
+  size_t i;
+  for( i=ring->head; i!=ring->tail; i++ ) {
+    MIDIMessageRelease( ring->slots[i & ring->mask] );
+  }
+  free( ring->slots );
+  free( ring );
+}
+
+/**
+ * @brief Store a message in the ring.
+ * Must only be called from the producer thread.
+ * @private @memberof MIDIMessageQueue
+ * @param ring    The ring.
+ * @param message The message.
+ * @retval 0 on success.
+ * @retval 1 if the ring is full.
+ */
+static int _ring_push( struct MIDIMessageRing * ring, struct MIDIMessage * message ) {
+  size_t tail = ring->tail;
+  if( tail - ring->cached_head > ring->mask ) {
+    ring->cached_head = ATOMIC_LOAD_ACQUIRE( &(ring->head) );
+    if( tail - ring->cached_head > ring->mask ) return 1;
+  }
+  ring->slots[tail & ring->mask] = message;
+  ATOMIC_STORE_RELEASE( &(ring->tail), tail + 1 );
+  return 0;
+}
+
+/**
+ * @brief Get the first message in the ring.
+ * Must only be called from the consumer thread.
+ * @private @memberof MIDIMessageQueue
+ * @param ring    The ring.
+ * @param message The message or @c NULL if the ring is empty.
+ * @param remove  If nonzero, remove the message from the ring.
+ */
+static void _ring_pop( struct MIDIMessageRing * ring, struct MIDIMessage ** message, int remove ) {
+  size_t head = ring->head;
+  if( head == ring->cached_tail ) {
+    ring->cached_tail = ATOMIC_LOAD_ACQUIRE( &(ring->tail) );
+    if( head == ring->cached_tail ) {
+      *message = NULL;
+      return;
+    }
+  }
+  *message = ring->slots[head & ring->mask];
+  if( remove ) {
+    ATOMIC_STORE_RELEASE( &(ring->head), head + 1 );
+  }
+}
+
+static struct MIDIMessageFanIn * _fanin_create( size_t capacity ) {
+  struct MIDIMessageFanIn * fanin;
+  size_t i, size = 2;
+  while( size < capacity ) size <<= 1;
+
+  if( posix_memalign( (void **) &fanin, MIDI_CACHE_LINE_SIZE, sizeof( struct MIDIMessageFanIn ) ) ) {
+    return NULL;
+  }
+  fanin->slots = malloc( size * sizeof( struct MIDIMessageSlot ) );
+  fanin->heap  = malloc( size * sizeof( struct MIDIMessageHeapEntry ) );
+  if( fanin->slots == NULL || fanin->heap == NULL ) {
+    free( fanin->slots );
+    free( fanin->heap );
+    free( fanin );
+    return NULL;
+  }
+  for( i=0; i<size; i++ ) {
+    fanin->slots[i].seq     = i;
+    fanin->slots[i].message = NULL;
+  }
+  fanin->mask   = size - 1;
+  fanin->tail   = 0;
+  fanin->head   = 0;
+  fanin->length = 0;
+  return fanin;
+}
+
+static void _fanin_destroy( struct MIDIMessageFanIn * fanin ) {
+  struct MIDIMessageSlot * slot;
+  size_t i;
+  for( i=0; i<fanin->length; i++ ) {
+    MIDIMessageRelease( fanin->heap[i].message );
+  }
+  for( i=fanin->head; ; i++ ) {
+    slot = &(fanin->slots[i & fanin->mask]);
+    if( slot->seq != i + 1 ) break;
+    MIDIMessageRelease( slot->message );
+  }
+  free( fanin->slots );
+  free( fanin->heap );
+  free( fanin );
+}
+
+/**
+ * @brief Store a message in the fan-in ring.
+ * May be called from any number of threads at the same time.
+ * @private @memberof MIDIMessageQueue
+ * @param fanin   The fan-in ring.
+ * @param message The message.
+ * @retval 0 on success.
+ * @retval 1 if the ring is full.
+ */
+static int _fanin_push( struct MIDIMessageFanIn * fanin, struct MIDIMessage * message ) {
+  struct MIDIMessageSlot * slot;
+  size_t pos, seq;
+  long dif;
+
+  pos = ATOMIC_LOAD_RELAXED( &(fanin->tail) );
+  for(;;) {
+    slot = &(fanin->slots[pos & fanin->mask]);
+    seq  = ATOMIC_LOAD_ACQUIRE( &(slot->seq) );
+    dif  = (long) seq - (long) pos;
+    if( dif == 0 ) {
+      if( ATOMIC_CAS_WEAK( &(fanin->tail), &pos, pos + 1 ) ) break;
+    } else if( dif < 0 ) {
+      return 1;
+    } else {
+      pos = ATOMIC_LOAD_RELAXED( &(fanin->tail) );
+    }
+  }
+  slot->message = message;
+  ATOMIC_STORE_RELEASE( &(slot->seq), pos + 1 );
+  return 0;
+}
+
+static int _heap_less( struct MIDIMessageHeapEntry * a, struct MIDIMessageHeapEntry * b ) {
+  return ( a->timestamp < b->timestamp ) ||
+         ( a->timestamp == b->timestamp && a->order < b->order );
+}
+
+static void _heap_insert( struct MIDIMessageFanIn * fanin, struct MIDIMessageHeapEntry * entry ) {
+  struct MIDIMessageHeapEntry * heap = fanin->heap;
+  size_t i = fanin->length++, parent;
+  while( i > 0 ) {
+    parent = (i-1) / 2;
+    if( ! _heap_less( entry, &heap[parent] ) ) break;
+    heap[i] = heap[parent];
+    i = parent;
+  }
+  heap[i] = *entry;
+}
+
+static void _heap_remove_first( struct MIDIMessageFanIn * fanin ) {
+  struct MIDIMessageHeapEntry * heap = fanin->heap;
+  struct MIDIMessageHeapEntry last = heap[--fanin->length];
+  size_t i = 0, child, n = fanin->length;
+  while( (child = 2*i+1) < n ) {
+    if( child+1 < n && _heap_less( &heap[child+1], &heap[child] ) ) child++;
+    if( ! _heap_less( &heap[child], &last ) ) break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = last;
+}
+
+/**
+ * @brief Move all published messages from the ring into the reorder heap.
+ * Must only be called from the consumer thread.
+ * @private @memberof MIDIMessageQueue
+ * @param fanin The fan-in ring.
+ */
+static void _fanin_collect( struct MIDIMessageFanIn * fanin ) {
+  struct MIDIMessageSlot * slot;
+  struct MIDIMessageHeapEntry entry;
+  size_t head = fanin->head;
+
+  while( fanin->length <= fanin->mask ) {
+    slot = &(fanin->slots[head & fanin->mask]);
+    if( ATOMIC_LOAD_ACQUIRE( &(slot->seq) ) != head + 1 ) break;
+    entry.message = slot->message;
+    entry.order   = head;
+    MIDIMessageGetTimestamp( entry.message, &(entry.timestamp) );
+    ATOMIC_STORE_RELEASE( &(slot->seq), head + fanin->mask + 1 );
+    _heap_insert( fanin, &entry );
+    head++;
+  }
+  fanin->head = head;
+}
+
+/**
+ * @}
+ * @endcond
+ */
+
 /* MARK: Creation and destruction *//**
  * @name Creation and destruction
  * Creating, destroying and reference counting of MIDIMessageQueue objects.
@@ -39,9 +353,64 @@ struct MIDIMessageQueue * MIDIMessageQueueCreate() {
   queue->length = 0;
   queue->first  = NULL;
   queue->last   = NULL;
+  queue->ring   = NULL;
+  queue->fanin  = NULL;
   return queue;
 };
 
+/**
+ * @brief Create a lock-free MIDIMessageQueue instance.
+ * Allocate space and initialize a bounded MIDIMessageQueue that stores its
+ * messages in a ring buffer. One thread may push messages while another
+ * thread pops them without any locking. The capacity is rounded up to the
+ * next power of two.
+ * @public @memberof MIDIMessageQueue
+ * @param capacity The minimum number of messages the queue can hold.
+ * @return a pointer to the created queue structure on success.
+ * @return a @c NULL pointer if the queue could not created.
+ */
+struct MIDIMessageQueue * MIDIMessageQueueCreateRing( size_t capacity ) {
+  struct MIDIMessageQueue * queue;
+  MIDIPrecondReturn( capacity > 0, EINVAL, NULL );
+  queue = MIDIMessageQueueCreate();
+  if( queue == NULL ) return NULL;
+
+  queue->ring = _ring_create( capacity );
+  if( queue->ring == NULL ) {
+    MIDIMessageQueueDestroy( queue );
+    MIDIError( ENOMEM, "Could not allocate message ring." );
+    return NULL;
+  }
+  return queue;
+}
+
+/**
+ * @brief Create a lock-free fan-in MIDIMessageQueue instance.
+ * Allocate space and initialize a bounded MIDIMessageQueue that many threads
+ * (for example several drivers) can push messages to without locking. A
+ * single consumer thread pops the messages in timestamp order. Messages with
+ * the same timestamp are popped in the order they were pushed. The capacity
+ * is rounded up to the next power of two.
+ * @public @memberof MIDIMessageQueue
+ * @param capacity The minimum number of messages the queue can hold.
+ * @return a pointer to the created queue structure on success.
+ * @return a @c NULL pointer if the queue could not created.
+ */
+struct MIDIMessageQueue * MIDIMessageQueueCreateFanIn( size_t capacity ) {
+  struct MIDIMessageQueue * queue;
+  MIDIPrecondReturn( capacity > 0, EINVAL, NULL );
+  queue = MIDIMessageQueueCreate();
+  if( queue == NULL ) return NULL;
+
+  queue->fanin = _fanin_create( capacity );
+  if( queue->fanin == NULL ) {
+    MIDIMessageQueueDestroy( queue );
+    MIDIError( ENOMEM, "Could not allocate message ring." );
+    return NULL;
+  }
+  return queue;
+}
+
 /**
  * @brief Destroy a MIDIMessageQueue instance.
  * Free all resources occupied by the queue and release all referenced messages.
@@ -61,6 +430,12 @@ void MIDIMessageQueueDestroy( struct MIDIMessageQueue * queue ) {
     free( item );
     item = next;
   }
+  if( queue->ring != NULL ) {
+    _ring_destroy( queue->ring );
+  }
+  if( queue->fanin != NULL ) {
+    _fanin_destroy( queue->fanin );
+  }
   free( queue );
 }
 
@@ -109,12 +484,42 @@ void MIDIMessageQueueRelease( struct MIDIMessageQueue * queue ) {
 int MIDIMessageQueueGetLength( struct MIDIMessageQueue * queue, size_t * length ) {
   MIDIPrecond( queue != NULL, EFAULT );
   MIDIPrecond( length != NULL, EINVAL );
-  *length = queue->length;
+  if( queue->ring != NULL ) {
+    *length = ATOMIC_LOAD_ACQUIRE( &(queue->ring->tail) )
+            - ATOMIC_LOAD_ACQUIRE( &(queue->ring->head) );
+  } else if( queue->fanin != NULL ) {
+    *length = ATOMIC_LOAD_ACQUIRE( &(queue->fanin->tail) )
+            - queue->fanin->head + queue->fanin->length;
+  } else {
+    *length = queue->length;
+  }
+  return 0;
+}
+
+/**
+ * @brief Get the capacity of a message queue.
+ * @public @memberof MIDIMessageQueue
+ * @param queue    The message queue.
+ * @param capacity The maximum number of messages, zero if the queue is unbounded.
+ * @retval 0 on success.
+ * @retval >0 if the capacity could not be determined.
+ */
+int MIDIMessageQueueGetCapacity( struct MIDIMessageQueue * queue, size_t * capacity ) {
+  MIDIPrecond( queue != NULL, EFAULT );
+  MIDIPrecond( capacity != NULL, EINVAL );
+  if( queue->ring != NULL ) {
+    *capacity = queue->ring->mask + 1;
+  } else if( queue->fanin != NULL ) {
+    *capacity = queue->fanin->mask + 1;
+  } else {
+    *capacity = 0;
+  }
   return 0;
 }
 
 /**
  * Add a message to the end queue.
+ * The message is retained, the caller keeps its own reference.
  * @public @memberof MIDIMessageQueue
  * @param queue The message queue.
  * @param message The message.
@@ -122,9 +527,44 @@ int MIDIMessageQueueGetLength( struct MIDIMessageQueue * queue, size_t * length
  * @retval >0 if the item could not be added.
  */
 int MIDIMessageQueuePush( struct MIDIMessageQueue * queue, struct MIDIMessage * message ) {
+  int result;
+  result = MIDIMessageQueueTryPush( queue, message );
+  if( result == 1 ) {
+    MIDIError( ENOBUFS, "Message queue is full." );
+    return ENOBUFS;
+  }
+  return result;
+}
+
+/**
+ * Try to add a message to the end of the queue.
+ * In contrast to MIDIMessageQueuePush a full queue is not treated as an error.
+ * The message is retained if it was added, the caller keeps its own reference.
+ * A producer that pushes to a ring or fan-in queue from another thread than
+ * the consumer should use MIDIMessageQueueTryPushTransfer instead. Unless
+ * midikit was built with MIDI_ATOMIC_REFS, releasing its own reference after
+ * the push races with the consumer releasing the queue's reference.
+ * @public @memberof MIDIMessageQueue
+ * @param queue The message queue.
+ * @param message The message.
+ * @retval 0 on success.
+ * @retval 1 if the queue is full.
+ * @retval >1 if the item could not be added.
+ */
+int MIDIMessageQueueTryPush( struct MIDIMessageQueue * queue, struct MIDIMessage * message ) {
   struct MIDIMessageList * item;
+  int result;
   MIDIPrecond( queue != NULL, EFAULT );
   MIDIPrecond( message != NULL, EINVAL );
+  if( queue->ring != NULL || queue->fanin != NULL ) {
+    MIDIMessageRetain( message );
+    result = MIDIMessageQueueTryPushTransfer( queue, message );
+    if( result != 0 ) {
+      MIDIMessageRelease( message );
+    }
+    return result;
+  }
+  MIDIRealTimeCheck( MIDI_REALTIME_ALLOCATION );
   item = malloc( sizeof( struct MIDIMessageList ) );
   MIDIPrecond( item != NULL, ENOMEM );
   
@@ -142,6 +582,35 @@ int MIDIMessageQueuePush( struct MIDIMessageQueue * queue, struct MIDIMessage *
   return 0;
 }
 
+/**
+ * Try to add a message to the end of the queue and take over the caller's reference.
+ * This is the only push function that does not retain the message. A producer
+ * thread never touches the message's reference count after it became visible
+ * to the consumer. On failure the caller keeps its reference.
+ * @public @memberof MIDIMessageQueue
+ * @param queue The message queue.
+ * @param message The message.
+ * @retval 0 on success.
+ * @retval 1 if the queue is full.
+ * @retval >1 if the item could not be added.
+ */
+int MIDIMessageQueueTryPushTransfer( struct MIDIMessageQueue * queue, struct MIDIMessage * message ) {
+  int result;
+  MIDIPrecond( queue != NULL, EFAULT );
+  MIDIPrecond( message != NULL, EINVAL );
+  if( queue->ring != NULL ) {
+    return _ring_push( queue->ring, message );
+  }
+  if( queue->fanin != NULL ) {
+    return _fanin_push( queue->fanin, message );
+  }
+  result = MIDIMessageQueueTryPush( queue, message );
+  if( result == 0 ) {
+    MIDIMessageRelease( message );
+  }
+  return result;
+}
+
 /**
  * Get the message at the beginning of the queue but do not remove it.
  * @public @memberof MIDIMessageQueue
@@ -154,7 +623,12 @@ int MIDIMessageQueuePeek( struct MIDIMessageQueue * queue, struct MIDIMessage **
   MIDIPrecond( queue != NULL, EFAULT );
   MIDIPrecond( message != NULL, EINVAL );
 
-  if( queue->first != NULL ) {
+  if( queue->ring != NULL ) {
+    _ring_pop( queue->ring, message, 0 );
+  } else if( queue->fanin != NULL ) {
+    _fanin_collect( queue->fanin );
+    *message = ( queue->fanin->length > 0 ) ? queue->fanin->heap[0].message : NULL;
+  } else if( queue->first != NULL ) {
     *message = queue->first->message;
   } else {
     *message = NULL;
@@ -164,6 +638,7 @@ int MIDIMessageQueuePeek( struct MIDIMessageQueue * queue, struct MIDIMessage **
 
 /**
  * Remove the first message in the queue and store it.
+ * For fan-in queues the first message is the one with the earliest timestamp.
  * @public @memberof MIDIMessageQueue
  * @param queue The queue.
  * @param message The message.
@@ -175,6 +650,21 @@ int MIDIMessageQueuePop( struct MIDIMessageQueue * queue, struct MIDIMessage **
   MIDIPrecond( queue != NULL, EFAULT );
   MIDIPrecond( message != NULL, EINVAL );
 
+  if( queue->ring != NULL ) {
+    _ring_pop( queue->ring, message, 1 );
+    return 0;
+  }
+  if( queue->fanin != NULL ) {
+    _fanin_collect( queue->fanin );
+    if( queue->fanin->length > 0 ) {
+      *message = queue->fanin->heap[0].message;
+      _heap_remove_first( queue->fanin );
+    } else {
+      *message = NULL;
+    }
+    return 0;
+  }
+
   item = queue->first;
   if( item != NULL ) {
     *message     = item->message;
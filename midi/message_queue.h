@@ -7,13 +7,18 @@ struct MIDIMessage;
 struct MIDIMessageQueue;
 
 struct MIDIMessageQueue * MIDIMessageQueueCreate();
+struct MIDIMessageQueue * MIDIMessageQueueCreateRing( size_t capacity );
+struct MIDIMessageQueue * MIDIMessageQueueCreateFanIn( size_t capacity );
 void MIDIMessageQueueDestroy( struct MIDIMessageQueue * queue );
 void MIDIMessageQueueRetain( struct MIDIMessageQueue * queue );
 void MIDIMessageQueueRelease( struct MIDIMessageQueue * queue );
 
 int MIDIMessageQueueGetLength( struct MIDIMessageQueue * queue, size_t * length );
+int MIDIMessageQueueGetCapacity( struct MIDIMessageQueue * queue, size_t * capacity );
 
 int MIDIMessageQueuePush( struct MIDIMessageQueue * queue, struct MIDIMessage * message );
+int MIDIMessageQueueTryPush( struct MIDIMessageQueue * queue, struct MIDIMessage * message );
+int MIDIMessageQueueTryPushTransfer( struct MIDIMessageQueue * queue, struct MIDIMessage * message );
 int MIDIMessageQueuePeek( struct MIDIMessageQueue * queue, struct MIDIMessage ** message );
 int MIDIMessageQueuePop( struct MIDIMessageQueue * queue, struct MIDIMessage ** message );
 
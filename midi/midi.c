@@ -107,6 +107,8 @@ MIDILogFunction MIDILogger = NULL;
 /**
  * @def MIDILog
  * @brief Send a message to the MIDI logger.
+ * Messages are dropped on threads in real-time mode (see
+ * MIDIRealTimeEnter).
  * @param channels The log channels to use for logging.
  * @param ...      The log message format and variable arguments.
  * @return This macro can not be used as an lvalue.
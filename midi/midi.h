@@ -296,6 +296,8 @@ typedef int (*MIDILogFunction)( int, const char *, ... );
 extern MIDILogFunction MIDILogger;
 extern int MIDIErrorNumber;
 
+int MIDIRealTimeCheckLog( void );
+
 #define EASSERT -1
 
 #define MIDI_LOG_1        0x01
@@ -314,7 +316,7 @@ extern int MIDIErrorNumber;
 
 #ifndef NO_LOG
 #define MIDILog( channel, ... ) \
-do { if( MIDILogger != NULL ) { (*MIDILogger)( MIDI_LOG_ ## channel, __VA_ARGS__ ); } } while( 0 )
+do { if( MIDILogger != NULL && ! MIDIRealTimeCheckLog() ) { (*MIDILogger)( MIDI_LOG_ ## channel, __VA_ARGS__ ); } } while( 0 )
 #ifdef SUBDIR
 #define MIDILogLocation( channel, fmt, ... ) \
 MIDILog( channel, "%s/%s:%i: " fmt, SUBDIR, __FILE__, __LINE__, __VA_ARGS__ );
@@ -366,6 +368,39 @@ do { if( !(expr) ) { \
 #define MIDIPrecond( expr, kind )
 #endif
 
+/*
+ * Reference counting.
+ * Reference counts are plain integers by default, so an object must not
+ * be retained or released by two threads at the same time. Build with
+ * -DMIDI_ATOMIC_REFS to make MIDIMessage, MIDIPort, MIDIList, MIDIDriver,
+ * MIDIDevice and MIDIClock reference counts atomic. Retaining is relaxed,
+ * releasing is acquire-release so that the thread that destroys an object
+ * sees every write made through the released references.
+ * A release by the only owner skips the atomic decrement: nobody else can
+ * retain the object at that point, so objects that are created, passed on
+ * and released on one thread pay for a single load.
+ */
+#define MIDI_REFS_GET_PLAIN( r )     (r)
+#define MIDI_REFS_RETAIN_PLAIN( r )  (++(r))
+#define MIDI_REFS_RELEASE_PLAIN( r ) (--(r))
+
+#define MIDI_REFS_GET_ATOMIC( r )     __atomic_load_n( &(r), __ATOMIC_RELAXED )
+#define MIDI_REFS_RETAIN_ATOMIC( r )  __atomic_add_fetch( &(r), 1, __ATOMIC_RELAXED )
+#define MIDI_REFS_RELEASE_ATOMIC( r ) \
+  ( ( __atomic_load_n( &(r), __ATOMIC_ACQUIRE ) == 1 ) \
+    ? ( __atomic_store_n( &(r), 0, __ATOMIC_RELAXED ), 0 ) \
+    : __atomic_sub_fetch( &(r), 1, __ATOMIC_ACQ_REL ) )
+
+#ifdef MIDI_ATOMIC_REFS
+#define MIDI_REFS_GET( r )     MIDI_REFS_GET_ATOMIC( r )
+#define MIDI_REFS_RETAIN( r )  MIDI_REFS_RETAIN_ATOMIC( r )
+#define MIDI_REFS_RELEASE( r ) MIDI_REFS_RELEASE_ATOMIC( r )
+#else
+#define MIDI_REFS_GET( r )     MIDI_REFS_GET_PLAIN( r )
+#define MIDI_REFS_RETAIN( r )  MIDI_REFS_RETAIN_PLAIN( r )
+#define MIDI_REFS_RELEASE( r ) MIDI_REFS_RELEASE_PLAIN( r )
+#endif
+
 /**
  * @addtogroup MIDI
  * @{
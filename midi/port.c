@@ -3,6 +3,7 @@
 #include "midi.h"
 #include "list.h"
 #include "port.h"
+#include "message.h"
 
 /**
  * @ingroup MIDI
@@ -32,6 +33,24 @@ struct MIDIPort {
  */
 MIDI_TYPE_SPEC_OBJECT( MIDIPort, 0x3000 );
 
+/**
+ * @brief Declare the MIDIPortBatch type specification.
+ * Batches are only borrowed while they are passed through ports and
+ * are not reference counted.
+ * @relates MIDIPortBatch
+ */
+MIDI_TYPE_SPEC( MIDIPortBatch, 0x3001, NULL, NULL, NULL, NULL );
+
+/**
+ * @ingroup MIDI
+ * @struct MIDIPortBatch port.h
+ * @brief A borrowed array of objects of the same type.
+ * Batches are sent through ports like a single object, so observers
+ * and connected ports are visited once per batch instead of once per
+ * object. Ports that were created with @c MIDI_PORT_BATCH receive the
+ * whole batch, all other ports receive the objects one by one.
+ */
+
 /**
  * @def MIDI_PORT_IN
  * @brief Port mode for ports that can be used to receive messages.
@@ -54,6 +73,12 @@ MIDI_TYPE_SPEC_OBJECT( MIDIPort, 0x3000 );
  * intercepted by an observer.
  * @relates MIDIPort
  */
+/**
+ * @def MIDI_PORT_BATCH
+ * @brief Port mode for ports that receive MIDIPortBatch objects as a
+ * whole instead of one object at a time.
+ * @relates MIDIPort
+ */
 /**
  * @def MIDI_PORT_INVALID
  * @brief Marker for invalidated ports.
@@ -73,6 +98,7 @@ MIDI_TYPE_SPEC_OBJECT( MIDIPort, 0x3000 );
  */
 struct MIDIPortApplyParams {
   struct MIDIPort * port;     /**< source port */
+  struct MIDIList * ports;    /**< list that is applied */
   struct MIDITypeSpec * type; /**< message type */
   void * object;              /**< message data */
 };
@@ -93,7 +119,7 @@ static int _port_apply_send( void * item, void * info ) {
   struct MIDIPortApplyParams * params = info;
   if( port->mode & MIDI_PORT_INVALID ) {
     MIDIPortRetain( port );
-    MIDIListRemove( params->port->ports, port );
+    MIDIListRemoveCurrent( params->ports );
     MIDIPortRelease( port );
     return 0;
   } else if( port != params->port ) {
@@ -120,7 +146,7 @@ static int _port_apply_check( void * item, void * info ) {
     /* retain the port, before removing to avoid recursion
      * release the port *after* it was removed from the list */
     MIDIPortRetain( port );
-    MIDIListRemove( source->ports, port );
+    MIDIListRemoveCurrent( source->ports );
     MIDIPortRelease( port );
   }
   return 0;
@@ -160,6 +186,48 @@ static int _port_intercept( struct MIDIPort * port, int mode, struct MIDITypeSpe
   }
 }
 
+/**
+ * @brief Pass an object to the port's receive callback.
+ * Batches are split into their objects if the port does not handle
+ * batches itself. Arrays of packed messages are unpacked into
+ * MIDIMessage objects for those ports.
+ * @private @memberof MIDIPort
+ * @param port   The port.
+ * @param source The target of the source port or @c NULL.
+ * @param type   The type of the message.
+ * @param object The message.
+ * @retval 0 on success.
+ */
+static int _port_receive( struct MIDIPort * port, void * source, struct MIDITypeSpec * type, void * object ) {
+  struct MIDIPortBatch * batch = object;
+  struct MIDIPackedMessageArray * array = object;
+  struct MIDIMessage * message;
+  size_t i;
+  int result = 0;
+  MIDIAssert( port != NULL );
+  if( port->mode & MIDI_PORT_BATCH ) {
+    return (*port->receive)( port->target, source, type, object );
+  }
+  if( type == MIDIPackedMessageArrayType ) {
+    for( i=0; i<array->count; i++ ) {
+      if( MIDIPackedMessageToMessage( &(array->messages[i]), &message ) ) {
+        result++;
+        continue;
+      }
+      result += (*port->receive)( port->target, source, MIDIMessageType, message );
+      MIDIMessageRelease( message );
+    }
+    return result;
+  }
+  if( type != MIDIPortBatchType ) {
+    return (*port->receive)( port->target, source, type, object );
+  }
+  for( i=0; i<batch->count; i++ ) {
+    result += (*port->receive)( port->target, source, batch->type, batch->objects[i] );
+  }
+  return result;
+}
+
 /**
  * @brief Handle the internal passthrough.
  * Forward the received message to all connected ports.
@@ -176,6 +244,7 @@ static int _port_passthrough( struct MIDIPort * port, struct MIDIPort * source,
   MIDIAssert( port->mode & MIDI_PORT_THRU );
   _port_intercept( port, MIDI_PORT_THRU, type, object );
   params.port   = source;
+  params.ports  = port->ports;
   params.type   = type;
   params.object = object;
   return MIDIListApply( port->ports, &params, &_port_apply_send );
@@ -269,7 +338,7 @@ void MIDIPortDestroy( struct MIDIPort * port ) {
  */
 void MIDIPortRetain( struct MIDIPort * port ) {
   MIDIPrecondReturn( port != NULL, EFAULT, (void)0 );
-  port->refs++;
+  MIDI_REFS_RETAIN( port->refs );
 }
 
 /**
@@ -283,11 +352,11 @@ void MIDIPortRetain( struct MIDIPort * port ) {
  */
 void MIDIPortRelease( struct MIDIPort * port ) {
   MIDIPrecondReturn( port != NULL, EFAULT, (void)0 );
-  if( port->refs > 1 ) {
+  if( MIDI_REFS_GET( port->refs ) > 1 ) {
     MIDIListApply( port->ports, port, &_port_apply_check );
   }
-  MIDILogLocation( DEVELOP, "Release port %s [%p] (%i -> %i)\n", port->name, port, port->refs, port->refs -1 );
-  if( ! --port->refs ) {
+  MIDILogLocation( DEVELOP, "Release port %s [%p] (%i -> %i)\n", port->name, port, MIDI_REFS_GET( port->refs ), MIDI_REFS_GET( port->refs ) - 1 );
+  if( MIDI_REFS_RELEASE( port->refs ) == 0 ) {
     MIDIPortDestroy( port );
   }
 }
@@ -409,9 +478,9 @@ int MIDIPortReceiveFrom( struct MIDIPort * port, struct MIDIPort * source, struc
 
     _port_intercept( port, MIDI_PORT_IN, type, object );
     if( source != NULL ) {
-      result = (*port->receive)( port->target, source->target, type, object );
+      result = _port_receive( port, source->target, type, object );
     } else {
-      result = (*port->receive)( port->target, NULL, type, object );
+      result = _port_receive( port, NULL, type, object );
     }
     if( port->mode & MIDI_PORT_THRU ) {
       return result + _port_passthrough( port, source, type, object );
@@ -478,10 +547,33 @@ int MIDIPortSend( struct MIDIPort * port, struct MIDITypeSpec * type, void * obj
   } else {
     _port_intercept( port, MIDI_PORT_OUT, type, object );
     params.port   = port;
+    params.ports  = port->ports;
     params.type   = type;
     params.object = object;
     return MIDIListApply( port->ports, &params, &_port_apply_send );
   }
 }
 
+/**
+ * @brief Send several messages to all connected ports at once.
+ * The messages are wrapped in a MIDIPortBatch that is intercepted and
+ * passed to every connected port once. Ports that do not handle
+ * batches receive the messages one by one.
+ * @public @memberof MIDIPort
+ * @param port    The source port.
+ * @param type    The type of the messages.
+ * @param count   The number of messages.
+ * @param objects The messages.
+ * @retval 0 on success.
+ */
+int MIDIPortSendBatch( struct MIDIPort * port, struct MIDITypeSpec * type, size_t count, void ** objects ) {
+  struct MIDIPortBatch batch;
+  MIDIPrecond( port != NULL, EFAULT );
+  MIDIPrecond( objects != NULL || count == 0, EINVAL );
+  batch.type    = type;
+  batch.count   = count;
+  batch.objects = objects;
+  return MIDIPortSend( port, MIDIPortBatchType, &batch );
+}
+
 /** @} */
@@ -1,15 +1,24 @@
 #ifndef MIDIKIT_MIDI_PORT_H
 #define MIDIKIT_MIDI_PORT_H
+#include <stdlib.h>
 #include "type.h"
 
 #define MIDI_PORT_IN      0x01
 #define MIDI_PORT_OUT     0x02
 #define MIDI_PORT_THRU    0x04
 #define MIDI_PORT_INVALID 0x08
+#define MIDI_PORT_BATCH   0x10
 
 struct MIDIPort;
 extern struct MIDITypeSpec * MIDIPortType;
 
+struct MIDIPortBatch {
+  struct MIDITypeSpec * type;
+  size_t count;
+  void ** objects;
+};
+extern struct MIDITypeSpec * MIDIPortBatchType;
+
 typedef int MIDIPortReceiveFn( void * target, void * source, struct MIDITypeSpec * type, void * object );
 typedef int MIDIPortInterceptFn( void * observer, struct MIDIPort * port, int mode, struct MIDITypeSpec * type, void * object );
 
@@ -32,5 +41,6 @@ int MIDIPortReceiveFrom( struct MIDIPort * port, struct MIDIPort * source, struc
 int MIDIPortReceive( struct MIDIPort * port, struct MIDITypeSpec * type, void * object );
 int MIDIPortSendTo( struct MIDIPort * port, struct MIDIPort * target, struct MIDITypeSpec * type, void * object );
 int MIDIPortSend( struct MIDIPort * port, struct MIDITypeSpec * type, void * object );
+int MIDIPortSendBatch( struct MIDIPort * port, struct MIDITypeSpec * type, size_t count, void ** objects );
 
 #endif
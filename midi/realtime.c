@@ -0,0 +1,171 @@
+#include "realtime.h"
+#include "message_pool.h"
+
+/*
+ * Real-time mode.
+ * Audio hosts call MIDIDeviceReceive and the device delegate from a thread
+ * that must not block: no allocation, no mutexes, no logging. A thread marks
+ * itself with MIDIRealTimeEnter. While the mark is set, every place on the
+ * delivery path that would allocate memory or take a lock counts a
+ * violation, and log messages are dropped (and counted) instead of being
+ * formatted and written.
+ * The objects on the path come from the real-time thread's default
+ * MIDIMessagePool, which MIDIRealTimeSetup sizes up front. A stream that stays within those sizes
+ * is delivered without any violation. Violations are not fatal, the
+ * operation still completes, so that a stream is never dropped because an
+ * arena was too small. Check MIDIRealTimeGetStats during testing and size
+ * the arenas so that the counters stay zero.
+ */
+
+/* MARK: Internals *//**
+ * @name Internals
+ * @cond INTERNALS
+ * @{
+ */
+
+#define ATOMIC_LOAD_RELAXED( p )     __atomic_load_n( p, __ATOMIC_RELAXED )
+#define ATOMIC_STORE_RELAXED( p, v ) __atomic_store_n( p, v, __ATOMIC_RELAXED )
+#define ATOMIC_ADD_FETCH( p, v )     __atomic_add_fetch( p, v, __ATOMIC_RELAXED )
+
+static __thread int _depth = 0;
+static size_t _violations[3] = { 0, 0, 0 };
+
+/**
+ * @}
+ * @endcond
+ */
+
+/* MARK: -
+ * MARK: Setup *//**
+ * @name Setup
+ * @{
+ */
+
+/**
+ * @brief Preallocate the arenas for real-time delivery.
+ * Create a message pool with the given number of message structures and
+ * system exclusive buffers and make it the default pool of the calling
+ * thread, so that MIDIMessageCreate and the message decoders take their
+ * objects from it on this thread. Other threads keep their own default pool.
+ * Call this on the real-time thread before it enters real-time mode, and
+ * reset the default pool with MIDIMessagePoolSetDefault before the thread
+ * exits. The messages may be released on any thread, the pool takes them
+ * back through its return list. Without -DMIDI_ATOMIC_REFS only one thread
+ * at a time may hold references to a message.
+ * @param messages The number of messages that may be alive at the same time.
+ * @param buffers  The number of system exclusive buffers of each size class
+ *                 that may be alive at the same time.
+ * @retval 0 on success.
+ * @retval >0 if the pool could not be created or set as the default pool.
+ */
+int MIDIRealTimeSetup( size_t messages, size_t buffers ) {
+  struct MIDIMessagePool * pool = MIDIMessagePoolCreate( messages, buffers );
+  int result;
+  MIDIPrecond( pool != NULL, ENOMEM );
+  result = MIDIMessagePoolSetDefault( pool );
+  MIDIMessagePoolRelease( pool );
+  return result;
+}
+
+/** @} */
+
+/* MARK: Real-time threads *//**
+ * @name Real-time threads
+ * @{
+ */
+
+/**
+ * @brief Put the calling thread into real-time mode.
+ * Calls may be nested, the thread stays in real-time mode until every
+ * MIDIRealTimeEnter was matched by a MIDIRealTimeLeave.
+ * @retval 0 on success.
+ */
+int MIDIRealTimeEnter( void ) {
+  _depth++;
+  return 0;
+}
+
+/**
+ * @brief Leave real-time mode on the calling thread.
+ * @retval 0 on success.
+ * @retval >0 if the thread was not in real-time mode.
+ */
+int MIDIRealTimeLeave( void ) {
+  MIDIPrecond( _depth > 0, EINVAL );
+  _depth--;
+  return 0;
+}
+
+/**
+ * @brief Check if the calling thread is in real-time mode.
+ * @retval 1 if the thread is in real-time mode.
+ * @retval 0 otherwise.
+ */
+int MIDIRealTimeIsActive( void ) {
+  return _depth > 0;
+}
+
+/**
+ * @brief Report an operation that is not real-time safe.
+ * Call this right before allocating memory or taking a lock on a path
+ * that may run on a real-time thread. Nothing happens unless the calling
+ * thread is in real-time mode.
+ * @param violation MIDI_REALTIME_ALLOCATION, MIDI_REALTIME_LOCK or
+ *                  MIDI_REALTIME_LOG.
+ * @retval 1 if the calling thread is in real-time mode and the violation
+ *           was counted.
+ * @retval 0 otherwise.
+ */
+int MIDIRealTimeCheck( int violation ) {
+  if( _depth == 0 ) return 0;
+  if( violation >= MIDI_REALTIME_ALLOCATION && violation <= MIDI_REALTIME_LOG ) {
+    ATOMIC_ADD_FETCH( &(_violations[violation]), 1 );
+  }
+  return 1;
+}
+
+/**
+ * @brief Check if a log message should be dropped.
+ * Used by MIDILog, log messages are formatted and written synchronously
+ * and must not happen on a real-time thread.
+ * @retval 1 if the calling thread is in real-time mode.
+ * @retval 0 otherwise.
+ */
+int MIDIRealTimeCheckLog( void ) {
+  return MIDIRealTimeCheck( MIDI_REALTIME_LOG );
+}
+
+/** @} */
+
+/* MARK: Statistics *//**
+ * @name Statistics
+ * Count the violations of all real-time threads.
+ * @{
+ */
+
+/**
+ * @brief Get the number of violations since the last reset.
+ * @param stats The structure to fill.
+ * @retval 0 on success.
+ * @retval >0 if the statistics could not be stored.
+ */
+int MIDIRealTimeGetStats( struct MIDIRealTimeStats * stats ) {
+  MIDIPrecond( stats != NULL, EINVAL );
+  stats->allocations = ATOMIC_LOAD_RELAXED( &(_violations[MIDI_REALTIME_ALLOCATION]) );
+  stats->locks       = ATOMIC_LOAD_RELAXED( &(_violations[MIDI_REALTIME_LOCK]) );
+  stats->logs        = ATOMIC_LOAD_RELAXED( &(_violations[MIDI_REALTIME_LOG]) );
+  return 0;
+}
+
+/**
+ * @brief Reset the violation counters.
+ * @retval 0 on success.
+ */
+int MIDIRealTimeResetStats( void ) {
+  ATOMIC_STORE_RELAXED( &(_violations[MIDI_REALTIME_ALLOCATION]), 0 );
+  ATOMIC_STORE_RELAXED( &(_violations[MIDI_REALTIME_LOCK]), 0 );
+  ATOMIC_STORE_RELAXED( &(_violations[MIDI_REALTIME_LOG]), 0 );
+  return 0;
+}
+
+/** @} */
@@ -0,0 +1,27 @@
+#ifndef MIDIKIT_MIDI_REALTIME_H
+#define MIDIKIT_MIDI_REALTIME_H
+#include <stdlib.h>
+#include "midi.h"
+
+#define MIDI_REALTIME_ALLOCATION 0
+#define MIDI_REALTIME_LOCK       1
+#define MIDI_REALTIME_LOG        2
+
+struct MIDIRealTimeStats {
+  size_t allocations; /**< Allocations on threads in real-time mode */
+  size_t locks;       /**< Mutexes taken on threads in real-time mode */
+  size_t logs;        /**< Log messages that were dropped in real-time mode */
+};
+
+int MIDIRealTimeSetup( size_t messages, size_t buffers );
+
+int MIDIRealTimeEnter( void );
+int MIDIRealTimeLeave( void );
+int MIDIRealTimeIsActive( void );
+
+int MIDIRealTimeGetStats( struct MIDIRealTimeStats * stats );
+int MIDIRealTimeResetStats( void );
+
+int MIDIRealTimeCheck( int violation );
+
+#endif
@@ -1,25 +1,115 @@
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
 #include <sys/select.h>
 #include <sys/time.h>
 #include <time.h>
+#if defined( __linux__ )
+#define HAVE_TIMERFD 1
+#include <poll.h>
+#include <sys/timerfd.h>
+#ifndef NO_EPOLL
+#define HAVE_EPOLL 1
+#include <sys/epoll.h>
+#endif
+#if ! defined( NO_IO_URING ) && defined( __has_include )
+#if __has_include( <linux/io_uring.h> )
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef IORING_RECV_MULTISHOT
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+#endif
 #include "runloop.h"
 #include "midi.h"
+#define MIDI_TIMER_WHEEL_INTERNALS
+#include "timer_wheel.h"
 
 #define CURRENT_RUNLOOP( rl ) do { _current_runloop = (rl); } while(0)
 
-#define MAX_RUNLOOP_SOURCES 16
+#define MAX_RUNLOOP_EVENTS  32
+#define RUNLOOP_TIMER_TICK  100000ULL
+#define RUNLOOP_INDEX_SIZE  64
 
-static struct MIDIRunloop * _current_runloop = NULL;
+#define FDSET_WORD( fd ) ( (fd) / NFDBITS )
+#define FDSET_MASK( fd ) ( (fd_mask) ( 1UL << ( (fd) % NFDBITS ) ) )
+
+static __thread struct MIDIRunloop * _current_runloop = NULL;
+
+/**
+ * @brief Operations of a runloop backend.
+ * A backend decides how the runloop waits for its file descriptors and
+ * timeouts. The select backend needs no state, the epoll backend keeps an
+ * epoll instance that is updated whenever the runloop's file descriptor sets
+ * change. Descriptors must be lower than @c nfds.
+ */
+struct MIDIRunloopBackend {
+  int  type;
+  int  nfds;
+  int  (*init)( struct MIDIRunloop * runloop );
+  void (*destroy)( struct MIDIRunloop * runloop );
+  int  (*update)( struct MIDIRunloop * runloop, int fd );
+  int  (*wait)( struct MIDIRunloop * runloop );
+};
+
+/**
+ * @brief A set of file descriptors that grows past FD_SETSIZE.
+ * The bits are laid out like an fd_set, so the set can be handed to select
+ * and to source delegates as an fd_set. A set uses the storage of an
+ * embedded fd_set until a descriptor of FD_SETSIZE or above is added.
+ */
+struct MIDIRunloopFdSet {
+  int       size;
+  fd_mask * bits;
+  fd_set    base;
+};
 
 struct MIDIRunloopSource {
   int    refs;
   int    nfds;
-  fd_set readfds;
-  fd_set writefds;
+  struct MIDIRunloopFdSet readfds;
+  struct MIDIRunloopFdSet writefds;
   struct timespec timeout_start;
   struct timespec timeout_time;
   struct MIDIRunloopSourceDelegate delegate;
+  int (*receive)( void * info, int fd, size_t size, void * data, socklen_t namelen, struct sockaddr * name );
   struct MIDIRunloop * runloop;
+  int      index;
+  unsigned stamp;
+  struct MIDITimerWheelEntry timeout_entry;
+  struct MIDIRunloopTimer  * timers;
+};
+
+/**
+ * @brief A one-shot timer that belongs to a runloop source.
+ * A source may own any number of timers. While the source is added to a
+ * runloop its scheduled timers are stored in the runloop's timer wheel.
+ */
+struct MIDIRunloopTimer {
+  int    refs;
+  int    scheduled;
+  unsigned long long deadline;
+  struct MIDIRunloopSource * source;
+  struct MIDIRunloopTimer  * next;
+  struct MIDIRunloopTimer  * prev;
+  struct MIDIRunloopTimerDelegate delegate;
+  struct MIDITimerWheelEntry entry;
+};
+
+/**
+ * @brief Map file descriptors to the sources that wait for them.
+ * If exactly one source waits for a descriptor it is stored as the owner,
+ * shared descriptors have no owner and are dispatched by scanning all
+ * sources. The arrays grow with the highest descriptor.
+ */
+struct MIDIRunloopFdIndex {
+  int size;
+  unsigned short * count;
+  struct MIDIRunloopSource ** owner;
 };
 
 struct MIDIRunloop {
@@ -27,41 +117,105 @@ struct MIDIRunloop {
   int    active;
   struct MIDIRunloopDelegate delegate;
   struct MIDIRunloopSource   master;
-  struct MIDIRunloopSource * sources[MAX_RUNLOOP_SOURCES];
+  struct MIDIRunloopSource ** sources;
+  int      length;
+  int      capacity;
+  int      dispatching;
+  int      holes;
+  unsigned stamp;
+  struct MIDITimerWheel * wheel;
+  struct MIDIRunloopFdIndex readers;
+  struct MIDIRunloopFdIndex writers;
+  struct MIDIRunloopBackend * backend;
+  int    epoll_fd;
+  int    timer_fd;
+  struct MIDIRunloopURing * uring;
+  struct MIDIRunloopFdSet registered;
+  struct MIDIRunloopFdSet readable;
+  struct MIDIRunloopFdSet writable;
+  struct timespec timer_deadline;
 };
 
-static int _fds_cmp( fd_set * a, fd_set * b, int nfds ) {
-  int fd;
-  for( fd=0; fd<nfds; fd++ ) {
-    if( FD_ISSET( fd, a ) != FD_ISSET( fd, b ) ) {
-      return 1;
-    }
+static void _fdset_init( struct MIDIRunloopFdSet * set ) {
+  FD_ZERO( &(set->base) );
+  set->size = FD_SETSIZE;
+  set->bits = (fd_mask *) &(set->base);
+}
+
+static void _fdset_free( struct MIDIRunloopFdSet * set ) {
+  if( set->bits != (fd_mask *) &(set->base) ) {
+    free( set->bits );
   }
-  return 0;
 }
 
-static int _fds_check2( fd_set * fds, fd_set * chk, int nfds ) {
-  int fd;
-  for( fd=0; fd<nfds; fd++ ) {
-    if( FD_ISSET( fd, chk ) && FD_ISSET( fd, fds ) ) {
-      return 1;
-    }
+static fd_set * _fdset_get( struct MIDIRunloopFdSet * set ) {
+  return (fd_set *) set->bits;
+}
+
+/**
+ * @brief Make room for a file descriptor in a set.
+ * @param set The set.
+ * @param fd  The file descriptor.
+ * @retval 0 on success.
+ * @retval >0 if the set could not be grown.
+ */
+static int _fdset_reserve( struct MIDIRunloopFdSet * set, int fd ) {
+  fd_mask * bits;
+  int size = set->size;
+
+  if( fd < size ) return 0;
+  while( size <= fd ) size *= 2;
+  bits = calloc( size / NFDBITS, sizeof(fd_mask) );
+  if( bits == NULL ) {
+    MIDIError( ENOMEM, "Could not grow file descriptor set." );
+    return ENOMEM;
   }
+  memcpy( bits, set->bits, ( set->size / NFDBITS ) * sizeof(fd_mask) );
+  _fdset_free( set );
+  set->bits = bits;
+  set->size = size;
   return 0;
 }
 
+static int _fdset_isset( struct MIDIRunloopFdSet * set, int fd ) {
+  return fd < set->size && ( set->bits[FDSET_WORD( fd )] & FDSET_MASK( fd ) ) != 0;
+}
+
+static void _fdset_set( struct MIDIRunloopFdSet * set, int fd ) {
+  set->bits[FDSET_WORD( fd )] |= FDSET_MASK( fd );
+}
+
+static void _fdset_clr( struct MIDIRunloopFdSet * set, int fd ) {
+  if( fd < set->size ) {
+    set->bits[FDSET_WORD( fd )] &= ~FDSET_MASK( fd );
+  }
+}
+
+/**
+ * @brief Get a word of an fd_set without the bits of descriptors >= nfds.
+ */
+static fd_mask _fds_word( fd_set * fds, int i, int nfds ) {
+  fd_mask word = ((fd_mask *) fds)[i];
+  if( ( i + 1 ) * NFDBITS > nfds ) {
+    word &= (fd_mask) ( ( 1UL << ( nfds % NFDBITS ) ) - 1 );
+  }
+  return word;
+}
+
 static int _fds_check( fd_set * fds, int nfds ) {
-  fd_set empty;
-  FD_ZERO( &empty );
-  return _fds_cmp( fds, &empty, nfds );
+  int i;
+  for( i=0; i*NFDBITS<nfds; i++ ) {
+    if( _fds_word( fds, i, nfds ) ) {
+      return 1;
+    }
+  }
+  return 0;
 }
 
 static int _fds_add( fd_set * lhs, fd_set * rhs, int nfds ) {
-  int fd;
-  for( fd=0; fd<nfds; fd++ ) {
-    if( FD_ISSET( fd, rhs ) ) {
-      FD_SET( fd, lhs );
-    }
+  int i;
+  for( i=0; i*NFDBITS<nfds; i++ ) {
+    ((fd_mask *) lhs)[i] |= _fds_word( rhs, i, nfds );
   }
   return 0;
 }
@@ -72,11 +226,9 @@ static int _fds_cpy( fd_set * lhs, fd_set * rhs, int nfds ) {
 }
 
 static int _fds_sub( fd_set * lhs, fd_set * rhs, int nfds ) {
-  int fd;
-  for( fd=0; fd<nfds; fd++ ) {
-    if( FD_ISSET( fd, rhs ) ) {
-      FD_CLR( fd, lhs );
-    }
+  int i;
+  for( i=0; i*NFDBITS<nfds; i++ ) {
+    ((fd_mask *) lhs)[i] &= ~_fds_word( rhs, i, nfds );
   }
   return 0;
 }
@@ -153,14 +305,31 @@ static void _timeval_from_timespec( struct timeval * tv, struct timespec * ts )
   tv->tv_usec = ts->tv_nsec / 1000;
 }
 
+static unsigned long long _timespec_ns( struct timespec * ts ) {
+  return (unsigned long long) ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static int _runloop_source_timeout_fire( void * info, struct timespec * now );
+
+/**
+ * @brief Create a MIDIRunloopSource instance.
+ * The read callback is invoked with the set of readable descriptors. A
+ * source that also sets a receive callback with MIDIRunloopSourceSetReceive
+ * may instead be handed every datagram that the runloop received on a
+ * socket only it reads, so the read callback must not rely on being invoked
+ * for every datagram.
+ * @public @memberof MIDIRunloopSource
+ * @param delegate The delegate with the callbacks, may be @c NULL.
+ * @return a pointer to the created source.
+ */
 struct MIDIRunloopSource * MIDIRunloopSourceCreate( struct MIDIRunloopSourceDelegate * delegate ) {
   struct MIDIRunloopSource * source = malloc( sizeof( struct MIDIRunloopSource ) );
 
   source->refs = 1;
   source->nfds = 0;
 
-  FD_ZERO( &(source->readfds) );
-  FD_ZERO( &(source->writefds) );
+  _fdset_init( &(source->readfds) );
+  _fdset_init( &(source->writefds) );
 
   _timespec_zero( &(source->timeout_start) );
   _timespec_zero( &(source->timeout_time) );
@@ -176,12 +345,27 @@ struct MIDIRunloopSource * MIDIRunloopSourceCreate( struct MIDIRunloopSourceDele
     source->delegate.write   = NULL;
     source->delegate.timeout = NULL;
   }
+  source->receive = NULL;
   source->runloop = NULL;
+  source->index   = -1;
+  source->stamp   = 0;
+  source->timers  = NULL;
+  MIDITimerWheelEntryInit( &(source->timeout_entry), &_runloop_source_timeout_fire, source );
 
   return source;
 }
 
 void MIDIRunloopSourceDestroy( struct MIDIRunloopSource * source ) {
+  struct MIDIRunloopTimer * timer;
+  while( source->timers != NULL ) {
+    timer = source->timers;
+    source->timers = timer->next;
+    timer->source = NULL;
+    timer->next   = NULL;
+    timer->prev   = NULL;
+  }
+  _fdset_free( &(source->readfds) );
+  _fdset_free( &(source->writefds) );
   free( source );
 }
 
@@ -211,6 +395,7 @@ int MIDIRunloopSourceInvalidate( struct MIDIRunloopSource * source ) {
   source->delegate.read    = NULL;
   source->delegate.write   = NULL;
   source->delegate.timeout = NULL;
+  source->receive          = NULL;
   
   if( source->runloop != NULL ) {
     return MIDIRunloopRemoveSource( source->runloop, source );
@@ -219,6 +404,48 @@ int MIDIRunloopSourceInvalidate( struct MIDIRunloopSource * source ) {
   }
 }
 
+/**
+ * @brief Get the runloop a source was added to.
+ * @public @memberof MIDIRunloopSource
+ * @param source  The runloop source.
+ * @param runloop The runloop, @c NULL if the source was not added to any runloop.
+ * @retval 0 on success.
+ */
+int MIDIRunloopSourceGetRunloop( struct MIDIRunloopSource * source, struct MIDIRunloop ** runloop ) {
+  MIDIPrecond( source != NULL, EFAULT );
+  MIDIPrecond( runloop != NULL, EINVAL );
+  *runloop = source->runloop;
+  return 0;
+}
+
+/**
+ * @brief Set the receive callback of a runloop source.
+ * Backends that receive datagrams themselves (io_uring) hand every datagram
+ * that arrived on a socket only this source reads to the callback, together
+ * with the delegate's info pointer, instead of invoking the read callback.
+ * Other backends never invoke it. Sources are created without a receive
+ * callback.
+ * @public @memberof MIDIRunloopSource
+ * @param source  The runloop source.
+ * @param receive The callback or @c NULL to remove it.
+ * @retval 0 on success.
+ */
+int MIDIRunloopSourceSetReceive( struct MIDIRunloopSource * source,
+  int (*receive)( void * info, int fd, size_t size, void * data, socklen_t namelen, struct sockaddr * name ) ) {
+  int fd;
+  MIDIPrecond( source != NULL, EFAULT );
+  source->receive = receive;
+  if( source->runloop != NULL && source->runloop->backend->update != NULL ) {
+    /* switch the descriptors between receiving and polling */
+    for( fd=0; fd<source->nfds; fd++ ) {
+      if( _fdset_isset( &(source->readfds), fd ) ) {
+        (source->runloop->backend->update)( source->runloop, fd );
+      }
+    }
+  }
+  return 0;
+}
+
 /**
  * @brief Start a new timeout.
  * @private @memberof MIDIRunloopSource
@@ -227,6 +454,10 @@ int MIDIRunloopSourceInvalidate( struct MIDIRunloopSource * source ) {
  */
 static void _runloop_source_timeout_start( struct MIDIRunloopSource * source, struct timespec * now ) {
   _timespec_cpy( &(source->timeout_start), now );
+  if( source->runloop != NULL && ! _timespec_empty( &(source->timeout_time) ) ) {
+    MIDITimerWheelSchedule( source->runloop->wheel, &(source->timeout_entry),
+                            _timespec_ns( now ) + _timespec_ns( &(source->timeout_time) ) );
+  }
 }
 
 /**
@@ -301,7 +532,7 @@ static int _runloop_source_read( struct MIDIRunloopSource * source, struct times
 static int _runloop_source_write( struct MIDIRunloopSource * source, struct timespec * now, fd_set * fds ) {
   if( source->delegate.info == NULL || source->delegate.write == NULL ) return 0;
   if( _fds_check( fds, source->nfds ) ) {
-    _fds_sub( &(source->writefds), fds, source->nfds );
+    _fds_sub( _fdset_get( &(source->writefds) ), fds, source->nfds );
     _runloop_source_timeout_start( source, now );
     return (source->delegate.write)( source->delegate.info, source->nfds, fds );
   }
@@ -310,7 +541,8 @@ static int _runloop_source_write( struct MIDIRunloopSource * source, struct time
 
 /**
  * @brief Wait until any callback of the runloop source is triggered.
- * If no callbacks are scheduled return immediately.
+ * If no callbacks are scheduled return immediately. Uses select, so all
+ * file descriptors of the source must be lower than FD_SETSIZE.
  * @public @memberof MIDIRunloopSource
  * @param source The runloop source.
  */
@@ -321,6 +553,7 @@ int MIDIRunloopSourceWait( struct MIDIRunloopSource * source ) {
   fd_set readfds;
   fd_set writefds;
 
+  MIDIPrecond( source->nfds <= FD_SETSIZE, EINVAL );
   /*printf( "RunloopSourceWait\n" );*/
   _timespec_now( &now );
   if( _runloop_source_timeout_check( source, &now ) ) {
@@ -331,8 +564,8 @@ int MIDIRunloopSourceWait( struct MIDIRunloopSource * source ) {
     /* select */
     _runloop_source_timeout_remain( source, &remain, &now );
     _timeval_from_timespec( &remain_tv, &remain );
-    _fds_cpy( &readfds, &(source->readfds), source->nfds );
-    _fds_cpy( &writefds, &(source->writefds), source->nfds );
+    _fds_cpy( &readfds, _fdset_get( &(source->readfds) ), source->nfds );
+    _fds_cpy( &writefds, _fdset_get( &(source->writefds) ), source->nfds );
 
     /*printf( "- select(nfds:%i)\n", source->nfds );*/
     result = select( source->nfds, &readfds, &writefds, NULL, &remain_tv );
@@ -357,9 +590,13 @@ int MIDIRunloopSourceWait( struct MIDIRunloopSource * source ) {
   return 0;
 }
 
+static int _runloop_reserve( struct MIDIRunloop * runloop, int fd );
+static void _runloop_index_add( struct MIDIRunloopFdIndex * index, struct MIDIRunloopSource * source, int fd );
+static void _runloop_index_remove( struct MIDIRunloop * runloop, struct MIDIRunloopFdIndex * index,
+                                   struct MIDIRunloopSource * source, int fd );
 static int _runloop_schedule_read( struct MIDIRunloop * runloop, int fd );
 static int _runloop_schedule_write( struct MIDIRunloop * runloop, int fd );
-static int _runloop_schedule_timeout( struct MIDIRunloop * runloop, struct timespec * ts );
+static int _runloop_schedule_timeout( struct MIDIRunloop * runloop, struct MIDIRunloopSource * source );
 static int _runloop_clear_read( struct MIDIRunloop * runloop, int fd );
 static int _runloop_clear_write( struct MIDIRunloop * runloop, int fd );
 
@@ -371,11 +608,21 @@ static int _runloop_clear_write( struct MIDIRunloop * runloop, int fd );
  * MIDIRunloopSourceClearRead.
  * @public @memberof MIDIRunloopSource
  * @param source The source that should be scheduled.
- * @param fd     The file descriptor from which to read.
+ * @param fd     The file descriptor from which to read. Descriptors of FD_SETSIZE
+ *               and above can only be used with the epoll backend.
  */
 int MIDIRunloopSourceScheduleRead( struct MIDIRunloopSource * source, int fd ) {
   MIDIPrecond( source != NULL, EFAULT );
-  FD_SET( fd, &(source->readfds) );
+  MIDIPrecond( fd >= 0, EINVAL );
+  MIDIPrecond( source->runloop == NULL || fd < source->runloop->backend->nfds, EINVAL );
+  if( ! _fdset_isset( &(source->readfds), fd ) ) {
+    if( _fdset_reserve( &(source->readfds), fd ) ) return ENOMEM;
+    if( source->runloop != NULL ) {
+      if( _runloop_reserve( source->runloop, fd ) ) return ENOMEM;
+      _runloop_index_add( &(source->runloop->readers), source, fd );
+    }
+    _fdset_set( &(source->readfds), fd );
+  }
   if( source->nfds <= fd ) source->nfds = fd + 1;
   if( source->runloop != NULL ) {
     return _runloop_schedule_read( source->runloop, fd );
@@ -393,8 +640,11 @@ int MIDIRunloopSourceScheduleRead( struct MIDIRunloopSource * source, int fd ) {
  */
 int MIDIRunloopSourceClearRead( struct MIDIRunloopSource * source, int fd ) {
   MIDIPrecond( source != NULL, EFAULT );
-  FD_CLR( fd, &(source->readfds) );
+  MIDIPrecond( fd >= 0, EINVAL );
+  if( ! _fdset_isset( &(source->readfds), fd ) ) return 0;
+  _fdset_clr( &(source->readfds), fd );
   if( source->runloop != NULL ) {
+    _runloop_index_remove( source->runloop, &(source->runloop->readers), source, fd );
     return _runloop_clear_read( source->runloop, fd );
   } else {
     return 0;
@@ -409,11 +659,21 @@ int MIDIRunloopSourceClearRead( struct MIDIRunloopSource * source, int fd ) {
  * again.
  * @public @memberof MIDIRunloopSource
  * @param source The source that should be scheduled.
- * @param fd     The file descriptor to which to write.
+ * @param fd     The file descriptor to which to write. Descriptors of FD_SETSIZE
+ *               and above can only be used with the epoll backend.
  */
 int MIDIRunloopSourceScheduleWrite( struct MIDIRunloopSource * source, int fd ) {
   MIDIPrecond( source != NULL, EFAULT );
-  FD_SET( fd, &(source->writefds) );
+  MIDIPrecond( fd >= 0, EINVAL );
+  MIDIPrecond( source->runloop == NULL || fd < source->runloop->backend->nfds, EINVAL );
+  if( ! _fdset_isset( &(source->writefds), fd ) ) {
+    if( _fdset_reserve( &(source->writefds), fd ) ) return ENOMEM;
+    if( source->runloop != NULL ) {
+      if( _runloop_reserve( source->runloop, fd ) ) return ENOMEM;
+      _runloop_index_add( &(source->runloop->writers), source, fd );
+    }
+    _fdset_set( &(source->writefds), fd );
+  }
   if( source->nfds <= fd ) source->nfds = fd + 1;
   if( source->runloop != NULL ) {
     return _runloop_schedule_write( source->runloop, fd );
@@ -431,8 +691,11 @@ int MIDIRunloopSourceScheduleWrite( struct MIDIRunloopSource * source, int fd )
  */
 int MIDIRunloopSourceClearWrite( struct MIDIRunloopSource * source, int fd ) {
   MIDIPrecond( source != NULL, EFAULT );
-  FD_CLR( fd, &(source->writefds) );
+  MIDIPrecond( fd >= 0, EINVAL );
+  if( ! _fdset_isset( &(source->writefds), fd ) ) return 0;
+  _fdset_clr( &(source->writefds), fd );
   if( source->runloop != NULL ) {
+    _runloop_index_remove( source->runloop, &(source->runloop->writers), source, fd );
     return _runloop_clear_write( source->runloop, fd );
   } else {
     return 0;
@@ -449,17 +712,19 @@ int MIDIRunloopSourceClearWrite( struct MIDIRunloopSource * source, int fd ) {
  * @param timeout The timeout to be scheduled.
  */
 int MIDIRunloopSourceScheduleTimeout( struct MIDIRunloopSource * source, struct timespec * timeout ) {
+  struct timespec now;
   MIDIPrecond( source != NULL, EFAULT );
   MIDIPrecond( timeout != NULL, EINVAL );
-  _timespec_now( &(source->timeout_start) );
   _timespec_cpy( &(source->timeout_time), timeout );
   if( source->timeout_time.tv_sec == 0 && source->timeout_time.tv_nsec == 0 ) {
     /* We use timeout == 0 to signal that no timeout was scheduled.
      * Use a minimal timeout instead. */
     source->timeout_time.tv_nsec = 1;
   }
+  _timespec_now( &now );
+  _runloop_source_timeout_start( source, &now );
   if( source->runloop != NULL ) {
-    return _runloop_schedule_timeout( source->runloop, timeout );
+    return _runloop_schedule_timeout( source->runloop, source );
   } else {
     return 0;
   }
@@ -474,206 +739,1407 @@ int MIDIRunloopSourceScheduleTimeout( struct MIDIRunloopSource * source, struct
 int MIDIRunloopSourceClearTimeout( struct MIDIRunloopSource * source ) {
   MIDIPrecond( source != NULL, EFAULT );
   _timespec_zero( &(source->timeout_time) );
+  if( source->runloop != NULL ) {
+    MIDITimerWheelCancel( source->runloop->wheel, &(source->timeout_entry) );
+  }
   return 0;
 }
 
-static int _runloop_master_read( void * rl, int nfds, fd_set * readfds ) {
-  int i, result = 0, cb = 0;
-  struct MIDIRunloop * runloop = rl;
-  struct MIDIRunloopSource * source;
-  struct timespec now;
-  
-  CURRENT_RUNLOOP( runloop );
+static int _runloop_source_timeout_fire( void * info, struct timespec * now ) {
+  return _runloop_source_timeout( info, now );
+}
 
-  /* _timespec_now( &now ); */
-  _timespec_cpy( &now, &(runloop->master.timeout_start) );
-  
-  for( i=0; i<MAX_RUNLOOP_SOURCES; i++ ) {
-    source = runloop->sources[i];
-    if( source == NULL ) continue;
-
-    if( source->delegate.read != NULL ) {
-      cb++;
-      if( _fds_check2( readfds, &(source->readfds), source->nfds ) ) {
-        result += _runloop_source_read( source, &now, readfds );
-      } else if( _runloop_source_timeout_check( source, &now ) ) {
-        result += _runloop_source_timeout( source, &now );
-      }
-    } else {
-      if( _runloop_source_timeout_check( source, &now ) ) {
-        result += _runloop_source_timeout( source, &now );
-      }
-    }
-  }
-  if( cb == 0 ) {
-    runloop->master.delegate.read = NULL;
+/* MARK: Timers *//**
+ * @name Timers
+ * Additional one-shot timers of a runloop source.
+ * @{
+ */
+
+static int _runloop_timer_fire( void * info, struct timespec * now ) {
+  struct MIDIRunloopTimer * timer = info;
+  int result = 0;
+  timer->scheduled = 0;
+  if( timer->delegate.fire != NULL ) {
+    MIDIRunloopTimerRetain( timer );
+    result = (timer->delegate.fire)( timer->delegate.info, timer, now );
+    MIDIRunloopTimerRelease( timer );
   }
   return result;
 }
 
-static int _runloop_master_write( void * rl, int nfds, fd_set * writefds ) {
-  int i, result = 0, cb = 0;
-  struct MIDIRunloop * runloop = rl;
-  struct MIDIRunloopSource * source;  
-  struct timespec now;
-  
-  CURRENT_RUNLOOP( runloop );
+/**
+ * @brief Create a MIDIRunloopTimer instance.
+ * The timer belongs to the given source and fires while the source is
+ * added to a runloop. The source does not retain its timers.
+ * @public @memberof MIDIRunloopTimer
+ * @param source   The source that owns the timer.
+ * @param delegate The delegate that is invoked when the timer fires.
+ * @return a pointer to the created timer on success.
+ * @return a @c NULL pointer if the timer could not be created.
+ */
+struct MIDIRunloopTimer * MIDIRunloopTimerCreate( struct MIDIRunloopSource * source, struct MIDIRunloopTimerDelegate * delegate ) {
+  struct MIDIRunloopTimer * timer;
+  MIDIPrecondReturn( source != NULL, EFAULT, NULL );
+  MIDIPrecondReturn( delegate != NULL, EINVAL, NULL );
+  timer = malloc( sizeof( struct MIDIRunloopTimer ) );
+  MIDIPrecondReturn( timer != NULL, ENOMEM, NULL );
+
+  timer->refs      = 1;
+  timer->scheduled = 0;
+  timer->deadline  = 0;
+  timer->delegate.info = delegate->info;
+  timer->delegate.fire = delegate->fire;
+  MIDITimerWheelEntryInit( &(timer->entry), &_runloop_timer_fire, timer );
+
+  timer->source = source;
+  timer->prev   = NULL;
+  timer->next   = source->timers;
+  if( timer->next != NULL ) {
+    timer->next->prev = timer;
+  }
+  source->timers = timer;
+  return timer;
+}
 
-  /* _timespec_now( &now ); */
-  _timespec_cpy( &now, &(runloop->master.timeout_start) );
-  
-  for( i=0; i<MAX_RUNLOOP_SOURCES; i++ ) {
-    source = runloop->sources[i];
-    if( source == NULL ) continue;
-
-    if( source->delegate.write != NULL ) {
-      cb++;
-      if( _fds_check2( writefds, &(source->writefds), source->nfds ) ) {
-        result += _runloop_source_write( source, &now, writefds );
-      } else if( _runloop_source_timeout_check( source, &now ) ) {
-        result += _runloop_source_timeout( source, &now );
-      }
+/**
+ * @brief Destroy a MIDIRunloopTimer instance.
+ * The timer is cancelled and removed from its source.
+ * @public @memberof MIDIRunloopTimer
+ * @param timer The timer.
+ */
+void MIDIRunloopTimerDestroy( struct MIDIRunloopTimer * timer ) {
+  MIDIRunloopTimerCancel( timer );
+  if( timer->source != NULL ) {
+    if( timer->prev != NULL ) {
+      timer->prev->next = timer->next;
     } else {
-      if( _runloop_source_timeout_check( source, &now ) ) {
-        result += _runloop_source_timeout( source, &now );
-      }
+      timer->source->timers = timer->next;
+    }
+    if( timer->next != NULL ) {
+      timer->next->prev = timer->prev;
     }
   }
-  if( cb == 0 ) {
-    runloop->master.delegate.write = NULL;
+  free( timer );
+}
+
+/**
+ * @brief Retain a MIDIRunloopTimer instance.
+ * @public @memberof MIDIRunloopTimer
+ * @param timer The timer.
+ */
+void MIDIRunloopTimerRetain( struct MIDIRunloopTimer * timer ) {
+  MIDIPrecondReturn( timer != NULL, EFAULT, (void)0 );
+  timer->refs++;
+}
+
+/**
+ * @brief Release a MIDIRunloopTimer instance.
+ * @public @memberof MIDIRunloopTimer
+ * @param timer The timer.
+ */
+void MIDIRunloopTimerRelease( struct MIDIRunloopTimer * timer ) {
+  MIDIPrecondReturn( timer != NULL, EFAULT, (void)0 );
+  if( ! --timer->refs ) {
+    MIDIRunloopTimerDestroy( timer );
   }
-  return result;
 }
 
-static int _runloop_master_timeout( void * rl, struct timespec * ts ) {
-  int i, result = 0;
-  struct MIDIRunloop * runloop = rl;
-  struct MIDIRunloopSource * source;
+/**
+ * @brief Schedule a timer.
+ * The timer fires once after the given timeout. Scheduling a timer that is
+ * already scheduled moves it to the new deadline. Takes constant time.
+ * @public @memberof MIDIRunloopTimer
+ * @param timer   The timer.
+ * @param timeout The time from now after which the timer should fire.
+ * @retval 0 on success.
+ */
+int MIDIRunloopTimerSchedule( struct MIDIRunloopTimer * timer, struct timespec * timeout ) {
   struct timespec now;
-  
-  CURRENT_RUNLOOP( runloop );
-
-  /* _timespec_now( &now ); */
-  _timespec_cpy( &now, &(runloop->master.timeout_start) );
+  MIDIPrecond( timer != NULL, EFAULT );
+  MIDIPrecond( timeout != NULL, EINVAL );
+  MIDIPrecond( timer->source != NULL, EINVAL );
 
-  for( i=0; i<MAX_RUNLOOP_SOURCES; i++ ) {
-    source = runloop->sources[i];
-    if( source == NULL ) continue;
+  _timespec_now( &now );
+  timer->deadline  = _timespec_ns( &now ) + _timespec_ns( timeout );
+  timer->scheduled = 1;
+  if( timer->source->runloop != NULL ) {
+    return MIDITimerWheelSchedule( timer->source->runloop->wheel, &(timer->entry), timer->deadline );
+  }
+  return 0;
+}
 
-    if( _runloop_source_timeout_check( source, &now ) ) {
-      result += _runloop_source_timeout( source, &now );
-    }
-    
-    if( source->delegate.read != NULL ) {
-      runloop->master.delegate.read  = &_runloop_master_read;
-    }
-    if( source->delegate.write != NULL ) {
-      runloop->master.delegate.write = &_runloop_master_write;
-    }
+/**
+ * @brief Cancel a timer.
+ * Cancelling a timer that is not scheduled is not an error. Takes
+ * constant time.
+ * @public @memberof MIDIRunloopTimer
+ * @param timer The timer.
+ * @retval 0 on success.
+ */
+int MIDIRunloopTimerCancel( struct MIDIRunloopTimer * timer ) {
+  MIDIPrecond( timer != NULL, EFAULT );
+  timer->scheduled = 0;
+  if( timer->source != NULL && timer->source->runloop != NULL ) {
+    return MIDITimerWheelCancel( timer->source->runloop->wheel, &(timer->entry) );
   }
-  return result;
+  return 0;
 }
 
-struct MIDIRunloop * MIDIRunloopCreate( struct MIDIRunloopDelegate * delegate ) {
-  int i;
-  struct MIDIRunloop * runloop = malloc( sizeof( struct MIDIRunloop ) );
-  MIDIPrecondReturn( runloop != NULL, ENOMEM, NULL );
+/**
+ * @brief Check if a timer is scheduled.
+ * @public @memberof MIDIRunloopTimer
+ * @param timer     The timer.
+ * @param scheduled Set to 1 if the timer is scheduled, 0 otherwise.
+ * @retval 0 on success.
+ */
+int MIDIRunloopTimerIsScheduled( struct MIDIRunloopTimer * timer, int * scheduled ) {
+  MIDIPrecond( timer != NULL, EFAULT );
+  MIDIPrecond( scheduled != NULL, EINVAL );
+  *scheduled = timer->scheduled;
+  return 0;
+}
 
-  runloop->refs   = 1;
-  runloop->active = 0;
-  runloop->master.nfds = 0;
-  FD_ZERO( &(runloop->master.readfds) );
-  FD_ZERO( &(runloop->master.writefds) );
-  _timespec_now( &(runloop->master.timeout_start) );
-  _timespec_zero( &(runloop->master.timeout_time) );
-  runloop->master.delegate.read    = NULL;
-  runloop->master.delegate.write   = NULL;
-  runloop->master.delegate.timeout = NULL;
-  runloop->master.delegate.info    = runloop;
+/** @} */
 
-  for( i=0; i<MAX_RUNLOOP_SOURCES; i++ ) {
-    runloop->sources[i] = NULL;
-  }
-  
-  if( delegate != NULL ) {
-    runloop->delegate.info             = delegate->info;
-    runloop->delegate.schedule_read    = delegate->schedule_read;
-    runloop->delegate.schedule_write   = delegate->schedule_write;
-    runloop->delegate.schedule_timeout = delegate->schedule_timeout;
-    runloop->delegate.clear_read       = delegate->clear_read;
-    runloop->delegate.clear_write      = delegate->clear_write;
-    runloop->delegate.clear_timeout    = delegate->clear_timeout;
-  } else {
-    runloop->delegate.info             = NULL;
-    runloop->delegate.schedule_read    = NULL;
-    runloop->delegate.schedule_write   = NULL;
-    runloop->delegate.schedule_timeout = NULL;
-    runloop->delegate.clear_read       = NULL;
-    runloop->delegate.clear_write      = NULL;
-    runloop->delegate.clear_timeout    = NULL;
-  }
+/* MARK: Source index *//**
+ * @name Source index
+ * @cond INTERNALS
+ * Find the sources that wait for a file descriptor without scanning all
+ * sources of the runloop.
+ * @{
+ */
 
-  return runloop;
-}
+static int _runloop_index_grow( struct MIDIRunloopFdIndex * index, int fd ) {
+  unsigned short * count;
+  struct MIDIRunloopSource ** owner;
+  int size = ( index->size > 0 ) ? index->size : RUNLOOP_INDEX_SIZE;
+
+  if( fd < index->size ) return 0;
+  while( size <= fd ) size *= 2;
+  count = realloc( index->count, size * sizeof(unsigned short) );
+  if( count == NULL ) goto fail;
+  index->count = count;
+  owner = realloc( index->owner, size * sizeof(struct MIDIRunloopSource *) );
+  if( owner == NULL ) goto fail;
+  index->owner = owner;
+  memset( index->count + index->size, 0, ( size - index->size ) * sizeof(unsigned short) );
+  memset( index->owner + index->size, 0, ( size - index->size ) * sizeof(struct MIDIRunloopSource *) );
+  index->size = size;
+  return 0;
 
-void MIDIRunloopDestroy( struct MIDIRunloop * runloop ) {
-  int i;
-  for( i=0; i<MAX_RUNLOOP_SOURCES; i++ ) {
-    if( runloop->sources[i] != NULL ) {
-      runloop->sources[i]->runloop = NULL;
-      MIDIRunloopSourceRelease( runloop->sources[i] );
-    }
-  }
-  free( runloop );
+fail:
+  MIDIError( ENOMEM, "Could not grow runloop descriptor index." );
+  return ENOMEM;
 }
 
-void MIDIRunloopRetain( struct MIDIRunloop * runloop ) {
-  runloop->refs++;
+static int _runloop_index_count( struct MIDIRunloopFdIndex * index, int fd ) {
+  return ( fd < index->size ) ? index->count[fd] : 0;
 }
 
-void MIDIRunloopRelease( struct MIDIRunloop * runloop ) {
-  if( ! --runloop->refs ) {
-    MIDIRunloopDestroy( runloop );
+/**
+ * @brief Make room for a file descriptor in the runloop's sets and indices.
+ * Called before a descriptor is added, so that adding cannot fail.
+ * @private @memberof MIDIRunloop
+ * @param runloop The runloop.
+ * @param fd      The file descriptor.
+ * @retval 0 on success.
+ * @retval >0 if memory could not be allocated.
+ */
+static int _runloop_reserve( struct MIDIRunloop * runloop, int fd ) {
+  if( _fdset_reserve( &(runloop->master.readfds), fd )
+   || _fdset_reserve( &(runloop->master.writefds), fd )
+   || _fdset_reserve( &(runloop->readable), fd )
+   || _fdset_reserve( &(runloop->writable), fd )
+   || _runloop_index_grow( &(runloop->readers), fd )
+   || _runloop_index_grow( &(runloop->writers), fd ) ) {
+    return ENOMEM;
   }
+  return 0;
 }
 
-static int _runloop_schedule_read( struct MIDIRunloop * runloop, int fd ) {
-  MIDIAssert( runloop != NULL );
-  
-  if( fd >= runloop->master.nfds ) {
-    runloop->master.nfds = fd + 1;
-  }
-  FD_SET( fd, &(runloop->master.readfds) );
-  runloop->master.delegate.read = &_runloop_master_read;
-
-  if( runloop->delegate.info != NULL && runloop->delegate.schedule_read != NULL ) {
-    return (runloop->delegate.schedule_read)( runloop->delegate.info, fd );
-  } else {
-    return 0;
-  }
+static void _runloop_index_add( struct MIDIRunloopFdIndex * index, struct MIDIRunloopSource * source, int fd ) {
+  index->owner[fd] = ( index->count[fd]++ == 0 ) ? source : NULL;
 }
 
-static int _runloop_clear_read( struct MIDIRunloop * runloop, int fd ) {
+/**
+ * @brief Remove a source from the descriptor index.
+ * If only one source remains that waits for the descriptor it becomes the
+ * owner again. Finding it requires a scan, but only for shared descriptors.
+ * @private @memberof MIDIRunloop
+ * @param runloop The runloop.
+ * @param index   The read or write index.
+ * @param source  The source that no longer waits for the descriptor.
+ * @param fd      The file descriptor.
+ */
+static void _runloop_index_remove( struct MIDIRunloop * runloop, struct MIDIRunloopFdIndex * index,
+                                   struct MIDIRunloopSource * source, int fd ) {
+  struct MIDIRunloopSource * other;
   int i;
-  MIDIAssert( runloop != NULL );
 
-  for( i=0; i<MAX_RUNLOOP_SOURCES; i++ ) {
-    if( runloop->sources[i] != NULL ) {
-      if( FD_ISSET( fd, &(runloop->sources[i]->readfds) ) ) {
-        return 0;
-      }
+  if( _runloop_index_count( index, fd ) == 0 ) return;
+  index->owner[fd] = NULL;
+  if( --index->count[fd] != 1 ) return;
+  for( i=0; i<runloop->length; i++ ) {
+    other = runloop->sources[i];
+    if( other == NULL || other == source ) continue;
+    if( _fdset_isset( ( index == &(runloop->writers) ) ? &(other->writefds) : &(other->readfds), fd ) ) {
+      index->owner[fd] = other;
+      return;
     }
   }
-  
-  if( fd == runloop->master.nfds - 1 ) {
-    runloop->master.nfds = fd;
-  }
-  FD_CLR( fd, &(runloop->master.readfds) );
+}
 
-  if( runloop->delegate.info != NULL && runloop->delegate.clear_read != NULL ) {
-    return (runloop->delegate.clear_read)( runloop->delegate.info, fd );
-  } else {
-    return 0;
+/**
+ * @brief Put the timeout and the timers of a source into the timer wheel.
+ * @private @memberof MIDIRunloop
+ * @param runloop The runloop.
+ * @param source  The source.
+ */
+static void _runloop_attach_timers( struct MIDIRunloop * runloop, struct MIDIRunloopSource * source ) {
+  struct MIDIRunloopTimer * timer;
+  if( ! _timespec_empty( &(source->timeout_time) ) ) {
+    MIDITimerWheelSchedule( runloop->wheel, &(source->timeout_entry),
+      _timespec_ns( &(source->timeout_start) ) + _timespec_ns( &(source->timeout_time) ) );
+  }
+  for( timer=source->timers; timer!=NULL; timer=timer->next ) {
+    if( timer->scheduled ) {
+      MIDITimerWheelSchedule( runloop->wheel, &(timer->entry), timer->deadline );
+    }
+  }
+}
+
+/**
+ * @brief Remove the timeout and the timers of a source from the timer wheel.
+ * Timers stay scheduled and are put back when the source is added again.
+ * @private @memberof MIDIRunloop
+ * @param runloop The runloop.
+ * @param source  The source.
+ */
+static void _runloop_detach_timers( struct MIDIRunloop * runloop, struct MIDIRunloopSource * source ) {
+  struct MIDIRunloopTimer * timer;
+  MIDITimerWheelCancel( runloop->wheel, &(source->timeout_entry) );
+  for( timer=source->timers; timer!=NULL; timer=timer->next ) {
+    MIDITimerWheelCancel( runloop->wheel, &(timer->entry) );
+  }
+}
+
+/**
+ * @brief Fire all timers that expired.
+ * Timers that are scheduled again by their callbacks with a deadline that
+ * already passed fire during the next step.
+ * @private @memberof MIDIRunloop
+ * @param runloop The runloop.
+ * @param now     Must be set to the current time.
+ */
+static int _runloop_timeouts( struct MIDIRunloop * runloop, struct timespec * now ) {
+  struct MIDITimerWheelEntry * entry;
+  int result = 0;
+
+  MIDITimerWheelAdvance( runloop->wheel, _timespec_ns( now ) );
+  for(;;) {
+    MIDITimerWheelPopExpired( runloop->wheel, &entry );
+    if( entry == NULL ) break;
+    if( entry->fire != NULL ) {
+      result += (entry->fire)( entry->info, now );
+    }
+  }
+  return result;
+}
+
+static void _runloop_dispatch_begin( struct MIDIRunloop * runloop ) {
+  runloop->stamp++;
+  runloop->dispatching++;
+}
+
+/**
+ * @brief Finish a dispatch.
+ * Sources that were removed while dispatching left holes in the source
+ * array. Close them once the outermost dispatch is done.
+ * @private @memberof MIDIRunloop
+ * @param runloop The runloop.
+ */
+static void _runloop_dispatch_end( struct MIDIRunloop * runloop ) {
+  int i, j;
+  if( --runloop->dispatching > 0 || runloop->holes == 0 ) return;
+  for( i=0, j=0; i<runloop->length; i++ ) {
+    if( runloop->sources[i] != NULL ) {
+      runloop->sources[j] = runloop->sources[i];
+      runloop->sources[j]->index = j;
+      j++;
+    }
+  }
+  runloop->length = j;
+  runloop->holes  = 0;
+}
+
+/**
+ * @brief Invoke the read callback of a source.
+ * The caller knows that one of the source's descriptors is ready.
+ * @private @memberof MIDIRunloop
+ */
+static int _runloop_dispatch_read( struct MIDIRunloop * runloop, struct MIDIRunloopSource * source,
+                                   struct timespec * now, fd_set * readfds ) {
+  source->stamp = runloop->stamp;
+  if( source->delegate.info == NULL || source->delegate.read == NULL ) return 0;
+  _runloop_source_timeout_start( source, now );
+  return (source->delegate.read)( source->delegate.info, source->nfds, readfds );
+}
+
+/**
+ * @brief Invoke the write callback of a source.
+ * Write callbacks are one-shot. The ready descriptors are cleared from the
+ * source and the index before the delegate may schedule them again.
+ * @private @memberof MIDIRunloop
+ */
+static int _runloop_dispatch_write( struct MIDIRunloop * runloop, struct MIDIRunloopSource * source,
+                                    struct timespec * now, fd_set * writefds ) {
+  int i, fd;
+  source->stamp = runloop->stamp;
+  if( source->delegate.info == NULL || source->delegate.write == NULL ) return 0;
+  for( i=0; i*NFDBITS<source->nfds; i++ ) {
+    if( ( _fds_word( writefds, i, source->nfds ) & source->writefds.bits[i] ) == 0 ) continue;
+    for( fd=i*NFDBITS; fd<(i+1)*NFDBITS && fd<source->nfds; fd++ ) {
+      if( ( ((fd_mask *) writefds)[i] & FDSET_MASK( fd ) ) && _fdset_isset( &(source->writefds), fd ) ) {
+        _fdset_clr( &(source->writefds), fd );
+        _runloop_index_remove( runloop, &(runloop->writers), source, fd );
+      }
+    }
+  }
+  _runloop_source_timeout_start( source, now );
+  return (source->delegate.write)( source->delegate.info, source->nfds, writefds );
+}
+
+/**
+ * @brief Dispatch a ready file descriptor to the sources that wait for it.
+ * Sources that were already invoked during this dispatch are skipped.
+ * @private @memberof MIDIRunloop
+ * @param runloop The runloop.
+ * @param fd      The ready file descriptor.
+ * @param fds     The ready file descriptors that are passed to the sources.
+ * @param write   Non-zero to dispatch writes, zero to dispatch reads.
+ * @param now     Must be set to the current time.
+ */
+static int _runloop_dispatch_fd( struct MIDIRunloop * runloop, int fd, fd_set * fds, int write, struct timespec * now ) {
+  struct MIDIRunloopFdIndex * index = write ? &(runloop->writers) : &(runloop->readers);
+  struct MIDIRunloopSource * source;
+  int i, result = 0;
+
+  if( _runloop_index_count( index, fd ) == 0 ) return 0;
+  source = index->owner[fd];
+  if( source != NULL ) {
+    if( source->stamp == runloop->stamp ) return 0;
+    return write ? _runloop_dispatch_write( runloop, source, now, fds )
+                 : _runloop_dispatch_read( runloop, source, now, fds );
+  }
+  for( i=0; i<runloop->length; i++ ) {
+    source = runloop->sources[i];
+    if( source == NULL || source->stamp == runloop->stamp ) continue;
+    if( _fdset_isset( write ? &(source->writefds) : &(source->readfds), fd ) ) {
+      result += write ? _runloop_dispatch_write( runloop, source, now, fds )
+                      : _runloop_dispatch_read( runloop, source, now, fds );
+    }
+  }
+  return result;
+}
+
+/**
+ * @brief Dispatch ready file descriptors to the sources that wait for them.
+ * Each source is invoked at most once. Used by the select backend, which
+ * reports the ready descriptors in an fd_set.
+ * @private @memberof MIDIRunloop
+ * @param runloop The runloop.
+ * @param nfds    The number of file descriptors in @c fds.
+ * @param fds     The ready file descriptors.
+ * @param write   Non-zero to dispatch writes, zero to dispatch reads.
+ */
+static int _runloop_master_io( struct MIDIRunloop * runloop, int nfds, fd_set * fds, int write ) {
+  struct timespec now;
+  int fd, result = 0;
+
+  CURRENT_RUNLOOP( runloop );
+
+  /* _timespec_now( &now ); */
+  _timespec_cpy( &now, &(runloop->master.timeout_start) );
+
+  _runloop_dispatch_begin( runloop );
+  for( fd=0; fd<nfds; fd++ ) {
+    if( FD_ISSET( fd, fds ) ) {
+      result += _runloop_dispatch_fd( runloop, fd, fds, write, &now );
+    }
+  }
+  result += _runloop_timeouts( runloop, &now );
+  _runloop_dispatch_end( runloop );
+  return result;
+}
+
+static int _runloop_master_read( void * rl, int nfds, fd_set * readfds ) {
+  return _runloop_master_io( rl, nfds, readfds, 0 );
+}
+
+static int _runloop_master_write( void * rl, int nfds, fd_set * writefds ) {
+  return _runloop_master_io( rl, nfds, writefds, 1 );
+}
+
+static int _runloop_master_timeout( void * rl, struct timespec * ts ) {
+  int result;
+  struct MIDIRunloop * runloop = rl;
+  struct timespec now;
+  
+  CURRENT_RUNLOOP( runloop );
+
+  /* _timespec_now( &now ); */
+  _timespec_cpy( &now, &(runloop->master.timeout_start) );
+
+  _runloop_dispatch_begin( runloop );
+  result = _runloop_timeouts( runloop, &now );
+  _runloop_dispatch_end( runloop );
+  return result;
+}
+
+/**
+ * @brief Set the master source's timeout to the timer wheel's next deadline.
+ * @private @memberof MIDIRunloop
+ * @param runloop The runloop.
+ */
+static void _runloop_master_deadline( struct MIDIRunloop * runloop ) {
+  struct MIDIRunloopSource * master = &(runloop->master);
+  unsigned long long deadline, now_ns;
+  struct timespec now;
+
+  MIDITimerWheelGetNextDeadline( runloop->wheel, &deadline );
+  if( deadline == MIDI_TIMER_WHEEL_NEVER ) {
+    _timespec_zero( &(master->timeout_time) );
+    return;
+  }
+  _timespec_now( &now );
+  now_ns = _timespec_ns( &now );
+  _timespec_cpy( &(master->timeout_start), &now );
+  if( deadline > now_ns ) {
+    master->timeout_time.tv_sec  = ( deadline - now_ns ) / 1000000000ULL;
+    master->timeout_time.tv_nsec = ( deadline - now_ns ) % 1000000000ULL;
+  } else {
+    master->timeout_time.tv_sec  = 0;
+    master->timeout_time.tv_nsec = 1;
+  }
+  master->delegate.timeout = &_runloop_master_timeout;
+}
+
+/** @} @endcond */
+
+/* MARK: Backends *//**
+ * @name Backends
+ * @cond INTERNALS
+ * Different ways to wait for the master source.
+ * @{
+ */
+
+/**
+ * @brief Wait for the master source using select.
+ * @private @memberof MIDIRunloop
+ * @param runloop The runloop.
+ */
+static int _runloop_select_wait( struct MIDIRunloop * runloop ) {
+  return MIDIRunloopSourceWait( &(runloop->master) );
+}
+
+static struct MIDIRunloopBackend _select_backend = {
+  MIDI_RUNLOOP_BACKEND_SELECT,
+  FD_SETSIZE,
+  NULL,
+  NULL,
+  NULL,
+  &_runloop_select_wait
+};
+
+#ifdef HAVE_TIMERFD
+static int _runloop_timer_create( struct MIDIRunloop * runloop ) {
+  runloop->timer_fd = timerfd_create( CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC );
+  return runloop->timer_fd < 0;
+}
+
+static void _runloop_timer_drain( struct MIDIRunloop * runloop ) {
+  unsigned long long expirations;
+  while( read( runloop->timer_fd, &expirations, sizeof(expirations) ) > 0 ) {}
+  _timespec_zero( &(runloop->timer_deadline) );
+}
+
+/**
+ * @brief Program the timer file descriptor with the master source deadline.
+ * @private @memberof MIDIRunloop
+ * @param runloop The runloop.
+ */
+static void _runloop_arm_timer( struct MIDIRunloop * runloop ) {
+  struct itimerspec its;
+  struct timespec deadline;
+
+  if( _timespec_empty( &(runloop->master.timeout_time) ) ) {
+    _timespec_zero( &deadline );
+  } else {
+    _timespec_cpy( &deadline, &(runloop->master.timeout_start) );
+    _timespec_add( &deadline, &(runloop->master.timeout_time) );
+  }
+  if( _timespec_cmp( &deadline, &(runloop->timer_deadline) ) == 0 ) return;
+
+  _timespec_cpy( &(runloop->timer_deadline), &deadline );
+  _timespec_zero( &(its.it_interval) );
+  _timespec_cpy( &(its.it_value), &deadline );
+  timerfd_settime( runloop->timer_fd, TFD_TIMER_ABSTIME, &its, NULL );
+}
+#endif
+
+#ifdef HAVE_EPOLL
+static int _runloop_epoll_init( struct MIDIRunloop * runloop ) {
+  struct epoll_event ev;
+  runloop->epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+  if( runloop->epoll_fd < 0 ) return 1;
+  if( _runloop_timer_create( runloop ) ) {
+    close( runloop->epoll_fd );
+    return 1;
+  }
+  ev.events  = EPOLLIN;
+  ev.data.fd = runloop->timer_fd;
+  if( epoll_ctl( runloop->epoll_fd, EPOLL_CTL_ADD, runloop->timer_fd, &ev ) ) {
+    close( runloop->timer_fd );
+    close( runloop->epoll_fd );
+    return 1;
+  }
+  return 0;
+}
+
+static void _runloop_epoll_destroy( struct MIDIRunloop * runloop ) {
+  close( runloop->timer_fd );
+  close( runloop->epoll_fd );
+}
+
+/**
+ * @brief Register a file descriptor with the epoll instance.
+ * Compute the events of interest from the master source's sets.
+ * Registrations are level-triggered: a descriptor that still has data
+ * after its read callback is reported again by the next epoll_wait, even
+ * if the delegate read less than everything that was available.
+ * @private @memberof MIDIRunloop
+ * @param runloop The runloop.
+ * @param fd      The file descriptor that changed.
+ */
+static int _runloop_epoll_update( struct MIDIRunloop * runloop, int fd ) {
+  struct epoll_event ev;
+  int op;
+
+  ev.events  = 0;
+  ev.data.fd = fd;
+  if( _fdset_isset( &(runloop->master.readfds), fd ) )  ev.events |= EPOLLIN;
+  if( _fdset_isset( &(runloop->master.writefds), fd ) ) ev.events |= EPOLLOUT;
+
+  if( ev.events == 0 ) {
+    if( _fdset_isset( &(runloop->registered), fd ) ) {
+      _fdset_clr( &(runloop->registered), fd );
+      epoll_ctl( runloop->epoll_fd, EPOLL_CTL_DEL, fd, &ev );
+    }
+    return 0;
+  }
+  if( _fdset_reserve( &(runloop->registered), fd ) ) {
+    return 1;
+  }
+
+  op = _fdset_isset( &(runloop->registered), fd ) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  if( epoll_ctl( runloop->epoll_fd, op, fd, &ev ) ) {
+    /* the descriptor was closed and reused or registered behind our back */
+    op = ( op == EPOLL_CTL_MOD ) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    if( epoll_ctl( runloop->epoll_fd, op, fd, &ev ) ) {
+      _fdset_clr( &(runloop->registered), fd );
+      MIDIError( errno, "Could not register file descriptor with epoll." );
+      return 1;
+    }
+  }
+  _fdset_set( &(runloop->registered), fd );
+  return 0;
+}
+
+/**
+ * @brief Wait for the master source using epoll.
+ * Behaves like MIDIRunloopSourceWait on the master source: either the read
+ * and write callbacks or the timeout callback are invoked. Only the
+ * descriptors reported by epoll_wait are dispatched, the cost does not
+ * depend on the highest scheduled descriptor. Write callbacks are
+ * one-shot, so EPOLLOUT is dropped from registrations whose write was
+ * dispatched and not scheduled again.
+ * @private @memberof MIDIRunloop
+ * @param runloop The runloop.
+ */
+static int _runloop_epoll_wait( struct MIDIRunloop * runloop ) {
+  struct MIDIRunloopSource * master = &(runloop->master);
+  struct epoll_event events[MAX_RUNLOOP_EVENTS];
+  int reads[MAX_RUNLOOP_EVENTS], writes[MAX_RUNLOOP_EVENTS];
+  struct timespec now;
+  int i, n, fd, nreads = 0, nwrites = 0, timer = 0, result = 0;
+
+  _timespec_now( &now );
+  if( _runloop_source_timeout_check( master, &now ) ) {
+    return _runloop_source_timeout( master, &now );
+  }
+  if( master->nfds == 0 && _timespec_empty( &(master->timeout_time) ) ) {
+    return 0;
+  }
+
+  _runloop_arm_timer( runloop );
+  n = epoll_wait( runloop->epoll_fd, events, MAX_RUNLOOP_EVENTS, -1 );
+  _timespec_now( &now );
+  for( i=0; i<n; i++ ) {
+    fd = events[i].data.fd;
+    if( fd == runloop->timer_fd ) {
+      _runloop_timer_drain( runloop );
+      timer = 1;
+      continue;
+    }
+    if( ( events[i].events & ( EPOLLIN | EPOLLERR | EPOLLHUP ) ) && _fdset_isset( &(master->readfds), fd ) ) {
+      _fdset_set( &(runloop->readable), fd );
+      reads[nreads++] = fd;
+    }
+    if( ( events[i].events & ( EPOLLOUT | EPOLLERR ) ) && _fdset_isset( &(master->writefds), fd ) ) {
+      _fdset_clr( &(master->writefds), fd );
+      _fdset_set( &(runloop->writable), fd );
+      writes[nwrites++] = fd;
+    }
+  }
+
+  if( nreads == 0 && nwrites == 0 ) {
+    return timer ? _runloop_source_timeout( master, &now ) : 0;
+  }
+
+  CURRENT_RUNLOOP( runloop );
+  _runloop_source_timeout_start( master, &now );
+  _runloop_dispatch_begin( runloop );
+  for( i=0; i<nreads; i++ ) {
+    result += _runloop_dispatch_fd( runloop, reads[i], _fdset_get( &(runloop->readable) ), 0, &now );
+  }
+  for( i=0; i<nwrites; i++ ) {
+    result += _runloop_dispatch_fd( runloop, writes[i], _fdset_get( &(runloop->writable) ), 1, &now );
+  }
+  result += _runloop_timeouts( runloop, &now );
+  _runloop_dispatch_end( runloop );
+
+  for( i=0; i<nreads; i++ ) {
+    _fdset_clr( &(runloop->readable), reads[i] );
+  }
+  for( i=0; i<nwrites; i++ ) {
+    _fdset_clr( &(runloop->writable), writes[i] );
+    if( ! _fdset_isset( &(master->writefds), writes[i] ) ) {
+      _runloop_epoll_update( runloop, writes[i] );
+    }
+  }
+  return result;
+}
+
+static struct MIDIRunloopBackend _epoll_backend = {
+  MIDI_RUNLOOP_BACKEND_EPOLL,
+  INT_MAX,
+  &_runloop_epoll_init,
+  &_runloop_epoll_destroy,
+  &_runloop_epoll_update,
+  &_runloop_epoll_wait
+};
+#endif
+
+#ifdef HAVE_IO_URING
+#define URING_ENTRIES       256
+#define URING_BUFFERS       64
+#define URING_BUFFER_SIZE   2048
+#define URING_BUFFER_GROUP  0
+#define URING_NAME_SIZE     sizeof(struct sockaddr_storage)
+#define URING_TAG_RECV      0x80000000ULL
+#define URING_TAG_IGNORE    0xffffffffffffffffULL
+#define URING_TAG_TIMER     0xfffffffffffffffeULL
+
+/**
+ * @brief Submission and completion rings of an io_uring instance.
+ * A descriptor that is read by a single source with a receive callback
+ * has one multishot recvmsg request that picks its buffers from a ring of
+ * provided buffers. Every other scheduled descriptor has a one-shot poll
+ * request that is queued again after its completion was dispatched.
+ * Requests are tagged with a generation counter so that completions of
+ * cancelled requests can be told apart from the current one.
+ */
+struct MIDIRunloopURing {
+  int fd;
+  unsigned pending;
+  unsigned sq_entries;
+  unsigned * sq_head;
+  unsigned * sq_tail;
+  unsigned * sq_mask;
+  unsigned * sq_array;
+  unsigned * cq_head;
+  unsigned * cq_tail;
+  unsigned * cq_mask;
+  struct io_uring_sqe * sqes;
+  struct io_uring_cqe * cqes;
+  void * sq_ptr;
+  void * cq_ptr;
+  size_t sq_size;
+  size_t cq_size;
+  size_t sqes_size;
+  struct io_uring_buf_ring * buf_ring;
+  unsigned char * buffers;
+  struct msghdr msg;
+  unsigned armed[FD_SETSIZE];
+  unsigned gen[FD_SETSIZE];
+  unsigned recv_gen[FD_SETSIZE];
+  unsigned char receiving[FD_SETSIZE];
+  unsigned char fallback[FD_SETSIZE];
+};
+
+static int _uring_enter( struct MIDIRunloopURing * ring, unsigned min_complete, unsigned flags ) {
+  int result = syscall( __NR_io_uring_enter, ring->fd, ring->pending, min_complete, flags, NULL, 0 );
+  if( result >= 0 ) {
+    ring->pending -= result;
+  }
+  return result;
+}
+
+static struct io_uring_sqe * _uring_get_sqe( struct MIDIRunloopURing * ring ) {
+  struct io_uring_sqe * sqe;
+  unsigned tail = *(ring->sq_tail), index;
+
+  if( tail - __atomic_load_n( ring->sq_head, __ATOMIC_ACQUIRE ) >= ring->sq_entries ) {
+    _uring_enter( ring, 0, 0 );
+    if( tail - __atomic_load_n( ring->sq_head, __ATOMIC_ACQUIRE ) >= ring->sq_entries ) {
+      return NULL;
+    }
+  }
+  index = tail & *(ring->sq_mask);
+  sqe   = &(ring->sqes[index]);
+  memset( sqe, 0, sizeof(struct io_uring_sqe) );
+  ring->sq_array[index] = index;
+  __atomic_store_n( ring->sq_tail, tail + 1, __ATOMIC_RELEASE );
+  ring->pending++;
+  return sqe;
+}
+
+static int _uring_poll_add( struct MIDIRunloopURing * ring, int fd, unsigned events, unsigned flags, unsigned long long tag ) {
+  struct io_uring_sqe * sqe = _uring_get_sqe( ring );
+  if( sqe == NULL ) return 1;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  events = ( events << 16 ) | ( events >> 16 );
+#endif
+  sqe->opcode        = IORING_OP_POLL_ADD;
+  sqe->fd            = fd;
+  sqe->len           = flags;
+  sqe->poll32_events = events;
+  sqe->user_data     = tag;
+  return 0;
+}
+
+static int _uring_recvmsg( struct MIDIRunloopURing * ring, int fd, unsigned long long tag ) {
+  struct io_uring_sqe * sqe = _uring_get_sqe( ring );
+  if( sqe == NULL ) return 1;
+  sqe->opcode    = IORING_OP_RECVMSG;
+  sqe->fd        = fd;
+  sqe->addr      = (unsigned long) &(ring->msg);
+  sqe->len       = 1;
+  sqe->ioprio    = IORING_RECV_MULTISHOT;
+  sqe->flags     = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  sqe->user_data = tag;
+  return 0;
+}
+
+static int _uring_cancel( struct MIDIRunloopURing * ring, unsigned long long tag ) {
+  struct io_uring_sqe * sqe = _uring_get_sqe( ring );
+  if( sqe == NULL ) return 1;
+  sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+  sqe->fd        = -1;
+  sqe->addr      = tag;
+  sqe->user_data = URING_TAG_IGNORE;
+  return 0;
+}
+
+static unsigned long long _uring_fd_tag( struct MIDIRunloopURing * ring, int fd ) {
+  return ( (unsigned long long) ring->gen[fd] << 32 ) | (unsigned) fd;
+}
+
+static unsigned long long _uring_recv_tag( struct MIDIRunloopURing * ring, int fd ) {
+  return ( (unsigned long long) ring->recv_gen[fd] << 32 ) | URING_TAG_RECV | (unsigned) fd;
+}
+
+static int _uring_arm( struct MIDIRunloopURing * ring, int fd, unsigned events ) {
+  ring->gen[fd]++;
+  if( _uring_poll_add( ring, fd, events, 0, _uring_fd_tag( ring, fd ) ) ) {
+    ring->armed[fd] = 0;
+    return 1;
+  }
+  ring->armed[fd] = events;
+  return 0;
+}
+
+static int _uring_receive( struct MIDIRunloopURing * ring, int fd ) {
+  ring->recv_gen[fd]++;
+  if( _uring_recvmsg( ring, fd, _uring_recv_tag( ring, fd ) ) ) {
+    ring->receiving[fd] = 0;
+    return 1;
+  }
+  ring->receiving[fd] = 1;
+  return 0;
+}
+
+/**
+ * @brief Give a buffer back to the kernel.
+ * @private @memberof MIDIRunloop
+ * @param ring The io_uring instance.
+ * @param bid  The buffer id.
+ */
+static void _uring_buffer_recycle( struct MIDIRunloopURing * ring, unsigned bid ) {
+  struct io_uring_buf * buf;
+  unsigned short tail = ring->buf_ring->tail;
+
+  buf = &(ring->buf_ring->bufs[tail & ( URING_BUFFERS - 1 )]);
+  buf->addr = (unsigned long) ( ring->buffers + bid * URING_BUFFER_SIZE );
+  buf->len  = URING_BUFFER_SIZE;
+  buf->bid  = bid;
+  __atomic_store_n( &(ring->buf_ring->tail), tail + 1, __ATOMIC_RELEASE );
+}
+
+static void _uring_buffers_free( struct MIDIRunloopURing * ring ) {
+  if( ring->buf_ring != NULL ) munmap( ring->buf_ring, URING_BUFFERS * sizeof(struct io_uring_buf) );
+  free( ring->buffers );
+  ring->buf_ring = NULL;
+  ring->buffers  = NULL;
+}
+
+/**
+ * @brief Register the provided buffers that datagrams are received into.
+ * Kernels without provided buffer rings leave the ring without buffers,
+ * all descriptors are polled then.
+ * @private @memberof MIDIRunloop
+ * @param ring The io_uring instance.
+ * @retval 0 on success.
+ * @retval 1 if the buffers could not be registered.
+ */
+static int _uring_buffers_setup( struct MIDIRunloopURing * ring ) {
+  struct io_uring_buf_reg reg;
+  void * buf_ring;
+  unsigned bid;
+
+  buf_ring = mmap( NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+  if( buf_ring == MAP_FAILED ) return 1;
+  ring->buf_ring = buf_ring;
+  ring->buffers  = malloc( URING_BUFFERS * URING_BUFFER_SIZE );
+  if( ring->buffers == NULL ) goto fail;
+
+  memset( &reg, 0, sizeof(reg) );
+  reg.ring_addr    = (unsigned long) buf_ring;
+  reg.ring_entries = URING_BUFFERS;
+  reg.bgid         = URING_BUFFER_GROUP;
+  if( syscall( __NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1 ) ) goto fail;
+
+  for( bid=0; bid<URING_BUFFERS; bid++ ) {
+    _uring_buffer_recycle( ring, bid );
+  }
+  memset( &(ring->msg), 0, sizeof(ring->msg) );
+  ring->msg.msg_namelen = URING_NAME_SIZE;
+  return 0;
+
+fail:
+  _uring_buffers_free( ring );
+  return 1;
+}
+
+static void _uring_unmap( struct MIDIRunloopURing * ring ) {
+  if( ring->sqes != NULL && ring->sqes != MAP_FAILED ) munmap( ring->sqes, ring->sqes_size );
+  if( ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr ) munmap( ring->cq_ptr, ring->cq_size );
+  if( ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED ) munmap( ring->sq_ptr, ring->sq_size );
+}
+
+static int _uring_setup( struct MIDIRunloopURing * ring ) {
+  struct io_uring_params params;
+
+  memset( &params, 0, sizeof(params) );
+  ring->fd = syscall( __NR_io_uring_setup, URING_ENTRIES, &params );
+  if( ring->fd < 0 ) return 1;
+
+  ring->sq_size   = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_size   = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  if( params.features & IORING_FEAT_SINGLE_MMAP ) {
+    if( ring->cq_size > ring->sq_size ) ring->sq_size = ring->cq_size;
+    ring->cq_size = ring->sq_size;
+  }
+
+  ring->sq_ptr = mmap( NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring->fd, IORING_OFF_SQ_RING );
+  if( ring->sq_ptr == MAP_FAILED ) goto fail;
+  if( params.features & IORING_FEAT_SINGLE_MMAP ) {
+    ring->cq_ptr = ring->sq_ptr;
+  } else {
+    ring->cq_ptr = mmap( NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_CQ_RING );
+    if( ring->cq_ptr == MAP_FAILED ) goto fail;
+  }
+  ring->sqes = mmap( NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring->fd, IORING_OFF_SQES );
+  if( ring->sqes == MAP_FAILED ) goto fail;
+
+  ring->sq_entries = params.sq_entries;
+  ring->sq_head  = (unsigned *) ( (char *) ring->sq_ptr + params.sq_off.head );
+  ring->sq_tail  = (unsigned *) ( (char *) ring->sq_ptr + params.sq_off.tail );
+  ring->sq_mask  = (unsigned *) ( (char *) ring->sq_ptr + params.sq_off.ring_mask );
+  ring->sq_array = (unsigned *) ( (char *) ring->sq_ptr + params.sq_off.array );
+  ring->cq_head  = (unsigned *) ( (char *) ring->cq_ptr + params.cq_off.head );
+  ring->cq_tail  = (unsigned *) ( (char *) ring->cq_ptr + params.cq_off.tail );
+  ring->cq_mask  = (unsigned *) ( (char *) ring->cq_ptr + params.cq_off.ring_mask );
+  ring->cqes     = (struct io_uring_cqe *) ( (char *) ring->cq_ptr + params.cq_off.cqes );
+  return 0;
+
+fail:
+  _uring_unmap( ring );
+  close( ring->fd );
+  return 1;
+}
+
+static int _runloop_uring_init( struct MIDIRunloop * runloop ) {
+  struct MIDIRunloopURing * ring = calloc( 1, sizeof(struct MIDIRunloopURing) );
+  if( ring == NULL ) return 1;
+  if( _uring_setup( ring ) ) {
+    free( ring );
+    return 1;
+  }
+  if( _uring_buffers_setup( ring ) ) {
+    MIDILog( INFO, "io_uring provided buffers not available, polling all descriptors.\n" );
+  }
+  if( _runloop_timer_create( runloop ) ) {
+    goto fail;
+  }
+  if( _uring_poll_add( ring, runloop->timer_fd, POLLIN, IORING_POLL_ADD_MULTI, URING_TAG_TIMER ) ) {
+    close( runloop->timer_fd );
+    runloop->timer_fd = -1;
+    goto fail;
+  }
+  runloop->uring = ring;
+  return 0;
+
+fail:
+  _uring_unmap( ring );
+  close( ring->fd );
+  _uring_buffers_free( ring );
+  free( ring );
+  return 1;
+}
+
+static void _runloop_uring_destroy( struct MIDIRunloop * runloop ) {
+  struct MIDIRunloopURing * ring = runloop->uring;
+  _uring_unmap( ring );
+  close( ring->fd );
+  close( runloop->timer_fd );
+  _uring_buffers_free( ring );
+  free( ring );
+  runloop->uring = NULL;
+}
+
+/**
+ * @brief Check if datagrams can be received for the source that reads a descriptor.
+ * @private @memberof MIDIRunloop
+ * @param runloop The runloop.
+ * @param fd      The file descriptor.
+ * @return the source that receives datagrams from the descriptor or @c NULL.
+ */
+static struct MIDIRunloopSource * _runloop_uring_receiver( struct MIDIRunloop * runloop, int fd ) {
+  struct MIDIRunloopSource * source;
+  if( runloop->uring->buffers == NULL || runloop->uring->fallback[fd] ) return NULL;
+  if( ! _fdset_isset( &(runloop->master.readfds), fd ) ) return NULL;
+  if( _runloop_index_count( &(runloop->readers), fd ) != 1 ) return NULL;
+  source = runloop->readers.owner[fd];
+  if( source == NULL || source->delegate.info == NULL || source->receive == NULL ) return NULL;
+  return source;
+}
+
+/**
+ * @brief Update the requests of a file descriptor.
+ * A descriptor that is read by a single source with a receive callback
+ * gets a multishot recvmsg request, other reads and writes are polled.
+ * Requests that no longer match the events of interest are cancelled and
+ * new ones are queued. The requests are submitted with the next wait.
+ * Like modifying an epoll registration, a new request reports a scheduled
+ * write on a socket that is already writable again.
+ * @private @memberof MIDIRunloop
+ * @param runloop The runloop.
+ * @param fd      The file descriptor that changed.
+ */
+static int _runloop_uring_update( struct MIDIRunloop * runloop, int fd ) {
+  struct MIDIRunloopURing * ring = runloop->uring;
+  unsigned events = 0;
+  int receive = 0;
+
+  if( ! _fdset_isset( &(runloop->master.readfds), fd ) ) {
+    ring->fallback[fd] = 0;
+  } else if( _runloop_uring_receiver( runloop, fd ) != NULL ) {
+    receive = 1;
+  } else {
+    events |= POLLIN;
+  }
+  if( _fdset_isset( &(runloop->master.writefds), fd ) ) events |= POLLOUT;
+
+  if( ring->receiving[fd] && ! receive ) {
+    _uring_cancel( ring, _uring_recv_tag( ring, fd ) );
+    ring->receiving[fd] = 0;
+  }
+  if( receive && ! ring->receiving[fd] && _uring_receive( ring, fd ) ) {
+    MIDIError( EBUSY, "Could not queue io_uring receive request." );
+    return 1;
+  }
+  if( ring->armed[fd] == events ) {
+    return 0;
+  }
+  if( ring->armed[fd] ) {
+    _uring_cancel( ring, _uring_fd_tag( ring, fd ) );
+    ring->armed[fd] = 0;
+  }
+  if( events && _uring_arm( ring, fd, events ) ) {
+    MIDIError( EBUSY, "Could not queue io_uring poll request." );
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Hand a received datagram to the source that reads the descriptor.
+ * @private @memberof MIDIRunloop
+ * @param runloop The runloop.
+ * @param fd      The file descriptor the datagram was received on.
+ * @param size    The size of the completion.
+ * @param buffer  The provided buffer the datagram was received into.
+ * @param now     Must be set to the current time.
+ */
+static int _runloop_uring_deliver( struct MIDIRunloop * runloop, int fd, size_t size,
+                                   unsigned char * buffer, struct timespec * now ) {
+  struct io_uring_recvmsg_out * out = (struct io_uring_recvmsg_out *) buffer;
+  struct MIDIRunloopSource * source = _runloop_uring_receiver( runloop, fd );
+  socklen_t namelen;
+
+  if( source == NULL || size < sizeof(struct io_uring_recvmsg_out) ) return 0;
+  if( out->flags & MSG_TRUNC ) {
+    MIDILog( INFO, "Dropped datagram of %u bytes on fd(%i).\n", out->payloadlen, fd );
+    return 0;
+  }
+  namelen = ( out->namelen < URING_NAME_SIZE ) ? out->namelen : URING_NAME_SIZE;
+  source->stamp = runloop->stamp;
+  _runloop_source_timeout_start( source, now );
+  return (source->receive)( source->delegate.info, fd, out->payloadlen,
+                                     buffer + sizeof(struct io_uring_recvmsg_out) + URING_NAME_SIZE,
+                                     namelen, (struct sockaddr *) ( buffer + sizeof(struct io_uring_recvmsg_out) ) );
+}
+
+/**
+ * @brief Wait for the master source using io_uring.
+ * Submits all queued requests and waits for completions with a single
+ * system call. Received datagrams are handed to their sources right away
+ * and the provided buffers are recycled. Poll completions are dispatched
+ * like epoll events, then their one-shot requests are queued again, so a
+ * descriptor that still has data is reported by the next wait.
+ * @private @memberof MIDIRunloop
+ * @param runloop The runloop.
+ */
+static int _runloop_uring_wait( struct MIDIRunloop * runloop ) {
+  struct MIDIRunloopSource * master = &(runloop->master);
+  struct MIDIRunloopURing * ring = runloop->uring;
+  struct io_uring_cqe * cqe;
+  struct timespec now;
+  int reads[MAX_RUNLOOP_EVENTS], writes[MAX_RUNLOOP_EVENTS], changed[MAX_RUNLOOP_EVENTS];
+  unsigned long long tag;
+  unsigned head, tail, more, bid;
+  int i, fd, nreads = 0, nwrites = 0, nchanged = 0, io = 0, timer = 0, result = 0;
+
+  _timespec_now( &now );
+  if( _runloop_source_timeout_check( master, &now ) ) {
+    return _runloop_source_timeout( master, &now );
+  }
+  if( master->nfds == 0 && _timespec_empty( &(master->timeout_time) ) ) {
+    return 0;
+  }
+
+  _runloop_arm_timer( runloop );
+  head = *(ring->cq_head);
+  if( head == __atomic_load_n( ring->cq_tail, __ATOMIC_ACQUIRE ) ) {
+    _uring_enter( ring, 1, IORING_ENTER_GETEVENTS );
+  } else if( ring->pending ) {
+    _uring_enter( ring, 0, 0 );
+  }
+
+  _timespec_now( &now );
+  CURRENT_RUNLOOP( runloop );
+  _runloop_dispatch_begin( runloop );
+  tail = __atomic_load_n( ring->cq_tail, __ATOMIC_ACQUIRE );
+  for( ; head != tail && nchanged < MAX_RUNLOOP_EVENTS; head++ ) {
+    cqe  = &(ring->cqes[head & *(ring->cq_mask)]);
+    tag  = cqe->user_data;
+    more = cqe->flags & IORING_CQE_F_MORE;
+    if( tag == URING_TAG_IGNORE ) continue;
+    if( tag == URING_TAG_TIMER ) {
+      _runloop_timer_drain( runloop );
+      timer = 1;
+      if( ! more ) _uring_poll_add( ring, runloop->timer_fd, POLLIN, IORING_POLL_ADD_MULTI, URING_TAG_TIMER );
+      continue;
+    }
+    fd = tag & ( URING_TAG_RECV - 1 );
+    if( tag & URING_TAG_RECV ) {
+      bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      if( ring->receiving[fd] && ( tag >> 32 ) == ring->recv_gen[fd] ) {
+        if( ! more ) {
+          ring->receiving[fd] = 0;
+          changed[nchanged++] = fd;
+        }
+        if( cqe->res >= 0 && ( cqe->flags & IORING_CQE_F_BUFFER ) ) {
+          result += _runloop_uring_deliver( runloop, fd, cqe->res, ring->buffers + bid * URING_BUFFER_SIZE, &now );
+          io++;
+        } else if( cqe->res < 0 && cqe->res != -ENOBUFS ) {
+          /* not a socket or no multishot receive, poll instead */
+          ring->fallback[fd] = 1;
+        }
+      }
+      if( cqe->flags & IORING_CQE_F_BUFFER ) {
+        _uring_buffer_recycle( ring, bid );
+      }
+      continue;
+    }
+    if( ring->armed[fd] == 0 || ( tag >> 32 ) != ring->gen[fd] ) {
+      /* completion of a request that has been cancelled */
+      continue;
+    }
+    ring->armed[fd] = 0;
+    changed[nchanged++] = fd;
+    if( cqe->res < 0 ) continue;
+    if( ( cqe->res & ( POLLIN | POLLERR | POLLHUP ) ) && _fdset_isset( &(master->readfds), fd ) ) {
+      _fdset_set( &(runloop->readable), fd );
+      reads[nreads++] = fd;
+    }
+    if( ( cqe->res & ( POLLOUT | POLLERR ) ) && _fdset_isset( &(master->writefds), fd ) ) {
+      _fdset_clr( &(master->writefds), fd );
+      _fdset_set( &(runloop->writable), fd );
+      writes[nwrites++] = fd;
+    }
+  }
+  __atomic_store_n( ring->cq_head, head, __ATOMIC_RELEASE );
+
+  if( io || nreads || nwrites || timer ) {
+    _runloop_source_timeout_start( master, &now );
+    for( i=0; i<nreads; i++ ) {
+      result += _runloop_dispatch_fd( runloop, reads[i], _fdset_get( &(runloop->readable) ), 0, &now );
+    }
+    for( i=0; i<nwrites; i++ ) {
+      result += _runloop_dispatch_fd( runloop, writes[i], _fdset_get( &(runloop->writable) ), 1, &now );
+    }
+    result += _runloop_timeouts( runloop, &now );
+  }
+  _runloop_dispatch_end( runloop );
+
+  for( i=0; i<nreads; i++ ) {
+    _fdset_clr( &(runloop->readable), reads[i] );
+  }
+  for( i=0; i<nwrites; i++ ) {
+    _fdset_clr( &(runloop->writable), writes[i] );
+  }
+  for( i=0; i<nchanged; i++ ) {
+    _runloop_uring_update( runloop, changed[i] );
+  }
+  return result;
+}
+
+static struct MIDIRunloopBackend _uring_backend = {
+  MIDI_RUNLOOP_BACKEND_IO_URING,
+  FD_SETSIZE,
+  &_runloop_uring_init,
+  &_runloop_uring_destroy,
+  &_runloop_uring_update,
+  &_runloop_uring_wait
+};
+#endif
+
+/** @} @endcond */
+
+/**
+ * @brief Create a MIDIRunloop instance.
+ * Allocate space and initialize a MIDIRunloop instance that waits for its
+ * sources using select.
+ * @public @memberof MIDIRunloop
+ * @param delegate The delegate that is informed about scheduling changes, may be @c NULL.
+ * @return a pointer to the created runloop on success.
+ * @return a @c NULL pointer if the runloop could not be created.
+ */
+struct MIDIRunloop * MIDIRunloopCreate( struct MIDIRunloopDelegate * delegate ) {
+  return MIDIRunloopCreateWithBackend( delegate, MIDI_RUNLOOP_BACKEND_SELECT );
+}
+
+/**
+ * @brief Create a MIDIRunloop instance with a given backend.
+ * Allocate space and initialize a MIDIRunloop instance. If the requested
+ * backend is not available on this platform the select backend is used.
+ * Source delegates are invoked with the same fd_set based callbacks,
+ * regardless of the backend. The epoll backend also accepts descriptors
+ * of FD_SETSIZE and above, the sets passed to delegates are then larger
+ * than an fd_set.
+ * @public @memberof MIDIRunloop
+ * @param delegate The delegate that is informed about scheduling changes, may be @c NULL.
+ * @param backend  One of the @c MIDI_RUNLOOP_BACKEND_* constants.
+ * @return a pointer to the created runloop on success.
+ * @return a @c NULL pointer if the runloop could not be created.
+ */
+struct MIDIRunloop * MIDIRunloopCreateWithBackend( struct MIDIRunloopDelegate * delegate, int backend ) {
+  struct MIDIRunloop * runloop = malloc( sizeof( struct MIDIRunloop ) );
+  MIDIPrecondReturn( runloop != NULL, ENOMEM, NULL );
+
+  runloop->backend  = &_select_backend;
+  runloop->epoll_fd = -1;
+  runloop->timer_fd = -1;
+  runloop->uring    = NULL;
+  _fdset_init( &(runloop->registered) );
+  _fdset_init( &(runloop->readable) );
+  _fdset_init( &(runloop->writable) );
+  _timespec_zero( &(runloop->timer_deadline) );
+#ifdef HAVE_EPOLL
+  if( backend == MIDI_RUNLOOP_BACKEND_EPOLL ) {
+    runloop->backend = &_epoll_backend;
+  }
+#endif
+#ifdef HAVE_IO_URING
+  if( backend == MIDI_RUNLOOP_BACKEND_IO_URING ) {
+    runloop->backend = &_uring_backend;
+  }
+#endif
+  if( runloop->backend->init != NULL && (runloop->backend->init)( runloop ) ) {
+    MIDILog( INFO, "Runloop backend %i not available, falling back to select.\n", backend );
+    runloop->backend = &_select_backend;
+  }
+
+  runloop->refs   = 1;
+  runloop->active = 0;
+  runloop->master.nfds = 0;
+  _fdset_init( &(runloop->master.readfds) );
+  _fdset_init( &(runloop->master.writefds) );
+  _timespec_now( &(runloop->master.timeout_start) );
+  _timespec_zero( &(runloop->master.timeout_time) );
+  runloop->master.delegate.read    = NULL;
+  runloop->master.delegate.write   = NULL;
+  runloop->master.delegate.timeout = NULL;
+  runloop->master.delegate.info    = runloop;
+  runloop->master.receive          = NULL;
+  runloop->master.runloop          = NULL;
+
+  runloop->sources     = NULL;
+  runloop->length      = 0;
+  runloop->capacity    = 0;
+  runloop->dispatching = 0;
+  runloop->holes       = 0;
+  runloop->stamp       = 0;
+  runloop->wheel = MIDITimerWheelCreate( RUNLOOP_TIMER_TICK, _timespec_ns( &(runloop->master.timeout_start) ) );
+  if( runloop->wheel == NULL ) {
+    if( runloop->backend->destroy != NULL ) {
+      (runloop->backend->destroy)( runloop );
+    }
+    free( runloop );
+    return NULL;
+  }
+  memset( &(runloop->readers), 0, sizeof(struct MIDIRunloopFdIndex) );
+  memset( &(runloop->writers), 0, sizeof(struct MIDIRunloopFdIndex) );
+
+
+  if( delegate != NULL ) {
+    runloop->delegate.info             = delegate->info;
+    runloop->delegate.schedule_read    = delegate->schedule_read;
+    runloop->delegate.schedule_write   = delegate->schedule_write;
+    runloop->delegate.schedule_timeout = delegate->schedule_timeout;
+    runloop->delegate.clear_read       = delegate->clear_read;
+    runloop->delegate.clear_write      = delegate->clear_write;
+    runloop->delegate.clear_timeout    = delegate->clear_timeout;
+  } else {
+    runloop->delegate.info             = NULL;
+    runloop->delegate.schedule_read    = NULL;
+    runloop->delegate.schedule_write   = NULL;
+    runloop->delegate.schedule_timeout = NULL;
+    runloop->delegate.clear_read       = NULL;
+    runloop->delegate.clear_write      = NULL;
+    runloop->delegate.clear_timeout    = NULL;
+  }
+
+  return runloop;
+}
+
+void MIDIRunloopDestroy( struct MIDIRunloop * runloop ) {
+  int i;
+  for( i=0; i<runloop->length; i++ ) {
+    if( runloop->sources[i] != NULL ) {
+      _runloop_detach_timers( runloop, runloop->sources[i] );
+      runloop->sources[i]->runloop = NULL;
+      runloop->sources[i]->index   = -1;
+      MIDIRunloopSourceRelease( runloop->sources[i] );
+    }
+  }
+  if( runloop->backend->destroy != NULL ) {
+    (runloop->backend->destroy)( runloop );
+  }
+  MIDITimerWheelRelease( runloop->wheel );
+  _fdset_free( &(runloop->master.readfds) );
+  _fdset_free( &(runloop->master.writefds) );
+  _fdset_free( &(runloop->registered) );
+  _fdset_free( &(runloop->readable) );
+  _fdset_free( &(runloop->writable) );
+  free( runloop->readers.count );
+  free( runloop->readers.owner );
+  free( runloop->writers.count );
+  free( runloop->writers.owner );
+  free( runloop->sources );
+  free( runloop );
+}
+
+void MIDIRunloopRetain( struct MIDIRunloop * runloop ) {
+  runloop->refs++;
+}
+
+void MIDIRunloopRelease( struct MIDIRunloop * runloop ) {
+  if( ! --runloop->refs ) {
+    MIDIRunloopDestroy( runloop );
+  }
+}
+
+static int _runloop_schedule_read( struct MIDIRunloop * runloop, int fd ) {
+  MIDIAssert( runloop != NULL );
+  
+  if( fd >= runloop->master.nfds ) {
+    runloop->master.nfds = fd + 1;
+  }
+  _fdset_set( &(runloop->master.readfds), fd );
+  runloop->master.delegate.read = &_runloop_master_read;
+  if( runloop->backend->update != NULL ) {
+    (runloop->backend->update)( runloop, fd );
+  }
+
+  if( runloop->delegate.info != NULL && runloop->delegate.schedule_read != NULL ) {
+    return (runloop->delegate.schedule_read)( runloop->delegate.info, fd );
+  } else {
+    return 0;
+  }
+}
+
+static int _runloop_clear_read( struct MIDIRunloop * runloop, int fd ) {
+  MIDIAssert( runloop != NULL );
+
+  if( _runloop_index_count( &(runloop->readers), fd ) > 0 ) {
+    /* the remaining reader may now own the descriptor */
+    if( runloop->backend->update != NULL ) {
+      (runloop->backend->update)( runloop, fd );
+    }
+    return 0;
+  }
+
+  if( fd == runloop->master.nfds - 1 ) {
+    runloop->master.nfds = fd;
+  }
+  _fdset_clr( &(runloop->master.readfds), fd );
+  if( runloop->backend->update != NULL ) {
+    (runloop->backend->update)( runloop, fd );
+  }
+
+  if( runloop->delegate.info != NULL && runloop->delegate.clear_read != NULL ) {
+    return (runloop->delegate.clear_read)( runloop->delegate.info, fd );
+  } else {
+    return 0;
   }
 }
 
@@ -683,8 +2149,11 @@ static int _runloop_schedule_write( struct MIDIRunloop * runloop, int fd ) {
   if( fd >= runloop->master.nfds ) {
     runloop->master.nfds = fd + 1;
   }
-  FD_SET( fd, &(runloop->master.writefds) );
+  _fdset_set( &(runloop->master.writefds), fd );
   runloop->master.delegate.write = &_runloop_master_write;
+  if( runloop->backend->update != NULL ) {
+    (runloop->backend->update)( runloop, fd );
+  }
 
   if( runloop->delegate.info != NULL && runloop->delegate.schedule_write != NULL ) {
     return (runloop->delegate.schedule_write)( runloop->delegate.info, fd );
@@ -694,21 +2163,19 @@ static int _runloop_schedule_write( struct MIDIRunloop * runloop, int fd ) {
 }
 
 static int _runloop_clear_write( struct MIDIRunloop * runloop, int fd ) {
-  int i;
   MIDIAssert( runloop != NULL );
 
-  for( i=0; i<MAX_RUNLOOP_SOURCES; i++ ) {
-    if( runloop->sources[i] != NULL ) {
-      if( FD_ISSET( fd, &(runloop->sources[i]->writefds) ) ) {
-        return 0;
-      }
-    }
+  if( _runloop_index_count( &(runloop->writers), fd ) > 0 ) {
+    return 0;
   }
-  
+
   if( fd == runloop->master.nfds - 1 ) {
     runloop->master.nfds = fd;
   }
-  FD_CLR( fd, &(runloop->master.writefds) );
+  _fdset_clr( &(runloop->master.writefds), fd );
+  if( runloop->backend->update != NULL ) {
+    (runloop->backend->update)( runloop, fd );
+  }
 
   if( runloop->delegate.info != NULL && runloop->delegate.clear_write != NULL ) {
     return (runloop->delegate.clear_write)( runloop->delegate.info, fd );
@@ -718,22 +2185,12 @@ static int _runloop_clear_write( struct MIDIRunloop * runloop, int fd ) {
 }
 
 
-static int _runloop_schedule_timeout( struct MIDIRunloop * runloop, struct timespec * timeout ) {
+static int _runloop_schedule_timeout( struct MIDIRunloop * runloop, struct MIDIRunloopSource * source ) {
+  struct timespec * timeout = &(source->timeout_time);
   MIDIAssert( runloop != NULL );
 
-  if( ! _timespec_empty( timeout ) ) {
-    if( (  _timespec_cmp( timeout, &(runloop->master.timeout_time) ) < 0 )
-        || _timespec_empty( &(runloop->master.timeout_time) ) ) {
-      /* fix this:
-       * The start time should not be changed. Instead the remaining time of the source
-       * timeout should be computed and checked against the remaining time of the master
-       * source.
-       */
-      _timespec_now( &(runloop->master.timeout_start) );
-      _timespec_cpy( &(runloop->master.timeout_time), timeout );
-    }
-    runloop->master.delegate.timeout = &_runloop_master_timeout;
-  }
+  /* the timeout was put into the timer wheel when it was started */
+  runloop->master.delegate.timeout = &_runloop_master_timeout;
 
   if( runloop->delegate.info != NULL && runloop->delegate.schedule_timeout != NULL ) {
     return (runloop->delegate.schedule_timeout)( runloop->delegate.info, timeout );
@@ -743,24 +2200,25 @@ static int _runloop_schedule_timeout( struct MIDIRunloop * runloop, struct times
 }
 
 static int _runloop_update_from_source( struct MIDIRunloop * runloop, struct MIDIRunloopSource * source ) {
-  if( ! _timespec_empty( &(source->timeout_time) ) ) {
-    if( (  _timespec_cmp( &(source->timeout_time), &(runloop->master.timeout_time) ) < 0 )
-        || _timespec_empty( &(runloop->master.timeout_time) ) ) {
-      /* fix this:
-       * The start time should not be changed. Instead the remaining time of the source
-       * timeout should be computed and checked against the remaining time of the master
-       * source.
-       */
-      _timespec_now( &(runloop->master.timeout_start) );
-      _timespec_cpy( &(runloop->master.timeout_time), &(source->timeout_time) );
-    }
-  }
+  int fd;
+  _runloop_attach_timers( runloop, source );
   if( source->nfds > 0 ) {
-    _fds_add( &(runloop->master.readfds), &(source->readfds), source->nfds );
-    _fds_add( &(runloop->master.writefds), &(source->writefds), source->nfds );
+    for( fd=0; fd<source->nfds; fd++ ) {
+      if( _fdset_isset( &(source->readfds), fd ) )  _runloop_index_add( &(runloop->readers), source, fd );
+      if( _fdset_isset( &(source->writefds), fd ) ) _runloop_index_add( &(runloop->writers), source, fd );
+    }
+    _fds_add( _fdset_get( &(runloop->master.readfds) ), _fdset_get( &(source->readfds) ), source->nfds );
+    _fds_add( _fdset_get( &(runloop->master.writefds) ), _fdset_get( &(source->writefds) ), source->nfds );
     if( source->nfds > runloop->master.nfds ) {
       runloop->master.nfds = source->nfds;
     }
+    if( runloop->backend->update != NULL ) {
+      for( fd=0; fd<source->nfds; fd++ ) {
+        if( _fdset_isset( &(source->readfds), fd ) || _fdset_isset( &(source->writefds), fd ) ) {
+          (runloop->backend->update)( runloop, fd );
+        }
+      }
+    }
   }
   if( source->delegate.read != NULL ) {
     runloop->master.delegate.read = &_runloop_master_read;
@@ -774,39 +2232,111 @@ static int _runloop_update_from_source( struct MIDIRunloop * runloop, struct MID
   return 0;
 }
 
+/**
+ * @brief Add a source to a runloop.
+ * The runloop retains the source until it is removed. Sources are stored
+ * in a growing array and remember their position, so adding and removing
+ * takes constant time.
+ * @public @memberof MIDIRunloop
+ * @param runloop The runloop.
+ * @param source  The source, must not be added to any runloop.
+ * @retval 0 on success.
+ */
 int MIDIRunloopAddSource( struct MIDIRunloop * runloop, struct MIDIRunloopSource * source ) {
-  int i;
-  for( i=0; i<MAX_RUNLOOP_SOURCES; i++ ) {
-    if( runloop->sources[i] == NULL ) {
-      runloop->sources[i] = source;
-      source->runloop = runloop;
-      MIDIRunloopSourceRetain( source );
-      break;
-    }
+  struct MIDIRunloopSource ** sources;
+  int capacity;
+
+  MIDIPrecond( runloop != NULL, EFAULT );
+  MIDIPrecond( source != NULL, EINVAL );
+  MIDIPrecond( source->runloop == NULL, EINVAL );
+  MIDIPrecond( source->nfds <= runloop->backend->nfds, EINVAL );
+
+  if( source->nfds > 0 && _runloop_reserve( runloop, source->nfds - 1 ) ) {
+    return ENOMEM;
   }
-  if( i == MAX_RUNLOOP_SOURCES ) {
-    return 1;
+  if( runloop->length == runloop->capacity ) {
+    capacity = ( runloop->capacity > 0 ) ? runloop->capacity * 2 : 8;
+    sources  = realloc( runloop->sources, capacity * sizeof(struct MIDIRunloopSource *) );
+    if( sources == NULL ) {
+      MIDIError( ENOMEM, "Could not grow runloop source array." );
+      return ENOMEM;
+    }
+    runloop->sources  = sources;
+    runloop->capacity = capacity;
   }
+  source->index   = runloop->length;
+  source->runloop = runloop;
+  runloop->sources[runloop->length++] = source;
+  MIDIRunloopSourceRetain( source );
+
   _runloop_update_from_source( runloop, source );
   MIDILog( DEVELOP, "master timeout %lu sec + %lu nsec\nnfds: %i\n",
     runloop->master.timeout_time.tv_sec, runloop->master.timeout_time.tv_nsec, runloop->master.nfds );
   return 0;
 }
 
+/**
+ * @brief Remove a source from a runloop.
+ * Clear all file descriptors that no other source waits for and release
+ * the source. Sources may be removed from within their own callbacks.
+ * @public @memberof MIDIRunloop
+ * @param runloop The runloop.
+ * @param source  The source.
+ * @retval 0 on success.
+ * @retval 1 if the source was not added to the runloop.
+ */
 int MIDIRunloopRemoveSource( struct MIDIRunloop * runloop, struct MIDIRunloopSource * source ) {
-  int i;
-  for( i=0; i<MAX_RUNLOOP_SOURCES; i++ ) {
-    if( runloop->sources[i] == source ) {
-      runloop->sources[i] = NULL;
-      MIDIRunloopSourceRelease( source );
-      return 0;
+  int fd, index;
+
+  MIDIPrecond( runloop != NULL, EFAULT );
+  MIDIPrecond( source != NULL, EINVAL );
+  if( source->runloop != runloop ) {
+    return 1;
+  }
+
+  index = source->index;
+  if( runloop->dispatching > 0 ) {
+    runloop->sources[index] = NULL;
+    runloop->holes++;
+  } else {
+    runloop->sources[index] = runloop->sources[--runloop->length];
+    runloop->sources[index]->index = index;
+  }
+  _runloop_detach_timers( runloop, source );
+  source->runloop = NULL;
+  source->index   = -1;
+
+  for( fd=0; fd<source->nfds; fd++ ) {
+    if( _fdset_isset( &(source->readfds), fd ) ) {
+      _runloop_index_remove( runloop, &(runloop->readers), source, fd );
+      _runloop_clear_read( runloop, fd );
+    }
+    if( _fdset_isset( &(source->writefds), fd ) ) {
+      _runloop_index_remove( runloop, &(runloop->writers), source, fd );
+      _runloop_clear_write( runloop, fd );
     }
   }
-  return 1;
+  MIDIRunloopSourceRelease( source );
+  return 0;
+}
+
+/**
+ * @brief Get the backend that is used by the runloop.
+ * @public @memberof MIDIRunloop
+ * @param runloop The runloop.
+ * @param backend The backend, one of the @c MIDI_RUNLOOP_BACKEND_* constants.
+ * @retval 0 on success.
+ */
+int MIDIRunloopGetBackend( struct MIDIRunloop * runloop, int * backend ) {
+  MIDIPrecond( runloop != NULL, EFAULT );
+  MIDIPrecond( backend != NULL, EINVAL );
+  *backend = runloop->backend->type;
+  return 0;
 }
 
 int MIDIRunloopStep( struct MIDIRunloop * runloop ) {
-  return MIDIRunloopSourceWait( &(runloop->master) );
+  _runloop_master_deadline( runloop );
+  return (runloop->backend->wait)( runloop );
 }
 
 int MIDIRunloopStart( struct MIDIRunloop * runloop ) {
@@ -1,13 +1,19 @@
 #ifndef MIDIKIT_MIDI_RUNLOOP_H
 #define MIDIKIT_MIDI_RUNLOOP_H
 #include <sys/select.h>
+#include <sys/socket.h>
 
 #define MIDI_RUNLOOP_READ       1
 #define MIDI_RUNLOOP_WRITE      2
 #define MIDI_RUNLOOP_IDLE       4
 #define MIDI_RUNLOOP_INVALIDATE 8
 
+#define MIDI_RUNLOOP_BACKEND_SELECT   0
+#define MIDI_RUNLOOP_BACKEND_EPOLL    1
+#define MIDI_RUNLOOP_BACKEND_IO_URING 2
+
 struct MIDIRunloopSource;
+struct MIDIRunloopTimer;
 struct MIDIRunloop;
 
 struct MIDIRunloopSourceDelegate {
@@ -34,6 +40,9 @@ void MIDIRunloopSourceRelease( struct MIDIRunloopSource * source );
 
 int MIDIRunloopSourceInvalidate( struct MIDIRunloopSource * source );
 int MIDIRunloopSourceWait( struct MIDIRunloopSource * source );
+int MIDIRunloopSourceGetRunloop( struct MIDIRunloopSource * source, struct MIDIRunloop ** runloop );
+int MIDIRunloopSourceSetReceive( struct MIDIRunloopSource * source,
+  int (*receive)( void * info, int fd, size_t size, void * data, socklen_t namelen, struct sockaddr * name ) );
 
 int MIDIRunloopSourceScheduleRead( struct MIDIRunloopSource * source, int fd );
 int MIDIRunloopSourceClearRead( struct MIDIRunloopSource * source, int fd );
@@ -42,7 +51,22 @@ int MIDIRunloopSourceClearWrite( struct MIDIRunloopSource * source, int fd );
 int MIDIRunloopSourceScheduleTimeout( struct MIDIRunloopSource * source, struct timespec * timeout );
 int MIDIRunloopSourceClearTimeout( struct MIDIRunloopSource * source );
 
+struct MIDIRunloopTimerDelegate {
+  void *info;
+  int (*fire)( void * info, struct MIDIRunloopTimer * timer, struct timespec * now );
+};
+
+struct MIDIRunloopTimer * MIDIRunloopTimerCreate( struct MIDIRunloopSource * source, struct MIDIRunloopTimerDelegate * delegate );
+void MIDIRunloopTimerDestroy( struct MIDIRunloopTimer * timer );
+void MIDIRunloopTimerRetain( struct MIDIRunloopTimer * timer );
+void MIDIRunloopTimerRelease( struct MIDIRunloopTimer * timer );
+
+int MIDIRunloopTimerSchedule( struct MIDIRunloopTimer * timer, struct timespec * timeout );
+int MIDIRunloopTimerCancel( struct MIDIRunloopTimer * timer );
+int MIDIRunloopTimerIsScheduled( struct MIDIRunloopTimer * timer, int * scheduled );
+
 struct MIDIRunloop * MIDIRunloopCreate( struct MIDIRunloopDelegate * delegate );
+struct MIDIRunloop * MIDIRunloopCreateWithBackend( struct MIDIRunloopDelegate * delegate, int backend );
 void MIDIRunloopDestroy( struct MIDIRunloop * runloop );
 void MIDIRunloopRetain( struct MIDIRunloop * runloop );
 void MIDIRunloopRelease( struct MIDIRunloop * runloop );
@@ -50,6 +74,8 @@ void MIDIRunloopRelease( struct MIDIRunloop * runloop );
 int MIDIRunloopAddSource( struct MIDIRunloop * runloop, struct MIDIRunloopSource * source );
 int MIDIRunloopRemoveSource( struct MIDIRunloop * runloop, struct MIDIRunloopSource * source );
 
+int MIDIRunloopGetBackend( struct MIDIRunloop * runloop, int * backend );
+
 int MIDIRunloopStart( struct MIDIRunloop * runloop );
 int MIDIRunloopStop( struct MIDIRunloop * runloop );
 int MIDIRunloopStep( struct MIDIRunloop * runloop );
@@ -0,0 +1,654 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <sched.h>
+#define HAVE_AFFINITY 1
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include "runloop_group.h"
+#include "message.h"
+#include "message_queue.h"
+
+#define MIDI_RUNLOOP_GROUP_INBOX 1024
+
+#define GROUP_OP_NONE   0
+#define GROUP_OP_ADD    1
+#define GROUP_OP_REMOVE 2
+
+#define GROUP_WAIT_NSEC 1000000
+
+/**
+ * @ingroup MIDI
+ * @struct MIDIRunloopGroupMember
+ * @brief A runloop of a group together with the thread that runs it.
+ * Other threads talk to the runloop through the inbox and the pending
+ * command. Both are followed by a byte on the wakeup pipe, which is read by
+ * a source in the member's own runloop.
+ */
+struct MIDIRunloopGroupMember {
+/**
+ * @privatesection
+ * @cond INTERNALS
+ */
+  struct MIDIRunloopGroup  * group;
+  struct MIDIRunloop       * runloop;
+  struct MIDIRunloopSource * wakeup;
+  struct MIDIMessageQueue  * inbox;
+  int       index;
+  int       fds[2];
+  int       stop;
+  int       signaled;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  int       op;
+  struct MIDIRunloopSource * source;
+  int       result;
+  unsigned  requested;
+  unsigned  completed;
+/** @endcond */
+};
+
+/**
+ * @ingroup MIDI
+ * @struct MIDIRunloopGroup runloop_group.h
+ * @brief A set of runloops that are run by one thread each.
+ * Sources are assigned to one of the runloops and stay there until they
+ * are removed. Each thread is pinned to a different core where the
+ * platform supports it. Messages can be handed to any of the runloops,
+ * the group's delegate receives them on the runloop's thread.
+ */
+struct MIDIRunloopGroup {
+/**
+ * @privatesection
+ * @cond INTERNALS
+ */
+  int      refs;
+  int      size;
+  int      running;
+  unsigned next;
+  struct MIDIRunloopGroupDelegate delegate;
+  struct MIDIRunloopGroupMember * members;
+/** @endcond */
+};
+
+/* MARK: Internals *//**
+ * @name Internals
+ * @cond INTERNALS
+ * @{
+ */
+
+static __thread struct MIDIRunloopGroupMember * _self = NULL;
+
+static int _group_default_size( void ) {
+#ifdef HAVE_AFFINITY
+  cpu_set_t set;
+  if( sched_getaffinity( 0, sizeof(set), &set ) == 0 && CPU_COUNT( &set ) > 0 ) {
+    return CPU_COUNT( &set );
+  }
+#endif
+  long n = sysconf( _SC_NPROCESSORS_ONLN );
+  return ( n > 0 ) ? (int) n : 1;
+}
+
+/**
+ * @brief Pin the calling thread to the n-th core it may run on.
+ * @private @memberof MIDIRunloopGroup
+ * @param n The index of the core, wraps around.
+ */
+static void _group_pin_thread( int n ) {
+#ifdef HAVE_AFFINITY
+  cpu_set_t allowed, set;
+  int cpu, count;
+  if( sched_getaffinity( 0, sizeof(allowed), &allowed ) ) return;
+  count = CPU_COUNT( &allowed );
+  if( count == 0 ) return;
+  n %= count;
+  for( cpu=0; cpu<CPU_SETSIZE; cpu++ ) {
+    if( CPU_ISSET( cpu, &allowed ) && n-- == 0 ) {
+      CPU_ZERO( &set );
+      CPU_SET( cpu, &set );
+      pthread_setaffinity_np( pthread_self(), sizeof(set), &set );
+      return;
+    }
+  }
+#endif
+}
+
+/**
+ * @brief Wake up the thread of a group member.
+ * Only the first wakeup after the member drained its inbox writes to the
+ * pipe, further wakeups are coalesced.
+ * @private @memberof MIDIRunloopGroup
+ * @param member The group member.
+ */
+static void _member_wakeup( struct MIDIRunloopGroupMember * member ) {
+  char c = 0;
+  if( __atomic_exchange_n( &(member->signaled), 1, __ATOMIC_SEQ_CST ) == 0 ) {
+    if( write( member->fds[1], &c, 1 ) < 0 ) {
+      MIDILog( DEBUG, "Could not wake up runloop %i.\n", member->index );
+    }
+  }
+}
+
+static int _member_execute( struct MIDIRunloopGroupMember * member, int op, struct MIDIRunloopSource * source ) {
+  switch( op ) {
+    case GROUP_OP_ADD:
+      return MIDIRunloopAddSource( member->runloop, source );
+    case GROUP_OP_REMOVE:
+      return MIDIRunloopRemoveSource( member->runloop, source );
+  }
+  return 0;
+}
+
+/**
+ * @brief Execute the pending command of a group member.
+ * Must be called on the member's own thread. The command stays posted while
+ * it runs, so no other thread can replace it, but the member's lock is not
+ * held. A command that performs a command on another member can therefore
+ * not deadlock with that member.
+ * @private @memberof MIDIRunloopGroup
+ * @param member The group member.
+ */
+static void _member_run_command( struct MIDIRunloopGroupMember * member ) {
+  struct MIDIRunloopSource * source;
+  unsigned seq;
+  int op, result;
+
+  pthread_mutex_lock( &(member->lock) );
+  op     = member->op;
+  source = member->source;
+  seq    = member->requested;
+  pthread_mutex_unlock( &(member->lock) );
+  if( op == GROUP_OP_NONE ) return;
+
+  result = _member_execute( member, op, source );
+
+  pthread_mutex_lock( &(member->lock) );
+  member->result    = result;
+  member->op        = GROUP_OP_NONE;
+  member->source    = NULL;
+  member->completed = seq;
+  pthread_cond_broadcast( &(member->cond) );
+  pthread_mutex_unlock( &(member->lock) );
+}
+
+/**
+ * @brief Wait for a change of a group member's command state.
+ * Must be called with the member's lock held. Threads of a group keep
+ * executing the commands that are posted to themselves while they wait,
+ * so two runloop threads that perform commands on each other make progress.
+ * @private @memberof MIDIRunloopGroup
+ * @param member The group member that is waited for.
+ */
+static void _member_wait( struct MIDIRunloopGroupMember * member ) {
+  struct timespec deadline;
+  if( _self == NULL ) {
+    pthread_cond_wait( &(member->cond), &(member->lock) );
+    return;
+  }
+  pthread_mutex_unlock( &(member->lock) );
+  _member_run_command( _self );
+  pthread_mutex_lock( &(member->lock) );
+  clock_gettime( CLOCK_REALTIME, &deadline );
+  deadline.tv_nsec += GROUP_WAIT_NSEC;
+  if( deadline.tv_nsec >= 1000000000 ) {
+    deadline.tv_sec  += 1;
+    deadline.tv_nsec -= 1000000000;
+  }
+  pthread_cond_timedwait( &(member->cond), &(member->lock), &deadline );
+}
+
+/**
+ * @brief Perform a command on the thread of a group member.
+ * Runloops are not synchronized, so sources are added and removed by the
+ * thread that runs the runloop. The caller blocks until the command was
+ * executed. If the group is not running or the caller is the member's own
+ * thread the command is executed immediately.
+ * @private @memberof MIDIRunloopGroup
+ * @param member The group member.
+ * @param op     The command.
+ * @param source The source to add or remove.
+ */
+static int _member_perform( struct MIDIRunloopGroupMember * member, int op, struct MIDIRunloopSource * source ) {
+  unsigned seq;
+  int result;
+
+  if( ! member->group->running || pthread_equal( pthread_self(), member->thread ) ) {
+    return _member_execute( member, op, source );
+  }
+
+  pthread_mutex_lock( &(member->lock) );
+  while( member->op != GROUP_OP_NONE ) {
+    _member_wait( member );
+  }
+  member->op     = op;
+  member->source = source;
+  seq = ++member->requested;
+  _member_wakeup( member );
+  while( member->completed != seq ) {
+    _member_wait( member );
+  }
+  result = member->result;
+  pthread_mutex_unlock( &(member->lock) );
+  return result;
+}
+
+/**
+ * @brief Handle a wakeup on the member's thread.
+ * Execute the pending command, deliver all messages in the inbox and stop
+ * the runloop if requested.
+ * @private @memberof MIDIRunloopGroup
+ */
+static int _member_read( void * info, int nfds, fd_set * readfds ) {
+  struct MIDIRunloopGroupMember * member = info;
+  struct MIDIRunloopGroup * group = member->group;
+  struct MIDIMessage * message;
+  char buffer[64];
+
+  if( ! FD_ISSET( member->fds[0], readfds ) ) return 0;
+  while( read( member->fds[0], buffer, sizeof(buffer) ) > 0 ) {}
+  __atomic_store_n( &(member->signaled), 0, __ATOMIC_SEQ_CST );
+
+  _member_run_command( member );
+
+  while( MIDIMessageQueuePop( member->inbox, &message ) == 0 && message != NULL ) {
+    if( group->delegate.receive != NULL ) {
+      (group->delegate.receive)( group->delegate.info, member->runloop, message );
+    }
+    MIDIMessageRelease( message );
+  }
+
+  if( __atomic_load_n( &(member->stop), __ATOMIC_ACQUIRE ) ) {
+    MIDIRunloopStop( member->runloop );
+  }
+  return 0;
+}
+
+static void * _member_thread( void * info ) {
+  struct MIDIRunloopGroupMember * member = info;
+  _self = member;
+  _group_pin_thread( member->index );
+  MIDIRunloopStart( member->runloop );
+  return NULL;
+}
+
+static int _member_init( struct MIDIRunloopGroupMember * member, int backend ) {
+  struct MIDIRunloopSourceDelegate delegate = { member, &_member_read, NULL, NULL };
+
+  member->fds[0] = -1;
+  member->fds[1] = -1;
+  pthread_mutex_init( &(member->lock), NULL );
+  pthread_cond_init( &(member->cond), NULL );
+
+  member->runloop = MIDIRunloopCreateWithBackend( NULL, backend );
+  if( member->runloop == NULL ) return 1;
+  member->inbox = MIDIMessageQueueCreateFanIn( MIDI_RUNLOOP_GROUP_INBOX );
+  if( member->inbox == NULL ) return 1;
+  if( pipe( member->fds ) ) {
+    member->fds[0] = -1;
+    member->fds[1] = -1;
+    return 1;
+  }
+  fcntl( member->fds[0], F_SETFL, O_NONBLOCK );
+  fcntl( member->fds[1], F_SETFL, O_NONBLOCK );
+
+  member->wakeup = MIDIRunloopSourceCreate( &delegate );
+  if( member->wakeup == NULL ) return 1;
+  MIDIRunloopSourceScheduleRead( member->wakeup, member->fds[0] );
+  return MIDIRunloopAddSource( member->runloop, member->wakeup );
+}
+
+static void _member_destroy( struct MIDIRunloopGroupMember * member ) {
+  if( member->wakeup != NULL ) {
+    MIDIRunloopSourceInvalidate( member->wakeup );
+    MIDIRunloopSourceRelease( member->wakeup );
+  }
+  if( member->runloop != NULL ) MIDIRunloopRelease( member->runloop );
+  if( member->inbox != NULL )   MIDIMessageQueueRelease( member->inbox );
+  if( member->fds[0] >= 0 ) close( member->fds[0] );
+  if( member->fds[1] >= 0 ) close( member->fds[1] );
+  pthread_cond_destroy( &(member->cond) );
+  pthread_mutex_destroy( &(member->lock) );
+}
+
+static int _group_find_member( struct MIDIRunloopGroup * group, struct MIDIRunloop * runloop ) {
+  int i;
+  for( i=0; i<group->size; i++ ) {
+    if( group->members[i].runloop == runloop ) return i;
+  }
+  return -1;
+}
+
+static int _group_hash( unsigned long key, int size ) {
+  unsigned long long h = (unsigned long long) key * 0x9e3779b97f4a7c15ULL;
+  return (int) ( ( h >> 32 ) % (unsigned) size );
+}
+
+/** @} @endcond */
+
+/* MARK: Creation and destruction *//**
+ * @name Creation and destruction
+ * Creating, destroying and reference counting of MIDIRunloopGroup objects.
+ * @{
+ */
+
+/**
+ * @brief Create a MIDIRunloopGroup instance.
+ * Create @c size runloops that use the given backend. The runloops are not
+ * started until MIDIRunloopGroupStart is called.
+ * @public @memberof MIDIRunloopGroup
+ * @param size     The number of runloops, zero for one per available core.
+ * @param backend  One of the @c MIDI_RUNLOOP_BACKEND_* constants.
+ * @param delegate The delegate that receives handed off messages, may be @c NULL.
+ * @return a pointer to the created group on success.
+ * @return a @c NULL pointer if the group could not be created.
+ */
+struct MIDIRunloopGroup * MIDIRunloopGroupCreate( int size, int backend, struct MIDIRunloopGroupDelegate * delegate ) {
+  struct MIDIRunloopGroup * group;
+  int i;
+
+  MIDIPrecondReturn( size >= 0, EINVAL, NULL );
+  if( size == 0 ) size = _group_default_size();
+
+  group = malloc( sizeof( struct MIDIRunloopGroup ) );
+  MIDIPrecondReturn( group != NULL, ENOMEM, NULL );
+  group->members = calloc( size, sizeof( struct MIDIRunloopGroupMember ) );
+  if( group->members == NULL ) {
+    free( group );
+    MIDIError( ENOMEM, "Could not allocate runloop group members." );
+    return NULL;
+  }
+
+  group->refs    = 1;
+  group->size    = size;
+  group->running = 0;
+  group->next    = 0;
+  if( delegate != NULL ) {
+    group->delegate.info    = delegate->info;
+    group->delegate.receive = delegate->receive;
+  } else {
+    group->delegate.info    = NULL;
+    group->delegate.receive = NULL;
+  }
+
+  for( i=0; i<size; i++ ) {
+    group->members[i].group = group;
+    group->members[i].index = i;
+    if( _member_init( &(group->members[i]), backend ) ) {
+      group->size = i + 1;
+      MIDIRunloopGroupDestroy( group );
+      MIDIError( ENOMEM, "Could not create runloop group member." );
+      return NULL;
+    }
+  }
+  return group;
+}
+
+/**
+ * @brief Destroy a MIDIRunloopGroup instance.
+ * Stop the group if it is running and free all runloops. Messages that
+ * were not delivered yet are released.
+ * @public @memberof MIDIRunloopGroup
+ * @param group The group.
+ */
+void MIDIRunloopGroupDestroy( struct MIDIRunloopGroup * group ) {
+  int i;
+  if( group->running ) {
+    MIDIRunloopGroupStop( group );
+  }
+  for( i=0; i<group->size; i++ ) {
+    _member_destroy( &(group->members[i]) );
+  }
+  free( group->members );
+  free( group );
+}
+
+/**
+ * @brief Retain a MIDIRunloopGroup instance.
+ * @public @memberof MIDIRunloopGroup
+ * @param group The group.
+ */
+void MIDIRunloopGroupRetain( struct MIDIRunloopGroup * group ) {
+  MIDIPrecondReturn( group != NULL, EFAULT, (void)0 );
+  group->refs++;
+}
+
+/**
+ * @brief Release a MIDIRunloopGroup instance.
+ * @public @memberof MIDIRunloopGroup
+ * @param group The group.
+ */
+void MIDIRunloopGroupRelease( struct MIDIRunloopGroup * group ) {
+  MIDIPrecondReturn( group != NULL, EFAULT, (void)0 );
+  if( ! --group->refs ) {
+    MIDIRunloopGroupDestroy( group );
+  }
+}
+
+/** @} */
+
+/* MARK: Properties *//**
+ * @name Properties
+ * @{
+ */
+
+/**
+ * @brief Get the number of runloops in the group.
+ * @public @memberof MIDIRunloopGroup
+ * @param group The group.
+ * @param size  The number of runloops.
+ * @retval 0 on success.
+ */
+int MIDIRunloopGroupGetSize( struct MIDIRunloopGroup * group, int * size ) {
+  MIDIPrecond( group != NULL, EFAULT );
+  MIDIPrecond( size != NULL, EINVAL );
+  *size = group->size;
+  return 0;
+}
+
+/**
+ * @brief Get one of the runloops of the group.
+ * The runloop must only be used from its own thread while the group is
+ * running.
+ * @public @memberof MIDIRunloopGroup
+ * @param group   The group.
+ * @param index   The index of the runloop.
+ * @param runloop The runloop.
+ * @retval 0 on success.
+ */
+int MIDIRunloopGroupGetRunloop( struct MIDIRunloopGroup * group, int index, struct MIDIRunloop ** runloop ) {
+  MIDIPrecond( group != NULL, EFAULT );
+  MIDIPrecond( index >= 0 && index < group->size, EINVAL );
+  MIDIPrecond( runloop != NULL, EINVAL );
+  *runloop = group->members[index].runloop;
+  return 0;
+}
+
+/** @} */
+
+/* MARK: Sources and messages *//**
+ * @name Sources and messages
+ * @{
+ */
+
+/**
+ * @brief Add a source to one of the runloops.
+ * The runloop is chosen by @c assign:
+ * - @c MIDI_RUNLOOP_GROUP_ROUND_ROBIN uses the runloops in turn.
+ * - @c MIDI_RUNLOOP_GROUP_HASH hashes @c key, e.g. the peer's SSRC, so that
+ *   all sources of a peer end up on the same runloop.
+ * - @c MIDI_RUNLOOP_GROUP_EXPLICIT uses @c key as the runloop index.
+ *
+ * If the group is running the source is added by the runloop's thread and
+ * the call blocks until that happened.
+ * @public @memberof MIDIRunloopGroup
+ * @param group  The group.
+ * @param source The source.
+ * @param assign How to choose the runloop.
+ * @param key    The hash key or runloop index.
+ * @param index  The index of the chosen runloop, may be @c NULL.
+ * @retval 0 on success.
+ */
+int MIDIRunloopGroupAddSource( struct MIDIRunloopGroup * group, struct MIDIRunloopSource * source,
+                               int assign, unsigned long key, int * index ) {
+  int i, result;
+  MIDIPrecond( group != NULL, EFAULT );
+  MIDIPrecond( source != NULL, EINVAL );
+
+  switch( assign ) {
+    case MIDI_RUNLOOP_GROUP_ROUND_ROBIN:
+      i = group->next++ % group->size;
+      break;
+    case MIDI_RUNLOOP_GROUP_HASH:
+      i = _group_hash( key, group->size );
+      break;
+    case MIDI_RUNLOOP_GROUP_EXPLICIT:
+      MIDIPrecond( key < (unsigned long) group->size, EINVAL );
+      i = (int) key;
+      break;
+    default:
+      MIDIError( EINVAL, "Unknown runloop group assignment." );
+      return EINVAL;
+  }
+
+  result = _member_perform( &(group->members[i]), GROUP_OP_ADD, source );
+  if( result == 0 && index != NULL ) {
+    *index = i;
+  }
+  return result;
+}
+
+/**
+ * @brief Remove a source from the runloop it was assigned to.
+ * @public @memberof MIDIRunloopGroup
+ * @param group  The group.
+ * @param source The source.
+ * @retval 0 on success.
+ * @retval 1 if the source does not belong to any runloop of the group.
+ */
+int MIDIRunloopGroupRemoveSource( struct MIDIRunloopGroup * group, struct MIDIRunloopSource * source ) {
+  struct MIDIRunloop * runloop;
+  int i;
+  MIDIPrecond( group != NULL, EFAULT );
+  MIDIPrecond( source != NULL, EINVAL );
+
+  MIDIRunloopSourceGetRunloop( source, &runloop );
+  i = _group_find_member( group, runloop );
+  if( runloop == NULL || i < 0 ) {
+    return 1;
+  }
+  return _member_perform( &(group->members[i]), GROUP_OP_REMOVE, source );
+}
+
+/**
+ * @brief Hand a message to one of the runloops.
+ * The message is passed to the group delegate's @c receive callback on the
+ * runloop's thread, which releases it afterwards. Any thread may send
+ * messages without locking. The caller's reference is transferred to the
+ * group, so the caller must not use or release the message afterwards. If
+ * the message can not be queued the caller keeps its reference.
+ * Messages from a message pool may be sent, the pool takes them back through
+ * its return list when they are released on the receiving thread. Without
+ * -DMIDI_ATOMIC_REFS the reference counts are not safe to change on two
+ * threads, so the transferred reference must be the only one.
+ * @public @memberof MIDIRunloopGroup
+ * @param group   The group.
+ * @param index   The index of the receiving runloop.
+ * @param message The message.
+ * @retval 0 on success.
+ * @retval EBUSY if the message has other references and midikit was built
+ *               without MIDI_ATOMIC_REFS.
+ * @retval ENOBUFS if the runloop's inbox is full.
+ */
+int MIDIRunloopGroupSendMessage( struct MIDIRunloopGroup * group, int index, struct MIDIMessage * message ) {
+  struct MIDIRunloopGroupMember * member;
+  int result;
+#ifndef MIDI_ATOMIC_REFS
+  int refs;
+#endif
+  MIDIPrecond( group != NULL, EFAULT );
+  MIDIPrecond( index >= 0 && index < group->size, EINVAL );
+  MIDIPrecond( message != NULL, EINVAL );
+
+#ifndef MIDI_ATOMIC_REFS
+  MIDIMessageGetRefs( message, &refs );
+  if( refs != 1 ) {
+    MIDIError( EBUSY, "Message has other references." );
+    return EBUSY;
+  }
+#endif
+  member = &(group->members[index]);
+  result = MIDIMessageQueueTryPushTransfer( member->inbox, message );
+  if( result == 1 ) {
+    MIDIError( ENOBUFS, "Runloop inbox is full." );
+    return ENOBUFS;
+  } else if( result ) {
+    return result;
+  }
+  _member_wakeup( member );
+  return 0;
+}
+
+/** @} */
+
+/* MARK: Threads *//**
+ * @name Threads
+ * @{
+ */
+
+/**
+ * @brief Start a thread for each runloop.
+ * Threads are pinned to the cores the process may run on, in order.
+ * @public @memberof MIDIRunloopGroup
+ * @param group The group.
+ * @retval 0 on success.
+ */
+int MIDIRunloopGroupStart( struct MIDIRunloopGroup * group ) {
+  int i, j;
+  MIDIPrecond( group != NULL, EFAULT );
+  MIDIPrecond( ! group->running, EINVAL );
+
+  for( i=0; i<group->size; i++ ) {
+    __atomic_store_n( &(group->members[i].stop), 0, __ATOMIC_RELEASE );
+    if( pthread_create( &(group->members[i].thread), NULL, &_member_thread, &(group->members[i]) ) ) {
+      for( j=0; j<i; j++ ) {
+        __atomic_store_n( &(group->members[j].stop), 1, __ATOMIC_RELEASE );
+        _member_wakeup( &(group->members[j]) );
+        pthread_join( group->members[j].thread, NULL );
+      }
+      MIDIError( EAGAIN, "Could not start runloop thread." );
+      return EAGAIN;
+    }
+  }
+  group->running = 1;
+  return 0;
+}
+
+/**
+ * @brief Stop all runloop threads.
+ * Wait until every thread finished its current step.
+ * @public @memberof MIDIRunloopGroup
+ * @param group The group.
+ * @retval 0 on success.
+ */
+int MIDIRunloopGroupStop( struct MIDIRunloopGroup * group ) {
+  int i;
+  MIDIPrecond( group != NULL, EFAULT );
+  if( ! group->running ) return 0;
+
+  for( i=0; i<group->size; i++ ) {
+    __atomic_store_n( &(group->members[i].stop), 1, __ATOMIC_RELEASE );
+    _member_wakeup( &(group->members[i]) );
+  }
+  for( i=0; i<group->size; i++ ) {
+    pthread_join( group->members[i].thread, NULL );
+  }
+  group->running = 0;
+  return 0;
+}
+
+/** @} */
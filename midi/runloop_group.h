@@ -0,0 +1,35 @@
+#ifndef MIDIKIT_MIDI_RUNLOOP_GROUP_H
+#define MIDIKIT_MIDI_RUNLOOP_GROUP_H
+#include "midi.h"
+#include "runloop.h"
+
+#define MIDI_RUNLOOP_GROUP_ROUND_ROBIN 0
+#define MIDI_RUNLOOP_GROUP_HASH        1
+#define MIDI_RUNLOOP_GROUP_EXPLICIT    2
+
+struct MIDIMessage;
+struct MIDIRunloopGroup;
+
+struct MIDIRunloopGroupDelegate {
+  void * info;
+  int (*receive)( void * info, struct MIDIRunloop * runloop, struct MIDIMessage * message );
+};
+
+struct MIDIRunloopGroup * MIDIRunloopGroupCreate( int size, int backend, struct MIDIRunloopGroupDelegate * delegate );
+void MIDIRunloopGroupDestroy( struct MIDIRunloopGroup * group );
+void MIDIRunloopGroupRetain( struct MIDIRunloopGroup * group );
+void MIDIRunloopGroupRelease( struct MIDIRunloopGroup * group );
+
+int MIDIRunloopGroupGetSize( struct MIDIRunloopGroup * group, int * size );
+int MIDIRunloopGroupGetRunloop( struct MIDIRunloopGroup * group, int index, struct MIDIRunloop ** runloop );
+
+int MIDIRunloopGroupAddSource( struct MIDIRunloopGroup * group, struct MIDIRunloopSource * source,
+                               int assign, unsigned long key, int * index );
+int MIDIRunloopGroupRemoveSource( struct MIDIRunloopGroup * group, struct MIDIRunloopSource * source );
+
+int MIDIRunloopGroupSendMessage( struct MIDIRunloopGroup * group, int index, struct MIDIMessage * message );
+
+int MIDIRunloopGroupStart( struct MIDIRunloopGroup * group );
+int MIDIRunloopGroupStop( struct MIDIRunloopGroup * group );
+
+#endif
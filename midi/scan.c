@@ -0,0 +1,212 @@
+#include "scan.h"
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#if defined( __SSE2__ )
+#include <emmintrin.h>
+#define MIDI_SCAN_HAVE_SSE2
+#endif
+#if defined( __GNUC__ ) && ( defined( __clang__ ) || __GNUC__ >= 5 )
+#include <immintrin.h>
+#define MIDI_SCAN_HAVE_AVX2
+#endif
+#endif
+
+/*
+ * Find status bytes in raw MIDI data.
+ * Decoding long dumps and system exclusive messages spends most of its
+ * time looking for the next byte with the high bit set. These functions
+ * check 16 (SSE2) or 32 (AVX2) bytes at a time when the processor
+ * supports it and fall back to a byte loop otherwise. The backend is
+ * chosen on first use and can be overridden with MIDIScanSetBackend,
+ * which is mostly useful for testing.
+ */
+
+/* MARK: Internals *//**
+ * @name Internals
+ * @cond INTERNALS
+ * @{
+ */
+
+/* Bytes from 0x80 to 0xf7 end a system exclusive message, real-time bytes do not. */
+#define SYSEX_END( byte ) ( (byte) >= 0x80 && (byte) < MIDI_STATUS_TIMING_CLOCK )
+
+static size_t _scan_status_scalar( size_t size, const unsigned char * buffer ) {
+  size_t i;
+  for( i=0; i<size && buffer[i] < 0x80; i++ );
+  return i;
+}
+
+static size_t _scan_sysex_end_scalar( size_t size, const unsigned char * buffer ) {
+  size_t i;
+  for( i=0; i<size && ! SYSEX_END( buffer[i] ); i++ );
+  return i;
+}
+
+#ifdef MIDI_SCAN_HAVE_SSE2
+static size_t _scan_status_sse2( size_t size, const unsigned char * buffer ) {
+  size_t i;
+  int mask;
+  for( i=0; i+16<=size; i+=16 ) {
+    mask = _mm_movemask_epi8( _mm_loadu_si128( (const __m128i *) (buffer+i) ) );
+    if( mask ) return i + __builtin_ctz( mask );
+  }
+  return i + _scan_status_scalar( size-i, buffer+i );
+}
+
+static size_t _scan_sysex_end_sse2( size_t size, const unsigned char * buffer ) {
+  /* as signed bytes, 0x80 to 0xf7 are exactly the values below -8 */
+  const __m128i limit = _mm_set1_epi8( -8 );
+  size_t i;
+  int mask;
+  for( i=0; i+16<=size; i+=16 ) {
+    mask = _mm_movemask_epi8( _mm_cmplt_epi8( _mm_loadu_si128( (const __m128i *) (buffer+i) ), limit ) );
+    if( mask ) return i + __builtin_ctz( mask );
+  }
+  return i + _scan_sysex_end_scalar( size-i, buffer+i );
+}
+#endif
+
+#ifdef MIDI_SCAN_HAVE_AVX2
+__attribute__(( target( "avx2" ) ))
+static size_t _scan_status_avx2( size_t size, const unsigned char * buffer ) {
+  size_t i;
+  unsigned int mask;
+  for( i=0; i+32<=size; i+=32 ) {
+    mask = _mm256_movemask_epi8( _mm256_loadu_si256( (const __m256i *) (buffer+i) ) );
+    if( mask ) return i + __builtin_ctz( mask );
+  }
+  return i + _scan_status_scalar( size-i, buffer+i );
+}
+
+__attribute__(( target( "avx2" ) ))
+static size_t _scan_sysex_end_avx2( size_t size, const unsigned char * buffer ) {
+  const __m256i limit = _mm256_set1_epi8( -8 );
+  size_t i;
+  unsigned int mask;
+  for( i=0; i+32<=size; i+=32 ) {
+    mask = _mm256_movemask_epi8( _mm256_cmpgt_epi8( limit, _mm256_loadu_si256( (const __m256i *) (buffer+i) ) ) );
+    if( mask ) return i + __builtin_ctz( mask );
+  }
+  return i + _scan_sysex_end_scalar( size-i, buffer+i );
+}
+#endif
+
+static int _backend = -1;
+static size_t (*_scan_status)( size_t size, const unsigned char * buffer ) = &_scan_status_scalar;
+static size_t (*_scan_sysex_end)( size_t size, const unsigned char * buffer ) = &_scan_sysex_end_scalar;
+
+static int _backend_supported( int backend ) {
+  switch( backend ) {
+    case MIDI_SCAN_SCALAR:
+      return 1;
+#ifdef MIDI_SCAN_HAVE_SSE2
+    case MIDI_SCAN_SSE2:
+      return 1;
+#endif
+#ifdef MIDI_SCAN_HAVE_AVX2
+    case MIDI_SCAN_AVX2:
+      return __builtin_cpu_supports( "avx2" );
+#endif
+    default:
+      return 0;
+  }
+}
+
+static void _backend_init( void ) {
+  if( _backend >= 0 ) return;
+  if( _backend_supported( MIDI_SCAN_AVX2 ) ) {
+    MIDIScanSetBackend( MIDI_SCAN_AVX2 );
+  } else if( _backend_supported( MIDI_SCAN_SSE2 ) ) {
+    MIDIScanSetBackend( MIDI_SCAN_SSE2 );
+  } else {
+    MIDIScanSetBackend( MIDI_SCAN_SCALAR );
+  }
+}
+
+/**
+ * @}
+ * @endcond
+ */
+
+/* MARK: -
+ * MARK: Backend selection *//**
+ * @name Backend selection
+ * @{
+ */
+
+/**
+ * @brief Get the backend that is used for scanning.
+ * @return MIDI_SCAN_SCALAR, MIDI_SCAN_SSE2 or MIDI_SCAN_AVX2.
+ */
+int MIDIScanGetBackend( void ) {
+  _backend_init();
+  return _backend;
+}
+
+/**
+ * @brief Choose the backend that is used for scanning.
+ * This is not thread-safe and should only be done while no other
+ * thread decodes messages.
+ * @param backend MIDI_SCAN_SCALAR, MIDI_SCAN_SSE2 or MIDI_SCAN_AVX2.
+ * @retval 0  on success.
+ * @retval >0 if the backend is not supported by the build or processor.
+ */
+int MIDIScanSetBackend( int backend ) {
+  if( ! _backend_supported( backend ) ) return 1;
+  switch( backend ) {
+#ifdef MIDI_SCAN_HAVE_AVX2
+    case MIDI_SCAN_AVX2:
+      _scan_status    = &_scan_status_avx2;
+      _scan_sysex_end = &_scan_sysex_end_avx2;
+      break;
+#endif
+#ifdef MIDI_SCAN_HAVE_SSE2
+    case MIDI_SCAN_SSE2:
+      _scan_status    = &_scan_status_sse2;
+      _scan_sysex_end = &_scan_sysex_end_sse2;
+      break;
+#endif
+    default:
+      _scan_status    = &_scan_status_scalar;
+      _scan_sysex_end = &_scan_sysex_end_scalar;
+      break;
+  }
+  _backend = backend;
+  return 0;
+}
+
+/** @} */
+
+/* MARK: Scanning *//**
+ * @name Scanning
+ * @{
+ */
+
+/**
+ * @brief Find the next status byte.
+ * @param size   The number of bytes in the buffer.
+ * @param buffer The buffer.
+ * @return the offset of the first byte with the high bit set or @c size
+ *         if there is none.
+ */
+size_t MIDIScanStatus( size_t size, const unsigned char * buffer ) {
+  _backend_init();
+  return (*_scan_status)( size, buffer );
+}
+
+/**
+ * @brief Find the end of a system exclusive message.
+ * The payload of a system exclusive message ends with the first status
+ * byte that is not a real-time message, usually
+ * @c MIDI_STATUS_END_OF_EXCLUSIVE.
+ * @param size   The number of bytes in the buffer.
+ * @param buffer The buffer, starting after the @c MIDI_STATUS_SYSTEM_EXCLUSIVE byte.
+ * @return the offset of the first byte from 0x80 to 0xf7 or @c size if
+ *         there is none.
+ */
+size_t MIDIScanSysexEnd( size_t size, const unsigned char * buffer ) {
+  _backend_init();
+  return (*_scan_sysex_end)( size, buffer );
+}
+
+/** @} */
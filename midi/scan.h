@@ -0,0 +1,16 @@
+#ifndef MIDIKIT_MIDI_SCAN_H
+#define MIDIKIT_MIDI_SCAN_H
+#include <stdlib.h>
+#include "midi.h"
+
+#define MIDI_SCAN_SCALAR 0
+#define MIDI_SCAN_SSE2   1
+#define MIDI_SCAN_AVX2   2
+
+int MIDIScanGetBackend( void );
+int MIDIScanSetBackend( int backend );
+
+size_t MIDIScanStatus( size_t size, const unsigned char * buffer );
+size_t MIDIScanSysexEnd( size_t size, const unsigned char * buffer );
+
+#endif
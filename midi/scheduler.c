@@ -0,0 +1,474 @@
+#include <stdlib.h>
+#include <time.h>
+#include "scheduler.h"
+#include "message.h"
+#include "clock.h"
+#include "runloop.h"
+#include "realtime.h"
+
+#define SCHEDULER_MIN_CAPACITY 32
+
+/**
+ * @ingroup MIDI
+ * @struct MIDISchedulerEntry
+ * @brief Entry of the scheduler heap.
+ * Messages with equal timestamps are ordered by the order in which they
+ * were scheduled.
+ */
+struct MIDISchedulerEntry {
+/**
+ * @privatesection
+ * @cond INTERNALS
+ */
+  MIDITimestamp timestamp;
+  unsigned long order;
+  struct MIDIMessage * message;
+/** @endcond */
+};
+
+/**
+ * @ingroup MIDI
+ * @struct MIDIScheduler scheduler.h
+ * @brief Hold back messages until their timestamp is due.
+ * Messages with a timestamp in the future of the scheduler's clock are
+ * stored in a min-heap. A runloop timer is armed for the earliest timestamp
+ * and hands all due messages to the delegate when it fires, so the
+ * runloop sleeps until the next message is due.
+ * Messages that are due when they are scheduled are delivered immediately.
+ */
+struct MIDIScheduler {
+/**
+ * @privatesection
+ * @cond INTERNALS
+ */
+  int    refs;
+  struct MIDIClock * clock;
+  struct MIDIRunloopSource * source;
+  struct MIDIRunloopTimer  * timer;
+  struct MIDISchedulerDelegate delegate;
+  struct MIDISchedulerEntry * heap;
+  size_t length;
+  size_t capacity;
+  unsigned long order;
+  struct MIDISchedulerStats stats;
+/** @endcond */
+};
+
+/* MARK: Internals *//**
+ * @name Internals
+ * @cond INTERNALS
+ * @{
+ */
+
+static int _heap_less( struct MIDISchedulerEntry * a, struct MIDISchedulerEntry * b ) {
+  return ( a->timestamp < b->timestamp ) ||
+         ( a->timestamp == b->timestamp && (long) ( a->order - b->order ) < 0 );
+}
+
+static int _heap_insert( struct MIDIScheduler * scheduler, struct MIDISchedulerEntry * entry ) {
+  struct MIDISchedulerEntry * heap = scheduler->heap;
+  size_t i, parent, capacity;
+
+  if( scheduler->length == scheduler->capacity ) {
+    capacity = ( scheduler->capacity < SCHEDULER_MIN_CAPACITY ) ? SCHEDULER_MIN_CAPACITY : scheduler->capacity * 2;
+    MIDIRealTimeCheck( MIDI_REALTIME_ALLOCATION );
+    heap = realloc( scheduler->heap, capacity * sizeof(struct MIDISchedulerEntry) );
+    if( heap == NULL ) return 1;
+    scheduler->heap     = heap;
+    scheduler->capacity = capacity;
+  }
+
+  i = scheduler->length++;
+  while( i > 0 ) {
+    parent = (i-1) / 2;
+    if( ! _heap_less( entry, &heap[parent] ) ) break;
+    heap[i] = heap[parent];
+    i = parent;
+  }
+  heap[i] = *entry;
+  return 0;
+}
+
+static void _heap_remove_first( struct MIDIScheduler * scheduler ) {
+  struct MIDISchedulerEntry * heap = scheduler->heap;
+  struct MIDISchedulerEntry last = heap[--scheduler->length];
+  size_t i = 0, child, n = scheduler->length;
+  while( (child = 2*i+1) < n ) {
+    if( child+1 < n && _heap_less( &heap[child+1], &heap[child] ) ) child++;
+    if( ! _heap_less( &heap[child], &last ) ) break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = last;
+}
+
+/**
+ * @brief Arm the timer for the earliest message.
+ * The runloop timer rounds the deadline up to its tick, so it never fires
+ * before the message is due.
+ * @private @memberof MIDIScheduler
+ * @param scheduler The scheduler.
+ * @param now       The current time of the scheduler's clock.
+ * @retval 0 on success.
+ */
+static int _scheduler_arm( struct MIDIScheduler * scheduler, MIDITimestamp now ) {
+  struct timespec timeout = { 0, 0 };
+  MIDISamplingRate rate;
+  double ns;
+
+  if( scheduler->length == 0 ) {
+    return MIDIRunloopTimerCancel( scheduler->timer );
+  }
+  if( scheduler->heap[0].timestamp > now ) {
+    MIDIClockGetSamplingRate( scheduler->clock, &rate );
+    ns = (double) ( scheduler->heap[0].timestamp - now ) * 1000000000.0 / rate;
+    timeout.tv_sec  = (time_t) ( ns / 1000000000.0 );
+    timeout.tv_nsec = (long) ( ns - timeout.tv_sec * 1000000000.0 );
+  }
+  return MIDIRunloopTimerSchedule( scheduler->timer, &timeout );
+}
+
+/**
+ * @brief Remove the earliest message and hand it to the delegate.
+ * @private @memberof MIDIScheduler
+ * @param scheduler The scheduler.
+ * @param now       The current time of the scheduler's clock.
+ * @retval 0 on success.
+ * @retval >0 if the delegate failed to deliver the message.
+ */
+static int _scheduler_deliver_first( struct MIDIScheduler * scheduler, MIDITimestamp now ) {
+  struct MIDIMessage * message = scheduler->heap[0].message;
+  MIDITimestamp timestamp = scheduler->heap[0].timestamp;
+  MIDISamplingRate rate;
+  unsigned long error;
+  int result = 0;
+
+  _heap_remove_first( scheduler );
+  if( timestamp > now ) {
+    scheduler->stats.flushed++;
+  } else {
+    MIDIClockGetSamplingRate( scheduler->clock, &rate );
+    error = (unsigned long) ( ( now - timestamp ) * 1000000 / rate );
+    scheduler->stats.delivered++;
+    scheduler->stats.error_total += error;
+    if( error > scheduler->stats.error_max ) {
+      scheduler->stats.error_max = error;
+    }
+  }
+  if( scheduler->delegate.deliver != NULL ) {
+    result = (*scheduler->delegate.deliver)( scheduler->delegate.info, message );
+  }
+  MIDIMessageRelease( message );
+  return result;
+}
+
+static int _scheduler_timer_fire( void * info, struct MIDIRunloopTimer * timer, struct timespec * now ) {
+  return MIDISchedulerDeliver( info );
+}
+
+/** @} @endcond */
+
+/* MARK: -
+ * MARK: Creation and destruction *//**
+ * @name Creation and destruction
+ * Creating, destroying and reference counting of MIDIScheduler objects.
+ * @{
+ */
+
+/**
+ * @brief Create a MIDIScheduler instance.
+ * The scheduler owns a timer of the given runloop source. If no source is
+ * given the scheduler creates its own, which has to be added to a runloop
+ * for the messages to be delivered.
+ * @public @memberof MIDIScheduler
+ * @param clock    The clock that the message timestamps refer to (pass @c NULL for global clock)
+ * @param source   The runloop source that owns the timer or @c NULL.
+ * @param delegate The delegate that delivers due messages.
+ * @return a pointer to the created scheduler on success.
+ * @return a @c NULL pointer if the scheduler could not be created.
+ */
+struct MIDIScheduler * MIDISchedulerCreate( struct MIDIClock * clock, struct MIDIRunloopSource * source,
+                                            struct MIDISchedulerDelegate * delegate ) {
+  struct MIDIRunloopSourceDelegate source_delegate = { NULL, NULL, NULL, NULL };
+  struct MIDIRunloopTimerDelegate timer_delegate;
+  struct MIDIScheduler * scheduler;
+
+  MIDIPrecondReturn( delegate != NULL, EINVAL, NULL );
+  scheduler = malloc( sizeof( struct MIDIScheduler ) );
+  MIDIPrecondReturn( scheduler != NULL, ENOMEM, NULL );
+
+  if( clock == NULL ) {
+    MIDIClockGetGlobalClock( &clock );
+  }
+  if( source == NULL ) {
+    source = MIDIRunloopSourceCreate( &source_delegate );
+  } else {
+    MIDIRunloopSourceRetain( source );
+  }
+  if( clock == NULL || source == NULL ) {
+    if( source != NULL ) MIDIRunloopSourceRelease( source );
+    free( scheduler );
+    return NULL;
+  }
+
+  timer_delegate.info = scheduler;
+  timer_delegate.fire = &_scheduler_timer_fire;
+  scheduler->timer = MIDIRunloopTimerCreate( source, &timer_delegate );
+  if( scheduler->timer == NULL ) {
+    MIDIRunloopSourceRelease( source );
+    free( scheduler );
+    return NULL;
+  }
+
+  MIDIClockRetain( clock );
+  scheduler->refs     = 1;
+  scheduler->clock    = clock;
+  scheduler->source   = source;
+  scheduler->delegate = *delegate;
+  scheduler->heap     = NULL;
+  scheduler->length   = 0;
+  scheduler->capacity = 0;
+  scheduler->order    = 0;
+  MIDISchedulerResetStats( scheduler );
+  return scheduler;
+}
+
+/**
+ * @brief Destroy a MIDIScheduler instance.
+ * Messages that were not delivered yet are released.
+ * @public @memberof MIDIScheduler
+ * @param scheduler The scheduler.
+ */
+void MIDISchedulerDestroy( struct MIDIScheduler * scheduler ) {
+  MIDIPrecondReturn( scheduler != NULL, EFAULT, (void)0 );
+  MIDISchedulerClear( scheduler );
+  MIDIRunloopTimerRelease( scheduler->timer );
+  MIDIRunloopSourceRelease( scheduler->source );
+  MIDIClockRelease( scheduler->clock );
+  free( scheduler->heap );
+  free( scheduler );
+}
+
+/**
+ * @brief Retain a MIDIScheduler instance.
+ * Increment the reference counter of a scheduler so that it won't be destroyed.
+ * @public @memberof MIDIScheduler
+ * @param scheduler The scheduler.
+ */
+void MIDISchedulerRetain( struct MIDIScheduler * scheduler ) {
+  MIDIPrecondReturn( scheduler != NULL, EFAULT, (void)0 );
+  scheduler->refs++;
+}
+
+/**
+ * @brief Release a MIDIScheduler instance.
+ * Decrement the reference counter of a scheduler. If the reference count
+ * reached zero, destroy the scheduler.
+ * @public @memberof MIDIScheduler
+ * @param scheduler The scheduler.
+ */
+void MIDISchedulerRelease( struct MIDIScheduler * scheduler ) {
+  MIDIPrecondReturn( scheduler != NULL, EFAULT, (void)0 );
+  if( ! --scheduler->refs ) {
+    MIDISchedulerDestroy( scheduler );
+  }
+}
+
+/** @} */
+
+/* MARK: Properties *//**
+ * @name Properties
+ * @{
+ */
+
+/**
+ * @brief Get the runloop source that owns the scheduler's timer.
+ * @public @memberof MIDIScheduler
+ * @param scheduler The scheduler.
+ * @param source    The runloop source.
+ * @retval 0 on success.
+ */
+int MIDISchedulerGetRunloopSource( struct MIDIScheduler * scheduler, struct MIDIRunloopSource ** source ) {
+  MIDIPrecond( scheduler != NULL, EFAULT );
+  MIDIPrecond( source != NULL, EINVAL );
+  *source = scheduler->source;
+  return 0;
+}
+
+/**
+ * @brief Get the number of messages that wait for their timestamp.
+ * @public @memberof MIDIScheduler
+ * @param scheduler The scheduler.
+ * @param length    The number of messages.
+ * @retval 0 on success.
+ */
+int MIDISchedulerGetLength( struct MIDIScheduler * scheduler, size_t * length ) {
+  MIDIPrecond( scheduler != NULL, EFAULT );
+  MIDIPrecond( length != NULL, EINVAL );
+  *length = scheduler->length;
+  return 0;
+}
+
+/**
+ * @brief Get the timestamp of the next message that will be delivered.
+ * @public @memberof MIDIScheduler
+ * @param scheduler The scheduler.
+ * @param timestamp The timestamp.
+ * @retval 0 on success.
+ * @retval >0 if no message is scheduled.
+ */
+int MIDISchedulerGetNextTimestamp( struct MIDIScheduler * scheduler, MIDITimestamp * timestamp ) {
+  MIDIPrecond( scheduler != NULL, EFAULT );
+  MIDIPrecond( timestamp != NULL, EINVAL );
+  if( scheduler->length == 0 ) return 1;
+  *timestamp = scheduler->heap[0].timestamp;
+  return 0;
+}
+
+/** @} */
+
+/* MARK: Scheduling *//**
+ * @name Scheduling
+ * Holding back and delivering messages.
+ * @{
+ */
+
+/**
+ * @brief Schedule a message for delivery at its timestamp.
+ * A message that is due is delivered immediately, later messages are
+ * retained until the timer fires. Takes logarithmic time.
+ * @public @memberof MIDIScheduler
+ * @param scheduler The scheduler.
+ * @param message   The message.
+ * @retval 0 on success.
+ * @retval >0 if the message could not be scheduled or delivered.
+ */
+int MIDISchedulerSchedule( struct MIDIScheduler * scheduler, struct MIDIMessage * message ) {
+  struct MIDISchedulerEntry entry;
+  MIDITimestamp now;
+
+  MIDIPrecond( scheduler != NULL, EFAULT );
+  MIDIPrecond( message != NULL, EINVAL );
+
+  MIDIMessageGetTimestamp( message, &(entry.timestamp) );
+  MIDIClockGetNow( scheduler->clock, &now );
+  if( entry.timestamp <= now ) {
+    /* do not overtake held back messages that are due as well */
+    if( scheduler->length > 0 && scheduler->heap[0].timestamp <= now ) {
+      MIDISchedulerDeliver( scheduler );
+    }
+    if( scheduler->delegate.deliver == NULL ) return 0;
+    return (*scheduler->delegate.deliver)( scheduler->delegate.info, message );
+  }
+
+  entry.order   = scheduler->order++;
+  entry.message = message;
+  if( _heap_insert( scheduler, &entry ) ) return 1;
+  MIDIMessageRetain( message );
+  scheduler->stats.scheduled++;
+  if( scheduler->heap[0].order == entry.order ) {
+    return _scheduler_arm( scheduler, now );
+  }
+  return 0;
+}
+
+/**
+ * @brief Deliver all messages that are due.
+ * This is called when the scheduler's timer fires, call it manually to
+ * poll a scheduler whose source is not added to a runloop.
+ * @public @memberof MIDIScheduler
+ * @param scheduler The scheduler.
+ * @retval 0 on success.
+ * @retval >0 if a message could not be delivered.
+ */
+int MIDISchedulerDeliver( struct MIDIScheduler * scheduler ) {
+  MIDITimestamp now;
+  int result = 0;
+
+  MIDIPrecond( scheduler != NULL, EFAULT );
+  MIDIClockGetNow( scheduler->clock, &now );
+  while( scheduler->length > 0 && scheduler->heap[0].timestamp <= now ) {
+    result += _scheduler_deliver_first( scheduler, now );
+  }
+  _scheduler_arm( scheduler, now );
+  return result;
+}
+
+/**
+ * @brief Deliver all messages now.
+ * Messages are delivered in timestamp order, even if they are not due.
+ * @public @memberof MIDIScheduler
+ * @param scheduler The scheduler.
+ * @retval 0 on success.
+ * @retval >0 if a message could not be delivered.
+ */
+int MIDISchedulerFlush( struct MIDIScheduler * scheduler ) {
+  MIDITimestamp now;
+  int result = 0;
+
+  MIDIPrecond( scheduler != NULL, EFAULT );
+  MIDIClockGetNow( scheduler->clock, &now );
+  while( scheduler->length > 0 ) {
+    result += _scheduler_deliver_first( scheduler, now );
+  }
+  MIDIRunloopTimerCancel( scheduler->timer );
+  return result;
+}
+
+/**
+ * @brief Drop all messages without delivering them.
+ * @public @memberof MIDIScheduler
+ * @param scheduler The scheduler.
+ * @retval 0 on success.
+ */
+int MIDISchedulerClear( struct MIDIScheduler * scheduler ) {
+  MIDIPrecond( scheduler != NULL, EFAULT );
+  while( scheduler->length > 0 ) {
+    MIDIMessageRelease( scheduler->heap[--scheduler->length].message );
+  }
+  return MIDIRunloopTimerCancel( scheduler->timer );
+}
+
+/** @} */
+
+/* MARK: Statistics *//**
+ * @name Statistics
+ * Monitor the scheduling error.
+ * @{
+ */
+
+/**
+ * @brief Get the scheduler statistics.
+ * The delivery delay is the time between the timestamp of a message and
+ * its delivery, as measured by the scheduler's clock. It is bounded by the
+ * tick of the runloop timers and the time the runloop spends on other
+ * sources.
+ * @public @memberof MIDIScheduler
+ * @param scheduler The scheduler.
+ * @param stats     The statistics structure to fill.
+ * @retval 0 on success.
+ */
+int MIDISchedulerGetStats( struct MIDIScheduler * scheduler, struct MIDISchedulerStats * stats ) {
+  MIDIPrecond( scheduler != NULL, EFAULT );
+  MIDIPrecond( stats != NULL, EINVAL );
+  *stats = scheduler->stats;
+  return 0;
+}
+
+/**
+ * @brief Reset the scheduler statistics.
+ * @public @memberof MIDIScheduler
+ * @param scheduler The scheduler.
+ * @retval 0 on success.
+ */
+int MIDISchedulerResetStats( struct MIDIScheduler * scheduler ) {
+  MIDIPrecond( scheduler != NULL, EFAULT );
+  scheduler->stats.scheduled   = 0;
+  scheduler->stats.delivered   = 0;
+  scheduler->stats.flushed     = 0;
+  scheduler->stats.error_total = 0;
+  scheduler->stats.error_max   = 0;
+  return 0;
+}
+
+/** @} */
@@ -0,0 +1,41 @@
+#ifndef MIDIKIT_MIDI_SCHEDULER_H
+#define MIDIKIT_MIDI_SCHEDULER_H
+#include "midi.h"
+
+struct MIDIClock;
+struct MIDIMessage;
+struct MIDIRunloopSource;
+struct MIDIScheduler;
+
+struct MIDISchedulerDelegate {
+  void * info;
+  int (*deliver)( void * info, struct MIDIMessage * message );
+};
+
+struct MIDISchedulerStats {
+  unsigned long scheduled;    /**< The number of messages that were held back */
+  unsigned long delivered;    /**< The number of held back messages that were delivered */
+  unsigned long flushed;      /**< The number of messages delivered before they were due */
+  unsigned long error_total;  /**< The sum of the delivery delays in microseconds */
+  unsigned long error_max;    /**< The largest delivery delay in microseconds */
+};
+
+struct MIDIScheduler * MIDISchedulerCreate( struct MIDIClock * clock, struct MIDIRunloopSource * source,
+                                            struct MIDISchedulerDelegate * delegate );
+void MIDISchedulerDestroy( struct MIDIScheduler * scheduler );
+void MIDISchedulerRetain( struct MIDIScheduler * scheduler );
+void MIDISchedulerRelease( struct MIDIScheduler * scheduler );
+
+int MIDISchedulerGetRunloopSource( struct MIDIScheduler * scheduler, struct MIDIRunloopSource ** source );
+int MIDISchedulerGetLength( struct MIDIScheduler * scheduler, size_t * length );
+int MIDISchedulerGetNextTimestamp( struct MIDIScheduler * scheduler, MIDITimestamp * timestamp );
+
+int MIDISchedulerSchedule( struct MIDIScheduler * scheduler, struct MIDIMessage * message );
+int MIDISchedulerDeliver( struct MIDIScheduler * scheduler );
+int MIDISchedulerFlush( struct MIDIScheduler * scheduler );
+int MIDISchedulerClear( struct MIDIScheduler * scheduler );
+
+int MIDISchedulerGetStats( struct MIDIScheduler * scheduler, struct MIDISchedulerStats * stats );
+int MIDISchedulerResetStats( struct MIDIScheduler * scheduler );
+
+#endif
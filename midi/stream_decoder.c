@@ -0,0 +1,309 @@
+#include <stdlib.h>
+#include <limits.h>
+#include "stream_decoder.h"
+#include "message_format.h"
+#include "scan.h"
+
+/**
+ * @ingroup MIDI
+ * @struct MIDIStreamEvent stream_decoder.h
+ * @brief Fixed-size record of a decoded message.
+ * Channel, system common and real-time messages are stored completely
+ * in the record. System exclusive messages are reported as one or more
+ * fragments with status @c MIDI_STATUS_SYSTEM_EXCLUSIVE that point to
+ * the payload in the chunk that was passed to the decoder, so that no
+ * payload is copied. The first fragment of a message has the
+ * @c MIDI_STREAM_SYSEX_START flag, the last one @c MIDI_STREAM_SYSEX_END.
+ * Messages that were ended by a status byte other than
+ * @c MIDI_STATUS_END_OF_EXCLUSIVE also have @c MIDI_STREAM_SYSEX_ABORTED.
+ */
+
+/**
+ * @ingroup MIDI
+ * @struct MIDIStreamDecoder stream_decoder.h
+ * @brief Decode raw MIDI byte streams in bulk.
+ * The decoder takes arbitrary chunks of a byte stream as it would appear
+ * on a MIDI cable or in a standard MIDI file dump and fills an array of
+ * MIDIStreamEvent records in one call, without creating MIDIMessage
+ * objects. Running status, incomplete messages and system exclusive
+ * messages are carried over from one chunk to the next. Real-time
+ * messages may appear anywhere, even between the data bytes of another
+ * message, and are reported where they appear.
+ */
+struct MIDIStreamDecoder {
+/**
+ * @privatesection
+ * @cond INTERNALS
+ */
+  int refs;
+  unsigned char running;  /* the running status or the status of the pending system common message */
+  unsigned char expected; /* the number of data bytes that belong to the running status */
+  unsigned char have;     /* the number of data bytes received so far */
+  unsigned char data[2];
+  int sysex;              /* inside a system exclusive message */
+  int sysex_start;        /* the start of the system exclusive message was not reported yet */
+/** @endcond */
+};
+
+/* MARK: Internals *//**
+ * @name Internals
+ * @cond INTERNALS
+ * @{
+ */
+
+static void _emit( struct MIDIStreamEvent * event, unsigned char status, unsigned char data0, unsigned char data1 ) {
+  event->status  = status;
+  event->data[0] = data0;
+  event->data[1] = data1;
+  event->flags   = 0;
+  event->offset  = 0;
+  event->size    = 0;
+}
+
+static void _emit_sysex( struct MIDIStreamEvent * event, unsigned char flags, size_t offset, size_t size ) {
+  event->status  = MIDI_STATUS_SYSTEM_EXCLUSIVE;
+  event->data[0] = 0;
+  event->data[1] = 0;
+  event->flags   = flags;
+  event->offset  = offset;
+  event->size    = size;
+}
+
+/* data bytes of the channel messages 0x8_ to 0xe_, indexed by the low bits of the high nibble */
+static const unsigned char _channel_data_length[8] = { 2, 2, 2, 2, 1, 1, 2, 0 };
+
+static int _is_undefined_real_time( unsigned char byte ) {
+  return byte == MIDI_STATUS_UNDEFINED2 || byte == MIDI_STATUS_UNDEFINED3;
+}
+
+/**
+ * @}
+ * @endcond
+ */
+
+/* MARK: -
+ * MARK: Creation and destruction *//**
+ * @name Creation and destruction
+ * Creating, destroying and reference counting of MIDIStreamDecoder objects.
+ * @{
+ */
+
+/**
+ * @brief Create a MIDIStreamDecoder instance.
+ * @public @memberof MIDIStreamDecoder
+ * @return a pointer to the created decoder on success.
+ * @return a @c NULL pointer if the decoder could not be created.
+ */
+struct MIDIStreamDecoder * MIDIStreamDecoderCreate( void ) {
+  struct MIDIStreamDecoder * decoder = malloc( sizeof( struct MIDIStreamDecoder ) );
+  MIDIPrecondReturn( decoder != NULL, ENOMEM, NULL );
+  decoder->refs = 1;
+  MIDIStreamDecoderReset( decoder );
+  return decoder;
+}
+
+/**
+ * @brief Destroy a MIDIStreamDecoder instance.
+ * @public @memberof MIDIStreamDecoder
+ * @param decoder The decoder.
+ */
+void MIDIStreamDecoderDestroy( struct MIDIStreamDecoder * decoder ) {
+  MIDIPrecondReturn( decoder != NULL, EFAULT, (void)0 );
+  free( decoder );
+}
+
+/**
+ * @brief Retain a MIDIStreamDecoder instance.
+ * @public @memberof MIDIStreamDecoder
+ * @param decoder The decoder.
+ */
+void MIDIStreamDecoderRetain( struct MIDIStreamDecoder * decoder ) {
+  MIDIPrecondReturn( decoder != NULL, EFAULT, (void)0 );
+  decoder->refs++;
+}
+
+/**
+ * @brief Release a MIDIStreamDecoder instance.
+ * @public @memberof MIDIStreamDecoder
+ * @param decoder The decoder.
+ */
+void MIDIStreamDecoderRelease( struct MIDIStreamDecoder * decoder ) {
+  MIDIPrecondReturn( decoder != NULL, EFAULT, (void)0 );
+  if( ! --decoder->refs ) {
+    MIDIStreamDecoderDestroy( decoder );
+  }
+}
+
+/** @} */
+
+/* MARK: Decoding *//**
+ * @name Decoding
+ * @{
+ */
+
+/**
+ * @brief Forget the state of the stream.
+ * Drop the running status, incomplete messages and system exclusive
+ * messages, e.g. when the stream was interrupted.
+ * @public @memberof MIDIStreamDecoder
+ * @param decoder The decoder.
+ * @retval 0 on success.
+ */
+int MIDIStreamDecoderReset( struct MIDIStreamDecoder * decoder ) {
+  MIDIPrecond( decoder != NULL, EFAULT );
+  decoder->running     = 0;
+  decoder->expected    = 0;
+  decoder->have        = 0;
+  decoder->data[0]     = 0;
+  decoder->data[1]     = 0;
+  decoder->sysex       = 0;
+  decoder->sysex_start = 0;
+  return 0;
+}
+
+/**
+ * @brief Decode a chunk of a raw MIDI byte stream.
+ * Decode messages from the buffer until all bytes were read or the
+ * event array is full. Call again with the remaining bytes to decode
+ * the rest. Data bytes without status and undefined status bytes are
+ * skipped, a status byte aborts an incomplete message.
+ * The @c offset of system exclusive fragments is relative to @c buffer.
+ * At most @c UINT_MAX bytes are read in one call.
+ * @public @memberof MIDIStreamDecoder
+ * @param decoder The decoder.
+ * @param size    The number of bytes in the buffer.
+ * @param buffer  The chunk of the byte stream.
+ * @param read    The number of bytes that were read. May be @c NULL.
+ * @param count   The number of records that fit into the event array.
+ * @param events  The event array.
+ * @param written The number of records that were stored.
+ * @retval 0 on success.
+ */
+int MIDIStreamDecoderDecode( struct MIDIStreamDecoder * decoder, size_t size, const unsigned char * buffer, size_t * read,
+                             size_t count, struct MIDIStreamEvent * events, size_t * written ) {
+  size_t i = 0, n = 0, start = 0, length, need;
+  unsigned char byte, running, expected, have, data[2];
+  int sysex, sysex_start;
+  MIDIPrecond( decoder != NULL, EFAULT );
+  MIDIPrecond( buffer != NULL || size == 0, EINVAL );
+  MIDIPrecond( events != NULL || count == 0, EINVAL );
+  MIDIPrecond( written != NULL, EINVAL );
+
+  if( size > UINT_MAX ) size = UINT_MAX;
+
+  /* work on local copies, stores to the event records may alias the decoder */
+  running     = decoder->running;
+  expected    = decoder->expected;
+  have        = decoder->have;
+  data[0]     = decoder->data[0];
+  data[1]     = decoder->data[1];
+  sysex       = decoder->sysex;
+  sysex_start = decoder->sysex_start;
+
+  while( i < size && n < count ) {
+    if( sysex ) {
+      /* skip the payload */
+      i += MIDIScanStatus( size-i, buffer+i );
+      if( i == size ) break;
+      byte = buffer[i];
+      if( byte >= MIDI_STATUS_TIMING_CLOCK ) {
+        /* split the payload around real-time messages */
+        need = ( i > start || sysex_start ) ? 1 : 0;
+        if( ! _is_undefined_real_time( byte ) ) need++;
+        if( count - n < need ) break;
+        if( i > start || sysex_start ) {
+          _emit_sysex( &(events[n++]), sysex_start ? MIDI_STREAM_SYSEX_START : 0, start, i - start );
+          sysex_start = 0;
+        }
+        if( ! _is_undefined_real_time( byte ) ) {
+          _emit( &(events[n++]), byte, 0, 0 );
+        }
+        start = ++i;
+        continue;
+      }
+      /* any other status byte ends the message */
+      _emit_sysex( &(events[n++]),
+                   ( sysex_start ? MIDI_STREAM_SYSEX_START : 0 ) | MIDI_STREAM_SYSEX_END
+                   | ( byte != MIDI_STATUS_END_OF_EXCLUSIVE ? MIDI_STREAM_SYSEX_ABORTED : 0 ),
+                   start, i - start );
+      sysex       = 0;
+      sysex_start = 0;
+      if( byte == MIDI_STATUS_END_OF_EXCLUSIVE ) i++;
+      continue;
+    }
+
+    byte = buffer[i++];
+    if( byte < 0x80 ) {
+      if( expected == 0 ) continue;
+      if( have == 0 && expected == 2 && i < size && buffer[i] < 0x80 ) {
+        /* fast path for messages with both data bytes in the chunk */
+        _emit( &(events[n++]), running, byte, buffer[i++] );
+        if( running >= MIDI_STATUS_SYSTEM_EXCLUSIVE ) {
+          running  = 0;
+          expected = 0;
+        }
+        continue;
+      }
+      data[have++] = byte;
+      if( have == expected ) {
+        _emit( &(events[n++]), running, data[0], ( have > 1 ) ? data[1] : 0 );
+        have = 0;
+        if( running >= MIDI_STATUS_SYSTEM_EXCLUSIVE ) {
+          /* system common messages have no running status */
+          running  = 0;
+          expected = 0;
+        }
+      }
+    } else if( byte >= MIDI_STATUS_TIMING_CLOCK ) {
+      if( ! _is_undefined_real_time( byte ) ) {
+        _emit( &(events[n++]), byte, 0, 0 );
+      }
+    } else if( byte < MIDI_STATUS_SYSTEM_EXCLUSIVE ) {
+      /* channel messages, the length only depends on the high nibble */
+      have     = 0;
+      running  = byte;
+      expected = _channel_data_length[MIDI_HIGH_NIBBLE( byte ) & 7];
+      if( expected == 2 && i+1 < size && ( ( buffer[i] | buffer[i+1] ) & 0x80 ) == 0 ) {
+        /* fast path for complete messages, saves two trips through the loop */
+        _emit( &(events[n++]), byte, buffer[i], buffer[i+1] );
+        i += 2;
+      }
+    } else {
+      have     = 0;
+      running  = 0;
+      expected = 0;
+      if( byte == MIDI_STATUS_SYSTEM_EXCLUSIVE ) {
+        sysex       = 1;
+        sysex_start = 1;
+        start = i;
+      } else if( MIDIMessageFormatGetDataLength( byte, &length ) == 0 ) {
+        if( length == 0 ) {
+          _emit( &(events[n++]), byte, 0, 0 );
+        } else {
+          running  = byte;
+          expected = length;
+        }
+      }
+    }
+  }
+
+  /* report the payload of an unfinished system exclusive message */
+  if( sysex && ( i > start || sysex_start ) ) {
+    _emit_sysex( &(events[n++]), sysex_start ? MIDI_STREAM_SYSEX_START : 0, start, i - start );
+    sysex_start = 0;
+  }
+
+  decoder->running     = running;
+  decoder->expected    = expected;
+  decoder->have        = have;
+  decoder->data[0]     = data[0];
+  decoder->data[1]     = data[1];
+  decoder->sysex       = sysex;
+  decoder->sysex_start = sysex_start;
+
+  if( read != NULL ) *read = i;
+  *written = n;
+  return 0;
+}
+
+/** @} */
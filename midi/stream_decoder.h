@@ -0,0 +1,28 @@
+#ifndef MIDIKIT_MIDI_STREAM_DECODER_H
+#define MIDIKIT_MIDI_STREAM_DECODER_H
+#include "midi.h"
+
+struct MIDIStreamDecoder;
+
+#define MIDI_STREAM_SYSEX_START   1
+#define MIDI_STREAM_SYSEX_END     2
+#define MIDI_STREAM_SYSEX_ABORTED 4
+
+struct MIDIStreamEvent {
+  unsigned char status;  /**< The complete status byte, including the channel */
+  unsigned char data[2]; /**< The data bytes, unused bytes are zero */
+  unsigned char flags;   /**< The MIDI_STREAM_SYSEX_* flags of system exclusive fragments */
+  unsigned int  offset;  /**< The offset of the system exclusive payload in the chunk */
+  unsigned int  size;    /**< The number of system exclusive payload bytes in the chunk */
+};
+
+struct MIDIStreamDecoder * MIDIStreamDecoderCreate( void );
+void MIDIStreamDecoderDestroy( struct MIDIStreamDecoder * decoder );
+void MIDIStreamDecoderRetain( struct MIDIStreamDecoder * decoder );
+void MIDIStreamDecoderRelease( struct MIDIStreamDecoder * decoder );
+
+int MIDIStreamDecoderReset( struct MIDIStreamDecoder * decoder );
+int MIDIStreamDecoderDecode( struct MIDIStreamDecoder * decoder, size_t size, const unsigned char * buffer, size_t * read,
+                             size_t count, struct MIDIStreamEvent * events, size_t * written );
+
+#endif
@@ -0,0 +1,470 @@
+#include <stdlib.h>
+#include <stddef.h>
+#define MIDI_TIMER_WHEEL_INTERNALS
+#include "timer_wheel.h"
+
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SLOTS - 1)
+#define WHEEL_MAX    ((1ULL << (WHEEL_LEVELS * WHEEL_BITS)) - 1)
+
+/**
+ * @ingroup MIDI
+ * @struct MIDITimerWheelEntry timer_wheel.h
+ * @brief A timer that can be scheduled on a MIDITimerWheel.
+ * Entries are embedded in the objects that own them, so scheduling and
+ * cancelling never allocates. An entry is in at most one list at a time,
+ * @c pprev points to the pointer that points to the entry.
+ */
+
+/**
+ * @ingroup MIDI
+ * @struct MIDITimerWheel timer_wheel.h
+ * @brief Hierarchical timing wheel.
+ * Time is measured in ticks of a fixed length. The wheel has four levels of
+ * 64 slots; level @c n holds the entries that expire within @c 64^(n+1)
+ * ticks and is cascaded into the lower levels when the level below wraps
+ * around. Scheduling and cancelling take constant time, advancing takes
+ * constant time per tick and skips runs of empty slots.
+ * The tick only determines the slot of an entry. Entries in the slot of
+ * the current tick are checked against their exact deadline, so they
+ * neither fire early nor wait for the end of the tick.
+ */
+struct MIDITimerWheel {
+/**
+ * @privatesection
+ * @cond INTERNALS
+ */
+  int    refs;
+  size_t length;
+  size_t pending;
+  unsigned long long tick;
+  unsigned long long current;
+  unsigned long long bitmap[WHEEL_LEVELS];
+  struct MIDITimerWheelEntry * slots[WHEEL_LEVELS][WHEEL_SLOTS];
+  struct MIDITimerWheelEntry * due;
+  struct MIDITimerWheelEntry * expired;
+/** @endcond */
+};
+
+/* MARK: Internals *//**
+ * @name Internals
+ * @cond INTERNALS
+ * @{
+ */
+
+static void _entry_link( struct MIDITimerWheelEntry ** head, struct MIDITimerWheelEntry * entry ) {
+  entry->next = *head;
+  if( entry->next != NULL ) {
+    entry->next->pprev = &(entry->next);
+  }
+  *head = entry;
+  entry->pprev = head;
+}
+
+/**
+ * @brief Remove an entry from the list it is in.
+ * If the entry was the last one in a wheel slot, the slot's bit is cleared.
+ * @private @memberof MIDITimerWheel
+ * @param wheel The wheel.
+ * @param entry The entry.
+ */
+static void _entry_unlink( struct MIDITimerWheel * wheel, struct MIDITimerWheelEntry * entry ) {
+  struct MIDITimerWheelEntry ** pprev = entry->pprev;
+  ptrdiff_t slot;
+
+  *pprev = entry->next;
+  if( entry->next != NULL ) {
+    entry->next->pprev = pprev;
+  }
+  entry->next  = NULL;
+  entry->pprev = NULL;
+
+  if( pprev >= &(wheel->slots[0][0]) && pprev < &(wheel->slots[0][0]) + WHEEL_LEVELS * WHEEL_SLOTS ) {
+    wheel->pending--;
+    slot = pprev - &(wheel->slots[0][0]);
+    if( *pprev == NULL ) {
+      wheel->bitmap[slot / WHEEL_SLOTS] &= ~( 1ULL << ( slot % WHEEL_SLOTS ) );
+    }
+  }
+}
+
+static void _wheel_insert( struct MIDITimerWheel * wheel, struct MIDITimerWheelEntry * entry ) {
+  unsigned long long expires = entry->expires;
+  unsigned long long delta;
+  int level, slot;
+
+  if( expires < wheel->current ) {
+    _entry_link( &(wheel->due), entry );
+    return;
+  }
+  delta = expires - wheel->current;
+  if( delta > WHEEL_MAX ) {
+    /* park far entries in the last slot, they are re-inserted on cascade */
+    delta   = WHEEL_MAX;
+    expires = wheel->current + WHEEL_MAX;
+  }
+  for( level=0; level<WHEEL_LEVELS-1; level++ ) {
+    if( delta < ( 1ULL << ( ( level + 1 ) * WHEEL_BITS ) ) ) break;
+  }
+  slot = ( expires >> ( level * WHEEL_BITS ) ) & WHEEL_MASK;
+  _entry_link( &(wheel->slots[level][slot]), entry );
+  wheel->bitmap[level] |= 1ULL << slot;
+  wheel->pending++;
+}
+
+/**
+ * @brief Move the entries of a higher level slot into the lower levels.
+ * @private @memberof MIDITimerWheel
+ * @param wheel The wheel.
+ * @param level The level.
+ * @param slot  The slot.
+ */
+static void _wheel_cascade( struct MIDITimerWheel * wheel, int level, int slot ) {
+  struct MIDITimerWheelEntry * entry;
+  while( ( entry = wheel->slots[level][slot] ) != NULL ) {
+    _entry_unlink( wheel, entry );
+    _wheel_insert( wheel, entry );
+  }
+}
+
+static void _wheel_expire_list( struct MIDITimerWheel * wheel, struct MIDITimerWheelEntry ** head ) {
+  struct MIDITimerWheelEntry * entry;
+  while( ( entry = *head ) != NULL ) {
+    _entry_unlink( wheel, entry );
+    _entry_link( &(wheel->expired), entry );
+  }
+}
+
+static int _first_bit( unsigned long long bits ) {
+  return __builtin_ctzll( bits );
+}
+
+/**
+ * @brief Get the earliest deadline of the entries in a slot.
+ * @private @memberof MIDITimerWheel
+ * @param wheel The wheel.
+ * @param level The level.
+ * @param slot  The slot.
+ * @return the earliest deadline in nanoseconds.
+ */
+static unsigned long long _slot_next( struct MIDITimerWheel * wheel, int level, int slot ) {
+  struct MIDITimerWheelEntry * entry;
+  unsigned long long next = MIDI_TIMER_WHEEL_NEVER;
+  for( entry = wheel->slots[level][slot]; entry != NULL; entry = entry->next ) {
+    if( entry->deadline < next ) next = entry->deadline;
+  }
+  return next;
+}
+
+/**
+ * @brief Get the earliest deadline of a level.
+ * The slots of a level are visited in the order in which the wheel reaches
+ * them, the first occupied slot holds the entries of the level that expire
+ * first. On level zero that is the slot of the current tick, on the higher
+ * levels it is the slot after the current one. The last level also holds
+ * the parked far entries, so all of its slots are checked.
+ * @private @memberof MIDITimerWheel
+ * @param wheel The wheel.
+ * @param level The level.
+ * @return the earliest deadline in nanoseconds.
+ */
+static unsigned long long _wheel_level_next( struct MIDITimerWheel * wheel, int level ) {
+  unsigned long long next = MIDI_TIMER_WHEEL_NEVER, later, bits;
+  int index;
+
+  if( level == WHEEL_LEVELS-1 ) {
+    for( bits = wheel->bitmap[level]; bits; bits &= bits - 1 ) {
+      later = _slot_next( wheel, level, _first_bit( bits ) );
+      if( later < next ) next = later;
+    }
+    return next;
+  }
+  index = ( ( wheel->current >> ( level * WHEEL_BITS ) ) & WHEEL_MASK ) + ( level > 0 ? 1 : 0 );
+  bits  = ( index < WHEEL_SLOTS ) ? wheel->bitmap[level] & ( ~0ULL << index ) : 0;
+  return _slot_next( wheel, level, _first_bit( bits ? bits : wheel->bitmap[level] ) );
+}
+
+/**
+ * @brief Expire the entries of the current tick whose deadline passed.
+ * @private @memberof MIDITimerWheel
+ * @param wheel The wheel.
+ * @param now   The current time in nanoseconds.
+ */
+static void _wheel_expire_current( struct MIDITimerWheel * wheel, unsigned long long now ) {
+  struct MIDITimerWheelEntry * entry, * next;
+  for( entry = wheel->slots[0][wheel->current & WHEEL_MASK]; entry != NULL; entry = next ) {
+    next = entry->next;
+    if( entry->deadline <= now ) {
+      _entry_unlink( wheel, entry );
+      _entry_link( &(wheel->expired), entry );
+    }
+  }
+}
+
+/** @} @endcond */
+
+/* MARK: Creation and destruction *//**
+ * @name Creation and destruction
+ * Creating, destroying and reference counting of MIDITimerWheel objects.
+ * @{
+ */
+
+/**
+ * @brief Create a MIDITimerWheel instance.
+ * @public @memberof MIDITimerWheel
+ * @param tick The length of a tick in nanoseconds.
+ * @param now  The current time in nanoseconds.
+ * @return a pointer to the created wheel on success.
+ * @return a @c NULL pointer if the wheel could not be created.
+ */
+struct MIDITimerWheel * MIDITimerWheelCreate( unsigned long long tick, unsigned long long now ) {
+  struct MIDITimerWheel * wheel;
+  MIDIPrecondReturn( tick > 0, EINVAL, NULL );
+  wheel = calloc( 1, sizeof( struct MIDITimerWheel ) );
+  MIDIPrecondReturn( wheel != NULL, ENOMEM, NULL );
+  wheel->refs    = 1;
+  wheel->tick    = tick;
+  wheel->current = now / tick;
+  return wheel;
+}
+
+/**
+ * @brief Destroy a MIDITimerWheel instance.
+ * All scheduled entries are cancelled.
+ * @public @memberof MIDITimerWheel
+ * @param wheel The wheel.
+ */
+void MIDITimerWheelDestroy( struct MIDITimerWheel * wheel ) {
+  int level, slot;
+  for( level=0; level<WHEEL_LEVELS; level++ ) {
+    for( slot=0; slot<WHEEL_SLOTS; slot++ ) {
+      while( wheel->slots[level][slot] != NULL ) {
+        _entry_unlink( wheel, wheel->slots[level][slot] );
+      }
+    }
+  }
+  while( wheel->due != NULL )     _entry_unlink( wheel, wheel->due );
+  while( wheel->expired != NULL ) _entry_unlink( wheel, wheel->expired );
+  free( wheel );
+}
+
+/**
+ * @brief Retain a MIDITimerWheel instance.
+ * @public @memberof MIDITimerWheel
+ * @param wheel The wheel.
+ */
+void MIDITimerWheelRetain( struct MIDITimerWheel * wheel ) {
+  MIDIPrecondReturn( wheel != NULL, EFAULT, (void)0 );
+  wheel->refs++;
+}
+
+/**
+ * @brief Release a MIDITimerWheel instance.
+ * @public @memberof MIDITimerWheel
+ * @param wheel The wheel.
+ */
+void MIDITimerWheelRelease( struct MIDITimerWheel * wheel ) {
+  MIDIPrecondReturn( wheel != NULL, EFAULT, (void)0 );
+  if( ! --wheel->refs ) {
+    MIDITimerWheelDestroy( wheel );
+  }
+}
+
+/** @} */
+
+/* MARK: Entries *//**
+ * @name Entries
+ * Scheduling and cancelling timers.
+ * @{
+ */
+
+/**
+ * @brief Initialize a timer entry.
+ * @public @memberof MIDITimerWheel
+ * @param entry The entry.
+ * @param fire  The callback that should be invoked by the entry's owner when it expired.
+ * @param info  The info pointer for the callback.
+ * @retval 0 on success.
+ */
+int MIDITimerWheelEntryInit( struct MIDITimerWheelEntry * entry,
+                             int (*fire)( void * info, struct timespec * now ), void * info ) {
+  MIDIPrecond( entry != NULL, EFAULT );
+  entry->next    = NULL;
+  entry->pprev   = NULL;
+  entry->expires  = 0;
+  entry->deadline = 0;
+  entry->fire     = fire;
+  entry->info     = info;
+  return 0;
+}
+
+/**
+ * @brief Check if a timer entry is scheduled or expired but not popped yet.
+ * @public @memberof MIDITimerWheel
+ * @param entry The entry.
+ * @return 1 if the entry is scheduled, 0 otherwise.
+ */
+int MIDITimerWheelEntryIsScheduled( struct MIDITimerWheelEntry * entry ) {
+  return entry != NULL && entry->pprev != NULL;
+}
+
+/**
+ * @brief Schedule an entry.
+ * If the entry is already scheduled it is moved to the new deadline.
+ * Entries with a deadline in the past expire on the next advance.
+ * @public @memberof MIDITimerWheel
+ * @param wheel    The wheel.
+ * @param entry    The entry.
+ * @param deadline The absolute deadline in nanoseconds.
+ * @retval 0 on success.
+ */
+int MIDITimerWheelSchedule( struct MIDITimerWheel * wheel, struct MIDITimerWheelEntry * entry, unsigned long long deadline ) {
+  MIDIPrecond( wheel != NULL, EFAULT );
+  MIDIPrecond( entry != NULL, EINVAL );
+  if( entry->pprev != NULL ) {
+    _entry_unlink( wheel, entry );
+  } else {
+    wheel->length++;
+  }
+  entry->deadline = deadline;
+  entry->expires  = deadline / wheel->tick;
+  _wheel_insert( wheel, entry );
+  return 0;
+}
+
+/**
+ * @brief Cancel a scheduled entry.
+ * Cancelling an entry that is not scheduled is not an error.
+ * @public @memberof MIDITimerWheel
+ * @param wheel The wheel.
+ * @param entry The entry.
+ * @retval 0 on success.
+ */
+int MIDITimerWheelCancel( struct MIDITimerWheel * wheel, struct MIDITimerWheelEntry * entry ) {
+  MIDIPrecond( wheel != NULL, EFAULT );
+  MIDIPrecond( entry != NULL, EINVAL );
+  if( entry->pprev != NULL ) {
+    _entry_unlink( wheel, entry );
+    wheel->length--;
+  }
+  return 0;
+}
+
+/** @} */
+
+/* MARK: Expiration *//**
+ * @name Expiration
+ * Advancing the wheel and collecting expired entries.
+ * @{
+ */
+
+/**
+ * @brief Get the number of scheduled entries.
+ * @public @memberof MIDITimerWheel
+ * @param wheel  The wheel.
+ * @param length The number of entries, including expired entries that were not popped.
+ * @retval 0 on success.
+ */
+int MIDITimerWheelGetLength( struct MIDITimerWheel * wheel, size_t * length ) {
+  MIDIPrecond( wheel != NULL, EFAULT );
+  MIDIPrecond( length != NULL, EINVAL );
+  *length = wheel->length;
+  return 0;
+}
+
+/**
+ * @brief Get the time at which the wheel has to be advanced next.
+ * The result is the earliest deadline of all entries, pending cascades
+ * of higher levels do not cause earlier results. If entries already
+ * expired the result is zero, if no entries are scheduled it is
+ * @c MIDI_TIMER_WHEEL_NEVER.
+ * @public @memberof MIDITimerWheel
+ * @param wheel    The wheel.
+ * @param deadline The absolute deadline in nanoseconds.
+ * @retval 0 on success.
+ */
+int MIDITimerWheelGetNextDeadline( struct MIDITimerWheel * wheel, unsigned long long * deadline ) {
+  unsigned long long next = MIDI_TIMER_WHEEL_NEVER, later;
+  int level;
+  MIDIPrecond( wheel != NULL, EFAULT );
+  MIDIPrecond( deadline != NULL, EINVAL );
+
+  if( wheel->due != NULL || wheel->expired != NULL ) {
+    *deadline = 0;
+    return 0;
+  }
+  for( level=0; level<WHEEL_LEVELS && wheel->pending > 0; level++ ) {
+    if( wheel->bitmap[level] ) {
+      later = _wheel_level_next( wheel, level );
+      if( later < next ) next = later;
+    }
+  }
+  *deadline = next;
+  return 0;
+}
+
+/**
+ * @brief Advance the wheel to the given time.
+ * All entries that expired until then are moved to the list of expired
+ * entries, which can be emptied with MIDITimerWheelPopExpired.
+ * @public @memberof MIDITimerWheel
+ * @param wheel The wheel.
+ * @param now   The current time in nanoseconds.
+ * @retval 0 on success.
+ */
+int MIDITimerWheelAdvance( struct MIDITimerWheel * wheel, unsigned long long now ) {
+  unsigned long long target, next, bits;
+  int index, level, slot;
+  MIDIPrecond( wheel != NULL, EFAULT );
+
+  _wheel_expire_list( wheel, &(wheel->due) );
+  target = now / wheel->tick;
+  while( wheel->current < target ) {
+    if( wheel->pending == 0 ) {
+      wheel->current = target;
+      break;
+    }
+    _wheel_expire_list( wheel, &(wheel->slots[0][wheel->current & WHEEL_MASK]) );
+    wheel->current++;
+
+    /* skip empty slots up to the next cascade */
+    index = wheel->current & WHEEL_MASK;
+    if( index != 0 ) {
+      bits = wheel->bitmap[0] & ( ~0ULL << index );
+      next = wheel->current - index + ( bits ? _first_bit( bits ) : WHEEL_SLOTS );
+      wheel->current = ( next <= target ) ? next : target;
+    }
+    /* entering a new round of level zero, move the next entries down */
+    if( ( wheel->current & WHEEL_MASK ) == 0 ) {
+      for( level=1; level<WHEEL_LEVELS; level++ ) {
+        slot = ( wheel->current >> ( level * WHEEL_BITS ) ) & WHEEL_MASK;
+        _wheel_cascade( wheel, level, slot );
+        if( slot != 0 ) break;
+      }
+    }
+  }
+  _wheel_expire_current( wheel, now );
+  return 0;
+}
+
+/**
+ * @brief Remove an expired entry from the wheel.
+ * @public @memberof MIDITimerWheel
+ * @param wheel The wheel.
+ * @param entry The expired entry or @c NULL if no more entries expired.
+ * @retval 0 on success.
+ */
+int MIDITimerWheelPopExpired( struct MIDITimerWheel * wheel, struct MIDITimerWheelEntry ** entry ) {
+  MIDIPrecond( wheel != NULL, EFAULT );
+  MIDIPrecond( entry != NULL, EINVAL );
+  *entry = wheel->expired;
+  if( *entry != NULL ) {
+    _entry_unlink( wheel, *entry );
+    wheel->length--;
+  }
+  return 0;
+}
+
+/** @} */
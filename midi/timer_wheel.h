@@ -0,0 +1,38 @@
+#ifndef MIDIKIT_MIDI_TIMER_WHEEL_H
+#define MIDIKIT_MIDI_TIMER_WHEEL_H
+#include "midi.h"
+
+#define MIDI_TIMER_WHEEL_NEVER ((unsigned long long) -1)
+
+struct MIDITimerWheel;
+struct MIDITimerWheelEntry;
+
+#ifdef MIDI_TIMER_WHEEL_INTERNALS
+struct MIDITimerWheelEntry {
+  struct MIDITimerWheelEntry *  next;
+  struct MIDITimerWheelEntry ** pprev;
+  unsigned long long expires;
+  unsigned long long deadline;
+  int (*fire)( void * info, struct timespec * now );
+  void * info;
+};
+#endif
+
+struct MIDITimerWheel * MIDITimerWheelCreate( unsigned long long tick, unsigned long long now );
+void MIDITimerWheelDestroy( struct MIDITimerWheel * wheel );
+void MIDITimerWheelRetain( struct MIDITimerWheel * wheel );
+void MIDITimerWheelRelease( struct MIDITimerWheel * wheel );
+
+int MIDITimerWheelEntryInit( struct MIDITimerWheelEntry * entry,
+                             int (*fire)( void * info, struct timespec * now ), void * info );
+int MIDITimerWheelEntryIsScheduled( struct MIDITimerWheelEntry * entry );
+
+int MIDITimerWheelSchedule( struct MIDITimerWheel * wheel, struct MIDITimerWheelEntry * entry, unsigned long long deadline );
+int MIDITimerWheelCancel( struct MIDITimerWheel * wheel, struct MIDITimerWheelEntry * entry );
+
+int MIDITimerWheelGetLength( struct MIDITimerWheel * wheel, size_t * length );
+int MIDITimerWheelGetNextDeadline( struct MIDITimerWheel * wheel, unsigned long long * deadline );
+int MIDITimerWheelAdvance( struct MIDITimerWheel * wheel, unsigned long long now );
+int MIDITimerWheelPopExpired( struct MIDITimerWheel * wheel, struct MIDITimerWheelEntry ** entry );
+
+#endif
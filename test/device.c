@@ -89,3 +89,69 @@ int test002_device( void ) {
   MIDIDeviceRelease( device_slave );
   return 0;
 }
+
+static int _packed_non;
+static MIDILongValue _packed_pwc;
+static size_t _packed_sx;
+
+static int _receive_non( struct MIDIDevice * device, MIDIChannel channel, MIDIKey key, MIDIVelocity velocity ) {
+  _packed_non += key;
+  return 0;
+}
+
+static int _receive_pwc( struct MIDIDevice * device, MIDIChannel channel, MIDILongValue value ) {
+  _packed_pwc = value;
+  return 0;
+}
+
+static int _receive_sx( struct MIDIDevice * device, MIDIManufacturerId manufacturer_id,
+                        size_t size, void * data, uint8_t fragment ) {
+  _packed_sx = size;
+  return 0;
+}
+
+static struct MIDIDeviceDelegate _test_packed_device = {
+  NULL, &_receive_non, NULL, NULL, NULL, NULL, &_receive_pwc, &_receive_sx,
+  NULL, NULL, NULL, NULL, NULL, &_receive_rt
+};
+
+/**
+ * Test that packed messages are dispatched and relayed through the
+ * THRU port.
+ */
+int test003_device( void ) {
+  unsigned char buffer[] = { MIDI_STATUS_SYSTEM_EXCLUSIVE, 0x7d, 1, 2, 3, MIDI_STATUS_END_OF_EXCLUSIVE };
+  struct MIDIPackedMessage packed[4] = {
+    { 0, 0x90, { 60, 100 }, 0, 0 },
+    { 0, 0x91, { 62, 100 }, 0, 0 },
+    { 0, 0xe0, { 0x01, 0x40 }, 0, 0 },
+    { 0, 0, { 0, 0 }, 0, 0 }
+  };
+  struct MIDIMessage * message;
+  struct MIDIDevice * device_master;
+  struct MIDIDevice * device_slave;
+  struct MIDIPort * port;
+
+  message = MIDIMessageCreate( MIDI_STATUS_RESET );
+  ASSERT_NO_ERROR( MIDIMessageDecode( message, sizeof(buffer), buffer, NULL ), "Could not decode sysex message." );
+  ASSERT_NO_ERROR( MIDIPackedMessageFromMessage( &packed[3], message ), "Could not pack sysex message." );
+  MIDIMessageRelease( message );
+
+  device_master = MIDIDeviceCreate( &_test_packed_device );
+  device_slave  = MIDIDeviceCreate( &_test_packed_device );
+  ASSERT_NO_ERROR( MIDIDeviceGetThroughPort( device_master, &port ), "Could get master thru port." );
+  ASSERT_NO_ERROR( MIDIDeviceAttachIn( device_slave, port ), "Could not attach port to slave in port." );
+
+  _packed_non = 0;
+  _packed_pwc = 0;
+  _packed_sx  = 0;
+  ASSERT_NO_ERROR( MIDIDeviceReceivePacked( device_master, 4, &packed[0] ), "Could not receive packed messages." );
+  ASSERT_EQUAL( _packed_non, 2 * ( 60 + 62 ), "Note on messages were not received by both devices." );
+  ASSERT_EQUAL( _packed_pwc, 0x2001, "Pitch wheel change has wrong value." );
+  ASSERT_EQUAL( _packed_sx, 4, "System exclusive message was not received." );
+
+  MIDIPackedMessageRelease( &packed[3] );
+  MIDIDeviceRelease( device_master );
+  MIDIDeviceRelease( device_slave );
+  return 0;
+}
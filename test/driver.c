@@ -1,10 +1,15 @@
 #include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
 #include "test.h"
 #define MIDI_DRIVER_INTERNALS
 #include "midi/message.h"
 #include "midi/port.h"
 #include "midi/device.h"
 #include "midi/driver.h"
+#include "midi/clock.h"
+#include "midi/runloop.h"
+#include "midi/scheduler.h"
 
 static unsigned char * _buffer = NULL;
 
@@ -131,3 +136,279 @@ int test002_driver( void ) {
 }
 
 
+
+static int _scheduled = 0;
+
+static int _send_scheduled( struct MIDIDriver * driver, struct MIDIMessage * message ) {
+  _scheduled++;
+  return 0;
+}
+
+/**
+ * Test that a driver holds back messages with future timestamps until
+ * they are due and sends waiting messages when scheduling stops or the
+ * driver is destroyed.
+ */
+int test003_driver( void ) {
+  struct MIDIRunloopSource * source;
+  struct MIDIScheduler * scheduler;
+  struct MIDIRunloop * runloop;
+  struct MIDIMessage * message;
+  struct MIDIDriver * driver;
+  struct MIDIPort * port;
+  MIDISamplingRate rate;
+  MIDITimestamp now;
+  int i;
+
+  driver = MIDIDriverCreate( "test driver", MIDI_SAMPLING_RATE_DEFAULT );
+  ASSERT_NOT_EQUAL( driver, NULL, "Could not create driver!" );
+  driver->send = &_send_scheduled;
+  MIDIClockGetSamplingRate( driver->clock, &rate );
+  ASSERT_NO_ERROR( MIDIDriverStartScheduling( driver ), "Could not start scheduling." );
+  ASSERT_NO_ERROR( MIDIDriverGetScheduler( driver, &scheduler ), "Could not get scheduler." );
+  ASSERT_NOT_EQUAL( scheduler, NULL, "Driver has no scheduler." );
+  ASSERT_NO_ERROR( MIDIDriverGetPort( driver, &port ), "Could not get driver port." );
+
+  runloop = MIDIRunloopCreate( NULL );
+  ASSERT_NO_ERROR( MIDISchedulerGetRunloopSource( scheduler, &source ), "Could not get runloop source." );
+  ASSERT_NO_ERROR( MIDIRunloopAddSource( runloop, source ), "Could not add source to runloop." );
+
+  message = MIDIMessageCreate( MIDI_STATUS_TIMING_CLOCK );
+  MIDIClockGetNow( driver->clock, &now );
+  MIDIMessageSetTimestamp( message, now + rate / 100 );
+  ASSERT_NO_ERROR( MIDIPortReceive( port, MIDIMessageType, message ), "Driver port could not receive message." );
+  ASSERT_EQUAL( _scheduled, 0, "Future message was sent immediately." );
+  for( i=0; i<10 && _scheduled == 0; i++ ) {
+    ASSERT_NO_ERROR( MIDIRunloopStep( runloop ), "Runloop step failed." );
+  }
+  ASSERT_EQUAL( _scheduled, 1, "Message was not sent when it was due." );
+
+  MIDIClockGetNow( driver->clock, &now );
+  MIDIMessageSetTimestamp( message, now + rate );
+  ASSERT_NO_ERROR( MIDIDriverSend( driver, message ), "Could not send message." );
+  ASSERT_EQUAL( _scheduled, 1, "Future message was sent immediately." );
+  ASSERT_NO_ERROR( MIDIDriverStopScheduling( driver ), "Could not stop scheduling." );
+  ASSERT_EQUAL( _scheduled, 2, "Waiting message was not sent when scheduling stopped." );
+
+  ASSERT_NO_ERROR( MIDIDriverStartScheduling( driver ), "Could not restart scheduling." );
+  ASSERT_NO_ERROR( MIDIDriverSend( driver, message ), "Could not send message." );
+  ASSERT_EQUAL( _scheduled, 2, "Future message was sent immediately." );
+
+  MIDIRunloopRemoveSource( runloop, source );
+  MIDIRunloopRelease( runloop );
+  MIDIMessageRelease( message );
+  MIDIDriverRelease( driver );
+  ASSERT_EQUAL( _scheduled, 3, "Waiting message was not sent when the driver was destroyed." );
+  return 0;
+}
+
+#define PROFILE_MESSAGES 100
+
+static void * _profile_thread( void * info ) {
+  struct MIDIDriver * driver = info;
+  struct MIDIMessage * message;
+  int i;
+
+  message = MIDIMessageCreate( MIDI_STATUS_TIMING_CLOCK );
+  for( i=0; i<PROFILE_MESSAGES; i++ ) {
+    MIDIDriverSend( driver, message );
+  }
+  MIDIMessageRelease( message );
+  return NULL;
+}
+
+/**
+ * Test that a driver records message counts, sizes and latencies from
+ * all threads while profiling and stops recording afterwards.
+ */
+int test004_driver( void ) {
+  struct MIDIDriverProfilingStats stats;
+  struct MIDIMessage * message;
+  struct MIDIDriver * driver;
+  MIDISamplingRate rate;
+  MIDITimestamp now;
+  unsigned long long median, p99;
+  pthread_t thread;
+  int i;
+
+  driver = MIDIDriverCreate( "test driver", MIDI_SAMPLING_RATE_DEFAULT );
+  ASSERT_NOT_EQUAL( driver, NULL, "Could not create driver!" );
+  driver->send = &_send_scheduled;
+  MIDIClockGetSamplingRate( driver->clock, &rate );
+  message = MIDIMessageCreate( MIDI_STATUS_TIMING_CLOCK );
+
+  /* nothing is recorded before profiling starts */
+  ASSERT_NO_ERROR( MIDIDriverSend( driver, message ), "Could not send message." );
+  ASSERT_NO_ERROR( MIDIDriverStartProfiling( driver ), "Could not start profiling." );
+
+  ASSERT_NO_ERROR( pthread_create( &thread, NULL, &_profile_thread, driver ), "Could not start sender thread." );
+  for( i=0; i<PROFILE_MESSAGES; i++ ) {
+    /* messages are 1ms old when they are received */
+    MIDIClockGetNow( driver->clock, &now );
+    MIDIMessageSetTimestamp( message, now - rate / 1000 );
+    ASSERT_NO_ERROR( MIDIDriverReceive( driver, message ), "Could not receive message." );
+  }
+  pthread_join( thread, NULL );
+
+  ASSERT_NO_ERROR( MIDIDriverGetProfilingStats( driver, &stats ), "Could not get profiling statistics." );
+  ASSERT_EQUAL( stats.messages_in, PROFILE_MESSAGES, "Wrong number of received messages." );
+  ASSERT_EQUAL( stats.messages_out, PROFILE_MESSAGES, "Wrong number of sent messages from other thread." );
+  ASSERT_EQUAL( stats.bytes_in, PROFILE_MESSAGES, "Wrong number of received bytes." );
+  ASSERT_EQUAL( stats.bytes_out, PROFILE_MESSAGES, "Wrong number of sent bytes." );
+  ASSERT_EQUAL( stats.latency_in.count, PROFILE_MESSAGES, "Wrong number of recorded latencies." );
+  ASSERT_EQUAL( stats.latency_out.count, 0, "Messages without timestamp were recorded." );
+  ASSERT_GREATER_OR_EQUAL( stats.latency_in.total, PROFILE_MESSAGES * 1000, "Latency total is too small." );
+
+  ASSERT_NO_ERROR( MIDIDriverHistogramGetPercentile( &(stats.latency_in), 50, &median ), "Could not get median." );
+  ASSERT_NO_ERROR( MIDIDriverHistogramGetPercentile( &(stats.latency_in), 99, &p99 ), "Could not get percentile." );
+  ASSERT_GREATER_OR_EQUAL( median, 1000, "Median latency is too small." );
+  ASSERT_LESS_OR_EQUAL( median, p99, "Percentiles are not ordered." );
+  ASSERT_LESS_OR_EQUAL( p99, stats.latency_in.max, "Percentile exceeds maximum." );
+
+  /* scheduled messages are sampled for the queue depth */
+  ASSERT_NO_ERROR( MIDIDriverStartScheduling( driver ), "Could not start scheduling." );
+  MIDIClockGetNow( driver->clock, &now );
+  for( i=0; i<3; i++ ) {
+    MIDIMessageSetTimestamp( message, now + rate );
+    ASSERT_NO_ERROR( MIDIDriverSend( driver, message ), "Could not send message." );
+  }
+  ASSERT_NO_ERROR( MIDIDriverStopScheduling( driver ), "Could not stop scheduling." );
+  ASSERT_NO_ERROR( MIDIDriverGetProfilingStats( driver, &stats ), "Could not get profiling statistics." );
+  ASSERT_EQUAL( stats.queue_depth.count, 3, "Wrong number of queue depth samples." );
+  ASSERT_EQUAL( stats.queue_depth.max, 3, "Wrong maximum queue depth." );
+  ASSERT_EQUAL( stats.latency_out.count, 3, "Flushed messages were not recorded." );
+  ASSERT_EQUAL( stats.messages_out, PROFILE_MESSAGES + 3, "Wrong number of sent messages." );
+
+  ASSERT_NO_ERROR( MIDIDriverStopProfiling( driver ), "Could not stop profiling." );
+  ASSERT_NO_ERROR( MIDIDriverReceive( driver, message ), "Could not receive message." );
+  ASSERT_NO_ERROR( MIDIDriverGetProfilingStats( driver, &stats ), "Could not get profiling statistics." );
+  ASSERT_EQUAL( stats.messages_in, PROFILE_MESSAGES, "Messages were recorded after profiling stopped." );
+
+  /* restarting resets the statistics */
+  ASSERT_NO_ERROR( MIDIDriverStartProfiling( driver ), "Could not start profiling." );
+  ASSERT_NO_ERROR( MIDIDriverGetProfilingStats( driver, &stats ), "Could not get profiling statistics." );
+  ASSERT_EQUAL( stats.messages_in, 0, "Statistics were not reset." );
+
+  MIDIMessageRelease( message );
+  MIDIDriverRelease( driver );
+  return 0;
+}
+
+static int _packed_sent = 0;
+
+static int _send_packed( struct MIDIDriver * driver, struct MIDIMessage * message ) {
+  MIDIStatus status;
+  MIDIMessageGetStatus( message, &status );
+  if( status == MIDI_STATUS_NOTE_ON ) _packed_sent++;
+  return 0;
+}
+
+static int _packed_received = 0;
+
+static int _receive_packed_non( struct MIDIDevice * device, MIDIChannel channel, MIDIKey key, MIDIVelocity velocity ) {
+  _packed_received++;
+  return 0;
+}
+
+static struct MIDIDeviceDelegate _packed_delegate = {
+  NULL, &_receive_packed_non, NULL, NULL, NULL, NULL, NULL, NULL,
+  NULL, NULL, NULL, NULL, NULL, NULL
+};
+
+/**
+ * Test that packed messages are passed to the implementation and
+ * relayed to connected devices.
+ */
+int test005_driver( void ) {
+  struct MIDIPackedMessage packed[3] = {
+    { 0, 0x90, { 60, 100 }, 0, 0 },
+    { 0, 0x95, { 61, 100 }, 0, 0 },
+    { 0, 0x9f, { 62, 100 }, 0, 0 }
+  };
+  struct MIDIDriverProfilingStats stats;
+  struct MIDIDevice * device;
+  struct MIDIDriver * driver;
+  struct MIDIPort * port;
+
+  driver = MIDIDriverCreate( "test driver", MIDI_SAMPLING_RATE_DEFAULT );
+  ASSERT_NOT_EQUAL( driver, NULL, "Could not create driver!" );
+  driver->send = &_send_packed;
+  ASSERT_NO_ERROR( MIDIDriverSendPacked( driver, 3, &packed[0] ), "Could not send packed messages." );
+  ASSERT_EQUAL( _packed_sent, 3, "Packed messages were not passed to the implementation." );
+
+  device = MIDIDeviceCreate( &_packed_delegate );
+  ASSERT_NO_ERROR( MIDIDriverGetPort( driver, &port ), "Could not get driver port." );
+  ASSERT_NO_ERROR( MIDIDeviceAttachIn( device, port ), "Could not connect device to driver." );
+  ASSERT_NO_ERROR( MIDIDriverStartProfiling( driver ), "Could not start profiling." );
+  ASSERT_NO_ERROR( MIDIDriverReceivePacked( driver, 3, &packed[0] ), "Could not receive packed messages." );
+  ASSERT_EQUAL( _packed_received, 3, "Packed messages were not relayed to the device." );
+  ASSERT_NO_ERROR( MIDIDriverGetProfilingStats( driver, &stats ), "Could not get profiling stats." );
+  ASSERT_EQUAL( stats.messages_in, 3, "Packed messages were not counted." );
+  ASSERT_EQUAL( stats.bytes_in, 9, "Packed message bytes were not counted." );
+  MIDIDriverStopProfiling( driver );
+
+  MIDIDeviceRelease( device );
+  MIDIDriverRelease( driver );
+  return 0;
+}
+
+#define BATCH_BENCHMARK_MESSAGES (1<<20)
+#define BATCH_BENCHMARK_MAX      512
+
+static unsigned long _batch_sent = 0;
+
+static int _send_encode( struct MIDIDriver * driver, struct MIDIMessage * message ) {
+  unsigned char buffer[4];
+  _batch_sent++;
+  return MIDIMessageEncode( message, sizeof(buffer), &buffer[0], NULL );
+}
+
+/**
+ * Benchmark sending messages from a device to a driver in batches of
+ * 1, 8, 64 and 512 messages and report the messages per second. The
+ * driver encodes every message on its own, so the difference is the
+ * cost of the ports.
+ */
+int test006_driver( void ) {
+  static const size_t sizes[] = { 1, 8, 64, 512 };
+  struct MIDIMessage * messages[BATCH_BENCHMARK_MAX];
+  struct MIDIDevice * device;
+  struct MIDIDriver * driver;
+  struct MIDIPort * port;
+  struct timespec start, end;
+  double seconds;
+  size_t i, s, n;
+
+  driver = MIDIDriverCreate( "test driver", MIDI_SAMPLING_RATE_DEFAULT );
+  ASSERT_NOT_EQUAL( driver, NULL, "Could not create driver!" );
+  driver->send = &_send_encode;
+  device = MIDIDeviceCreate( NULL );
+  ASSERT_NOT_EQUAL( device, NULL, "Could not create device!" );
+  ASSERT_NO_ERROR( MIDIDriverGetPort( driver, &port ), "Could not get driver port." );
+  ASSERT_NO_ERROR( MIDIDeviceAttachOut( device, port ), "Could not connect device to driver." );
+  for( i=0; i<BATCH_BENCHMARK_MAX; i++ ) {
+    messages[i] = MIDIMessageCreate( MIDI_STATUS_NOTE_ON );
+    ASSERT_NOT_EQUAL( messages[i], NULL, "Could not create message." );
+  }
+
+  for( s=0; s<sizeof(sizes)/sizeof(sizes[0]); s++ ) {
+    _batch_sent = 0;
+    clock_gettime( CLOCK_THREAD_CPUTIME_ID, &start );
+    for( n=0; n<BATCH_BENCHMARK_MESSAGES; n+=sizes[s] ) {
+      ASSERT_NO_ERROR( MIDIDeviceSendBatch( device, sizes[s], &messages[0] ), "Could not send batch." );
+    }
+    clock_gettime( CLOCK_THREAD_CPUTIME_ID, &end );
+    ASSERT_EQUAL( _batch_sent, BATCH_BENCHMARK_MESSAGES, "Driver did not get every message." );
+    seconds = ( end.tv_sec - start.tv_sec ) + ( end.tv_nsec - start.tv_nsec ) / 1000000000.0;
+    printf( "batch send, %3lu messages per batch: %.0f msgs/s\n", (unsigned long) sizes[s],
+            seconds > 0 ? BATCH_BENCHMARK_MESSAGES / seconds : 0.0 );
+  }
+
+  for( i=0; i<BATCH_BENCHMARK_MAX; i++ ) {
+    MIDIMessageRelease( messages[i] );
+  }
+  MIDIDeviceDetachOut( device );
+  MIDIDeviceRelease( device );
+  MIDIDriverRelease( driver );
+  return 0;
+}
@@ -10,6 +10,7 @@
 #include "midi/driver.h"
 #include "midi/message.h"
 #include "midi/runloop.h"
+#include "midi/clock.h"
 #include "driver/applemidi/applemidi.h"
 
 #define CLIENT_SSRC 0x5d72fb43
@@ -21,6 +22,10 @@
 #define SERVER_CONTROL_PORT 5204
 #define SERVER_RTP_PORT SERVER_CONTROL_PORT + 1
 
+#define SEND_SHORT_BUDGET 500 /* microseconds */
+#define SEND_SHORT_ROUNDS 5
+#define SEND_CLOCK_TICK   100 /* microseconds per tick of the driver clock */
+
 static struct MIDIDriverAppleMIDI * driver = NULL;
 
 static int client_control_socket = 0;
@@ -326,9 +331,244 @@ int test004_applemidi( void ) {
   return 0;
 }
 
+static struct MIDIMessage * _note_on( MIDIKey key ) {
+  struct MIDIMessage * message = MIDIMessageCreate( MIDI_STATUS_NOTE_ON );
+  MIDIChannel  channel  = MIDI_CHANNEL_1;
+  MIDIVelocity velocity = 100;
+  MIDIMessageSet( message, MIDI_CHANNEL, sizeof(MIDIChannel), &channel );
+  MIDIMessageSet( message, MIDI_KEY, sizeof(MIDIKey), &key );
+  MIDIMessageSet( message, MIDI_VELOCITY, sizeof(MIDIVelocity), &velocity );
+  return message;
+}
+
+static int _pending_packets( int fd ) {
+  static struct timeval tv = { 0, 0 };
+  fd_set fds;
+  FD_ZERO( &fds );
+  FD_SET( fd, &fds );
+  return select( fd+1, &fds, NULL, NULL, &tv );
+}
+
+/**
+ * Test that the send scheduler coalesces messages within the latency
+ * budget, sends real-time messages immediately and that the runloop
+ * sends held back messages in time.
+ */
+int test006_applemidi( void ) {
+  struct MIDIMessage * message;
+  struct AppleMIDISendStats stats;
+  struct MIDIRunloopSource * source;
+  struct MIDIRunloop * runloop;
+  unsigned char buffer[1500];
+  unsigned long latency;
+  int i, j, k;
+
+  /* drop packets of the previous tests */
+  while( _pending_packets( client_rtp_socket ) > 0 ) {
+    recv( client_rtp_socket, &(buffer[0]), sizeof(buffer), 0 );
+  }
+
+  ASSERT_NO_ERROR( MIDIDriverAppleMIDISetSendLatency( driver, 200000 ), "Could not set latency budget." );
+  ASSERT_NO_ERROR( MIDIDriverAppleMIDIGetSendLatency( driver, &latency ), "Could not get latency budget." );
+  ASSERT_EQUAL( latency, 200000, "Latency budget was not stored." );
+  ASSERT_NO_ERROR( MIDIDriverAppleMIDIResetSendStats( driver ), "Could not reset statistics." );
+
+  for( i=0; i<8; i++ ) {
+    message = _note_on( 60 + i );
+    ASSERT_NO_ERROR( MIDIDriverAppleMIDISendMessage( driver, message ), "Could not queue message." );
+    MIDIMessageRelease( message );
+  }
+  ASSERT_EQUAL( _pending_packets( client_rtp_socket ), 0, "Messages were sent before the budget ran out." );
+
+  message = MIDIMessageCreate( MIDI_STATUS_TIMING_CLOCK );
+  ASSERT_NO_ERROR( MIDIDriverAppleMIDISendMessage( driver, message ), "Could not queue real-time message." );
+  MIDIMessageRelease( message );
+  ASSERT( _check_socket_in( client_rtp_socket ), "Real-time message did not flush the queue." );
+  /* one packet for each peer, with all nine commands using running status */
+  while( _pending_packets( client_rtp_socket ) > 0 ) {
+    ASSERT_GREATER( recv( client_rtp_socket, &(buffer[0]), sizeof(buffer), 0 ), 14, "Received short packet." );
+    ASSERT_EQUAL( ( ( buffer[12] & 0x0f ) << 8 ) | buffer[13], 3 + 7 * 3 + 2,
+                  "Packet does not contain all queued messages." );
+  }
+
+  ASSERT_NO_ERROR( MIDIDriverAppleMIDIGetSendStats( driver, &stats ), "Could not get statistics." );
+  ASSERT_EQUAL( stats.messages, 9, "Wrong number of messages in statistics." );
+  ASSERT_EQUAL( stats.packets, 1, "Wrong number of packets in statistics." );
+  ASSERT_LESS( stats.latency_max, 200000, "Added latency exceeds the budget." );
+
+  /* a message is sent when its budget is used up */
+  ASSERT_NO_ERROR( MIDIDriverAppleMIDISetSendLatency( driver, 10000 ), "Could not set latency budget." );
+  message = _note_on( 72 );
+  ASSERT_NO_ERROR( MIDIDriverAppleMIDISendMessage( driver, message ), "Could not queue message." );
+  MIDIMessageRelease( message );
+  ASSERT_EQUAL( _pending_packets( client_rtp_socket ), 0, "Message was sent before the budget ran out." );
+  usleep( 20000 );
+  ASSERT_NO_ERROR( MIDIDriverAppleMIDISend( driver ), "Could not send queued messages." );
+  ASSERT( _check_socket_in( client_rtp_socket ), "Message was not sent after the budget ran out." );
+  while( _pending_packets( client_rtp_socket ) > 0 ) {
+    recv( client_rtp_socket, &(buffer[0]), sizeof(buffer), 0 );
+  }
+
+  ASSERT_NO_ERROR( MIDIDriverAppleMIDIGetSendStats( driver, &stats ), "Could not get statistics." );
+  ASSERT_EQUAL( stats.packets, 2, "Wrong number of packets in statistics." );
+  ASSERT_GREATER_OR_EQUAL( stats.latency_max, 10000, "Added latency is shorter than the budget." );
+
+  /* the runloop sends when the budget runs out, without starting clock synchronization */
+  runloop = MIDIRunloopCreate( NULL );
+  ASSERT_NOT_EQUAL( runloop, NULL, "Could not create runloop." );
+  ASSERT_NO_ERROR( MIDIDriverAppleMIDIGetRunloopSource( driver, &source ), "Could not get runloop source." );
+  ASSERT_NO_ERROR( MIDIRunloopAddSource( runloop, source ), "Could not add source to runloop." );
+  for( i=0; i<10; i++ ) {
+    message = _note_on( 60 + i );
+    ASSERT_NO_ERROR( MIDIDriverAppleMIDISendMessage( driver, message ), "Could not queue message." );
+    MIDIMessageRelease( message );
+    for( j=0; j<100 && _pending_packets( client_rtp_socket ) == 0; j++ ) {
+      ASSERT_NO_ERROR( MIDIRunloopStep( runloop ), "Could not step through runloop." );
+    }
+    ASSERT_GREATER( _pending_packets( client_rtp_socket ), 0, "Runloop did not send when the budget ran out." );
+    while( _pending_packets( client_rtp_socket ) > 0 ) {
+      recv( client_rtp_socket, &(buffer[0]), sizeof(buffer), 0 );
+      ASSERT( buffer[0] != 0xff || buffer[1] != 0xff, "Budget timeout started clock synchronization." );
+    }
+  }
+
+  /* a short budget is kept to within one tick of the driver clock, the
+   * operating system may wake the runloop late, so one round must pass */
+  ASSERT_NO_ERROR( MIDIDriverAppleMIDISetSendLatency( driver, SEND_SHORT_BUDGET ), "Could not set latency budget." );
+  for( k=0; k<SEND_SHORT_ROUNDS; k++ ) {
+    ASSERT_NO_ERROR( MIDIDriverAppleMIDIResetSendStats( driver ), "Could not reset statistics." );
+    for( i=0; i<4; i++ ) {
+      message = _note_on( 60 + i );
+      ASSERT_NO_ERROR( MIDIDriverAppleMIDISendMessage( driver, message ), "Could not queue message." );
+      MIDIMessageRelease( message );
+      for( j=0; j<100 && _pending_packets( client_rtp_socket ) == 0; j++ ) {
+        ASSERT_NO_ERROR( MIDIRunloopStep( runloop ), "Could not step through runloop." );
+      }
+      ASSERT_GREATER( _pending_packets( client_rtp_socket ), 0, "Runloop did not send when the budget ran out." );
+      while( _pending_packets( client_rtp_socket ) > 0 ) {
+        recv( client_rtp_socket, &(buffer[0]), sizeof(buffer), 0 );
+      }
+    }
+    ASSERT_NO_ERROR( MIDIDriverAppleMIDIGetSendStats( driver, &stats ), "Could not get statistics." );
+    ASSERT_GREATER_OR_EQUAL( stats.latency_max, SEND_SHORT_BUDGET, "Added latency is shorter than the budget." );
+    if( stats.latency_max <= SEND_SHORT_BUDGET + SEND_CLOCK_TICK ) break;
+  }
+  ASSERT_LESS( k, SEND_SHORT_ROUNDS, "Added latency exceeds the budget by more than one clock tick." );
+
+  ASSERT_NO_ERROR( MIDIRunloopRemoveSource( runloop, source ), "Could not remove source from runloop." );
+  MIDIRunloopRelease( runloop );
+
+  ASSERT_NO_ERROR( MIDIDriverAppleMIDISetSendLatency( driver, 0 ), "Could not reset latency budget." );
+  return 0;
+}
+
+static void _set_sync_timestamp( unsigned char * buf, int i, MIDITimestamp ts ) {
+  int offset = 12 + (8*i);
+  int j;
+  for( j=0; j<8; j++ ) {
+    buf[offset+j] = ( ts >> ( 56 - 8*j ) ) & 0xff;
+  }
+}
+
+static MIDITimestamp _get_sync_timestamp( unsigned char * buf, int i ) {
+  int offset = 12 + (8*i);
+  MIDITimestamp ts = 0;
+  int j;
+  for( j=0; j<8; j++ ) {
+    ts = ( ts << 8 ) | buf[offset+j];
+  }
+  return ts;
+}
+
+#define PEER_OFFSET 1234567
+#define PEER_DRIFT  100
+
+/* time of a peer clock that runs one percent fast */
+static MIDITimestamp _peer_time( MIDITimestamp local, MIDITimestamp origin ) {
+  return local + PEER_OFFSET + ( local - origin ) / PEER_DRIFT;
+}
+
+/**
+ * Test that the offset and drift of a peer clock are estimated from
+ * synchronization rounds initiated by the peer.
+ */
+int test007_applemidi( void ) {
+  struct MIDIClock * clock;
+  struct sockaddr_in addr;
+  unsigned char buf[36] = { 0 };
+  MIDITimestamp now, local, origin, ts, t1;
+  double latency, jitter;
+  int i;
+
+  clock = MIDIClockCreate( 10000 );
+  ASSERT_NOT_EQUAL( clock, NULL, "Could not create clock." );
+  addr = server_addr;
+  inet_aton( CLIENT_ADDRESS, &(addr.sin_addr) );
+  addr.sin_port = htons( CLIENT_CONTROL_PORT );
+  server_addr.sin_port = htons( SERVER_RTP_PORT );
+
+  /* the answer to a first request tells the difference between the clocks */
+  _fillin_sync( &(buf[0]), 0 );
+  _set_sync_timestamp( &(buf[0]), 0, 0 );
+  ASSERT_EQUAL( 36, sendto( client_rtp_socket, &(buf[0]), sizeof(buf), 0,
+                (struct sockaddr *) &server_addr, sizeof(server_addr) ), "Could not send sync." );
+  ASSERT_NO_ERROR( MIDIDriverAppleMIDIReceive( driver ), "Could not receive sync." );
+  ASSERT( _check_socket_in( client_rtp_socket ), "Expected synchronization answer." );
+  ASSERT_EQUAL( 36, recv( client_rtp_socket, &(buf[0]), sizeof(buf), 0 ), "Did not receive synchronization answer." );
+  MIDIClockGetNow( clock, &now );
+  local  = _get_sync_timestamp( &(buf[0]), 1 ) - now;
+  origin = _get_sync_timestamp( &(buf[0]), 1 );
+
+  for( i=0; i<12; i++ ) {
+    usleep( 20000 );
+    MIDIClockGetNow( clock, &now );
+    t1 = _peer_time( now + local, origin );
+    _fillin_sync( &(buf[0]), 0 );
+    _set_sync_timestamp( &(buf[0]), 0, t1 );
+    ASSERT_EQUAL( 36, sendto( client_rtp_socket, &(buf[0]), sizeof(buf), 0,
+                  (struct sockaddr *) &server_addr, sizeof(server_addr) ), "Could not send sync." );
+    ASSERT_NO_ERROR( MIDIDriverAppleMIDIReceive( driver ), "Could not receive sync." );
+    ASSERT( _check_socket_in( client_rtp_socket ), "Expected synchronization answer." );
+    ASSERT_EQUAL( 36, recv( client_rtp_socket, &(buf[0]), sizeof(buf), 0 ), "Did not receive synchronization answer." );
+    ASSERT_EQUAL( buf[8], 1, "Received wrong synchronization count." );
+    ASSERT_EQUAL( _get_sync_timestamp( &(buf[0]), 0 ), t1, "Synchronization answer did not echo the timestamp." );
+
+    MIDIClockGetNow( clock, &now );
+    buf[8] = 2;
+    buf[4] = 0xff & (CLIENT_SSRC >> 24);
+    buf[5] = 0xff & (CLIENT_SSRC >> 16);
+    buf[6] = 0xff & (CLIENT_SSRC >> 8);
+    buf[7] = 0xff &  CLIENT_SSRC;
+    _set_sync_timestamp( &(buf[0]), 2, _peer_time( now + local, origin ) );
+    ASSERT_EQUAL( 36, sendto( client_rtp_socket, &(buf[0]), sizeof(buf), 0,
+                  (struct sockaddr *) &server_addr, sizeof(server_addr) ), "Could not send sync." );
+    ASSERT_NO_ERROR( MIDIDriverAppleMIDIReceive( driver ), "Could not receive sync." );
+  }
+
+  ASSERT_NO_ERROR( MIDIDriverAppleMIDIGetPeerLatency( driver, sizeof(addr), (struct sockaddr *) &addr, &latency, &jitter ),
+                   "Could not get peer latency." );
+  ASSERT_LESS( latency, 0.01, "Latency over loopback is too high." );
+  ASSERT_LESS( jitter, 0.01, "Jitter over loopback is too high." );
+
+  /* the current time and the time one second ahead map onto the local clock */
+  MIDIClockGetNow( clock, &now );
+  ts = _peer_time( now + local, origin );
+  ASSERT_NO_ERROR( MIDIDriverAppleMIDIConvertPeerTimestamp( driver, sizeof(addr), (struct sockaddr *) &addr, clock, &ts ),
+                   "Could not convert peer timestamp." );
+  ASSERT_LESS( ( ts > now ) ? ts - now : now - ts, 5, "Peer offset was not compensated." );
+  ts = _peer_time( now + local + 10000, origin );
+  ASSERT_NO_ERROR( MIDIDriverAppleMIDIConvertPeerTimestamp( driver, sizeof(addr), (struct sockaddr *) &addr, clock, &ts ),
+                   "Could not convert peer timestamp." );
+  ASSERT_LESS( ( ts > now + 10000 ) ? ts - now - 10000 : now + 10000 - ts, 20, "Peer drift was not compensated." );
+
+  MIDIClockRelease( clock );
+  return 0;
+}
+
 /**
  * Test that AppleMIDI sessions can be torn down and
  * clients receive the proper ENDSESSION commands.
+ * This releases the shared driver, so it stays the last test in the file.
  */
 int test005_applemidi( void ) {
 
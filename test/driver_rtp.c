@@ -1,8 +1,10 @@
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
 #include <arpa/inet.h>
 #include "test.h"
 #include "driver/common/rtp.h"
+#include "driver/common/rtpmidi.h"
 
 #define RTP_ADDRESS "127.0.0.1"
 #define RTP_CLIENT_PORT 5204
@@ -192,3 +194,581 @@ int test006_rtp( void ) {
 
   return 0;
 }
+
+#define RTP_BATCH_PEERS 3
+#define RTP_BATCH_PORT  5304
+
+/**
+ * Test that packets can be sent to and received from several peers
+ * with the batch functions.
+ */
+int test007_rtp( void ) {
+  struct RTPSession * session;
+  struct RTPPeer * peers[RTP_BATCH_PEERS];
+  struct RTPPacketInfo infos[RTP_BATCH_PEERS];
+  struct iovec iov[RTP_BATCH_PEERS][2];
+  struct sockaddr_in session_address, addresses[RTP_BATCH_PEERS];
+  unsigned char payload[4] = { 1, 2, 3, 4 };
+  unsigned char packet[32];
+  unsigned long ssrc;
+  size_t count;
+  int i, s, sockets[RTP_BATCH_PEERS];
+
+  ASSERT_NO_ERROR( _rtp_address( &session_address, RTP_BATCH_PORT ), "Could not fill out session address." );
+  ASSERT_NO_ERROR( _rtp_socket( &s, &session_address ), "Could not create session socket." );
+  session = RTPSessionCreate( s );
+  ASSERT_NOT_EQUAL( session, NULL, "Could not create RTP session." );
+  RTPSessionGetSSRC( session, &ssrc );
+
+  for( i=0; i<RTP_BATCH_PEERS; i++ ) {
+    ASSERT_NO_ERROR( _rtp_address( &addresses[i], RTP_BATCH_PORT + 1 + i ), "Could not fill out peer address." );
+    ASSERT_NO_ERROR( _rtp_socket( &sockets[i], &addresses[i] ), "Could not create peer socket." );
+    peers[i] = RTPPeerCreate( RTP_CLIENT_SSRC + i, sizeof(struct sockaddr_in), (void*) &addresses[i] );
+    RTPSessionAddPeer( session, peers[i] );
+    RTPPeerRelease( peers[i] );
+
+    infos[i].peer         = peers[i];
+    infos[i].padding      = 0;
+    infos[i].extension    = 0;
+    infos[i].csrc_count   = 0;
+    infos[i].marker       = 0;
+    infos[i].payload_type = 96;
+    infos[i].timestamp    = i;
+    infos[i].iovlen       = 1;
+    infos[i].iov          = &(iov[i][0]);
+    iov[i][0].iov_base    = &(payload[0]);
+    iov[i][0].iov_len     = sizeof(payload);
+  }
+
+  ASSERT_NO_ERROR( RTPSessionSendBatch( session, RTP_BATCH_PEERS, &(infos[0]), &count ),
+                   "Could not send batch of packets." );
+  ASSERT_EQUAL( count, RTP_BATCH_PEERS, "Not all packets of the batch were sent." );
+  for( i=0; i<RTP_BATCH_PEERS; i++ ) {
+    ASSERT_EQUAL( recv( sockets[i], &packet[0], sizeof(packet), 0 ), 16, "Peer received packet of unexpected size." );
+    ASSERT_EQUAL( packet[7], i, "Peer received wrong packet." );
+    ASSERT_EQUAL( packet[12], 1, "Peer received wrong payload." );
+  }
+
+  for( i=0; i<RTP_BATCH_PEERS; i++ ) {
+    memset( &packet[0], 0, 16 );
+    packet[0]  = 0x80;
+    packet[1]  = 96;
+    packet[3]  = i;
+    packet[11] = ( RTP_CLIENT_SSRC + i ) & 0xff;
+    packet[10] = ( ( RTP_CLIENT_SSRC + i ) >> 8 ) & 0xff;
+    packet[9]  = ( ( RTP_CLIENT_SSRC + i ) >> 16 ) & 0xff;
+    packet[8]  = ( ( RTP_CLIENT_SSRC + i ) >> 24 ) & 0xff;
+    packet[12] = 10 + i;
+    sendto( sockets[i], &packet[0], 13, 0, (struct sockaddr *) &session_address, sizeof(session_address) );
+  }
+  ASSERT_NO_ERROR( RTPSessionReceiveBatch( session, RTP_BATCH_PEERS, &(infos[0]), &count ),
+                   "Could not receive batch of packets." );
+  ASSERT_GREATER( count, 0, "No packets were received." );
+  for( i=0; i<count; i++ ) {
+    ASSERT_EQUAL( infos[i].peer, peers[infos[i].ssrc - RTP_CLIENT_SSRC], "Packet was assigned to wrong peer." );
+    ASSERT_EQUAL( infos[i].payload_size, 1, "Received payload of unexpected size." );
+    ASSERT_EQUAL( *(unsigned char *) infos[i].iov[0].iov_base, 10 + infos[i].ssrc - RTP_CLIENT_SSRC,
+                  "Received wrong payload." );
+  }
+
+  for( i=0; i<RTP_BATCH_PEERS; i++ ) {
+    close( sockets[i] );
+  }
+  RTPSessionRelease( session );
+  close( s );
+  return 0;
+}
+
+#define RTP_MANY_PEERS 300
+
+/**
+ * Test that a session holds many peers, finds them by SSRC and address
+ * and iterates over them while peers are removed.
+ */
+int test008_rtp( void ) {
+  struct RTPSession * session = RTPSessionCreate( -1 );
+  struct RTPPeer * peers[RTP_MANY_PEERS];
+  struct RTPPeer * p;
+  struct sockaddr_in address;
+  int i, visited[RTP_MANY_PEERS] = { 0 };
+
+  ASSERT_NOT_EQUAL( session, NULL, "Could not create RTP session." );
+  for( i=0; i<RTP_MANY_PEERS; i++ ) {
+    ASSERT_NO_ERROR( _rtp_address( &address, 10000 + i ), "Could not fill out peer address." );
+    peers[i] = RTPPeerCreate( RTP_CLIENT_SSRC + i * 16, sizeof(address), (void*) &address );
+    ASSERT_NO_ERROR( RTPSessionAddPeer( session, peers[i] ), "Could not add peer." );
+    RTPPeerRelease( peers[i] );
+  }
+  ASSERT_ERROR( RTPSessionAddPeer( session, peers[0] ), "Added peer twice." );
+
+  for( i=0; i<RTP_MANY_PEERS; i++ ) {
+    ASSERT_NO_ERROR( RTPSessionFindPeerBySSRC( session, &p, RTP_CLIENT_SSRC + i * 16 ), "Could not find peer by SSRC." );
+    ASSERT_EQUAL( p, peers[i], "Lookup by SSRC returned wrong peer." );
+    _rtp_address( &address, 10000 + i );
+    ASSERT_NO_ERROR( RTPSessionFindPeerByAddress( session, &p, sizeof(address), (void*) &address ),
+                     "Could not find peer by address." );
+    ASSERT_EQUAL( p, peers[i], "Lookup by address returned wrong peer." );
+  }
+
+  /* remove every odd peer ahead of the iteration */
+  p = NULL;
+  RTPSessionNextPeer( session, &p );
+  while( p != NULL ) {
+    for( i=0; i<RTP_MANY_PEERS && peers[i] != p; i++ );
+    ASSERT_LESS( i, RTP_MANY_PEERS, "Iteration returned unknown peer." );
+    ASSERT_EQUAL( i % 2, 0, "Iteration returned removed peer." );
+    visited[i]++;
+    if( i+1 < RTP_MANY_PEERS ) {
+      ASSERT_NO_ERROR( RTPSessionRemovePeer( session, peers[i+1] ), "Could not remove peer." );
+    }
+    ASSERT_NO_ERROR( RTPSessionNextPeer( session, &p ), "Could not get next peer." );
+  }
+  for( i=0; i<RTP_MANY_PEERS; i+=2 ) {
+    ASSERT_EQUAL( visited[i], 1, "Iteration did not return peer exactly once." );
+  }
+  ASSERT_ERROR( RTPSessionFindPeerBySSRC( session, &p, RTP_CLIENT_SSRC + 16 ), "Removed peer was found." );
+  ASSERT_NO_ERROR( RTPSessionFindPeerBySSRC( session, &p, RTP_CLIENT_SSRC + 32 ), "Could not find peer by SSRC." );
+  ASSERT_EQUAL( p, peers[2], "Lookup by SSRC returned wrong peer after removal." );
+
+  RTPSessionRelease( session );
+  return 0;
+}
+
+#define RTP_VIEW_PORT 5404
+
+/**
+ * Test that RTP-MIDI commands can be walked in place without creating
+ * messages, that real-time messages keep the running status and that
+ * released views are reused.
+ */
+int test009_rtp( void ) {
+  struct RTPSession * session;
+  struct RTPMIDISession * midi_session;
+  struct RTPMIDIPacketView * view, * other;
+  struct RTPMIDICommand command;
+  struct sockaddr_in session_address, peer_address;
+  const unsigned char * data;
+  unsigned char packet[] = { 0x80, 97, 0x00, 0x01, 0, 0, 0x10, 0, 0x01, 0x02, 0x03, 0x04,
+                             15,                          /* B=0, J=0, Z=0, P=0, LEN=15 */
+                             0x90, 0x3c, 0x40,            /* note on */
+                             0x05, 0x3e, 0x40,            /* running status */
+                             0x00, 0xf0, 0x7e, 0x01, 0xf7, /* sysex */
+                             0x81, 0x00, 0xc1, 0x05 };    /* program change */
+  unsigned char clock[] = { 0x80, 97, 0x00, 0x02, 0, 0, 0x10, 0, 0x01, 0x02, 0x03, 0x04,
+                            8,                            /* B=0, J=0, Z=0, P=0, LEN=8 */
+                            0x90, 0x3c, 0x40,             /* note on */
+                            0x00, 0xf8,                   /* timing clock */
+                            0x00, 0x3e, 0x40 };           /* running status */
+  size_t size;
+  int s, p;
+
+  ASSERT_NO_ERROR( _rtp_address( &session_address, RTP_VIEW_PORT ), "Could not fill out session address." );
+  ASSERT_NO_ERROR( _rtp_socket( &s, &session_address ), "Could not create session socket." );
+  ASSERT_NO_ERROR( _rtp_address( &peer_address, RTP_VIEW_PORT + 1 ), "Could not fill out peer address." );
+  ASSERT_NO_ERROR( _rtp_socket( &p, &peer_address ), "Could not create peer socket." );
+  session      = RTPSessionCreate( s );
+  midi_session = RTPMIDISessionCreate( session );
+  ASSERT_NOT_EQUAL( midi_session, NULL, "Could not create RTP-MIDI session." );
+
+  sendto( p, &packet[0], sizeof(packet), 0, (struct sockaddr *) &session_address, sizeof(session_address) );
+  ASSERT_NO_ERROR( RTPMIDISessionReceiveView( midi_session, &view ), "Could not receive packet view." );
+  ASSERT_NO_ERROR( RTPMIDIPacketViewGetData( view, &size, &data ), "Could not get packet data." );
+  ASSERT_EQUAL( size, sizeof(packet), "Packet view has wrong size." );
+
+  ASSERT_NO_ERROR( RTPMIDIPacketViewFirstCommand( view, &command ), "Could not get first command." );
+  ASSERT_EQUAL( command.status, 0x90, "First command has wrong status." );
+  ASSERT_EQUAL( command.size, 2, "First command has wrong size." );
+  ASSERT_EQUAL( data[command.offset], 0x3c, "First command has wrong data." );
+  ASSERT_EQUAL( command.timestamp, 0x1000, "First command has wrong timestamp." );
+
+  ASSERT_NO_ERROR( RTPMIDIPacketViewNextCommand( view, &command ), "Could not get second command." );
+  ASSERT_EQUAL( command.status, 0x90, "Running status was not applied." );
+  ASSERT_EQUAL( data[command.offset], 0x3e, "Second command has wrong data." );
+  ASSERT_EQUAL( command.delta, 5, "Second command has wrong delta time." );
+
+  ASSERT_NO_ERROR( RTPMIDIPacketViewNextCommand( view, &command ), "Could not get third command." );
+  ASSERT_EQUAL( command.status, 0xf0, "Third command is not a system exclusive message." );
+  ASSERT_EQUAL( command.size, 3, "System exclusive message has wrong size." );
+
+  ASSERT_NO_ERROR( RTPMIDIPacketViewNextCommand( view, &command ), "Could not get fourth command." );
+  ASSERT_EQUAL( command.status, 0xc1, "Fourth command has wrong status." );
+  ASSERT_EQUAL( command.delta, 128, "Fourth command has wrong delta time." );
+  ASSERT_EQUAL( command.timestamp, 0x1000 + 5 + 128, "Fourth command has wrong timestamp." );
+  ASSERT_EQUAL( data[command.offset], 0x05, "Fourth command has wrong data." );
+  ASSERT_NOT_EQUAL( RTPMIDIPacketViewNextCommand( view, &command ), 0, "Read past the command list." );
+
+  RTPMIDIPacketViewRelease( view );
+  sendto( p, &packet[0], sizeof(packet), 0, (struct sockaddr *) &session_address, sizeof(session_address) );
+  ASSERT_NO_ERROR( RTPMIDISessionReceiveView( midi_session, &other ), "Could not receive packet view." );
+  ASSERT_EQUAL( other, view, "Released view was not reused." );
+  RTPMIDIPacketViewRelease( other );
+
+  /* real-time messages do not cancel the running status */
+  sendto( p, &clock[0], sizeof(clock), 0, (struct sockaddr *) &session_address, sizeof(session_address) );
+  ASSERT_NO_ERROR( RTPMIDISessionReceiveView( midi_session, &view ), "Could not receive packet view." );
+  ASSERT_NO_ERROR( RTPMIDIPacketViewGetData( view, &size, &data ), "Could not get packet data." );
+  ASSERT_NO_ERROR( RTPMIDIPacketViewFirstCommand( view, &command ), "Could not get first command." );
+  ASSERT_NO_ERROR( RTPMIDIPacketViewNextCommand( view, &command ), "Could not get timing clock." );
+  ASSERT_EQUAL( command.status, 0xf8, "Second command is not a timing clock." );
+  ASSERT_NO_ERROR( RTPMIDIPacketViewNextCommand( view, &command ), "Timing clock cancelled the running status." );
+  ASSERT_EQUAL( command.status, 0x90, "Running status was not kept across the timing clock." );
+  ASSERT_EQUAL( data[command.offset], 0x3e, "Third command has wrong data." );
+  RTPMIDIPacketViewRelease( view );
+
+  RTPMIDISessionRelease( midi_session );
+  RTPSessionRelease( session );
+  close( p );
+  close( s );
+  return 0;
+}
+
+#define RTP_JOURNAL_PORT 5504
+
+static int _rtp_send_note( struct RTPMIDISession * session, MIDIKey key ) {
+  struct MIDIMessage * message = MIDIMessageCreate( MIDI_STATUS_NOTE_ON );
+  struct MIDIMessageList messages = { message, NULL };
+  MIDIValue values[3] = { MIDI_CHANNEL_1, key, 64 };
+  ASSERT_NOT_EQUAL( message, NULL, "Could not create note on message." );
+  MIDIMessageSet( message, MIDI_CHANNEL,  sizeof(MIDIChannel),  &values[0] );
+  MIDIMessageSet( message, MIDI_KEY,      sizeof(MIDIKey),      &values[1] );
+  MIDIMessageSet( message, MIDI_VELOCITY, sizeof(MIDIVelocity), &values[2] );
+  ASSERT_NO_ERROR( RTPMIDISessionSend( session, &messages ), "Could not send message." );
+  MIDIMessageRelease( message );
+  return 0;
+}
+
+/**
+ * Test that sent packets carry a recovery journal with the state
+ * since the last checkpoint and that the journal goes away with the peer.
+ */
+int test010_rtp( void ) {
+  struct RTPSession * session;
+  struct RTPMIDISession * midi_session;
+  struct RTPPeer * peer;
+  struct sockaddr_in session_address, peer_address;
+  unsigned char packet[64];
+  unsigned short seqnum;
+  void * info;
+  int s, p;
+
+  ASSERT_NO_ERROR( _rtp_address( &session_address, RTP_JOURNAL_PORT ), "Could not fill out session address." );
+  ASSERT_NO_ERROR( _rtp_socket( &s, &session_address ), "Could not create session socket." );
+  ASSERT_NO_ERROR( _rtp_address( &peer_address, RTP_JOURNAL_PORT + 1 ), "Could not fill out peer address." );
+  ASSERT_NO_ERROR( _rtp_socket( &p, &peer_address ), "Could not create peer socket." );
+  session      = RTPSessionCreate( s );
+  midi_session = RTPMIDISessionCreate( session );
+  peer = RTPPeerCreate( RTP_CLIENT_SSRC, sizeof(struct sockaddr_in), (void*) &peer_address );
+  RTPSessionAddPeer( session, peer );
+
+  ASSERT_NO_ERROR( _rtp_send_note( midi_session, 0x3c ), "Could not send first note." );
+  ASSERT_EQUAL( recv( p, &packet[0], sizeof(packet), 0 ), 16, "First packet has unexpected size." );
+  ASSERT_EQUAL( packet[12], 0x03, "First packet must not have a journal." );
+  seqnum = ( packet[2] << 8 ) | packet[3];
+
+  ASSERT_NO_ERROR( _rtp_send_note( midi_session, 0x3e ), "Could not send second note." );
+  ASSERT_EQUAL( recv( p, &packet[0], sizeof(packet), 0 ), 26, "Second packet has unexpected size." );
+  ASSERT_EQUAL( packet[12], 0x43, "Second packet has no journal." );
+  ASSERT_EQUAL( packet[16], 0x20, "Journal header has wrong flags." );
+  ASSERT_EQUAL( ( packet[17] << 8 ) | packet[18], seqnum, "Journal has wrong checkpoint." );
+  ASSERT_EQUAL( packet[19] & 0x78, 0, "Channel journal has wrong channel." );
+  ASSERT_EQUAL( packet[21], 0x08, "Channel journal does not contain only chapter N." );
+  ASSERT_EQUAL( packet[22], 1, "Chapter N has wrong number of note logs." );
+  ASSERT_EQUAL( packet[24], 0x3c, "Chapter N has wrong note." );
+  ASSERT_EQUAL( packet[25], 0xc0, "Chapter N has wrong velocity." );
+
+  ASSERT_NO_ERROR( RTPMIDISessionJournalTrunkate( midi_session, peer, seqnum ), "Could not trunkate journal." );
+  ASSERT_NO_ERROR( _rtp_send_note( midi_session, 0x40 ), "Could not send third note." );
+  ASSERT_EQUAL( recv( p, &packet[0], sizeof(packet), 0 ), 26, "Third packet has unexpected size." );
+  ASSERT_EQUAL( ( packet[17] << 8 ) | packet[18], ( seqnum + 1 ) & 0xffff, "Checkpoint was not advanced." );
+  ASSERT_EQUAL( packet[22], 1, "Trunkated chapter N has wrong number of note logs." );
+  ASSERT_EQUAL( packet[24], 0x3e, "Trunkated chapter N has wrong note." );
+
+  ASSERT_NO_ERROR( RTPMIDISessionRemovePeer( midi_session, peer ), "Could not remove peer." );
+  RTPPeerGetInfo( peer, &info );
+  ASSERT_EQUAL( info, NULL, "Journals of the removed peer were not freed." );
+
+  RTPPeerRelease( peer );
+  RTPMIDISessionRelease( midi_session );
+  RTPSessionRelease( session );
+  close( p );
+  close( s );
+  return 0;
+}
+
+#define RTP_LOSS_PORT     5604
+#define RTP_LOSS_PACKETS  200
+#define RTP_LOSS_MESSAGES 256
+
+/**
+ * The state of the first two channels of a MIDI stream, used to
+ * compare what the receiver has seen with what the sender has sent.
+ */
+struct RTPLossState {
+  unsigned char notes[2][128];
+  unsigned char controls[2][128];
+  unsigned char programs[2];
+};
+
+static size_t              _captured_size[RTP_LOSS_PACKETS];
+static unsigned char       _captured[RTP_LOSS_PACKETS][RTPMIDI_VIEW_SIZE];
+static struct RTPLossState _expected[RTP_LOSS_PACKETS];
+static unsigned long       _loss_random = 1;
+
+static int _rtp_loss_random( void ) {
+  _loss_random = _loss_random * 1103515245 + 12345;
+  return ( _loss_random >> 16 ) & 0x7fff;
+}
+
+static void _rtp_loss_apply( struct RTPLossState * state, struct MIDIMessage * message ) {
+  unsigned char bytes[4];
+  size_t size;
+  int channel;
+  if( MIDIMessageEncode( message, sizeof(bytes), &bytes[0], &size ) ) return;
+  channel = bytes[0] & 0x0f;
+  if( channel > 1 ) return;
+  switch( bytes[0] & 0xf0 ) {
+    case 0x90: state->notes[channel][bytes[1]] = bytes[2]; break;
+    case 0x80: state->notes[channel][bytes[1]] = 0; break;
+    case 0xb0: state->controls[channel][bytes[1]] = bytes[2]; break;
+    case 0xc0: state->programs[channel] = bytes[1]; break;
+  }
+}
+
+static int _rtp_loss_equal( struct RTPLossState * a, struct RTPLossState * b ) {
+  int c, i;
+  for( c=0; c<2; c++ ) {
+    if( a->programs[c] != b->programs[c] ) return 0;
+    for( i=0; i<128; i++ ) {
+      if( a->notes[c][i] != b->notes[c][i] ) return 0;
+      if( a->controls[c][i] != b->controls[c][i] ) return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * Send a pseudo random stream of note, controller and program changes
+ * and capture the packets together with the state of the stream after
+ * each packet.
+ */
+static int _rtp_loss_capture( int s, int c, struct sockaddr_in * address ) {
+  struct RTPSession * session = RTPSessionCreate( s );
+  struct RTPMIDISession * midi_session = RTPMIDISessionCreate( session );
+  struct RTPPeer * peer = RTPPeerCreate( RTP_CLIENT_SSRC, sizeof(struct sockaddr_in), (void*) address );
+  struct MIDIMessageList messages[3];
+  struct RTPLossState state;
+  MIDIValue values[3];
+  int i, k, n, r, channel;
+  ssize_t bytes;
+
+  memset( &state, 0, sizeof(state) );
+  RTPSessionAddPeer( session, peer );
+  for( k=0; k<RTP_LOSS_PACKETS; k++ ) {
+    n = 1 + _rtp_loss_random() % 3;
+    for( i=0; i<n; i++ ) {
+      r = _rtp_loss_random();
+      channel = r & 1;
+      values[0] = channel;
+      switch( ( r >> 1 ) % 4 ) {
+        case 0:
+        case 1:
+          values[1] = 48 + ( r >> 3 ) % 24;
+          values[2] = 1 + ( r >> 5 ) % 127;
+          messages[i].message = MIDIMessageCreate( state.notes[channel][(unsigned char) values[1]]
+                                                   ? MIDI_STATUS_NOTE_OFF : MIDI_STATUS_NOTE_ON );
+          MIDIMessageSet( messages[i].message, MIDI_KEY,      sizeof(MIDIKey),      &values[1] );
+          MIDIMessageSet( messages[i].message, MIDI_VELOCITY, sizeof(MIDIVelocity), &values[2] );
+          break;
+        case 2:
+          values[1] = 1 + ( r >> 3 ) % 16;
+          values[2] = ( r >> 7 ) % 128;
+          messages[i].message = MIDIMessageCreate( MIDI_STATUS_CONTROL_CHANGE );
+          MIDIMessageSet( messages[i].message, MIDI_CONTROL, sizeof(MIDIControl), &values[1] );
+          MIDIMessageSet( messages[i].message, MIDI_VALUE,   sizeof(MIDIValue),   &values[2] );
+          break;
+        default:
+          values[1] = ( r >> 3 ) % 128;
+          messages[i].message = MIDIMessageCreate( MIDI_STATUS_PROGRAM_CHANGE );
+          MIDIMessageSet( messages[i].message, MIDI_PROGRAM, sizeof(MIDIProgram), &values[1] );
+          break;
+      }
+      MIDIMessageSet( messages[i].message, MIDI_CHANNEL, sizeof(MIDIChannel), &values[0] );
+      MIDIMessageSetTimestamp( messages[i].message, k );
+      messages[i].next = ( i+1 < n ) ? &(messages[i+1]) : NULL;
+      _rtp_loss_apply( &state, messages[i].message );
+    }
+    ASSERT_NO_ERROR( RTPMIDISessionSend( midi_session, &(messages[0]) ), "Could not send messages." );
+    for( i=0; i<n; i++ ) {
+      MIDIMessageRelease( messages[i].message );
+    }
+    bytes = recv( c, &(_captured[k][0]), RTPMIDI_VIEW_SIZE, 0 );
+    ASSERT_GREATER( bytes, 12, "Could not capture packet." );
+    _captured_size[k] = bytes;
+    _expected[k]      = state;
+  }
+
+  RTPPeerRelease( peer );
+  RTPMIDISessionRelease( midi_session );
+  RTPSessionRelease( session );
+  return 0;
+}
+
+/**
+ * Replay the captured packets to a new session and drop the packets
+ * selected by the pattern. The recovery latency is the number of
+ * packets that had to be received after a loss until the receiver
+ * reached the state of the sender again.
+ */
+static int _rtp_loss_replay( int s, int p, struct sockaddr_in * address,
+                             int (*drop)( int ), int * losses, int * latency ) {
+  struct RTPSession * session = RTPSessionCreate( s );
+  struct RTPMIDISession * midi_session = RTPMIDISessionCreate( session );
+  struct MIDIMessageList messages[RTP_LOSS_MESSAGES];
+  struct RTPLossState state;
+  int i, k, lost = 0, received = 0;
+
+  memset( &state, 0, sizeof(state) );
+  for( i=0; i<RTP_LOSS_MESSAGES; i++ ) {
+    messages[i].message = NULL;
+    messages[i].next    = ( i+1 < RTP_LOSS_MESSAGES ) ? &(messages[i+1]) : NULL;
+  }
+  *losses  = 0;
+  *latency = 0;
+  for( k=0; k<RTP_LOSS_PACKETS; k++ ) {
+    /* the first packet starts the stream and the last one ends the
+     * replay, so they are never dropped */
+    if( k > 0 && k < RTP_LOSS_PACKETS - 1 && drop( k ) ) {
+      if( ! lost ) (*losses)++;
+      lost     = 1;
+      received = 0;
+      continue;
+    }
+    sendto( p, &(_captured[k][0]), _captured_size[k], 0, (struct sockaddr *) address, sizeof(struct sockaddr_in) );
+    ASSERT_NO_ERROR( RTPMIDISessionReceive( midi_session, &(messages[0]) ), "Could not receive packet." );
+    for( i=0; i<RTP_LOSS_MESSAGES && messages[i].message != NULL; i++ ) {
+      _rtp_loss_apply( &state, messages[i].message );
+      MIDIMessageRelease( messages[i].message );
+      messages[i].message = NULL;
+    }
+    if( lost ) {
+      received++;
+      if( _rtp_loss_equal( &state, &_expected[k] ) ) {
+        if( received > *latency ) *latency = received;
+        lost = 0;
+      }
+    } else {
+      ASSERT( _rtp_loss_equal( &state, &_expected[k] ), "Receiver state differs without loss." );
+    }
+  }
+  ASSERT_EQUAL( lost, 0, "Receiver did not recover from the last loss." );
+
+  RTPMIDISessionRelease( midi_session );
+  RTPSessionRelease( session );
+  return 0;
+}
+
+static int _rtp_drop_none( int k )   { return 0; }
+static int _rtp_drop_every( int k )  { return k % 5 == 4; }
+static int _rtp_drop_burst( int k )  { return k % 20 >= 10 && k % 20 < 15; }
+static int _rtp_drop_random( int k ) { return ( ( k * 2654435761UL ) >> 8 ) % 4 == 0; }
+
+/**
+ * Test that a receiver recovers from lost packets using the journal by
+ * replaying a captured session with different drop patterns.
+ */
+int test011_rtp( void ) {
+  struct sockaddr_in sender_address, capture_address, receiver_address;
+  int (*patterns[4])( int ) = { &_rtp_drop_none, &_rtp_drop_every, &_rtp_drop_burst, &_rtp_drop_random };
+  int i, s, c, r, losses, latency;
+
+  ASSERT_NO_ERROR( _rtp_address( &sender_address, RTP_LOSS_PORT ), "Could not fill out sender address." );
+  ASSERT_NO_ERROR( _rtp_socket( &s, &sender_address ), "Could not create sender socket." );
+  ASSERT_NO_ERROR( _rtp_address( &capture_address, RTP_LOSS_PORT + 1 ), "Could not fill out capture address." );
+  ASSERT_NO_ERROR( _rtp_socket( &c, &capture_address ), "Could not create capture socket." );
+  ASSERT_NO_ERROR( _rtp_address( &receiver_address, RTP_LOSS_PORT + 2 ), "Could not fill out receiver address." );
+  ASSERT_NO_ERROR( _rtp_socket( &r, &receiver_address ), "Could not create receiver socket." );
+
+  ASSERT_NO_ERROR( _rtp_loss_capture( s, c, &capture_address ), "Could not capture session." );
+  for( i=0; i<4; i++ ) {
+    ASSERT_NO_ERROR( _rtp_loss_replay( r, c, &receiver_address, patterns[i], &losses, &latency ),
+                     "Could not replay session." );
+    if( i == 0 ) {
+      ASSERT_EQUAL( losses, 0, "Packets were lost without dropping any." );
+      ASSERT_EQUAL( latency, 0, "Recovery latency without loss." );
+    } else {
+      ASSERT_GREATER( losses, 0, "Drop pattern did not drop any packets." );
+      /* every packet carries a journal, so one packet is enough to recover */
+      ASSERT_EQUAL( latency, 1, "Recovery took more than one packet." );
+    }
+  }
+
+  close( r );
+  close( c );
+  close( s );
+  return 0;
+}
+
+#define RTP_CURSOR_PEERS 16
+
+/**
+ * Test that the iteration continues after the current peer was removed
+ * and after an added peer compacted the peer table.
+ */
+int test012_rtp( void ) {
+  struct RTPSession * session = RTPSessionCreate( -1 );
+  struct RTPPeer * peers[RTP_CURSOR_PEERS+1];
+  struct RTPPeer * p, * current;
+  struct sockaddr_in address;
+  int i, n, visited[RTP_CURSOR_PEERS+1] = { 0 };
+
+  ASSERT_NOT_EQUAL( session, NULL, "Could not create RTP session." );
+  for( i=0; i<=RTP_CURSOR_PEERS; i++ ) {
+    ASSERT_NO_ERROR( _rtp_address( &address, 11000 + i ), "Could not fill out peer address." );
+    peers[i] = RTPPeerCreate( RTP_CLIENT_SSRC + i * 16, sizeof(address), (void*) &address );
+    ASSERT_NOT_EQUAL( peers[i], NULL, "Could not create peer." );
+  }
+
+  /* remove every peer while it is the current one */
+  for( i=0; i<RTP_CURSOR_PEERS; i++ ) {
+    ASSERT_NO_ERROR( RTPSessionAddPeer( session, peers[i] ), "Could not add peer." );
+  }
+  p = NULL;
+  ASSERT_NO_ERROR( RTPSessionNextPeer( session, &p ), "Could not get first peer." );
+  for( n=0; p != NULL; n++ ) {
+    ASSERT_EQUAL( p, peers[n], "Iteration returned wrong peer." );
+    ASSERT_NO_ERROR( RTPSessionRemovePeer( session, p ), "Could not remove current peer." );
+    ASSERT_NO_ERROR( RTPSessionNextPeer( session, &p ), "Could not continue after removing current peer." );
+  }
+  ASSERT_EQUAL( n, RTP_CURSOR_PEERS, "Iteration did not visit every peer." );
+
+  /* fill the table, empty the front and add a peer to compact it mid-iteration */
+  for( i=0; i<RTP_CURSOR_PEERS; i++ ) {
+    ASSERT_NO_ERROR( RTPSessionAddPeer( session, peers[i] ), "Could not add peer." );
+  }
+  for( i=0; i<10; i++ ) {
+    ASSERT_NO_ERROR( RTPSessionRemovePeer( session, peers[i] ), "Could not remove peer." );
+  }
+  p = NULL;
+  ASSERT_NO_ERROR( RTPSessionNextPeer( session, &p ), "Could not get first peer." );
+  ASSERT_EQUAL( p, peers[10], "Iteration did not skip removed peers." );
+  ASSERT_NO_ERROR( RTPSessionAddPeer( session, peers[RTP_CURSOR_PEERS] ), "Could not add peer to full table." );
+  while( p != NULL ) {
+    for( i=0; i<=RTP_CURSOR_PEERS && peers[i] != p; i++ );
+    ASSERT_LESS( i, RTP_CURSOR_PEERS+1, "Iteration returned unknown peer." );
+    visited[i]++;
+    current = p;
+    if( i == 12 ) {
+      ASSERT_NO_ERROR( RTPSessionRemovePeer( session, current ), "Could not remove current peer." );
+    }
+    ASSERT_NO_ERROR( RTPSessionNextPeer( session, &p ), "Could not get next peer after compaction." );
+  }
+  for( i=0; i<=RTP_CURSOR_PEERS; i++ ) {
+    ASSERT_EQUAL( visited[i], ( i < 10 ) ? 0 : 1, "Iteration did not return peer exactly once." );
+  }
+
+  RTPSessionRelease( session );
+  for( i=0; i<=RTP_CURSOR_PEERS; i++ ) {
+    RTPPeerRelease( peers[i] );
+  }
+  return 0;
+}
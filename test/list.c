@@ -64,3 +64,111 @@ int test002_list( void ) {
   MIDIListRelease( list );
   return 0;
 }
+
+struct remove_params {
+  struct MIDIList * list;
+  int * other;
+  int visits[8];
+  int * items;
+};
+
+static int _apply_remove( void * item, void * info ) {
+  struct remove_params * params = info;
+  int index = (int*)item - params->items;
+  params->visits[index]++;
+  if( index % 2 == 0 ) {
+    MIDIListRemove( params->list, item );
+  }
+  if( params->other != NULL ) {
+    MIDIListRemove( params->list, params->other );
+    params->other = NULL;
+  }
+  return 0;
+}
+
+/**
+ * Test that items can be removed while the list is applied and
+ * that every remaining item is visited exactly once.
+ */
+int test003_list( void ) {
+  int items[8];
+  int i, v = 0;
+  struct remove_params params;
+  struct MIDIList * list = MIDIListCreate( NULL );
+
+  ASSERT_NOT_EQUAL( list, NULL, "Could not create list!" );
+  for( i=0; i<8; i++ ) {
+    ASSERT_NO_ERROR( MIDIListAdd( list, &items[i] ), "Could not add item." );
+    params.visits[i] = 0;
+  }
+  params.list  = list;
+  params.items = &items[0];
+  params.other = &items[7];
+
+  ASSERT_NO_ERROR( MIDIListApply( list, &params, &_apply_remove ), "Could not apply remove function." );
+  ASSERT_EQUAL( params.visits[7], 0, "Removed item was visited." );
+  for( i=0; i<7; i++ ) {
+    ASSERT_EQUAL( params.visits[i], 1, "Item was not visited exactly once." );
+  }
+  for( i=0; i<8; i++ ) {
+    if( i % 2 == 0 || i == 7 ) {
+      ASSERT_EQUAL( MIDIListContains( list, &items[i] ), -1, "Removed item is still in the list." );
+    } else {
+      ASSERT_EQUAL( MIDIListContains( list, &items[i] ), 0, "Item was lost from the list." );
+    }
+  }
+
+  ASSERT_NO_ERROR( MIDIListApply( list, &v, &_apply_set ), "Could not apply set function." );
+  ASSERT_EQUAL( items[1], v, "Setter did not set list item." );
+  ASSERT_EQUAL( items[5], v, "Setter did not set list item." );
+  MIDIListRelease( list );
+  return 0;
+}
+
+static int _apply_remove_current( void * item, void * info ) {
+  struct remove_params * params = info;
+  int index = (int*)item - params->items;
+  params->visits[index]++;
+  if( index % 2 == 1 ) {
+    MIDIListRemoveCurrent( params->list );
+  }
+  return 0;
+}
+
+/**
+ * Test that the applied item can be removed by its position and that
+ * removal of the current item outside of apply is rejected.
+ */
+int test004_list( void ) {
+  int items[8];
+  int i;
+  struct remove_params params;
+  struct MIDIList * list = MIDIListCreate( TestType );
+
+  ASSERT_NOT_EQUAL( list, NULL, "Could not create list!" );
+  for( i=0; i<8; i++ ) {
+    items[i] = 1;
+    ASSERT_NO_ERROR( MIDIListAdd( list, &items[i] ), "Could not add item." );
+    params.visits[i] = 0;
+  }
+  params.list  = list;
+  params.items = &items[0];
+  params.other = NULL;
+
+  ASSERT_NO_ERROR( MIDIListApply( list, &params, &_apply_remove_current ), "Could not apply remove function." );
+  for( i=0; i<8; i++ ) {
+    ASSERT_EQUAL( params.visits[i], 1, "Item was not visited exactly once." );
+    if( i % 2 == 1 ) {
+      ASSERT_EQUAL( items[i], 1, "Removed item was not released." );
+      ASSERT_EQUAL( MIDIListContains( list, &items[i] ), -1, "Removed item is still in the list." );
+    } else {
+      ASSERT_EQUAL( items[i], 2, "Remaining item was released." );
+      ASSERT_EQUAL( MIDIListContains( list, &items[i] ), 0, "Item was lost from the list." );
+    }
+  }
+
+  ASSERT_NOT_EQUAL( MIDIListRemoveCurrent( list ), 0, "Removed current item outside of apply." );
+  MIDIErrorNumber = 0;
+  MIDIListRelease( list );
+  return 0;
+}
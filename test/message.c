@@ -1,4 +1,6 @@
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
 #include "test.h"
 #include "midi/message.h"
 
@@ -257,3 +259,192 @@ int test006_message( void ) {
   MIDIMessageRelease( messages[11].message );
   return 0;
 }
+
+/**
+ * Test that a list of messages decodes a system exclusive message up to
+ * its end and continues with the following messages.
+ */
+int test007_message( void ) {
+  unsigned char buffer[64];
+  struct MIDIMessageList list[3];
+  MIDIStatus status;
+  size_t size, i, read;
+
+  buffer[0] = MIDI_STATUS_SYSTEM_EXCLUSIVE;
+  buffer[1] = 0x7d;
+  for( i=2; i<42; i++ ) buffer[i] = i;
+  buffer[42] = MIDI_STATUS_END_OF_EXCLUSIVE;
+  buffer[43] = MIDI_NIBBLE_VALUE( MIDI_STATUS_NOTE_ON, MIDI_CHANNEL_1 );
+  buffer[44] = 60;
+  buffer[45] = 100;
+  buffer[46] = MIDI_STATUS_TIMING_CLOCK;
+
+  for( i=0; i<3; i++ ) {
+    list[i].message = MIDIMessageCreate( MIDI_STATUS_RESET );
+    list[i].next    = ( i < 2 ) ? &(list[i+1]) : NULL;
+  }
+  ASSERT_NO_ERROR( MIDIMessageListDecode( &(list[0]), 47, buffer, &read ), "Could not decode message list." );
+  ASSERT_EQUAL( read, 47, "Did not read all messages." );
+
+  MIDIMessageGet( list[0].message, MIDI_STATUS, sizeof(MIDIStatus), &status );
+  ASSERT_EQUAL( status, MIDI_STATUS_SYSTEM_EXCLUSIVE, "First message is not system exclusive." );
+  MIDIMessageGet( list[0].message, MIDI_SYSEX_SIZE, sizeof(size_t), &size );
+  ASSERT_EQUAL( size, 41, "System exclusive payload has wrong size." );
+  MIDIMessageGet( list[1].message, MIDI_STATUS, sizeof(MIDIStatus), &status );
+  ASSERT_EQUAL( status, MIDI_STATUS_NOTE_ON, "Message after system exclusive was swallowed." );
+  MIDIMessageGet( list[2].message, MIDI_STATUS, sizeof(MIDIStatus), &status );
+  ASSERT_EQUAL( status, MIDI_STATUS_TIMING_CLOCK, "Last message was not decoded." );
+
+  for( i=0; i<3; i++ ) {
+    MIDIMessageRelease( list[i].message );
+  }
+  return 0;
+}
+
+/**
+ * Test that messages survive packing and unpacking, that packed
+ * system exclusive messages keep the original message alive and that
+ * stale handles do not resolve after the entry was reused.
+ */
+int test008_message( void ) {
+  unsigned char buffer[] = { MIDI_STATUS_SYSTEM_EXCLUSIVE, 0x7d, 1, 2, 3, MIDI_STATUS_END_OF_EXCLUSIVE };
+  struct MIDIPackedMessage packed, copy;
+  struct MIDIMessage * message, * unpacked, * sysex;
+  MIDIStatus status;
+  MIDIChannel channel;
+  MIDILongValue value;
+  size_t size;
+
+  ASSERT_EQUAL( sizeof(struct MIDIPackedMessage), 16, "Packed message is not 16 bytes." );
+
+  message = MIDIMessageCreate( MIDI_STATUS_PITCH_WHEEL_CHANGE );
+  ASSERT_NOT_EQUAL( message, NULL, "Could not create message." );
+  channel = MIDI_CHANNEL_3;
+  value   = 0x1234;
+  MIDIMessageSet( message, MIDI_CHANNEL, sizeof(MIDIChannel), &channel );
+  MIDIMessageSet( message, MIDI_VALUE, sizeof(MIDILongValue), &value );
+  MIDIMessageSetTimestamp( message, 12345 );
+  ASSERT_NO_ERROR( MIDIPackedMessageFromMessage( &packed, message ), "Could not pack message." );
+  ASSERT_EQUAL( packed.status, 0xe2, "Packed message has wrong status." );
+  ASSERT_EQUAL( packed.data[0], 0x34, "Packed message has wrong LSB." );
+  ASSERT_EQUAL( packed.data[1], 0x24, "Packed message has wrong MSB." );
+  ASSERT_EQUAL( packed.timestamp, 12345, "Packed message has wrong timestamp." );
+  ASSERT_EQUAL( packed.sysex, 0, "Channel message got a sysex handle." );
+  MIDIMessageRelease( message );
+
+  ASSERT_NO_ERROR( MIDIPackedMessageToMessage( &packed, &unpacked ), "Could not unpack message." );
+  MIDIMessageGetStatus( unpacked, &status );
+  MIDIMessageGet( unpacked, MIDI_CHANNEL, sizeof(MIDIChannel), &channel );
+  MIDIMessageGet( unpacked, MIDI_VALUE, sizeof(MIDILongValue), &value );
+  ASSERT_EQUAL( status, MIDI_STATUS_PITCH_WHEEL_CHANGE, "Unpacked message has wrong status." );
+  ASSERT_EQUAL( channel, MIDI_CHANNEL_3, "Unpacked message has wrong channel." );
+  ASSERT_EQUAL( value, 0x1234, "Unpacked message has wrong value." );
+  MIDIMessageRelease( unpacked );
+
+  message = MIDIMessageCreate( MIDI_STATUS_RESET );
+  ASSERT_NO_ERROR( MIDIMessageDecode( message, sizeof(buffer), buffer, NULL ), "Could not decode sysex message." );
+  ASSERT_NO_ERROR( MIDIPackedMessageFromMessage( &packed, message ), "Could not pack sysex message." );
+  ASSERT_NOT_EQUAL( packed.sysex, 0, "Sysex message got no handle." );
+  MIDIMessageRelease( message );
+
+  copy = packed;
+  MIDIPackedMessageRetain( &copy );
+  MIDIPackedMessageRelease( &packed );
+  ASSERT_NO_ERROR( MIDIPackedMessageGetSysex( &copy, &sysex ), "Sysex message was released too early." );
+  ASSERT_NO_ERROR( MIDIPackedMessageToMessage( &copy, &unpacked ), "Could not unpack sysex message." );
+  ASSERT_EQUAL( unpacked, sysex, "Unpacked sysex is not the stored message." );
+  MIDIMessageGet( unpacked, MIDI_SYSEX_SIZE, sizeof(size_t), &size );
+  ASSERT_EQUAL( size, 4, "Unpacked sysex has wrong size." );
+  MIDIPackedMessageRelease( &copy );
+  ASSERT_NOT_EQUAL( MIDIPackedMessageGetSysex( &copy, &sysex ), 0, "Sysex handle was not released." );
+
+  /* the freed entry is reused, the stale handle must not resolve to it */
+  ASSERT_NO_ERROR( MIDIPackedMessageFromMessage( &packed, unpacked ), "Could not pack sysex message again." );
+  ASSERT_NOT_EQUAL( packed.sysex, copy.sysex, "Reused handle did not change." );
+  ASSERT_NOT_EQUAL( MIDIPackedMessageGetSysex( &copy, &sysex ), 0, "Stale handle resolved to a reused entry." );
+  ASSERT_NOT_EQUAL( MIDIPackedMessageToMessage( &copy, &sysex ), 0, "Stale handle was unpacked." );
+  MIDIPackedMessageRelease( &copy );
+  ASSERT_NO_ERROR( MIDIPackedMessageGetSysex( &packed, &sysex ), "Stale release freed the reused entry." );
+  MIDIPackedMessageRelease( &packed );
+  MIDIMessageRelease( unpacked );
+  return 0;
+}
+
+#define REFS_ROUNDS  (1<<22)
+#define REFS_THREADS 4
+
+static int _shared_refs = 1;
+
+static double _seconds( struct timespec * start, struct timespec * end ) {
+  return ( end->tv_sec - start->tv_sec ) + ( end->tv_nsec - start->tv_nsec ) / 1000000000.0;
+}
+
+static void * _retain_release_plain( void * info ) {
+  volatile int refs = 1;
+  int i;
+  for( i=0; i<REFS_ROUNDS; i++ ) {
+    MIDI_REFS_RETAIN_PLAIN( refs );
+    MIDI_REFS_RELEASE_PLAIN( refs );
+  }
+  return NULL;
+}
+
+static void * _retain_release_atomic( void * info ) {
+  int * refs = info;
+  int i;
+  for( i=0; i<REFS_ROUNDS; i++ ) {
+    MIDI_REFS_RETAIN_ATOMIC( *refs );
+    MIDI_REFS_RELEASE_ATOMIC( *refs );
+  }
+  return NULL;
+}
+
+static int _benchmark_refs( const char * name, void * (*func)( void * ), void * info, int threads ) {
+  pthread_t thread[REFS_THREADS];
+  struct timespec start, end;
+  int i;
+
+  clock_gettime( CLOCK_MONOTONIC, &start );
+  for( i=0; i<threads; i++ ) {
+    ASSERT_NO_ERROR( pthread_create( &thread[i], NULL, func, info ), "Could not create thread." );
+  }
+  for( i=0; i<threads; i++ ) {
+    pthread_join( thread[i], NULL );
+  }
+  clock_gettime( CLOCK_MONOTONIC, &end );
+  printf( "refs, %s, %i thread%s: %.1f ns per retain/release\n", name, threads, ( threads > 1 ) ? "s" : "",
+          _seconds( &start, &end ) * 1000000000.0 / REFS_ROUNDS );
+  return 0;
+}
+
+/**
+ * Benchmark plain and atomic reference counts, with and without
+ * contention, and the message reference counts of this build.
+ */
+int test009_message( void ) {
+  struct MIDIMessage * message;
+  struct timespec start, end;
+  int local = 1, i;
+
+  ASSERT_NO_ERROR( _benchmark_refs( "plain", &_retain_release_plain, NULL, 1 ), "Plain benchmark failed." );
+  ASSERT_NO_ERROR( _benchmark_refs( "atomic", &_retain_release_atomic, &local, 1 ), "Atomic benchmark failed." );
+  ASSERT_NO_ERROR( _benchmark_refs( "atomic, shared", &_retain_release_atomic, &_shared_refs, REFS_THREADS ),
+                   "Contention benchmark failed." );
+  ASSERT_EQUAL( _shared_refs, 1, "Atomic reference count lost updates." );
+
+  message = MIDIMessageCreate( MIDI_STATUS_NOTE_ON );
+  clock_gettime( CLOCK_THREAD_CPUTIME_ID, &start );
+  for( i=0; i<REFS_ROUNDS; i++ ) {
+    MIDIMessageRetain( message );
+    MIDIMessageRelease( message );
+  }
+  clock_gettime( CLOCK_THREAD_CPUTIME_ID, &end );
+#ifdef MIDI_ATOMIC_REFS
+  printf( "refs, MIDIMessage (atomic build): %.1f ns per retain/release\n",
+#else
+  printf( "refs, MIDIMessage (plain build): %.1f ns per retain/release\n",
+#endif
+          _seconds( &start, &end ) * 1000000000.0 / REFS_ROUNDS );
+  MIDIMessageRelease( message );
+  return 0;
+}
@@ -1,6 +1,8 @@
 #include <stdlib.h>
+#include <time.h>
 #include "test.h"
 #include "midi/message_format.h"
+#include "midi/message_pool.h"
 
 /**
  * Test that note off works.
@@ -92,7 +94,179 @@ int test003_message_format( void ) {
   }
 
   if( message->data != NULL && message->bytes[3] == 1 )
-    free( message->data );
+    MIDIMessagePoolFreeData( message->data );
   free( message );
   return 0;
 }
+
+#define N_FORMAT_STATUS 13
+
+static void _all_formats( struct MIDIMessageFormat ** formats ) {
+  static MIDIStatus status[N_FORMAT_STATUS] = {
+    MIDI_STATUS_NOTE_ON, MIDI_STATUS_POLYPHONIC_KEY_PRESSURE, MIDI_STATUS_CONTROL_CHANGE,
+    MIDI_STATUS_PROGRAM_CHANGE, MIDI_STATUS_CHANNEL_PRESSURE, MIDI_STATUS_PITCH_WHEEL_CHANGE,
+    MIDI_STATUS_SYSTEM_EXCLUSIVE, MIDI_STATUS_TIME_CODE_QUARTER_FRAME, MIDI_STATUS_SONG_POSITION_POINTER,
+    MIDI_STATUS_SONG_SELECT, MIDI_STATUS_TUNE_REQUEST, MIDI_STATUS_TIMING_CLOCK, MIDI_STATUS_RESET
+  };
+  int i;
+  for( i=0; i<N_FORMAT_STATUS; i++ ) {
+    formats[i] = MIDIMessageFormatForStatus( status[i] );
+  }
+}
+
+/**
+ * Test that the status byte table agrees with the format tests for
+ * every possible first byte and knows the number of data bytes.
+ */
+int test004_message_format( void ) {
+  struct MIDIMessageFormat * formats[N_FORMAT_STATUS];
+  struct MIDIMessageFormat * format;
+  MIDIRunningStatus running = 0;
+  unsigned char byte;
+  size_t length;
+  int b, i;
+
+  _all_formats( &formats[0] );
+  for( i=0; i<N_FORMAT_STATUS; i++ ) {
+    ASSERT_NOT_EQUAL( formats[i], NULL, "Could not get format for status." );
+  }
+  for( b=0; b<256; b++ ) {
+    byte   = b;
+    format = MIDIMessageFormatDetect( &byte );
+    for( i=0; i<N_FORMAT_STATUS; i++ ) {
+      if( MIDIMessageFormatTest( formats[i], &byte ) ) break;
+    }
+    ASSERT_EQUAL( format, ( i < N_FORMAT_STATUS ) ? formats[i] : NULL, "Table detected wrong format." );
+    ASSERT_EQUAL( MIDIMessageFormatGetDataLength( byte, &length ) == 0,
+                  format != NULL && byte != MIDI_STATUS_SYSTEM_EXCLUSIVE, "Wrong data length result." );
+  }
+
+  byte = MIDI_NIBBLE_VALUE( MIDI_STATUS_NOTE_ON, MIDI_CHANNEL_3 );
+  ASSERT_NO_ERROR( MIDIMessageFormatGetDataLength( byte, &length ), "Could not get data length." );
+  ASSERT_EQUAL( length, 2, "Wrong data length for note on." );
+  byte = MIDI_NIBBLE_VALUE( MIDI_STATUS_PROGRAM_CHANGE, MIDI_CHANNEL_3 );
+  ASSERT_NO_ERROR( MIDIMessageFormatGetDataLength( byte, &length ), "Could not get data length." );
+  ASSERT_EQUAL( length, 1, "Wrong data length for program change." );
+  byte = MIDI_STATUS_TIMING_CLOCK;
+  ASSERT_NO_ERROR( MIDIMessageFormatGetDataLength( byte, &length ), "Could not get data length." );
+  ASSERT_EQUAL( length, 0, "Wrong data length for timing clock." );
+
+  /* data bytes use the running status, unless there is none */
+  byte = 64;
+  ASSERT_EQUAL( MIDIMessageFormatDetectRunningStatus( &byte, &running ), NULL, "Detected format without status." );
+  running = MIDI_NIBBLE_VALUE( MIDI_STATUS_CONTROL_CHANGE, MIDI_CHANNEL_1 );
+  ASSERT_EQUAL( MIDIMessageFormatDetectRunningStatus( &byte, &running ), formats[2], "Running status was not used." );
+  return 0;
+}
+
+#define BENCHMARK_BYTES  (1<<20)
+#define BENCHMARK_ROUNDS 8
+
+/**
+ * Fill a buffer with a realistic mix of channel voice messages using
+ * running status, controller sweeps, pitch bends and timing clocks.
+ */
+static size_t _mixed_traffic( unsigned char * buffer, size_t size ) {
+  unsigned char status = 0, next;
+  size_t n = 0;
+  int r;
+
+  srand( 19 );
+  while( n + 4 <= size ) {
+    r = rand() % 100;
+    if( r < 10 ) {
+      buffer[n++] = MIDI_STATUS_TIMING_CLOCK;
+      continue;
+    } else if( r < 50 ) {
+      next = MIDI_NIBBLE_VALUE( ( r < 30 ) ? MIDI_STATUS_NOTE_ON : MIDI_STATUS_NOTE_OFF, r % 4 );
+    } else if( r < 75 ) {
+      next = MIDI_NIBBLE_VALUE( MIDI_STATUS_CONTROL_CHANGE, r % 4 );
+    } else if( r < 85 ) {
+      next = MIDI_NIBBLE_VALUE( MIDI_STATUS_PITCH_WHEEL_CHANGE, r % 4 );
+    } else if( r < 93 ) {
+      next = MIDI_NIBBLE_VALUE( MIDI_STATUS_CHANNEL_PRESSURE, r % 4 );
+    } else {
+      next = MIDI_NIBBLE_VALUE( MIDI_STATUS_PROGRAM_CHANGE, r % 4 );
+    }
+    if( next != status ) buffer[n++] = next;
+    status = next;
+    buffer[n++] = rand() % 128;
+    if( ( status & 0xe0 ) != 0xc0 ) buffer[n++] = rand() % 128;
+  }
+  return n;
+}
+
+/**
+ * Detect formats the way it was done before the status byte table:
+ * test every format in turn.
+ */
+static struct MIDIMessageFormat * _detect_linear( struct MIDIMessageFormat ** formats, unsigned char * buffer,
+                                                  MIDIRunningStatus * status ) {
+  int i;
+  if( ( buffer[0] & 0x80 ) == 0 ) {
+    if( *status == 0 ) return NULL;
+    buffer = status;
+  }
+  for( i=0; i<N_FORMAT_STATUS; i++ ) {
+    if( MIDIMessageFormatTest( formats[i], buffer ) ) return formats[i];
+  }
+  return NULL;
+}
+
+static int _decode_traffic( struct MIDIMessageFormat ** formats, unsigned char * buffer, size_t size,
+                            unsigned long * messages, double * seconds ) {
+  struct MIDIMessageData data;
+  struct MIDIMessageFormat * format;
+  MIDIRunningStatus status = 0;
+  struct timespec start, end;
+  size_t n, read;
+  int round;
+
+  *messages = 0;
+  clock_gettime( CLOCK_THREAD_CPUTIME_ID, &start );
+  for( round=0; round<BENCHMARK_ROUNDS; round++ ) {
+    for( n=0; n<size; n+=read ) {
+      if( formats != NULL ) {
+        format = _detect_linear( formats, buffer+n, &status );
+      } else {
+        format = MIDIMessageFormatDetectRunningStatus( buffer+n, &status );
+      }
+      if( format == NULL ) return 1;
+      read = 0;
+      if( MIDIMessageFormatDecodeRunningStatus( format, &data, &status, size-n, buffer+n, &read ) ) return 1;
+      (*messages)++;
+    }
+  }
+  clock_gettime( CLOCK_THREAD_CPUTIME_ID, &end );
+  *seconds = ( end.tv_sec - start.tv_sec ) + ( end.tv_nsec - start.tv_nsec ) / 1000000000.0;
+  return 0;
+}
+
+/**
+ * Benchmark decoding mixed traffic with the status byte table against
+ * the previous linear format detection and report messages per second.
+ */
+int test005_message_format( void ) {
+  struct MIDIMessageFormat * formats[N_FORMAT_STATUS];
+  unsigned char * buffer = malloc( BENCHMARK_BYTES );
+  unsigned long linear_messages, table_messages;
+  double linear_seconds, table_seconds;
+  size_t size;
+
+  ASSERT_NOT_EQUAL( buffer, NULL, "Could not allocate traffic buffer." );
+  _all_formats( &formats[0] );
+  size = _mixed_traffic( buffer, BENCHMARK_BYTES );
+
+  ASSERT_NO_ERROR( _decode_traffic( &formats[0], buffer, size, &linear_messages, &linear_seconds ),
+                   "Could not decode traffic with linear detection." );
+  ASSERT_NO_ERROR( _decode_traffic( NULL, buffer, size, &table_messages, &table_seconds ),
+                   "Could not decode traffic with table detection." );
+  ASSERT_EQUAL( linear_messages, table_messages, "Detection methods decoded different messages." );
+
+  printf( "message format detection: linear %.0f messages/s, table %.0f messages/s\n",
+          linear_seconds > 0 ? linear_messages / linear_seconds : 0.0,
+          table_seconds > 0 ? table_messages / table_seconds : 0.0 );
+
+  free( buffer );
+  return 0;
+}
@@ -0,0 +1,198 @@
+#include <pthread.h>
+#include "test.h"
+#include "midi/message.h"
+#include "midi/message_pool.h"
+
+/**
+ * Test that messages are taken from the default pool and that
+ * released messages are reused.
+ */
+int test001_message_pool( void ) {
+  struct MIDIMessagePool * pool = MIDIMessagePoolCreate( 4, 0 );
+  struct MIDIMessagePoolStats stats;
+  struct MIDIMessage * message[8];
+  struct MIDIMessage * reused;
+  int i;
+
+  ASSERT_NOT_EQUAL( pool, NULL, "Could not create message pool." );
+  ASSERT_NO_ERROR( MIDIMessagePoolSetDefault( pool ), "Could not set default message pool." );
+  ASSERT_EQUAL( MIDIMessagePoolGetDefault(), pool, "Default message pool was not set." );
+
+  for( i=0; i<8; i++ ) {
+    message[i] = MIDIMessageCreate( MIDI_STATUS_NOTE_ON );
+    ASSERT_NOT_EQUAL( message[i], NULL, "Could not create pooled message." );
+  }
+  ASSERT_NO_ERROR( MIDIMessagePoolGetStats( pool, &stats ), "Could not get pool statistics." );
+  ASSERT_EQUAL( stats.message_hits, 7, "Pool reported wrong number of hits." );
+  ASSERT_EQUAL( stats.message_misses, 1, "Pool reported wrong number of misses." );
+  ASSERT_EQUAL( stats.message_used, 8, "Pool reported wrong number of used messages." );
+  ASSERT_EQUAL( stats.message_high_water, 8, "Pool reported wrong high-water mark." );
+
+  MIDIMessageRelease( message[7] );
+  reused = MIDIMessageCreate( MIDI_STATUS_NOTE_OFF );
+  ASSERT_EQUAL( reused, message[7], "Pool did not reuse released message." );
+  message[7] = reused;
+
+  for( i=0; i<8; i++ ) {
+    MIDIMessageRelease( message[i] );
+  }
+  ASSERT_NO_ERROR( MIDIMessagePoolGetStats( pool, &stats ), "Could not get pool statistics." );
+  ASSERT_EQUAL( stats.message_used, 0, "Pool leaked messages." );
+  ASSERT_EQUAL( stats.message_high_water, 8, "Pool reported wrong high-water mark." );
+
+  MIDIMessagePoolSetDefault( NULL );
+  MIDIMessagePoolRelease( pool );
+  return 0;
+}
+
+/**
+ * Test that decoded system exclusive data is stored in pooled buffers
+ * and returned to the pool when the message is released.
+ */
+int test002_message_pool( void ) {
+  struct MIDIMessagePool * pool = MIDIMessagePoolCreate( 4, 4 );
+  struct MIDIMessagePoolStats stats;
+  struct MIDIMessage * message;
+  unsigned char buffer[16] = { MIDI_STATUS_SYSTEM_EXCLUSIVE, 123, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14 };
+  unsigned char * data;
+  size_t size;
+  int i;
+
+  ASSERT_NOT_EQUAL( pool, NULL, "Could not create message pool." );
+  MIDIMessagePoolSetDefault( pool );
+
+  message = MIDIMessageCreate( MIDI_STATUS_SYSTEM_EXCLUSIVE );
+  ASSERT_NOT_EQUAL( message, NULL, "Could not create pooled message." );
+  ASSERT_NO_ERROR( MIDIMessageDecode( message, sizeof(buffer), &buffer[0], NULL ), "Could not decode system exclusive message." );
+  ASSERT_NO_ERROR( MIDIMessageGet( message, MIDI_SYSEX_DATA, sizeof(void*), &data ), "Could not get system exclusive data." );
+  ASSERT_NO_ERROR( MIDIMessageGet( message, MIDI_SYSEX_SIZE, sizeof(size_t), &size ), "Could not get system exclusive size." );
+  ASSERT_EQUAL( size, 14, "System exclusive message was truncated." );
+  for( i=0; i<size; i++ ) {
+    ASSERT_EQUAL( data[i], buffer[i+2], "Stored wrong system exclusive data." );
+  }
+
+  ASSERT_NO_ERROR( MIDIMessagePoolGetStats( pool, &stats ), "Could not get pool statistics." );
+  ASSERT_EQUAL( stats.data_hits, 1, "Pool did not serve system exclusive data." );
+  ASSERT_EQUAL( stats.data_used, 1, "Pool reported wrong number of used buffers." );
+
+  MIDIMessageRelease( message );
+  ASSERT_NO_ERROR( MIDIMessagePoolGetStats( pool, &stats ), "Could not get pool statistics." );
+  ASSERT_EQUAL( stats.data_used, 0, "System exclusive data was not returned to the pool." );
+  ASSERT_EQUAL( stats.message_used, 0, "Message was not returned to the pool." );
+
+  data = MIDIMessagePoolAllocData( pool, 4096 );
+  ASSERT_NOT_EQUAL( data, NULL, "Could not allocate oversized buffer." );
+  MIDIMessagePoolFreeData( data );
+  ASSERT_NO_ERROR( MIDIMessagePoolGetStats( pool, &stats ), "Could not get pool statistics." );
+  ASSERT_EQUAL( stats.data_misses, 1, "Oversized buffer was not counted as miss." );
+
+  MIDIMessagePoolSetDefault( NULL );
+  MIDIMessagePoolRelease( pool );
+  return 0;
+}
+
+/**
+ * Test that a system exclusive buffer keeps its pool alive after the
+ * pool was replaced as the default pool.
+ */
+int test003_message_pool( void ) {
+  struct MIDIMessagePool * pool = MIDIMessagePoolCreate( 4, 4 );
+  struct MIDIMessagePoolStats stats;
+  struct MIDIMessage * message;
+  unsigned char buffer[8] = { MIDI_STATUS_SYSTEM_EXCLUSIVE, 123, 1, 2, 3, 4, 5, MIDI_STATUS_END_OF_EXCLUSIVE };
+  unsigned char * data;
+  size_t size;
+
+  ASSERT_NOT_EQUAL( pool, NULL, "Could not create message pool." );
+  MIDIMessagePoolSetDefault( pool );
+  MIDIMessagePoolRelease( pool );
+
+  /* the message is allocated with malloc, its buffer comes from the pool */
+  MIDIMessagePoolSetDefault( NULL );
+  message = MIDIMessageCreate( MIDI_STATUS_SYSTEM_EXCLUSIVE );
+  ASSERT_NOT_EQUAL( message, NULL, "Could not create message." );
+  data = MIDIMessagePoolAllocData( NULL, 4 );
+  ASSERT_NOT_EQUAL( data, NULL, "Could not allocate buffer without pool." );
+  MIDIMessagePoolFreeData( data );
+
+  pool = MIDIMessagePoolCreate( 4, 4 );
+  ASSERT_NOT_EQUAL( pool, NULL, "Could not create message pool." );
+  MIDIMessagePoolSetDefault( pool );
+  ASSERT_NO_ERROR( MIDIMessageDecode( message, sizeof(buffer), &buffer[0], NULL ), "Could not decode system exclusive message." );
+  ASSERT_NO_ERROR( MIDIMessagePoolGetStats( pool, &stats ), "Could not get pool statistics." );
+  ASSERT_EQUAL( stats.data_used, 1, "Pool did not serve system exclusive data." );
+
+  /* drop every reference to the pool except the one held by the buffer */
+  MIDIMessagePoolSetDefault( NULL );
+  MIDIMessagePoolRelease( pool );
+  ASSERT_NO_ERROR( MIDIMessageGet( message, MIDI_SYSEX_DATA, sizeof(void*), &data ), "Could not get system exclusive data." );
+  ASSERT_NO_ERROR( MIDIMessageGet( message, MIDI_SYSEX_SIZE, sizeof(size_t), &size ), "Could not get system exclusive size." );
+  ASSERT_EQUAL( size, 6, "System exclusive message was truncated." );
+  ASSERT_EQUAL( data[0], 1, "Stored wrong system exclusive data." );
+  MIDIMessageRelease( message );
+  return 0;
+}
+
+struct pool_thread_info {
+  struct MIDIMessagePool * pool;
+  struct MIDIMessage * messages[4];
+  struct MIDIMessagePool * seen;
+  int result;
+};
+
+static void * _pool_thread( void * info ) {
+  struct pool_thread_info * t = info;
+  int i;
+  t->seen   = MIDIMessagePoolGetDefault();
+  t->result = MIDIMessagePoolSetDefault( t->pool );
+  for( i=0; i<4; i++ ) {
+    MIDIMessageRelease( t->messages[i] );
+  }
+  return NULL;
+}
+
+/**
+ * Test that every thread has its own default pool, that a pool cannot be
+ * the default pool of two threads and that messages released on another
+ * thread are handed back to the owning thread.
+ */
+int test004_message_pool( void ) {
+  struct MIDIMessagePool * pool = MIDIMessagePoolCreate( 4, 0 );
+  struct MIDIMessagePoolStats stats;
+  struct pool_thread_info info;
+  struct MIDIMessage * message, * created[4];
+  pthread_t thread;
+  int i, reused = 0;
+
+  ASSERT_NOT_EQUAL( pool, NULL, "Could not create message pool." );
+  ASSERT_NO_ERROR( MIDIMessagePoolSetDefault( pool ), "Could not set default message pool." );
+  info.pool = pool;
+  for( i=0; i<4; i++ ) {
+    info.messages[i] = MIDIMessageCreate( MIDI_STATUS_NOTE_ON );
+    ASSERT_NOT_EQUAL( info.messages[i], NULL, "Could not create pooled message." );
+  }
+
+  ASSERT_NO_ERROR( pthread_create( &thread, NULL, &_pool_thread, &info ), "Could not create thread." );
+  pthread_join( thread, NULL );
+  MIDIErrorNumber = 0;
+  ASSERT_EQUAL( info.seen, NULL, "Default pool was shared with another thread." );
+  ASSERT_EQUAL( info.result, EBUSY, "Pool became the default pool of two threads." );
+
+  ASSERT_NO_ERROR( MIDIMessagePoolGetStats( pool, &stats ), "Could not get pool statistics." );
+  ASSERT_EQUAL( stats.message_used, 0, "Messages released on another thread were not returned." );
+  for( i=0; i<4; i++ ) {
+    message = MIDIMessageCreate( MIDI_STATUS_NOTE_ON );
+    ASSERT_NOT_EQUAL( message, NULL, "Could not create pooled message." );
+    if( message == info.messages[0] || message == info.messages[1] ||
+        message == info.messages[2] || message == info.messages[3] ) reused++;
+    created[i] = message;
+  }
+  for( i=0; i<4; i++ ) {
+    MIDIMessageRelease( created[i] );
+  }
+  ASSERT_EQUAL( reused, 4, "Messages released on another thread were not reused." );
+
+  MIDIMessagePoolSetDefault( NULL );
+  MIDIMessagePoolRelease( pool );
+  return 0;
+}
@@ -1,3 +1,8 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
 #include "test.h"
 #include "midi/message.h"
 #include "midi/message_queue.h"
@@ -62,3 +67,228 @@ int test001_message_queue( void ) {
   MIDIMessageQueueRelease( queue );
   return 0;
 }
+
+/**
+ * Test that a ring queue keeps the message order across wrap-around
+ * and reports overflow without losing messages.
+ */
+int test002_message_queue( void ) {
+  struct MIDIMessageQueue * queue = MIDIMessageQueueCreateRing( 3 );
+  struct MIDIMessage * message[5];
+  struct MIDIMessage * m;
+  size_t length, capacity;
+  int i, j;
+
+  ASSERT_NOT_EQUAL( queue, NULL, "Could not create ring queue." );
+  ASSERT_NO_ERROR( MIDIMessageQueueGetCapacity( queue, &capacity ), "Could not get queue capacity." );
+  ASSERT_EQUAL( capacity, 4, "Capacity was not rounded up to a power of two." );
+
+  for( i=0; i<5; i++ ) {
+    message[i] = MIDIMessageCreate( MIDI_STATUS_NOTE_ON );
+    ASSERT_NOT_EQUAL( message[i], NULL, "Could not create message." );
+  }
+
+  for( j=0; j<3; j++ ) {
+    for( i=0; i<4; i++ ) {
+      ASSERT_NO_ERROR( MIDIMessageQueueTryPush( queue, message[i] ), "Could not enqueue message." );
+    }
+    ASSERT_EQUAL( MIDIMessageQueueTryPush( queue, message[4] ), 1, "Full queue accepted message." );
+    ASSERT_NO_ERROR( MIDIMessageQueueGetLength( queue, &length ), "Could not determine queue length." );
+    ASSERT_EQUAL( length, 4, "Message queue returned wrong length." );
+
+    ASSERT_NO_ERROR( MIDIMessageQueuePeek( queue, &m ), "Could not peek into queue." );
+    ASSERT_EQUAL( m, message[0], "Queue returned wrong message." );
+    for( i=0; i<4; i++ ) {
+      ASSERT_NO_ERROR( MIDIMessageQueuePop( queue, &m ), "Could not pop message." );
+      ASSERT_EQUAL( m, message[i], "Queue returned wrong message." );
+      MIDIMessageRelease( m );
+    }
+    ASSERT_NO_ERROR( MIDIMessageQueuePop( queue, &m ), "Could not pop from empty queue." );
+    ASSERT_EQUAL( m, NULL, "Empty queue returned a message." );
+  }
+
+  MIDIMessageQueuePush( queue, message[4] );
+  MIDIMessageQueueRelease( queue );
+  for( i=0; i<5; i++ ) {
+    MIDIMessageRelease( message[i] );
+  }
+  return 0;
+}
+
+#define RING_TRANSFER_COUNT 100000
+
+struct ring_transfer {
+  struct MIDIMessageQueue * queue;
+  struct MIDIMessage ** message;
+};
+
+static void * _ring_producer( void * info ) {
+  struct ring_transfer * transfer = info;
+  int i;
+  for( i=0; i<RING_TRANSFER_COUNT; i++ ) {
+    while( MIDIMessageQueueTryPushTransfer( transfer->queue, transfer->message[i] ) ) {
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Test that messages can be passed from one thread to another
+ * through a ring queue without losing or reordering them.
+ * Every push hands a fresh message to the consumer, which releases it.
+ */
+int test003_message_queue( void ) {
+  struct ring_transfer transfer;
+  struct MIDIMessage * m;
+  pthread_t producer;
+  int i;
+
+  transfer.queue = MIDIMessageQueueCreateRing( 64 );
+  ASSERT_NOT_EQUAL( transfer.queue, NULL, "Could not create ring queue." );
+  transfer.message = malloc( RING_TRANSFER_COUNT * sizeof(struct MIDIMessage *) );
+  ASSERT_NOT_EQUAL( transfer.message, NULL, "Could not allocate messages." );
+  for( i=0; i<RING_TRANSFER_COUNT; i++ ) {
+    transfer.message[i] = MIDIMessageCreate( MIDI_STATUS_NOTE_ON );
+  }
+  ASSERT_NO_ERROR( pthread_create( &producer, NULL, &_ring_producer, &transfer ), "Could not start producer thread." );
+
+  for( i=0; i<RING_TRANSFER_COUNT; i++ ) {
+    do {
+      MIDIMessageQueuePop( transfer.queue, &m );
+    } while( m == NULL );
+    ASSERT_EQUAL( m, transfer.message[i], "Queue returned wrong message." );
+    MIDIMessageRelease( m );
+  }
+  pthread_join( producer, NULL );
+
+  MIDIMessageQueueRelease( transfer.queue );
+  free( transfer.message );
+  return 0;
+}
+
+/**
+ * Test that a fan-in queue hands out messages in timestamp order
+ * and keeps the push order for equal timestamps.
+ */
+int test004_message_queue( void ) {
+  struct MIDIMessageQueue * queue = MIDIMessageQueueCreateFanIn( 8 );
+  MIDITimestamp timestamps[6] = { 40, 10, 30, 10, 20, 50 };
+  int expected[6] = { 1, 3, 4, 2, 0, 5 };
+  struct MIDIMessage * message[6];
+  struct MIDIMessage * m;
+  size_t length;
+  int i;
+
+  ASSERT_NOT_EQUAL( queue, NULL, "Could not create fan-in queue." );
+  for( i=0; i<6; i++ ) {
+    message[i] = MIDIMessageCreate( MIDI_STATUS_NOTE_ON );
+    MIDIMessageSetTimestamp( message[i], timestamps[i] );
+    ASSERT_NO_ERROR( MIDIMessageQueuePush( queue, message[i] ), "Could not enqueue message." );
+  }
+  ASSERT_NO_ERROR( MIDIMessageQueueGetLength( queue, &length ), "Could not determine queue length." );
+  ASSERT_EQUAL( length, 6, "Message queue returned wrong length." );
+
+  ASSERT_NO_ERROR( MIDIMessageQueuePeek( queue, &m ), "Could not peek into queue." );
+  ASSERT_EQUAL( m, message[1], "Queue returned wrong message." );
+  for( i=0; i<6; i++ ) {
+    ASSERT_NO_ERROR( MIDIMessageQueuePop( queue, &m ), "Could not pop message." );
+    ASSERT_EQUAL( m, message[expected[i]], "Queue returned messages out of order." );
+    MIDIMessageRelease( m );
+  }
+  ASSERT_NO_ERROR( MIDIMessageQueueGetLength( queue, &length ), "Could not determine queue length." );
+  ASSERT_EQUAL( length, 0, "Message queue returned wrong length." );
+
+  MIDIMessageQueueRelease( queue );
+  for( i=0; i<6; i++ ) {
+    MIDIMessageRelease( message[i] );
+  }
+  return 0;
+}
+
+#define FANIN_MESSAGES 20000
+#define FANIN_MAX_PRODUCERS 8
+
+struct fanin_producer {
+  struct MIDIMessageQueue * queue;
+  struct MIDIMessage ** message;
+};
+
+static void * _fanin_producer( void * info ) {
+  struct fanin_producer * producer = info;
+  int i;
+  for( i=0; i<FANIN_MESSAGES; i++ ) {
+    while( MIDIMessageQueueTryPushTransfer( producer->queue, producer->message[i] ) ) {
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+static double _fanin_seconds( void ) {
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/**
+ * Benchmark the fan-in queue with 1, 2, 4 and 8 producer threads.
+ * Check that no message gets lost and that the messages of each producer
+ * keep their relative order.
+ */
+int test005_message_queue( void ) {
+  struct fanin_producer producer[FANIN_MAX_PRODUCERS];
+  pthread_t thread[FANIN_MAX_PRODUCERS];
+  MIDITimestamp last[FANIN_MAX_PRODUCERS], timestamp;
+  struct MIDIMessage * m;
+  MIDIChannel channel;
+  int n, p, i, received;
+  double start, elapsed;
+
+  for( n=1; n<=FANIN_MAX_PRODUCERS; n*=2 ) {
+    for( p=0; p<n; p++ ) {
+      producer[p].queue   = MIDIMessageQueueCreateFanIn( 1024 );
+      producer[p].message = malloc( FANIN_MESSAGES * sizeof(struct MIDIMessage *) );
+      ASSERT_NOT_EQUAL( producer[p].message, NULL, "Could not allocate messages." );
+      for( i=0; i<FANIN_MESSAGES; i++ ) {
+        channel = p;
+        producer[p].message[i] = MIDIMessageCreate( MIDI_STATUS_NOTE_ON );
+        MIDIMessageSet( producer[p].message[i], MIDI_CHANNEL, sizeof(MIDIChannel), &channel );
+        MIDIMessageSetTimestamp( producer[p].message[i], i );
+      }
+      last[p] = -1;
+    }
+    for( p=1; p<n; p++ ) {
+      MIDIMessageQueueRelease( producer[p].queue );
+      producer[p].queue = producer[0].queue;
+      MIDIMessageQueueRetain( producer[0].queue );
+    }
+
+    start = _fanin_seconds();
+    for( p=0; p<n; p++ ) {
+      ASSERT_NO_ERROR( pthread_create( &thread[p], NULL, &_fanin_producer, &producer[p] ), "Could not start producer thread." );
+    }
+    for( received=0; received<n*FANIN_MESSAGES; received++ ) {
+      do {
+        MIDIMessageQueuePop( producer[0].queue, &m );
+      } while( m == NULL );
+      MIDIMessageGet( m, MIDI_CHANNEL, sizeof(MIDIChannel), &channel );
+      MIDIMessageGetTimestamp( m, &timestamp );
+      ASSERT_LESS( channel, n, "Received message from unknown producer." );
+      ASSERT_GREATER( timestamp, last[(int)channel], "Messages of one producer were reordered." );
+      last[(int)channel] = timestamp;
+      MIDIMessageRelease( m );
+    }
+    elapsed = _fanin_seconds() - start;
+    for( p=0; p<n; p++ ) {
+      pthread_join( thread[p], NULL );
+    }
+    printf( "  %i producer(s): %.0f messages/s\n", n, ( n * FANIN_MESSAGES ) / ( elapsed > 0 ? elapsed : 1e-6 ) );
+
+    for( p=0; p<n; p++ ) {
+      free( producer[p].message );
+      MIDIMessageQueueRelease( producer[p].queue );
+    }
+  }
+  return 0;
+}
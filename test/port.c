@@ -1,5 +1,6 @@
 #include "test.h"
 #include "midi/port.h"
+#include "midi/message.h"
 
 struct TestPort {
   int value;
@@ -51,3 +52,91 @@ int test001_port( void ) {
 /**
  * Test something else ..
  */
+
+static int _intercepted = 0;
+
+static int _intercept( void * observer, struct MIDIPort * port, int mode, struct MIDITypeSpec * type, void * object ) {
+  _intercepted++;
+  return 0;
+}
+
+static int _receive_sum( void * target, void * source, struct MIDITypeSpec * type, void * data ) {
+  if( type == TestPortType ) {
+    *(int*)target += *(int*)data;
+  }
+  return 0;
+}
+
+static int _receive_batch( void * target, void * source, struct MIDITypeSpec * type, void * data ) {
+  if( type == MIDIPortBatchType ) {
+    *(int*)target += ((struct MIDIPortBatch *)data)->count;
+  }
+  return 0;
+}
+
+/**
+ * Test that batches are intercepted once and passed as a whole only to
+ * ports that handle batches.
+ */
+int test002_port( void ) {
+  int a = 0, b = 0, v[3] = { 1, 2, 3 };
+  void * objects[3] = { &v[0], &v[1], &v[2] };
+  struct MIDIPort * port   = MIDIPortCreate( "port", MIDI_PORT_OUT, NULL, NULL );
+  struct MIDIPort * port_a = MIDIPortCreate( "port a", MIDI_PORT_IN, &a, &_receive_sum );
+  struct MIDIPort * port_b = MIDIPortCreate( "port b", MIDI_PORT_IN | MIDI_PORT_BATCH, &b, &_receive_batch );
+
+  ASSERT_NO_ERROR( MIDIPortConnect( port, port_a ), "Could not connect MIDI ports!" );
+  ASSERT_NO_ERROR( MIDIPortConnect( port, port_b ), "Could not connect MIDI ports!" );
+  ASSERT_NO_ERROR( MIDIPortSetObserver( port, &a, &_intercept ), "Could not set observer." );
+  ASSERT_NO_ERROR( MIDIPortSendBatch( port, TestPortType, 3, &objects[0] ), "Could not send batch." );
+  ASSERT_EQUAL( _intercepted, 1, "Batch was not intercepted exactly once." );
+  ASSERT_EQUAL( a, 6, "Port without batch support did not receive every object." );
+  ASSERT_EQUAL( b, 3, "Port with batch support did not receive the batch." );
+
+  MIDIPortInvalidate( port );
+  MIDIPortRelease( port );
+  MIDIPortRelease( port_a );
+  MIDIPortRelease( port_b );
+  return 0;
+}
+
+static int _receive_message( void * target, void * source, struct MIDITypeSpec * type, void * data ) {
+  MIDIStatus status;
+  if( type == MIDIMessageType ) {
+    MIDIMessageGetStatus( data, &status );
+    if( status == MIDI_STATUS_NOTE_ON ) (*(int*)target)++;
+  }
+  return 0;
+}
+
+/**
+ * Test that ports without batch support receive arrays of packed
+ * messages as single messages.
+ */
+int test003_port( void ) {
+  int a = 0, i;
+  struct MIDIPackedMessage packed[3];
+  struct MIDIPackedMessageArray array;
+  struct MIDIPort * port   = MIDIPortCreate( "port", MIDI_PORT_OUT, NULL, NULL );
+  struct MIDIPort * port_a = MIDIPortCreate( "port a", MIDI_PORT_IN, &a, &_receive_message );
+
+  for( i=0; i<3; i++ ) {
+    packed[i].timestamp = i;
+    packed[i].status    = MIDI_NIBBLE_VALUE( MIDI_STATUS_NOTE_ON, i );
+    packed[i].data[0]   = 60;
+    packed[i].data[1]   = 100;
+    packed[i].reserved  = 0;
+    packed[i].sysex     = 0;
+  }
+  array.count    = 3;
+  array.messages = &packed[0];
+
+  ASSERT_NO_ERROR( MIDIPortConnect( port, port_a ), "Could not connect MIDI ports!" );
+  ASSERT_NO_ERROR( MIDIPortSend( port, MIDIPackedMessageArrayType, &array ), "Could not send packed messages." );
+  ASSERT_EQUAL( a, 3, "Port without batch support did not receive every packed message." );
+
+  MIDIPortInvalidate( port );
+  MIDIPortRelease( port );
+  MIDIPortRelease( port_a );
+  return 0;
+}
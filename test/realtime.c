@@ -0,0 +1,243 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "test.h"
+#include "midi/realtime.h"
+#include "midi/message.h"
+#include "midi/message_pool.h"
+#include "midi/device.h"
+#include "midi/driver.h"
+
+/*
+ * Interpose the allocator so that the tests can see every allocation,
+ * including the ones that MIDIRealTimeCheck does not know about.
+ * Only allocations on the thread that sets _counting are counted.
+ */
+#ifdef __GLIBC__
+extern void * __libc_malloc( size_t size );
+extern void * __libc_calloc( size_t count, size_t size );
+extern void * __libc_realloc( void * ptr, size_t size );
+extern void __libc_free( void * ptr );
+
+static __thread int _counting = 0;
+static __thread unsigned long _allocations = 0;
+
+void * malloc( size_t size ) {
+  if( _counting ) _allocations++;
+  return __libc_malloc( size );
+}
+
+void * calloc( size_t count, size_t size ) {
+  if( _counting ) _allocations++;
+  return __libc_calloc( count, size );
+}
+
+void * realloc( void * ptr, size_t size ) {
+  if( _counting ) _allocations++;
+  return __libc_realloc( ptr, size );
+}
+
+void free( void * ptr ) {
+  __libc_free( ptr );
+}
+#else
+static int _counting = 0;
+static unsigned long _allocations = 0;
+#endif
+
+static int _logged = 0;
+
+static int _count_log( int channels, const char * fmt, ... ) {
+  _logged++;
+  return 0;
+}
+
+/**
+ * Test that real-time mode nests, drops log messages and counts
+ * allocations.
+ */
+int test001_realtime( void ) {
+  struct MIDIMessagePool * previous = MIDIMessagePoolGetDefault();
+  MIDILogFunction logger = MIDILogger;
+  struct MIDIRealTimeStats stats;
+  struct MIDIMessage * message;
+
+  ASSERT_EQUAL( MIDIRealTimeIsActive(), 0, "Thread started in real-time mode." );
+  ASSERT_NO_ERROR( MIDIRealTimeEnter(), "Could not enter real-time mode." );
+  ASSERT_NO_ERROR( MIDIRealTimeEnter(), "Could not enter real-time mode twice." );
+  ASSERT_NO_ERROR( MIDIRealTimeLeave(), "Could not leave inner real-time mode." );
+  ASSERT_EQUAL( MIDIRealTimeIsActive(), 1, "Inner leave ended real-time mode." );
+  ASSERT_NO_ERROR( MIDIRealTimeResetStats(), "Could not reset statistics." );
+
+  MIDILogger = &_count_log;
+  MIDILog( ERROR, "dropped\n" );
+  MIDILogger = logger;
+  ASSERT_EQUAL( _logged, 0, "Log message was written in real-time mode." );
+
+  /* without a pool, messages come from malloc */
+  if( previous != NULL ) MIDIMessagePoolRetain( previous );
+  MIDIMessagePoolSetDefault( NULL );
+  _allocations = 0;
+  _counting = 1;
+  message = MIDIMessageCreate( MIDI_STATUS_NOTE_ON );
+  _counting = 0;
+  ASSERT_NOT_EQUAL( message, NULL, "Could not create message." );
+  MIDIMessageRelease( message );
+  MIDIMessagePoolSetDefault( previous );
+  if( previous != NULL ) MIDIMessagePoolRelease( previous );
+
+  ASSERT_NO_ERROR( MIDIRealTimeLeave(), "Could not leave real-time mode." );
+  ASSERT_EQUAL( MIDIRealTimeIsActive(), 0, "Thread stayed in real-time mode." );
+  ASSERT_NO_ERROR( MIDIRealTimeGetStats( &stats ), "Could not get statistics." );
+  ASSERT_EQUAL( stats.logs, 1, "Dropped log message was not counted." );
+  ASSERT_EQUAL( stats.allocations, 1, "Allocation was not counted." );
+#ifdef __GLIBC__
+  ASSERT_EQUAL( _allocations, 1, "Interposed malloc did not see the allocation." );
+#endif
+
+  /* nothing is counted outside of real-time mode */
+  message = MIDIMessageCreate( MIDI_STATUS_NOTE_ON );
+  MIDIMessageRelease( message );
+  ASSERT_NO_ERROR( MIDIRealTimeGetStats( &stats ), "Could not get statistics." );
+  ASSERT_EQUAL( stats.allocations, 1, "Allocation outside of real-time mode was counted." );
+  MIDIRealTimeResetStats();
+  return 0;
+}
+
+#define STREAM_ROUNDS 256
+#define STREAM_BATCH  16
+
+static int _received = 0;
+
+static int _receive_non( struct MIDIDevice * device, MIDIChannel channel, MIDIKey key, MIDIVelocity velocity ) {
+  _received++;
+  return 0;
+}
+
+static int _receive_cc( struct MIDIDevice * device, MIDIChannel channel, MIDIControl control, MIDIValue value ) {
+  _received++;
+  return 0;
+}
+
+static struct MIDIDeviceDelegate _realtime_delegate = {
+  NULL, &_receive_non, NULL, &_receive_cc, NULL, NULL, NULL, NULL,
+  NULL, NULL, NULL, NULL, NULL, NULL
+};
+
+static int _stream( struct MIDIDriver * driver, struct MIDIDevice * device, int round ) {
+  struct MIDIPackedMessage packed[STREAM_BATCH];
+  struct MIDIMessage * batch[STREAM_BATCH];
+  struct MIDIMessage * message;
+  MIDIChannel channel = round % 16;
+  MIDIKey key = round % 128;
+  int i;
+
+  message = MIDIMessageCreate( MIDI_STATUS_NOTE_ON );
+  if( message == NULL ) return 1;
+  MIDIMessageSet( message, MIDI_CHANNEL, sizeof(MIDIChannel), &channel );
+  MIDIMessageSet( message, MIDI_KEY, sizeof(MIDIKey), &key );
+  if( MIDIDriverReceive( driver, message ) ) return 1;
+  if( MIDIDeviceReceive( device, message ) ) return 1;
+  MIDIMessageRelease( message );
+
+  for( i=0; i<STREAM_BATCH; i++ ) {
+    batch[i] = MIDIMessageCreate( MIDI_STATUS_CONTROL_CHANGE );
+    if( batch[i] == NULL ) return 1;
+  }
+  if( MIDIDriverReceiveBatch( driver, STREAM_BATCH, &batch[0] ) ) return 1;
+  for( i=0; i<STREAM_BATCH; i++ ) {
+    MIDIMessageRelease( batch[i] );
+  }
+
+  for( i=0; i<STREAM_BATCH; i++ ) {
+    packed[i].timestamp = 0;
+    packed[i].status    = MIDI_NIBBLE_VALUE( MIDI_STATUS_NOTE_ON, channel );
+    packed[i].data[0]   = i;
+    packed[i].data[1]   = 100;
+    packed[i].reserved  = 0;
+    packed[i].sysex     = 0;
+  }
+  return MIDIDriverReceivePacked( driver, STREAM_BATCH, &packed[0] );
+}
+
+/**
+ * Test that a steady-state stream is delivered from the driver to the
+ * device delegate without allocations once the arenas are set up.
+ */
+int test002_realtime( void ) {
+  struct MIDIMessagePool * previous = MIDIMessagePoolGetDefault();
+  struct MIDIRealTimeStats stats;
+  struct MIDIDevice * device;
+  struct MIDIDriver * driver;
+  struct MIDIPort * port;
+  int round;
+
+  if( previous != NULL ) MIDIMessagePoolRetain( previous );
+  ASSERT_NO_ERROR( MIDIRealTimeSetup( 2 * STREAM_BATCH, 0 ), "Could not set up real-time arenas." );
+
+  driver = MIDIDriverCreate( "realtime driver", MIDI_SAMPLING_RATE_DEFAULT );
+  ASSERT_NOT_EQUAL( driver, NULL, "Could not create driver." );
+  device = MIDIDeviceCreate( &_realtime_delegate );
+  ASSERT_NOT_EQUAL( device, NULL, "Could not create device." );
+  ASSERT_NO_ERROR( MIDIDriverGetPort( driver, &port ), "Could not get driver port." );
+  ASSERT_NO_ERROR( MIDIDeviceAttachIn( device, port ), "Could not connect device to driver." );
+
+  MIDIRealTimeResetStats();
+  _allocations = 0;
+  MIDIRealTimeEnter();
+  _counting = 1;
+  for( round=0; round<STREAM_ROUNDS; round++ ) {
+    if( _stream( driver, device, round ) ) break;
+  }
+  _counting = 0;
+  MIDIRealTimeLeave();
+
+  ASSERT_EQUAL( round, STREAM_ROUNDS, "Could not deliver stream." );
+  ASSERT_EQUAL( _received, STREAM_ROUNDS * ( 2 + 2 * STREAM_BATCH ), "Stream was not delivered completely." );
+  ASSERT_NO_ERROR( MIDIRealTimeGetStats( &stats ), "Could not get statistics." );
+  ASSERT_EQUAL( stats.allocations, 0, "Stream allocated in real-time mode." );
+  ASSERT_EQUAL( stats.locks, 0, "Stream took a lock in real-time mode." );
+  ASSERT_EQUAL( stats.logs, 0, "Stream logged in real-time mode." );
+  ASSERT_EQUAL( _allocations, 0, "Interposed malloc was called in real-time mode." );
+
+  MIDIDeviceRelease( device );
+  MIDIDriverRelease( driver );
+  MIDIMessagePoolSetDefault( previous );
+  if( previous != NULL ) MIDIMessagePoolRelease( previous );
+  return 0;
+}
+
+struct realtime_thread {
+  int result;
+  struct MIDIMessagePool * pool;
+  struct MIDIMessage * message;
+};
+
+static void * _realtime_thread( void * info ) {
+  struct realtime_thread * thread = info;
+  thread->result  = MIDIRealTimeSetup( 4, 0 );
+  thread->pool    = MIDIMessagePoolGetDefault();
+  thread->message = MIDIMessageCreate( MIDI_STATUS_NOTE_ON );
+  MIDIMessagePoolSetDefault( NULL );
+  return NULL;
+}
+
+/**
+ * Test that the arenas are set up for the calling thread only and that
+ * messages from them can be released on another thread.
+ */
+int test003_realtime( void ) {
+  struct MIDIMessagePool * previous = MIDIMessagePoolGetDefault();
+  struct realtime_thread thread = { -1, NULL, NULL };
+  pthread_t id;
+
+  ASSERT_NO_ERROR( pthread_create( &id, NULL, &_realtime_thread, &thread ), "Could not start real-time thread." );
+  pthread_join( id, NULL );
+
+  ASSERT_NO_ERROR( thread.result, "Could not set up real-time arenas." );
+  ASSERT_NOT_EQUAL( thread.pool, NULL, "Real-time thread has no default pool." );
+  ASSERT_NOT_EQUAL( thread.pool, previous, "Real-time thread shares the default pool." );
+  ASSERT_EQUAL( MIDIMessagePoolGetDefault(), previous, "Setup changed the default pool of another thread." );
+  ASSERT_NOT_EQUAL( thread.message, NULL, "Could not create message on real-time thread." );
+  MIDIMessageRelease( thread.message );
+  return 0;
+}
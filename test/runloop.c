@@ -1,9 +1,552 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include "test.h"
 #include "midi/util.h"
+#include "midi/runloop.h"
+
+struct pipe_info {
+  int fds[2];
+  int reads;
+  int timeouts;
+};
+
+static int _pipe_read( void * info, int nfds, fd_set * readfds ) {
+  struct pipe_info * p = info;
+  char c;
+  if( FD_ISSET( p->fds[0], readfds ) ) {
+    /* read only one byte per callback */
+    if( read( p->fds[0], &c, 1 ) == 1 ) p->reads++;
+  }
+  return 0;
+}
+
+static int _pipe_timeout( void * info, struct timespec * ts ) {
+  struct pipe_info * p = info;
+  p->timeouts++;
+  return 0;
+}
+
+static int _runloop_pipe_test( int backend ) {
+  struct pipe_info info = { { -1, -1 }, 0, 0 };
+  struct MIDIRunloopSourceDelegate delegate = { &info, &_pipe_read, NULL, &_pipe_timeout };
+  struct timespec timeout = { 0, 10000000 };
+  struct MIDIRunloopSource * source;
+  struct MIDIRunloop * runloop;
+  int actual;
+
+  ASSERT_NO_ERROR( pipe( info.fds ), "Could not create pipe." );
+  fcntl( info.fds[0], F_SETFL, O_NONBLOCK );
+
+  runloop = MIDIRunloopCreateWithBackend( NULL, backend );
+  ASSERT_NOT_EQUAL( runloop, NULL, "Could not create runloop." );
+  ASSERT_NO_ERROR( MIDIRunloopGetBackend( runloop, &actual ), "Could not get runloop backend." );
+  ASSERT_EQUAL( actual, backend, "Runloop uses wrong backend." );
+
+  source = MIDIRunloopSourceCreate( &delegate );
+  ASSERT_NOT_EQUAL( source, NULL, "Could not create runloop source." );
+  MIDIRunloopSourceScheduleRead( source, info.fds[0] );
+  MIDIRunloopSourceScheduleTimeout( source, &timeout );
+  ASSERT_NO_ERROR( MIDIRunloopAddSource( runloop, source ), "Could not add source to runloop." );
+
+  ASSERT_EQUAL( write( info.fds[1], "ab", 2 ), 2, "Could not write to pipe." );
+  ASSERT_NO_ERROR( MIDIRunloopStep( runloop ), "Runloop step failed." );
+  ASSERT_EQUAL( info.reads, 1, "Read callback was not invoked." );
+  ASSERT_NO_ERROR( MIDIRunloopStep( runloop ), "Runloop step failed." );
+  ASSERT_EQUAL( info.reads, 2, "Read callback was not invoked for remaining data." );
+  ASSERT_EQUAL( info.timeouts, 0, "Timeout callback was invoked too early." );
+
+  ASSERT_NO_ERROR( MIDIRunloopStep( runloop ), "Runloop step failed." );
+  ASSERT_EQUAL( info.reads, 2, "Read callback was invoked without data." );
+  ASSERT_EQUAL( info.timeouts, 1, "Timeout callback was not invoked." );
+
+  ASSERT_EQUAL( write( info.fds[1], "c", 1 ), 1, "Could not write to pipe." );
+  ASSERT_NO_ERROR( MIDIRunloopStep( runloop ), "Runloop step failed." );
+  ASSERT_EQUAL( info.reads, 3, "Read callback was not invoked after timeout." );
+
+  MIDIRunloopSourceInvalidate( source );
+  MIDIRunloopSourceRelease( source );
+  MIDIRunloopRelease( runloop );
+  close( info.fds[0] );
+  close( info.fds[1] );
+  return 0;
+}
 
 /**
  * Test that the runloop works.
  */
 int test001_runloop( void ) {
+  return _runloop_pipe_test( MIDI_RUNLOOP_BACKEND_SELECT );
+}
+
+/**
+ * Test that the epoll runloop backend dispatches reads and timeouts
+ * like the select backend, even if the delegate does not drain the
+ * file descriptor.
+ */
+int test002_runloop( void ) {
+#ifdef __linux__
+  return _runloop_pipe_test( MIDI_RUNLOOP_BACKEND_EPOLL );
+#else
+  return 0;
+#endif
+}
+
+/**
+ * Test that the io_uring runloop backend dispatches reads and timeouts
+ * like the select backend. Skipped if io_uring is not available.
+ */
+int test003_runloop( void ) {
+  struct MIDIRunloop * runloop = MIDIRunloopCreateWithBackend( NULL, MIDI_RUNLOOP_BACKEND_IO_URING );
+  int actual;
+
+  ASSERT_NOT_EQUAL( runloop, NULL, "Could not create runloop." );
+  ASSERT_NO_ERROR( MIDIRunloopGetBackend( runloop, &actual ), "Could not get runloop backend." );
+  MIDIRunloopRelease( runloop );
+  if( actual != MIDI_RUNLOOP_BACKEND_IO_URING ) {
+    return 0;
+  }
+  return _runloop_pipe_test( MIDI_RUNLOOP_BACKEND_IO_URING );
+}
+
+#define MANY_SOURCES 40
+
+struct many_info {
+  int fds[2];
+  int reads;
+  int invalidate;
+  struct MIDIRunloopSource * source;
+};
+
+static int _many_read( void * info, int nfds, fd_set * readfds ) {
+  struct many_info * m = info;
+  char c;
+  if( FD_ISSET( m->fds[0], readfds ) ) {
+    if( read( m->fds[0], &c, 1 ) == 1 ) m->reads++;
+    if( m->invalidate ) MIDIRunloopSourceInvalidate( m->source );
+  }
+  return 0;
+}
+
+/**
+ * Test that a runloop hosts more sources than the former fixed limit,
+ * only dispatches ready sources and allows sources to remove themselves
+ * from within their callbacks.
+ */
+int test005_runloop( void ) {
+  struct many_info info[MANY_SOURCES];
+  struct MIDIRunloopSourceDelegate delegate = { NULL, &_many_read, NULL, NULL };
+  struct MIDIRunloop * runloop = MIDIRunloopCreate( NULL );
+  int i;
+
+  ASSERT_NOT_EQUAL( runloop, NULL, "Could not create runloop." );
+  for( i=0; i<MANY_SOURCES; i++ ) {
+    ASSERT_NO_ERROR( pipe( info[i].fds ), "Could not create pipe." );
+    fcntl( info[i].fds[0], F_SETFL, O_NONBLOCK );
+    info[i].reads      = 0;
+    info[i].invalidate = ( i == 7 );
+    delegate.info      = &info[i];
+    info[i].source     = MIDIRunloopSourceCreate( &delegate );
+    MIDIRunloopSourceScheduleRead( info[i].source, info[i].fds[0] );
+    ASSERT_NO_ERROR( MIDIRunloopAddSource( runloop, info[i].source ), "Could not add source to runloop." );
+  }
+  ASSERT_ERROR( MIDIRunloopAddSource( runloop, info[0].source ), "Added source to runloop twice." );
+  MIDIErrorNumber = 0;
+
+  ASSERT_NO_ERROR( MIDIRunloopRemoveSource( runloop, info[3].source ), "Could not remove source from runloop." );
+  ASSERT_EQUAL( MIDIRunloopRemoveSource( runloop, info[3].source ), 1, "Removed source from runloop twice." );
+
+  write( info[3].fds[1], "x", 1 );
+  write( info[7].fds[1], "x", 1 );
+  write( info[MANY_SOURCES-1].fds[1], "x", 1 );
+  ASSERT_NO_ERROR( MIDIRunloopStep( runloop ), "Runloop step failed." );
+  for( i=0; i<MANY_SOURCES; i++ ) {
+    if( i == 7 || i == MANY_SOURCES-1 ) {
+      ASSERT_EQUAL( info[i].reads, 1, "Ready source was not dispatched." );
+    } else {
+      ASSERT_EQUAL( info[i].reads, 0, "Source was dispatched without data." );
+    }
+  }
+
+  write( info[7].fds[1], "x", 1 );
+  write( info[8].fds[1], "x", 1 );
+  ASSERT_NO_ERROR( MIDIRunloopStep( runloop ), "Runloop step failed." );
+  ASSERT_EQUAL( info[7].reads, 1, "Invalidated source was dispatched." );
+  ASSERT_EQUAL( info[8].reads, 1, "Source after invalidated source was not dispatched." );
+
+  for( i=0; i<MANY_SOURCES; i++ ) {
+    MIDIRunloopSourceInvalidate( info[i].source );
+    MIDIRunloopSourceRelease( info[i].source );
+    close( info[i].fds[0] );
+    close( info[i].fds[1] );
+  }
+  MIDIRunloopRelease( runloop );
+  return 0;
+}
+
+#define TIMER_COUNT 4
+
+struct timer_info {
+  struct MIDIRunloopTimer * timers[TIMER_COUNT];
+  int order[TIMER_COUNT];
+  int fired;
+};
+
+static int _timer_fire( void * info, struct MIDIRunloopTimer * timer, struct timespec * now ) {
+  struct timer_info * t = info;
+  int i;
+  for( i=0; i<TIMER_COUNT; i++ ) {
+    if( t->timers[i] == timer ) t->order[t->fired++] = i;
+  }
+  return 0;
+}
+
+/**
+ * Test that several timers of one source fire in deadline order and that
+ * cancelled timers do not fire.
+ */
+int test006_runloop( void ) {
+  struct timer_info info = { { NULL }, { 0 }, 0 };
+  struct MIDIRunloopSourceDelegate source_delegate = { NULL, NULL, NULL, NULL };
+  struct MIDIRunloopTimerDelegate delegate = { &info, &_timer_fire };
+  struct MIDIRunloop * runloop = MIDIRunloopCreate( NULL );
+  struct MIDIRunloopSource * source = MIDIRunloopSourceCreate( &source_delegate );
+  struct timespec timeouts[TIMER_COUNT] = { { 0, 30000000 }, { 0, 10000000 }, { 0, 20000000 }, { 0, 5000000 } };
+  int i, scheduled;
+
+  ASSERT_NOT_EQUAL( runloop, NULL, "Could not create runloop." );
+  ASSERT_NO_ERROR( MIDIRunloopAddSource( runloop, source ), "Could not add source to runloop." );
+  for( i=0; i<TIMER_COUNT; i++ ) {
+    info.timers[i] = MIDIRunloopTimerCreate( source, &delegate );
+    ASSERT_NOT_EQUAL( info.timers[i], NULL, "Could not create timer." );
+    ASSERT_NO_ERROR( MIDIRunloopTimerSchedule( info.timers[i], &timeouts[i] ), "Could not schedule timer." );
+  }
+  ASSERT_NO_ERROR( MIDIRunloopTimerCancel( info.timers[3] ), "Could not cancel timer." );
+  MIDIRunloopTimerIsScheduled( info.timers[3], &scheduled );
+  ASSERT_EQUAL( scheduled, 0, "Cancelled timer is still scheduled." );
+
+  for( i=0; i<10 && info.fired < TIMER_COUNT-1; i++ ) {
+    ASSERT_NO_ERROR( MIDIRunloopStep( runloop ), "Runloop step failed." );
+  }
+  ASSERT_EQUAL( info.fired, TIMER_COUNT-1, "Not all timers fired." );
+  ASSERT_EQUAL( info.order[0], 1, "Timers fired in wrong order." );
+  ASSERT_EQUAL( info.order[1], 2, "Timers fired in wrong order." );
+  ASSERT_EQUAL( info.order[2], 0, "Timers fired in wrong order." );
+  MIDIRunloopTimerIsScheduled( info.timers[0], &scheduled );
+  ASSERT_EQUAL( scheduled, 0, "Fired timer is still scheduled." );
+
+  for( i=0; i<TIMER_COUNT; i++ ) {
+    MIDIRunloopTimerRelease( info.timers[i] );
+  }
+  MIDIRunloopRemoveSource( runloop, source );
+  MIDIRunloopSourceRelease( source );
+  MIDIRunloopRelease( runloop );
+  return 0;
+}
+
+#define HIGH_FD ( FD_SETSIZE + 100 )
+
+struct high_info {
+  int fds[2];
+  int reads;
+  int writes;
+  int timeouts;
+};
+
+static int _high_read( void * info, int nfds, fd_set * readfds ) {
+  struct high_info * h = info;
+  char c;
+  if( FD_ISSET( h->fds[0], readfds ) ) {
+    if( read( h->fds[0], &c, 1 ) == 1 ) h->reads++;
+  }
+  return 0;
+}
+
+static int _high_write( void * info, int nfds, fd_set * writefds ) {
+  struct high_info * h = info;
+  if( FD_ISSET( h->fds[1], writefds ) ) h->writes++;
+  return 0;
+}
+
+static int _high_timeout( void * info, struct timespec * ts ) {
+  struct high_info * h = info;
+  h->timeouts++;
+  return 0;
+}
+
+/**
+ * Test that the epoll backend waits for file descriptors above
+ * FD_SETSIZE, which the select backend rejects, and that write callbacks
+ * stay one-shot. Skipped if the descriptor limit can not be raised.
+ */
+int test007_runloop( void ) {
+#ifdef __linux__
+  struct high_info info = { { -1, -1 }, 0, 0, 0 };
+  struct MIDIRunloopSourceDelegate delegate = { &info, &_high_read, &_high_write, &_high_timeout };
+  struct timespec timeout = { 0, 10000000 };
+  struct MIDIRunloopSource * source;
+  struct MIDIRunloop * runloop;
+  struct rlimit limit;
+  int fds[2];
+
+  getrlimit( RLIMIT_NOFILE, &limit );
+  if( limit.rlim_cur <= HIGH_FD + 1 ) {
+    if( limit.rlim_max != RLIM_INFINITY && limit.rlim_max <= HIGH_FD + 1 ) return 0;
+    limit.rlim_cur = HIGH_FD + 2;
+    if( setrlimit( RLIMIT_NOFILE, &limit ) ) return 0;
+  }
+  ASSERT_NO_ERROR( pipe( fds ), "Could not create pipe." );
+  info.fds[0] = dup2( fds[0], HIGH_FD );
+  info.fds[1] = dup2( fds[1], HIGH_FD + 1 );
+  close( fds[0] );
+  close( fds[1] );
+  ASSERT_EQUAL( info.fds[0], HIGH_FD, "Could not move pipe above FD_SETSIZE." );
+  fcntl( info.fds[0], F_SETFL, O_NONBLOCK );
+
+  source = MIDIRunloopSourceCreate( &delegate );
+  ASSERT_NOT_EQUAL( source, NULL, "Could not create runloop source." );
+  ASSERT_NO_ERROR( MIDIRunloopSourceScheduleRead( source, info.fds[0] ), "Could not schedule read." );
+  MIDIRunloopSourceScheduleTimeout( source, &timeout );
+
+  runloop = MIDIRunloopCreateWithBackend( NULL, MIDI_RUNLOOP_BACKEND_SELECT );
+  ASSERT_ERROR( MIDIRunloopAddSource( runloop, source ), "Select runloop accepted descriptor above FD_SETSIZE." );
+  MIDIErrorNumber = 0;
+  MIDIRunloopRelease( runloop );
+
+  runloop = MIDIRunloopCreateWithBackend( NULL, MIDI_RUNLOOP_BACKEND_EPOLL );
+  ASSERT_NOT_EQUAL( runloop, NULL, "Could not create runloop." );
+  ASSERT_NO_ERROR( MIDIRunloopAddSource( runloop, source ), "Could not add source to runloop." );
+
+  ASSERT_EQUAL( write( info.fds[1], "ab", 2 ), 2, "Could not write to pipe." );
+  ASSERT_NO_ERROR( MIDIRunloopStep( runloop ), "Runloop step failed." );
+  ASSERT_EQUAL( info.reads, 1, "Read callback was not invoked." );
+  ASSERT_NO_ERROR( MIDIRunloopStep( runloop ), "Runloop step failed." );
+  ASSERT_EQUAL( info.reads, 2, "Read callback was not invoked for remaining data." );
+
+  ASSERT_NO_ERROR( MIDIRunloopSourceScheduleWrite( source, info.fds[1] ), "Could not schedule write." );
+  ASSERT_NO_ERROR( MIDIRunloopStep( runloop ), "Runloop step failed." );
+  ASSERT_EQUAL( info.writes, 1, "Write callback was not invoked." );
+  ASSERT_NO_ERROR( MIDIRunloopStep( runloop ), "Runloop step failed." );
+  ASSERT_EQUAL( info.writes, 1, "Write callback was invoked without being scheduled." );
+  ASSERT_EQUAL( info.timeouts, 1, "Timeout callback was not invoked." );
+  ASSERT_EQUAL( info.reads, 2, "Read callback was invoked without data." );
+
+  MIDIRunloopSourceInvalidate( source );
+  MIDIRunloopSourceRelease( source );
+  MIDIRunloopRelease( runloop );
+  close( info.fds[0] );
+  close( info.fds[1] );
+#endif
+  return 0;
+}
+
+#define BENCHMARK_PACKETS 100000
+
+struct udp_info {
+  int sockets[2];
+  int received;
+  int done;
+  int stop;
+};
+
+static void * _udp_send_thread( void * info ) {
+  struct udp_info * u = info;
+  unsigned char packet[16] = { 0x80, 0x61 };
+  int i;
+  for( i=0; i<BENCHMARK_PACKETS; i++ ) {
+    packet[2] = i >> 8;
+    packet[3] = i;
+    send( u->sockets[1], packet, sizeof(packet), 0 );
+  }
+  __atomic_store_n( &(u->done), 1, __ATOMIC_RELEASE );
+  return NULL;
+}
+
+static int _udp_read( void * info, int nfds, fd_set * readfds ) {
+  struct udp_info * u = info;
+  unsigned char packet[64];
+  if( FD_ISSET( u->sockets[0], readfds ) ) {
+    /* receive one datagram per callback like the RTP driver */
+    if( recv( u->sockets[0], packet, sizeof(packet), MSG_DONTWAIT ) > 0 ) u->received++;
+  }
+  return 0;
+}
+
+static int _udp_receive( void * info, int fd, size_t size, void * data, socklen_t namelen, struct sockaddr * name ) {
+  struct udp_info * u = info;
+  if( fd == u->sockets[0] && size > 0 ) u->received++;
+  return 0;
+}
+
+static int _udp_timeout( void * info, struct timespec * ts ) {
+  struct udp_info * u = info;
+  if( __atomic_load_n( &(u->done), __ATOMIC_ACQUIRE ) ) u->stop = 1;
+  return 0;
+}
+
+static int _runloop_udp_benchmark( int backend ) {
+  struct udp_info info = { { -1, -1 }, 0, 0, 0 };
+  struct MIDIRunloopSourceDelegate delegate = { &info, &_udp_read, NULL, &_udp_timeout };
+  struct timespec timeout = { 0, 10000000 };
+  struct timespec start, end;
+  struct sockaddr_in addr;
+  socklen_t length = sizeof(addr);
+  struct MIDIRunloopSource * source;
+  struct MIDIRunloop * runloop;
+  pthread_t thread;
+  double seconds;
+  int actual;
+
+  memset( &addr, 0, sizeof(addr) );
+  addr.sin_family      = AF_INET;
+  addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+  addr.sin_port        = 0;
+  info.sockets[0] = socket( AF_INET, SOCK_DGRAM, 0 );
+  info.sockets[1] = socket( AF_INET, SOCK_DGRAM, 0 );
+  ASSERT_NO_ERROR( bind( info.sockets[0], (struct sockaddr *) &addr, sizeof(addr) ), "Could not bind socket." );
+  ASSERT_NO_ERROR( getsockname( info.sockets[0], (struct sockaddr *) &addr, &length ), "Could not get socket address." );
+  ASSERT_NO_ERROR( connect( info.sockets[1], (struct sockaddr *) &addr, sizeof(addr) ), "Could not connect socket." );
+
+  runloop = MIDIRunloopCreateWithBackend( NULL, backend );
+  ASSERT_NOT_EQUAL( runloop, NULL, "Could not create runloop." );
+  MIDIRunloopGetBackend( runloop, &actual );
+  if( actual != backend ) {
+    MIDIRunloopRelease( runloop );
+    close( info.sockets[0] );
+    close( info.sockets[1] );
+    return 0;
+  }
+  source = MIDIRunloopSourceCreate( &delegate );
+  MIDIRunloopSourceSetReceive( source, &_udp_receive );
+  MIDIRunloopSourceScheduleRead( source, info.sockets[0] );
+  MIDIRunloopSourceScheduleTimeout( source, &timeout );
+  ASSERT_NO_ERROR( MIDIRunloopAddSource( runloop, source ), "Could not add source to runloop." );
+
+  clock_gettime( CLOCK_THREAD_CPUTIME_ID, &start );
+  ASSERT_NO_ERROR( pthread_create( &thread, NULL, &_udp_send_thread, &info ), "Could not create sender thread." );
+  while( info.received < BENCHMARK_PACKETS && ! info.stop ) {
+    MIDIRunloopStep( runloop );
+  }
+  clock_gettime( CLOCK_THREAD_CPUTIME_ID, &end );
+  pthread_join( thread, NULL );
+
+  seconds = ( end.tv_sec - start.tv_sec ) + ( end.tv_nsec - start.tv_nsec ) / 1000000000.0;
+  printf( "runloop backend %i: %i packets, %.0f packets/s per core\n",
+          backend, info.received, seconds > 0 ? info.received / seconds : 0.0 );
+  ASSERT_GREATER( info.received, 0, "Did not receive any packets." );
+
+  MIDIRunloopSourceInvalidate( source );
+  MIDIRunloopSourceRelease( source );
+  MIDIRunloopRelease( runloop );
+  close( info.sockets[0] );
+  close( info.sockets[1] );
+  return 0;
+}
+
+/**
+ * Benchmark the runloop backends with UDP datagrams on the loopback
+ * interface and report the received packets per second of receiver
+ * thread CPU time.
+ */
+int test004_runloop( void ) {
+  ASSERT_NO_ERROR( _runloop_udp_benchmark( MIDI_RUNLOOP_BACKEND_SELECT ), "Select benchmark failed." );
+#ifdef __linux__
+  ASSERT_NO_ERROR( _runloop_udp_benchmark( MIDI_RUNLOOP_BACKEND_EPOLL ), "Epoll benchmark failed." );
+  ASSERT_NO_ERROR( _runloop_udp_benchmark( MIDI_RUNLOOP_BACKEND_IO_URING ), "io_uring benchmark failed." );
+#endif
+  return 0;
+}
+
+struct datagram_info {
+  int    reads;
+  int    received;
+  size_t size;
+  unsigned char data[16];
+  struct sockaddr_in name;
+};
+
+static int _datagram_read( void * info, int nfds, fd_set * readfds ) {
+  struct datagram_info * d = info;
+  d->reads++;
+  return 0;
+}
+
+static int _datagram_receive( void * info, int fd, size_t size, void * data, socklen_t namelen, struct sockaddr * name ) {
+  struct datagram_info * d = info;
+  d->received++;
+  d->size = size;
+  if( size <= sizeof(d->data) ) memcpy( &(d->data[0]), data, size );
+  if( namelen == sizeof(d->name) ) memcpy( &(d->name), name, namelen );
+  return 0;
+}
+
+/**
+ * Test that the io_uring backend hands datagrams and their sender to the
+ * receive callback instead of invoking the read callback. Skipped if
+ * io_uring is not available.
+ */
+int test008_runloop( void ) {
+#ifdef __linux__
+  struct datagram_info info;
+  struct MIDIRunloopSourceDelegate delegate = { &info, &_datagram_read, NULL, NULL };
+  unsigned char packet[4] = { 0x80, 0x61, 0x12, 0x34 };
+  struct sockaddr_in addr, sender;
+  socklen_t length = sizeof(addr);
+  struct MIDIRunloopSource * source;
+  struct MIDIRunloop * runloop;
+  int sockets[2], actual, i;
+
+  runloop = MIDIRunloopCreateWithBackend( NULL, MIDI_RUNLOOP_BACKEND_IO_URING );
+  ASSERT_NOT_EQUAL( runloop, NULL, "Could not create runloop." );
+  MIDIRunloopGetBackend( runloop, &actual );
+  if( actual != MIDI_RUNLOOP_BACKEND_IO_URING ) {
+    MIDIRunloopRelease( runloop );
+    return 0;
+  }
+
+  memset( &info, 0, sizeof(info) );
+  memset( &addr, 0, sizeof(addr) );
+  addr.sin_family      = AF_INET;
+  addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+  sockets[0] = socket( AF_INET, SOCK_DGRAM, 0 );
+  sockets[1] = socket( AF_INET, SOCK_DGRAM, 0 );
+  ASSERT_NO_ERROR( bind( sockets[0], (struct sockaddr *) &addr, sizeof(addr) ), "Could not bind socket." );
+  ASSERT_NO_ERROR( bind( sockets[1], (struct sockaddr *) &addr, sizeof(addr) ), "Could not bind socket." );
+  ASSERT_NO_ERROR( getsockname( sockets[0], (struct sockaddr *) &addr, &length ), "Could not get socket address." );
+  length = sizeof(sender);
+  ASSERT_NO_ERROR( getsockname( sockets[1], (struct sockaddr *) &sender, &length ), "Could not get socket address." );
+
+  source = MIDIRunloopSourceCreate( &delegate );
+  MIDIRunloopSourceScheduleRead( source, sockets[0] );
+  ASSERT_NO_ERROR( MIDIRunloopAddSource( runloop, source ), "Could not add source to runloop." );
+  /* switch the scheduled descriptor over to receiving */
+  ASSERT_NO_ERROR( MIDIRunloopSourceSetReceive( source, &_datagram_receive ), "Could not set receive callback." );
+
+  for( i=0; i<3; i++ ) {
+    packet[3] = i;
+    sendto( sockets[1], packet, sizeof(packet), 0, (struct sockaddr *) &addr, sizeof(addr) );
+  }
+  for( i=0; i<10 && info.received < 3; i++ ) {
+    MIDIRunloopStep( runloop );
+  }
+  ASSERT_EQUAL( info.received, 3, "Datagrams were not received." );
+  ASSERT_EQUAL( info.reads, 0, "Read callback was invoked for a receiving source." );
+  ASSERT_EQUAL( info.size, sizeof(packet), "Received datagram has wrong size." );
+  ASSERT_EQUAL( info.data[3], 2, "Received datagram has wrong contents." );
+  ASSERT_EQUAL( info.name.sin_port, sender.sin_port, "Received datagram has wrong sender." );
+
+  MIDIRunloopSourceInvalidate( source );
+  MIDIRunloopSourceRelease( source );
+  MIDIRunloopRelease( runloop );
+  close( sockets[0] );
+  close( sockets[1] );
+#endif
   return 0;
 }
@@ -0,0 +1,259 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include "test.h"
+#include "midi/message.h"
+#include "midi/message_pool.h"
+#include "midi/runloop_group.h"
+
+#define GROUP_SIZE    2
+#define GROUP_SOURCES 4
+
+struct group_info {
+  struct MIDIRunloopGroup * group;
+  int received[GROUP_SIZE];
+  int wrong;
+};
+
+struct group_source {
+  int fds[2];
+  int reads;
+  struct MIDIRunloopSource * source;
+};
+
+static int _group_receive( void * info, struct MIDIRunloop * runloop, struct MIDIMessage * message ) {
+  struct group_info * g = info;
+  struct MIDIRunloop * expected;
+  MIDITimestamp index;
+  MIDIMessageGetTimestamp( message, &index );
+  MIDIRunloopGroupGetRunloop( g->group, (int) index, &expected );
+  if( runloop != expected ) {
+    __atomic_add_fetch( &(g->wrong), 1, __ATOMIC_SEQ_CST );
+  }
+  __atomic_add_fetch( &(g->received[index]), 1, __ATOMIC_SEQ_CST );
+  return 0;
+}
+
+static int _group_read( void * info, int nfds, fd_set * readfds ) {
+  struct group_source * s = info;
+  char c;
+  if( FD_ISSET( s->fds[0], readfds ) ) {
+    if( read( s->fds[0], &c, 1 ) == 1 ) __atomic_add_fetch( &(s->reads), 1, __ATOMIC_SEQ_CST );
+  }
+  return 0;
+}
+
+static int _group_wait( int * value, int expected ) {
+  struct timespec ts = { 0, 1000000 };
+  int i;
+  for( i=0; i<1000; i++ ) {
+    if( __atomic_load_n( value, __ATOMIC_SEQ_CST ) == expected ) return 0;
+    nanosleep( &ts, NULL );
+  }
+  return 1;
+}
+
+/**
+ * Test that sources are assigned to the runloops of a group and that
+ * messages are handed to the right runloop thread.
+ */
+int test001_runloop_group( void ) {
+  struct group_info info = { NULL, { 0, 0 }, 0 };
+  struct MIDIRunloopGroupDelegate delegate = { &info, &_group_receive };
+  struct MIDIRunloopSourceDelegate source_delegate = { NULL, &_group_read, NULL, NULL };
+  struct group_source sources[GROUP_SOURCES];
+  struct MIDIMessage * message;
+  int i, size, index, other;
+
+  info.group = MIDIRunloopGroupCreate( GROUP_SIZE, MIDI_RUNLOOP_BACKEND_SELECT, &delegate );
+  ASSERT_NOT_EQUAL( info.group, NULL, "Could not create runloop group." );
+  ASSERT_NO_ERROR( MIDIRunloopGroupGetSize( info.group, &size ), "Could not get runloop group size." );
+  ASSERT_EQUAL( size, GROUP_SIZE, "Runloop group has wrong size." );
+
+  for( i=0; i<GROUP_SOURCES; i++ ) {
+    ASSERT_NO_ERROR( pipe( sources[i].fds ), "Could not create pipe." );
+    fcntl( sources[i].fds[0], F_SETFL, O_NONBLOCK );
+    sources[i].reads     = 0;
+    source_delegate.info = &sources[i];
+    sources[i].source    = MIDIRunloopSourceCreate( &source_delegate );
+    MIDIRunloopSourceScheduleRead( sources[i].source, sources[i].fds[0] );
+  }
+
+  ASSERT_NO_ERROR( MIDIRunloopGroupAddSource( info.group, sources[0].source, MIDI_RUNLOOP_GROUP_ROUND_ROBIN, 0, &index ),
+                   "Could not add source to runloop group." );
+  ASSERT_EQUAL( index, 0, "Round robin assigned wrong runloop." );
+  ASSERT_NO_ERROR( MIDIRunloopGroupAddSource( info.group, sources[1].source, MIDI_RUNLOOP_GROUP_ROUND_ROBIN, 0, &index ),
+                   "Could not add source to runloop group." );
+  ASSERT_EQUAL( index, 1, "Round robin assigned wrong runloop." );
+  ASSERT_NO_ERROR( MIDIRunloopGroupAddSource( info.group, sources[2].source, MIDI_RUNLOOP_GROUP_EXPLICIT, 1, &index ),
+                   "Could not add source to runloop group." );
+  ASSERT_EQUAL( index, 1, "Explicit assignment used wrong runloop." );
+  ASSERT_ERROR( MIDIRunloopGroupAddSource( info.group, sources[3].source, MIDI_RUNLOOP_GROUP_EXPLICIT, GROUP_SIZE, NULL ),
+                "Added source to a runloop that does not exist." );
+  MIDIErrorNumber = 0;
+
+  ASSERT_NO_ERROR( MIDIRunloopGroupStart( info.group ), "Could not start runloop group." );
+
+  /* add and remove while the runloops are running */
+  ASSERT_NO_ERROR( MIDIRunloopGroupAddSource( info.group, sources[3].source, MIDI_RUNLOOP_GROUP_HASH, 0x12345678, &index ),
+                   "Could not add source to running runloop group." );
+  ASSERT_NO_ERROR( MIDIRunloopGroupRemoveSource( info.group, sources[3].source ), "Could not remove source from runloop group." );
+  ASSERT_NO_ERROR( MIDIRunloopGroupAddSource( info.group, sources[3].source, MIDI_RUNLOOP_GROUP_HASH, 0x12345678, &other ),
+                   "Could not add source to running runloop group." );
+  ASSERT_EQUAL( index, other, "Hash assignment is not stable." );
+
+  for( i=0; i<GROUP_SOURCES; i++ ) {
+    ASSERT_EQUAL( write( sources[i].fds[1], "x", 1 ), 1, "Could not write to pipe." );
+  }
+  for( i=0; i<GROUP_SOURCES; i++ ) {
+    ASSERT_NO_ERROR( _group_wait( &(sources[i].reads), 1 ), "Source was not dispatched by its runloop." );
+  }
+
+  for( i=0; i<100; i++ ) {
+    message = MIDIMessageCreate( MIDI_STATUS_NOTE_ON );
+    MIDIMessageSetTimestamp( message, i % GROUP_SIZE );
+    ASSERT_NO_ERROR( MIDIRunloopGroupSendMessage( info.group, i % GROUP_SIZE, message ), "Could not send message to runloop." );
+  }
+  ASSERT_NO_ERROR( _group_wait( &(info.received[0]), 50 ), "First runloop did not receive all messages." );
+  ASSERT_NO_ERROR( _group_wait( &(info.received[1]), 50 ), "Second runloop did not receive all messages." );
+  ASSERT_EQUAL( info.wrong, 0, "Message was delivered on the wrong runloop." );
+
+  ASSERT_NO_ERROR( MIDIRunloopGroupStop( info.group ), "Could not stop runloop group." );
+  for( i=0; i<GROUP_SOURCES; i++ ) {
+    ASSERT_NO_ERROR( MIDIRunloopGroupRemoveSource( info.group, sources[i].source ), "Could not remove source from runloop group." );
+    MIDIRunloopSourceRelease( sources[i].source );
+    close( sources[i].fds[0] );
+    close( sources[i].fds[1] );
+  }
+  MIDIRunloopGroupRelease( info.group );
+  return 0;
+}
+
+#define GROUP_CROSS_ROUNDS 201
+
+struct group_cross {
+  struct MIDIRunloopGroup * group;
+  struct group_source * sources;
+  int added[GROUP_SIZE];
+  int done;
+};
+
+static int _group_cross_receive( void * info, struct MIDIRunloop * runloop, struct MIDIMessage * message ) {
+  struct group_cross * c = info;
+  MIDITimestamp index;
+  int result;
+  MIDIMessageGetTimestamp( message, &index );
+  /* add or remove a source of the other runloop from this runloop's thread */
+  if( c->added[index] ) {
+    result = MIDIRunloopGroupRemoveSource( c->group, c->sources[index].source );
+  } else {
+    result = MIDIRunloopGroupAddSource( c->group, c->sources[index].source, MIDI_RUNLOOP_GROUP_EXPLICIT,
+                                        GROUP_SIZE - 1 - (int) index, NULL );
+  }
+  if( result == 0 ) {
+    c->added[index] = ! c->added[index];
+    __atomic_add_fetch( &(c->done), 1, __ATOMIC_SEQ_CST );
+  }
+  return 0;
+}
+
+/**
+ * Test that two runloop threads can add sources to each other's runloop
+ * at the same time without deadlocking.
+ */
+int test002_runloop_group( void ) {
+  struct group_cross cross = { NULL, NULL, { 0, 0 }, 0 };
+  struct MIDIRunloopGroupDelegate delegate = { &cross, &_group_cross_receive };
+  struct MIDIRunloopSourceDelegate source_delegate = { NULL, &_group_read, NULL, NULL };
+  struct group_source sources[GROUP_SIZE];
+  struct MIDIMessage * message;
+  int i, j;
+
+  cross.group   = MIDIRunloopGroupCreate( GROUP_SIZE, MIDI_RUNLOOP_BACKEND_SELECT, &delegate );
+  cross.sources = &sources[0];
+  ASSERT_NOT_EQUAL( cross.group, NULL, "Could not create runloop group." );
+  for( i=0; i<GROUP_SIZE; i++ ) {
+    ASSERT_NO_ERROR( pipe( sources[i].fds ), "Could not create pipe." );
+    fcntl( sources[i].fds[0], F_SETFL, O_NONBLOCK );
+    sources[i].reads     = 0;
+    source_delegate.info = &sources[i];
+    sources[i].source    = MIDIRunloopSourceCreate( &source_delegate );
+    MIDIRunloopSourceScheduleRead( sources[i].source, sources[i].fds[0] );
+  }
+  ASSERT_NO_ERROR( MIDIRunloopGroupStart( cross.group ), "Could not start runloop group." );
+
+  for( j=0; j<GROUP_CROSS_ROUNDS; j++ ) {
+    for( i=0; i<GROUP_SIZE; i++ ) {
+      message = MIDIMessageCreate( MIDI_STATUS_NOTE_ON );
+      MIDIMessageSetTimestamp( message, i );
+      ASSERT_NO_ERROR( MIDIRunloopGroupSendMessage( cross.group, i, message ), "Could not send message to runloop." );
+    }
+  }
+  ASSERT_NO_ERROR( _group_wait( &(cross.done), GROUP_SIZE * GROUP_CROSS_ROUNDS ), "Runloops did not add sources to each other." );
+  for( i=0; i<GROUP_SIZE; i++ ) {
+    ASSERT_EQUAL( write( sources[i].fds[1], "x", 1 ), 1, "Could not write to pipe." );
+  }
+  for( i=0; i<GROUP_SIZE; i++ ) {
+    ASSERT_NO_ERROR( _group_wait( &(sources[i].reads), 1 ), "Source was not dispatched by the other runloop." );
+  }
+
+  ASSERT_NO_ERROR( MIDIRunloopGroupStop( cross.group ), "Could not stop runloop group." );
+  for( i=0; i<GROUP_SIZE; i++ ) {
+    ASSERT_NO_ERROR( MIDIRunloopGroupRemoveSource( cross.group, sources[i].source ), "Could not remove source from runloop group." );
+    MIDIRunloopSourceRelease( sources[i].source );
+    close( sources[i].fds[0] );
+    close( sources[i].fds[1] );
+  }
+  MIDIRunloopGroupRelease( cross.group );
+  return 0;
+}
+
+/**
+ * Test that messages from the sender's pool are taken back by the pool
+ * when the receiving runloops release them, and that shared messages are
+ * refused unless reference counts are atomic.
+ */
+int test003_runloop_group( void ) {
+  struct group_info info = { NULL, { 0, 0 }, 0 };
+  struct MIDIRunloopGroupDelegate delegate = { &info, &_group_receive };
+  struct MIDIMessagePool * pool = MIDIMessagePoolCreate( 64, 0 );
+  struct MIDIMessagePool * previous = MIDIMessagePoolGetDefault();
+  struct MIDIMessagePoolStats stats;
+  struct MIDIMessage * message;
+  int i;
+
+  ASSERT_NOT_EQUAL( pool, NULL, "Could not create message pool." );
+  ASSERT_NO_ERROR( MIDIMessagePoolSetDefault( pool ), "Could not set default message pool." );
+  info.group = MIDIRunloopGroupCreate( GROUP_SIZE, MIDI_RUNLOOP_BACKEND_SELECT, &delegate );
+  ASSERT_NOT_EQUAL( info.group, NULL, "Could not create runloop group." );
+  ASSERT_NO_ERROR( MIDIRunloopGroupStart( info.group ), "Could not start runloop group." );
+
+  for( i=0; i<100; i++ ) {
+    message = MIDIMessageCreate( MIDI_STATUS_NOTE_ON );
+    MIDIMessageSetTimestamp( message, i % GROUP_SIZE );
+    ASSERT_NO_ERROR( MIDIRunloopGroupSendMessage( info.group, i % GROUP_SIZE, message ), "Could not send message to runloop." );
+  }
+  ASSERT_NO_ERROR( _group_wait( &(info.received[0]), 50 ), "First runloop did not receive all messages." );
+  ASSERT_NO_ERROR( _group_wait( &(info.received[1]), 50 ), "Second runloop did not receive all messages." );
+
+  message = MIDIMessageCreate( MIDI_STATUS_NOTE_ON );
+  MIDIMessageRetain( message );
+#ifdef MIDI_ATOMIC_REFS
+  ASSERT_NO_ERROR( MIDIRunloopGroupSendMessage( info.group, 0, message ), "Could not send shared message to runloop." );
+  ASSERT_NO_ERROR( _group_wait( &(info.received[0]), 51 ), "Runloop did not receive shared message." );
+#else
+  ASSERT_ERROR( MIDIRunloopGroupSendMessage( info.group, 0, message ), "Sent shared message to runloop." );
+  MIDIErrorNumber = 0;
+  MIDIMessageRelease( message );
+#endif
+  MIDIMessageRelease( message );
+
+  ASSERT_NO_ERROR( MIDIRunloopGroupStop( info.group ), "Could not stop runloop group." );
+  ASSERT_NO_ERROR( MIDIMessagePoolGetStats( pool, &stats ), "Could not get message pool stats." );
+  ASSERT_EQUAL( stats.message_used, 0, "Released messages were not returned to the pool." );
+
+  MIDIRunloopGroupRelease( info.group );
+  MIDIMessagePoolSetDefault( previous );
+  MIDIMessagePoolRelease( pool );
+  return 0;
+}
@@ -0,0 +1,66 @@
+#include <stdlib.h>
+#include <string.h>
+#include "test.h"
+#include "midi/scan.h"
+
+#define SCAN_BYTES 512
+
+static size_t _status_reference( size_t size, const unsigned char * buffer ) {
+  size_t i;
+  for( i=0; i<size && buffer[i] < 0x80; i++ );
+  return i;
+}
+
+static size_t _sysex_end_reference( size_t size, const unsigned char * buffer ) {
+  size_t i;
+  for( i=0; i<size && ( buffer[i] < 0x80 || buffer[i] >= MIDI_STATUS_TIMING_CLOCK ); i++ );
+  return i;
+}
+
+/**
+ * Test that every scanning backend finds the same status bytes and
+ * system exclusive ends as a plain byte loop, for every position of
+ * the byte and every alignment and length of the buffer.
+ */
+int test001_scan( void ) {
+  static unsigned char buffer[SCAN_BYTES+32];
+  int backends[3] = { MIDI_SCAN_SCALAR, MIDI_SCAN_SSE2, MIDI_SCAN_AVX2 };
+  int b, backend, byte;
+  size_t offset, size, pos;
+
+  backend = MIDIScanGetBackend();
+  for( b=0; b<3; b++ ) {
+    if( MIDIScanSetBackend( backends[b] ) ) continue;
+    ASSERT_EQUAL( MIDIScanGetBackend(), backends[b], "Backend was not selected." );
+
+    for( byte=0x80; byte<=0xff; byte++ ) {
+      for( pos=0; pos<80; pos++ ) {
+        for( offset=0; offset<4; offset++ ) {
+          memset( buffer, 0x55, sizeof(buffer) );
+          buffer[offset+pos] = byte;
+          size = 80;
+          ASSERT_EQUAL( MIDIScanStatus( size, buffer+offset ), _status_reference( size, buffer+offset ),
+                        "Status scan differs from byte loop." );
+          ASSERT_EQUAL( MIDIScanSysexEnd( size, buffer+offset ), _sysex_end_reference( size, buffer+offset ),
+                        "Sysex end scan differs from byte loop." );
+        }
+      }
+    }
+
+    srand( 21 );
+    for( pos=0; pos<1000; pos++ ) {
+      for( offset=0; offset<SCAN_BYTES; offset++ ) {
+        buffer[offset] = ( rand() % 64 ) ? rand() % 128 : 0x80 + rand() % 128;
+      }
+      offset = rand() % 32;
+      size   = rand() % ( SCAN_BYTES - 32 );
+      ASSERT_EQUAL( MIDIScanStatus( size, buffer+offset ), _status_reference( size, buffer+offset ),
+                    "Status scan differs from byte loop for random data." );
+      ASSERT_EQUAL( MIDIScanSysexEnd( size, buffer+offset ), _sysex_end_reference( size, buffer+offset ),
+                    "Sysex end scan differs from byte loop for random data." );
+    }
+    ASSERT_EQUAL( MIDIScanStatus( 0, buffer ), 0, "Empty buffer scan returned wrong offset." );
+  }
+  MIDIScanSetBackend( backend );
+  return 0;
+}
@@ -0,0 +1,177 @@
+#include <stdlib.h>
+#include "test.h"
+#include "midi/message.h"
+#include "midi/clock.h"
+#include "midi/runloop.h"
+#include "midi/scheduler.h"
+
+#define SCHEDULER_MESSAGES 4
+/* runloop timers fire at their deadline, allow one timer tick plus the
+ * time the operating system takes to wake up the thread (microseconds) */
+#define SCHEDULER_TICK     100
+#define SCHEDULER_WAKEUP   400
+
+struct scheduler_info {
+  struct MIDIClock * clock;
+  MIDITimestamp timestamps[SCHEDULER_MESSAGES];
+  MIDITimestamp delivered[SCHEDULER_MESSAGES];
+  int count;
+};
+
+static int _deliver( void * info, struct MIDIMessage * message ) {
+  struct scheduler_info * s = info;
+  if( s->count < SCHEDULER_MESSAGES ) {
+    MIDIMessageGetTimestamp( message, &(s->timestamps[s->count]) );
+    MIDIClockGetNow( s->clock, &(s->delivered[s->count]) );
+  }
+  s->count++;
+  return 0;
+}
+
+static struct MIDIMessage * _message( MIDITimestamp timestamp ) {
+  struct MIDIMessage * message = MIDIMessageCreate( MIDI_STATUS_TIMING_CLOCK );
+  MIDIMessageSetTimestamp( message, timestamp );
+  return message;
+}
+
+/**
+ * Test that the scheduler delivers due messages immediately and holds
+ * back future messages until their timestamp, in timestamp order.
+ */
+int test001_scheduler( void ) {
+  struct scheduler_info info = { NULL, { 0 }, { 0 }, 0 };
+  struct MIDISchedulerDelegate delegate = { &info, &_deliver };
+  struct MIDISchedulerStats stats;
+  struct MIDIScheduler * scheduler;
+  struct MIDIRunloopSource * source;
+  struct MIDIRunloop * runloop;
+  struct MIDIMessage * message;
+  MIDITimestamp now, next;
+  size_t length;
+  int i;
+
+  info.clock = MIDIClockCreate( 1000000 );
+  ASSERT_NOT_EQUAL( info.clock, NULL, "Could not create clock." );
+  scheduler = MIDISchedulerCreate( info.clock, NULL, &delegate );
+  ASSERT_NOT_EQUAL( scheduler, NULL, "Could not create scheduler." );
+  runloop = MIDIRunloopCreate( NULL );
+  ASSERT_NOT_EQUAL( runloop, NULL, "Could not create runloop." );
+  ASSERT_NO_ERROR( MIDISchedulerGetRunloopSource( scheduler, &source ), "Could not get runloop source." );
+  ASSERT_NO_ERROR( MIDIRunloopAddSource( runloop, source ), "Could not add source to runloop." );
+
+  MIDIClockGetNow( info.clock, &now );
+  message = _message( now - 1000 );
+  ASSERT_NO_ERROR( MIDISchedulerSchedule( scheduler, message ), "Could not schedule due message." );
+  MIDIMessageRelease( message );
+  ASSERT_EQUAL( info.count, 1, "Due message was not delivered immediately." );
+
+  message = _message( now + 30000 );
+  ASSERT_NO_ERROR( MIDISchedulerSchedule( scheduler, message ), "Could not schedule message." );
+  MIDIMessageRelease( message );
+  message = _message( now + 10000 );
+  ASSERT_NO_ERROR( MIDISchedulerSchedule( scheduler, message ), "Could not schedule message." );
+  MIDIMessageRelease( message );
+  message = _message( now + 20000 );
+  ASSERT_NO_ERROR( MIDISchedulerSchedule( scheduler, message ), "Could not schedule message." );
+  MIDIMessageRelease( message );
+
+  ASSERT_EQUAL( info.count, 1, "Future message was delivered immediately." );
+  ASSERT_NO_ERROR( MIDISchedulerGetLength( scheduler, &length ), "Could not get scheduler length." );
+  ASSERT_EQUAL( length, 3, "Scheduler holds wrong number of messages." );
+  ASSERT_NO_ERROR( MIDISchedulerGetNextTimestamp( scheduler, &next ), "Could not get next timestamp." );
+  ASSERT_EQUAL( next, now + 10000, "Scheduler returned wrong next timestamp." );
+
+  for( i=0; i<20 && info.count < SCHEDULER_MESSAGES; i++ ) {
+    ASSERT_NO_ERROR( MIDIRunloopStep( runloop ), "Runloop step failed." );
+  }
+  ASSERT_EQUAL( info.count, SCHEDULER_MESSAGES, "Not all messages were delivered." );
+  for( i=1; i<SCHEDULER_MESSAGES; i++ ) {
+    ASSERT_EQUAL( info.timestamps[i], now + i * 10000, "Messages were delivered in wrong order." );
+    ASSERT_GREATER_OR_EQUAL( info.delivered[i], info.timestamps[i], "Message was delivered before it was due." );
+  }
+
+  ASSERT_NO_ERROR( MIDISchedulerGetStats( scheduler, &stats ), "Could not get statistics." );
+  ASSERT_EQUAL( stats.scheduled, 3, "Wrong number of scheduled messages in statistics." );
+  ASSERT_EQUAL( stats.delivered, 3, "Wrong number of delivered messages in statistics." );
+  ASSERT_EQUAL( stats.flushed, 0, "Wrong number of flushed messages in statistics." );
+  ASSERT_LESS_OR_EQUAL( stats.error_max, SCHEDULER_TICK + SCHEDULER_WAKEUP, "Scheduling error exceeds one timer tick and the wake-up latency." );
+  ASSERT_LESS_OR_EQUAL( stats.error_total, 3 * stats.error_max, "Scheduling error total is inconsistent." );
+
+  /* flushing delivers messages before they are due */
+  message = _message( now + 1000000 );
+  ASSERT_NO_ERROR( MIDISchedulerSchedule( scheduler, message ), "Could not schedule message." );
+  MIDIMessageRelease( message );
+  ASSERT_NO_ERROR( MIDISchedulerFlush( scheduler ), "Could not flush scheduler." );
+  ASSERT_EQUAL( info.count, SCHEDULER_MESSAGES + 1, "Flushed message was not delivered." );
+  ASSERT_NO_ERROR( MIDISchedulerGetStats( scheduler, &stats ), "Could not get statistics." );
+  ASSERT_EQUAL( stats.flushed, 1, "Wrong number of flushed messages in statistics." );
+
+  /* clearing drops messages */
+  message = _message( now + 1000000 );
+  ASSERT_NO_ERROR( MIDISchedulerSchedule( scheduler, message ), "Could not schedule message." );
+  MIDIMessageRelease( message );
+  ASSERT_NO_ERROR( MIDISchedulerClear( scheduler ), "Could not clear scheduler." );
+  ASSERT_NO_ERROR( MIDISchedulerGetLength( scheduler, &length ), "Could not get scheduler length." );
+  ASSERT_EQUAL( length, 0, "Scheduler was not cleared." );
+  ASSERT_EQUAL( info.count, SCHEDULER_MESSAGES + 1, "Cleared message was delivered." );
+
+  MIDIRunloopRemoveSource( runloop, source );
+  MIDIRunloopRelease( runloop );
+  MIDISchedulerRelease( scheduler );
+  MIDIClockRelease( info.clock );
+  return 0;
+}
+
+static struct MIDIMessage * _order[256];
+static int _order_count = 0;
+
+static int _deliver_order( void * info, struct MIDIMessage * message ) {
+  if( _order_count < 256 ) _order[_order_count] = message;
+  _order_count++;
+  return 0;
+}
+
+/**
+ * Test that many messages with random timestamps are delivered sorted by
+ * timestamp, and in scheduling order if their timestamps are equal.
+ */
+int test002_scheduler( void ) {
+  struct MIDISchedulerDelegate delegate = { NULL, &_deliver_order };
+  struct MIDIScheduler * scheduler;
+  struct MIDIClock * clock;
+  struct MIDIMessage * messages[256];
+  MIDITimestamp now, a, b;
+  int i, j, k;
+
+  clock = MIDIClockCreate( 1000000 );
+  scheduler = MIDISchedulerCreate( clock, NULL, &delegate );
+  ASSERT_NOT_EQUAL( scheduler, NULL, "Could not create scheduler." );
+
+  MIDIClockGetNow( clock, &now );
+  srand( 17 );
+  for( i=0; i<256; i++ ) {
+    messages[i] = _message( now + 1000000 + ( rand() % 64 ) );
+    ASSERT_NO_ERROR( MIDISchedulerSchedule( scheduler, messages[i] ), "Could not schedule message." );
+  }
+  _order_count = 0;
+  ASSERT_NO_ERROR( MIDISchedulerFlush( scheduler ), "Could not flush scheduler." );
+  ASSERT_EQUAL( _order_count, 256, "Not all messages were delivered." );
+
+  for( i=1; i<256; i++ ) {
+    MIDIMessageGetTimestamp( _order[i-1], &a );
+    MIDIMessageGetTimestamp( _order[i], &b );
+    ASSERT_LESS_OR_EQUAL( a, b, "Messages were not delivered in timestamp order." );
+    if( a == b ) {
+      for( j=0; messages[j] != _order[i-1]; j++ );
+      for( k=0; messages[k] != _order[i]; k++ );
+      ASSERT_LESS( j, k, "Messages with equal timestamps were reordered." );
+    }
+  }
+
+  for( i=0; i<256; i++ ) {
+    MIDIMessageRelease( messages[i] );
+  }
+  MIDISchedulerRelease( scheduler );
+  MIDIClockRelease( clock );
+  return 0;
+}
@@ -0,0 +1,224 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "test.h"
+#include "midi/stream_decoder.h"
+
+#define EVENTS 64
+
+/**
+ * Test that the decoder handles running status, real-time messages
+ * between data bytes, system common and system exclusive messages.
+ */
+int test001_stream_decoder( void ) {
+  unsigned char stream[] = {
+    0x90, 60, 100, 62, MIDI_STATUS_TIMING_CLOCK, 101,  /* note on, running status with clock inside */
+    0xc3, 5, 6,                                        /* program change with running status */
+    MIDI_STATUS_SYSTEM_EXCLUSIVE, 0x41, 1, MIDI_STATUS_START, 2, MIDI_STATUS_END_OF_EXCLUSIVE,
+    7,                                                 /* data byte without status */
+    MIDI_STATUS_SONG_POSITION_POINTER, 0x10, 0x20, 0x30,
+    MIDI_STATUS_UNDEFINED2, MIDI_STATUS_TUNE_REQUEST,
+    MIDI_STATUS_SYSTEM_EXCLUSIVE, 0x7d, 9, 0x80, 1, 2  /* aborted by note off */
+  };
+  struct MIDIStreamEvent events[EVENTS];
+  struct MIDIStreamDecoder * decoder;
+  size_t read, written;
+
+  decoder = MIDIStreamDecoderCreate();
+  ASSERT_NOT_EQUAL( decoder, NULL, "Could not create stream decoder." );
+  ASSERT_NO_ERROR( MIDIStreamDecoderDecode( decoder, sizeof(stream), &stream[0], &read, EVENTS, &events[0], &written ),
+                   "Could not decode stream." );
+  ASSERT_EQUAL( read, sizeof(stream), "Did not read the whole stream." );
+  ASSERT_EQUAL( written, 12, "Decoded wrong number of events." );
+
+  ASSERT_EQUAL( events[0].status, 0x90, "Wrong status of first note on." );
+  ASSERT_EQUAL( events[0].data[0], 60, "Wrong key of first note on." );
+  ASSERT_EQUAL( events[0].data[1], 100, "Wrong velocity of first note on." );
+  ASSERT_EQUAL( events[1].status, MIDI_STATUS_TIMING_CLOCK, "Real-time message was not reported in place." );
+  ASSERT_EQUAL( events[2].status, 0x90, "Running status was not used." );
+  ASSERT_EQUAL( events[2].data[0], 62, "Wrong key of second note on." );
+  ASSERT_EQUAL( events[2].data[1], 101, "Real-time message broke the running message." );
+  ASSERT_EQUAL( events[3].status, 0xc3, "Wrong status of program change." );
+  ASSERT_EQUAL( events[3].data[0], 5, "Wrong program." );
+  ASSERT_EQUAL( events[3].data[1], 0, "Unused data byte was not cleared." );
+  ASSERT_EQUAL( events[4].data[0], 6, "Running status was not used for program change." );
+
+  ASSERT_EQUAL( events[5].status, MIDI_STATUS_SYSTEM_EXCLUSIVE, "Wrong status of sysex fragment." );
+  ASSERT_EQUAL( events[5].flags, MIDI_STREAM_SYSEX_START, "Wrong flags of first sysex fragment." );
+  ASSERT_EQUAL( events[5].offset, 10, "Wrong offset of first sysex fragment." );
+  ASSERT_EQUAL( events[5].size, 2, "Wrong size of first sysex fragment." );
+  ASSERT_EQUAL( events[6].status, MIDI_STATUS_START, "Real-time message inside sysex was not reported." );
+  ASSERT_EQUAL( events[7].flags, MIDI_STREAM_SYSEX_END, "Wrong flags of last sysex fragment." );
+  ASSERT_EQUAL( events[7].offset, 13, "Wrong offset of last sysex fragment." );
+  ASSERT_EQUAL( events[7].size, 1, "Wrong size of last sysex fragment." );
+
+  ASSERT_EQUAL( events[8].status, MIDI_STATUS_SONG_POSITION_POINTER, "Wrong status of song position pointer." );
+  ASSERT_EQUAL( events[8].data[1], 0x20, "Wrong data of song position pointer." );
+  ASSERT_EQUAL( events[9].status, MIDI_STATUS_TUNE_REQUEST, "System common message kept running status." );
+  ASSERT_EQUAL( events[10].flags, MIDI_STREAM_SYSEX_START | MIDI_STREAM_SYSEX_END | MIDI_STREAM_SYSEX_ABORTED,
+                "Aborted sysex was not flagged." );
+  ASSERT_EQUAL( events[10].size, 2, "Wrong size of aborted sysex." );
+  ASSERT_EQUAL( events[11].status, 0x80, "Status after aborted sysex was lost." );
+
+  /* system common messages have no running status, even when both data bytes are in the chunk */
+  stream[0] = MIDI_STATUS_SONG_POSITION_POINTER;
+  stream[1] = 0x00;
+  stream[2] = 0x01;
+  stream[3] = 0x05;
+  stream[4] = 0x06;
+  ASSERT_NO_ERROR( MIDIStreamDecoderReset( decoder ), "Could not reset decoder." );
+  ASSERT_NO_ERROR( MIDIStreamDecoderDecode( decoder, 5, &stream[0], &read, EVENTS, &events[0], &written ),
+                   "Could not decode song position pointer." );
+  ASSERT_EQUAL( read, 5, "Did not read the whole stream." );
+  ASSERT_EQUAL( written, 1, "Stray data bytes after song position pointer were decoded." );
+  ASSERT_EQUAL( events[0].status, MIDI_STATUS_SONG_POSITION_POINTER, "Wrong status of song position pointer." );
+  ASSERT_EQUAL( events[0].data[1], 0x01, "Wrong data of song position pointer." );
+
+  MIDIStreamDecoderRelease( decoder );
+  return 0;
+}
+
+#define STREAM_BYTES 8192
+
+/**
+ * Generate a random stream with channel messages, running status,
+ * real-time messages anywhere and system exclusive messages.
+ */
+static size_t _random_stream( unsigned char * buffer, size_t size, int sysex_percent ) {
+  size_t n = 0, i, length;
+  int r;
+
+  while( n + 64 <= size ) {
+    r = rand() % 100;
+    if( r < sysex_percent ) {
+      buffer[n++] = MIDI_STATUS_SYSTEM_EXCLUSIVE;
+      length = rand() % 48;
+      for( i=0; i<length; i++ ) {
+        buffer[n++] = ( rand() % 64 == 0 ) ? MIDI_STATUS_TIMING_CLOCK : rand() % 128;
+      }
+      buffer[n++] = MIDI_STATUS_END_OF_EXCLUSIVE;
+    } else if( r < sysex_percent + 10 ) {
+      buffer[n++] = MIDI_STATUS_TIMING_CLOCK + rand() % 8;
+    } else {
+      if( rand() % 4 ) buffer[n++] = 0x80 + rand() % 0x70;
+      buffer[n++] = rand() % 128;
+      if( rand() % 8 == 0 ) buffer[n++] = MIDI_STATUS_ACTIVE_SENSING;
+      buffer[n++] = rand() % 128;
+    }
+  }
+  return n;
+}
+
+/**
+ * Serialize decoded events so that streams split into different chunks
+ * can be compared. System exclusive payload is copied from the chunk.
+ */
+static size_t _serialize( unsigned char * out, size_t n, const unsigned char * chunk,
+                          struct MIDIStreamEvent * events, size_t count ) {
+  size_t i;
+  for( i=0; i<count; i++ ) {
+    if( events[i].status == MIDI_STATUS_SYSTEM_EXCLUSIVE ) {
+      if( events[i].flags & MIDI_STREAM_SYSEX_START ) out[n++] = MIDI_STATUS_SYSTEM_EXCLUSIVE;
+      memcpy( out+n, chunk+events[i].offset, events[i].size );
+      n += events[i].size;
+      if( events[i].flags & MIDI_STREAM_SYSEX_END ) out[n++] = MIDI_STATUS_END_OF_EXCLUSIVE;
+    } else {
+      out[n++] = events[i].status;
+      out[n++] = events[i].data[0];
+      out[n++] = events[i].data[1];
+    }
+  }
+  return n;
+}
+
+/**
+ * Test that a stream decodes to the same messages no matter how it is
+ * split into chunks and how small the event array is.
+ */
+int test002_stream_decoder( void ) {
+  static unsigned char stream[STREAM_BYTES], whole[4*STREAM_BYTES], split[4*STREAM_BYTES];
+  struct MIDIStreamEvent events[EVENTS];
+  struct MIDIStreamDecoder * decoder;
+  size_t size, offset, chunk, done, read, written, whole_size, split_size;
+  int round;
+
+  srand( 20 );
+  size = _random_stream( &stream[0], STREAM_BYTES, 10 );
+  decoder = MIDIStreamDecoderCreate();
+  ASSERT_NOT_EQUAL( decoder, NULL, "Could not create stream decoder." );
+
+  whole_size = 0;
+  for( offset=0; offset<size; offset+=read ) {
+    ASSERT_NO_ERROR( MIDIStreamDecoderDecode( decoder, size-offset, &stream[offset], &read, EVENTS, &events[0], &written ),
+                     "Could not decode stream." );
+    whole_size = _serialize( &whole[0], whole_size, &stream[offset], &events[0], written );
+  }
+
+  for( round=0; round<32; round++ ) {
+    MIDIStreamDecoderReset( decoder );
+    split_size = 0;
+    for( offset=0; offset<size; offset+=chunk ) {
+      chunk = 1 + rand() % 40;
+      if( offset + chunk > size ) chunk = size - offset;
+      for( done=0; done<chunk; done+=read ) {
+        ASSERT_NO_ERROR( MIDIStreamDecoderDecode( decoder, chunk-done, &stream[offset+done], &read,
+                                                  1 + round % 3, &events[0], &written ),
+                         "Could not decode chunk." );
+        split_size = _serialize( &split[0], split_size, &stream[offset+done], &events[0], written );
+      }
+    }
+    ASSERT_EQUAL( split_size, whole_size, "Split stream decoded to different number of bytes." );
+    ASSERT_EQUAL( memcmp( &whole[0], &split[0], whole_size ), 0, "Split stream decoded differently." );
+  }
+
+  MIDIStreamDecoderRelease( decoder );
+  return 0;
+}
+
+#define BENCHMARK_BYTES  (4<<20)
+#define BENCHMARK_ROUNDS 8
+
+static int _benchmark( const char * name, int sysex_percent ) {
+  struct MIDIStreamEvent events[1024];
+  struct MIDIStreamDecoder * decoder;
+  unsigned char * stream = malloc( BENCHMARK_BYTES );
+  struct timespec start, end;
+  size_t size, offset, read, written;
+  unsigned long total = 0;
+  double seconds;
+  int round;
+
+  ASSERT_NOT_EQUAL( stream, NULL, "Could not allocate stream." );
+  srand( 21 );
+  size = _random_stream( stream, BENCHMARK_BYTES, sysex_percent );
+  decoder = MIDIStreamDecoderCreate();
+
+  clock_gettime( CLOCK_THREAD_CPUTIME_ID, &start );
+  for( round=0; round<BENCHMARK_ROUNDS; round++ ) {
+    for( offset=0; offset<size; offset+=read ) {
+      ASSERT_NO_ERROR( MIDIStreamDecoderDecode( decoder, size-offset, stream+offset, &read, 1024, &events[0], &written ),
+                       "Could not decode stream." );
+      total += written;
+    }
+  }
+  clock_gettime( CLOCK_THREAD_CPUTIME_ID, &end );
+
+  seconds = ( end.tv_sec - start.tv_sec ) + ( end.tv_nsec - start.tv_nsec ) / 1000000000.0;
+  printf( "stream decoder, %s: %.0f MB/s, %.0f events/s\n", name,
+          seconds > 0 ? BENCHMARK_ROUNDS * size / seconds / 1000000 : 0.0,
+          seconds > 0 ? total / seconds : 0.0 );
+
+  MIDIStreamDecoderRelease( decoder );
+  free( stream );
+  return 0;
+}
+
+/**
+ * Benchmark decoding channel-heavy and sysex-heavy streams and report
+ * the parsed bytes per second.
+ */
+int test003_stream_decoder( void ) {
+  ASSERT_NO_ERROR( _benchmark( "channel messages", 0 ), "Channel message benchmark failed." );
+  ASSERT_NO_ERROR( _benchmark( "sysex dumps", 80 ), "Sysex benchmark failed." );
+  return 0;
+}
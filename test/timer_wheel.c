@@ -0,0 +1,160 @@
+#include <stdlib.h>
+#include "test.h"
+#define MIDI_TIMER_WHEEL_INTERNALS
+#include "midi/timer_wheel.h"
+
+#define WHEEL_ENTRIES 512
+
+/**
+ * Test that entries expire at their deadline and that cancelled entries
+ * do not expire, across all levels of the wheel.
+ */
+int test001_timer_wheel( void ) {
+  struct MIDITimerWheel * wheel = MIDITimerWheelCreate( 1, 1000 );
+  struct MIDITimerWheelEntry entries[4];
+  struct MIDITimerWheelEntry * entry;
+  unsigned long long deadline;
+  size_t length;
+  int i;
+
+  ASSERT_NOT_EQUAL( wheel, NULL, "Could not create timer wheel." );
+  for( i=0; i<4; i++ ) {
+    MIDITimerWheelEntryInit( &entries[i], NULL, &entries[i] );
+  }
+  ASSERT_NO_ERROR( MIDITimerWheelGetNextDeadline( wheel, &deadline ), "Could not get next deadline." );
+  ASSERT_EQUAL( deadline, MIDI_TIMER_WHEEL_NEVER, "Empty wheel has a deadline." );
+
+  MIDITimerWheelSchedule( wheel, &entries[0], 1010 );
+  MIDITimerWheelSchedule( wheel, &entries[1], 1000 + 5000 );
+  MIDITimerWheelSchedule( wheel, &entries[2], 1000 + 300000 );
+  MIDITimerWheelSchedule( wheel, &entries[3], 1500 );
+  MIDITimerWheelGetLength( wheel, &length );
+  ASSERT_EQUAL( length, 4, "Wheel has wrong length." );
+  ASSERT( MIDITimerWheelEntryIsScheduled( &entries[3] ), "Entry is not scheduled." );
+
+  MIDITimerWheelGetNextDeadline( wheel, &deadline );
+  ASSERT_EQUAL( deadline, 1010, "Wrong next deadline." );
+  MIDITimerWheelCancel( wheel, &entries[3] );
+  ASSERT( ! MIDITimerWheelEntryIsScheduled( &entries[3] ), "Cancelled entry is still scheduled." );
+
+  MIDITimerWheelAdvance( wheel, 1009 );
+  MIDITimerWheelPopExpired( wheel, &entry );
+  ASSERT_EQUAL( entry, NULL, "Entry expired early." );
+  MIDITimerWheelAdvance( wheel, 1010 );
+  MIDITimerWheelPopExpired( wheel, &entry );
+  ASSERT_EQUAL( entry, &entries[0], "Entry did not expire." );
+
+  MIDITimerWheelGetNextDeadline( wheel, &deadline );
+  ASSERT_EQUAL( deadline, 6000, "Next deadline on second level is not exact." );
+  MIDITimerWheelAdvance( wheel, 5999 );
+  MIDITimerWheelPopExpired( wheel, &entry );
+  ASSERT_EQUAL( entry, NULL, "Entry expired early." );
+  MIDITimerWheelAdvance( wheel, 6000 );
+  MIDITimerWheelPopExpired( wheel, &entry );
+  ASSERT_EQUAL( entry, &entries[1], "Entry on second level did not expire." );
+
+  MIDITimerWheelGetNextDeadline( wheel, &deadline );
+  ASSERT_EQUAL( deadline, 301000, "Next deadline on third level is not exact." );
+
+  MIDITimerWheelAdvance( wheel, 300999 );
+  MIDITimerWheelPopExpired( wheel, &entry );
+  ASSERT_EQUAL( entry, NULL, "Entry expired early." );
+  MIDITimerWheelAdvance( wheel, 301000 );
+  MIDITimerWheelPopExpired( wheel, &entry );
+  ASSERT_EQUAL( entry, &entries[2], "Entry on third level did not expire." );
+
+  MIDITimerWheelPopExpired( wheel, &entry );
+  ASSERT_EQUAL( entry, NULL, "Cancelled entry expired." );
+  MIDITimerWheelGetLength( wheel, &length );
+  ASSERT_EQUAL( length, 0, "Wheel is not empty." );
+
+  MIDITimerWheelRelease( wheel );
+  return 0;
+}
+
+/**
+ * Test random schedules, reschedules and cancellations against the
+ * expected expiration times, advancing in random steps.
+ */
+int test002_timer_wheel( void ) {
+  struct MIDITimerWheel * wheel = MIDITimerWheelCreate( 1, 0 );
+  struct MIDITimerWheelEntry entries[WHEEL_ENTRIES];
+  struct MIDITimerWheelEntry * entry;
+  unsigned long long deadlines[WHEEL_ENTRIES];
+  unsigned long long now = 0, next;
+  int i, expired = 0, cancelled = 0;
+
+  srand( 42 );
+  for( i=0; i<WHEEL_ENTRIES; i++ ) {
+    MIDITimerWheelEntryInit( &entries[i], NULL, &deadlines[i] );
+    deadlines[i] = 1 + ( (unsigned long long) rand() << 8 | ( rand() & 0xff ) ) % 20000000ULL;
+    MIDITimerWheelSchedule( wheel, &entries[i], deadlines[i] );
+  }
+  for( i=0; i<WHEEL_ENTRIES; i+=7 ) {
+    deadlines[i] = 1 + rand() % 100000;
+    MIDITimerWheelSchedule( wheel, &entries[i], deadlines[i] );
+  }
+  for( i=3; i<WHEEL_ENTRIES; i+=11 ) {
+    MIDITimerWheelCancel( wheel, &entries[i] );
+    deadlines[i] = 0;
+    cancelled++;
+  }
+
+  while( expired + cancelled < WHEEL_ENTRIES ) {
+    MIDITimerWheelGetNextDeadline( wheel, &next );
+    ASSERT_NOT_EQUAL( next, MIDI_TIMER_WHEEL_NEVER, "Wheel lost entries." );
+    /* jump to the next deadline or a little less */
+    now = ( next > now ) ? next - ( rand() % 2 ) : now + 1;
+    MIDITimerWheelAdvance( wheel, now );
+    for(;;) {
+      MIDITimerWheelPopExpired( wheel, &entry );
+      if( entry == NULL ) break;
+      i = entry - &entries[0];
+      ASSERT_NOT_EQUAL( deadlines[i], 0, "Cancelled entry expired." );
+      ASSERT_LESS_OR_EQUAL( deadlines[i], now, "Entry expired early." );
+      ASSERT_GREATER( deadlines[i] + 1, now, "Entry expired late." );
+      deadlines[i] = 0;
+      expired++;
+    }
+  }
+  MIDITimerWheelRelease( wheel );
+  return 0;
+}
+
+/**
+ * Test that entries expire at their exact deadline and not at the end
+ * of the tick that contains it, on the first and on higher levels.
+ */
+int test003_timer_wheel( void ) {
+  struct MIDITimerWheel * wheel = MIDITimerWheelCreate( 100, 1000 );
+  struct MIDITimerWheelEntry entries[2];
+  struct MIDITimerWheelEntry * entry;
+  unsigned long long deadline;
+
+  ASSERT_NOT_EQUAL( wheel, NULL, "Could not create timer wheel." );
+  MIDITimerWheelEntryInit( &entries[0], NULL, &entries[0] );
+  MIDITimerWheelEntryInit( &entries[1], NULL, &entries[1] );
+  MIDITimerWheelSchedule( wheel, &entries[0], 1050 );
+  MIDITimerWheelSchedule( wheel, &entries[1], 1000 + 100 * 100 + 30 );
+
+  MIDITimerWheelGetNextDeadline( wheel, &deadline );
+  ASSERT_EQUAL( deadline, 1050, "Next deadline was rounded to the tick." );
+  MIDITimerWheelAdvance( wheel, 1049 );
+  MIDITimerWheelPopExpired( wheel, &entry );
+  ASSERT_EQUAL( entry, NULL, "Entry expired early." );
+  MIDITimerWheelAdvance( wheel, 1050 );
+  MIDITimerWheelPopExpired( wheel, &entry );
+  ASSERT_EQUAL( entry, &entries[0], "Entry did not expire at its deadline." );
+
+  MIDITimerWheelGetNextDeadline( wheel, &deadline );
+  ASSERT_EQUAL( deadline, 11030, "Next deadline on second level was rounded to the tick." );
+  MIDITimerWheelAdvance( wheel, 11029 );
+  MIDITimerWheelPopExpired( wheel, &entry );
+  ASSERT_EQUAL( entry, NULL, "Entry expired early." );
+  MIDITimerWheelAdvance( wheel, 11030 );
+  MIDITimerWheelPopExpired( wheel, &entry );
+  ASSERT_EQUAL( entry, &entries[1], "Entry on second level did not expire at its deadline." );
+
+  MIDITimerWheelRelease( wheel );
+  return 0;
+}